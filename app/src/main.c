@@ -7,7 +7,9 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <psp2/net/net.h>
 #include <psp2/net/netctl.h>
@@ -21,6 +23,7 @@
 #include <psp2/shellutil.h>
 
 #include <psvgamesd_api.h>
+#include <psv_types.h>
 
 #include "debugScreen.h"
 #include "sfo_utils.h"
@@ -82,82 +85,245 @@ void ps_btn_unlock()
 
 char g_current_directory[256] = {0};
 
-int get_dir_max_file_pos(const char* path)
+//---
+
+//listing of current directory is kept in memory sorted by name. it is rebuilt only when mtime of the directory changes.
+//files whose size and mtime did not change keep their parsed header so that rebuild only opens new or changed files
+
+//number of files that are shown on one screen
+#define DIR_PAGE_SIZE 40
+
+typedef struct dir_index_entry
+{
+  char name[256];
+  SceOff size;
+  SceDateTime mtime;
+  int is_psv;
+  uint32_t flags; //flags of psv header if is_psv is set
+} dir_index_entry;
+
+typedef struct dir_index
+{
+  int valid;
+  char path[256];
+  SceDateTime mtime; //mtime of the directory when index was built
+  dir_index_entry* entries;
+  uint32_t n_entries;
+} dir_index;
+
+SceUID g_dir_index_mutex_id = -1;
+
+dir_index g_dir_index;
+
+int compare_dir_entry_names(const char* a, const char* b)
+{
+  int res = strcasecmp(a, b);
+  if(res != 0)
+    return res;
+
+  return strcmp(a, b);
+}
+
+int compare_dir_entries(const void* a, const void* b)
+{
+  return compare_dir_entry_names(((const dir_index_entry*)a)->name, ((const dir_index_entry*)b)->name);
+}
+
+int compare_name_to_dir_entry(const void* name, const void* entry)
+{
+  return compare_dir_entry_names((const char*)name, ((const dir_index_entry*)entry)->name);
+}
+
+int read_psv_summary(const char* path, dir_index_entry* entry)
+{
+  entry->is_psv = 0;
+  entry->flags = 0;
+
+  char full_path[512];
+  snprintf(full_path, 512, "%s/%s", path, entry->name);
+
+  SceUID fd = sceIoOpen(full_path, SCE_O_RDONLY, 0777);
+  if(fd < 0)
+    return -1;
+
+  psv_file_header_v1 header;
+  int res = sceIoRead(fd, &header, sizeof(psv_file_header_v1));
+
+  sceIoClose(fd);
+
+  if(res != sizeof(psv_file_header_v1) || header.magic != PSV_MAGIC || header.version != PSV_VERSION_V1)
+    return -1;
+
+  entry->is_psv = 1;
+  entry->flags = header.flags;
+  return 0;
+}
+
+const char* get_psv_layout_name(uint32_t flags)
+{
+  if(flags & FLAG_DIGITAL)
+    return "digital";
+  else if(flags & FLAG_COMPRESSED)
+    return "compressed";
+  else if(flags & FLAG_SPARSE)
+    return "sparse";
+  else if(flags & FLAG_CHUNKED)
+    return "dedup";
+  else if(flags & FLAG_TRIMMED)
+    return "trimmed";
+  else
+    return "raw";
+}
+
+//entries of previous index are looked up by name. they are sorted so lookup is binary search
+int rebuild_dir_index(const char* path, const SceDateTime* mtime)
 {
-  int max_file_position = 0;
+  const dir_index_entry* old_entries = 0;
+  uint32_t n_old_entries = 0;
+
+  if(g_dir_index.entries != 0 && strncmp(g_dir_index.path, path, 256) == 0)
+  {
+    old_entries = g_dir_index.entries;
+    n_old_entries = g_dir_index.n_entries;
+  }
 
   SceUID dirId = sceIoDopen(path);
-  if(dirId >= 0)
+  if(dirId < 0)
+    return -1;
+
+  dir_index_entry* entries = 0;
+  uint32_t n_entries = 0;
+  uint32_t capacity = 0;
+
+  int res = 0;
+  do
   {
-    int res = 0;
-    do
-    {
-      SceIoDirent dir;
-      memset(&dir, 0, sizeof(SceIoDirent));
+    SceIoDirent dir;
+    memset(&dir, 0, sizeof(SceIoDirent));
 
-      res = sceIoDread(dirId, &dir);
-      if(res > 0)
+    res = sceIoDread(dirId, &dir);
+    if(res > 0 && SCE_S_ISREG(dir.d_stat.st_mode))
+    {
+      if(n_entries == capacity)
       {
-        if(SCE_S_ISREG(dir.d_stat.st_mode))
+        capacity = capacity > 0 ? capacity * 2 : 64;
+        dir_index_entry* temp = (dir_index_entry*)realloc(entries, capacity * sizeof(dir_index_entry));
+        if(temp == 0)
         {
-          max_file_position++;
+          res = -1;
+          break;
         }
+        entries = temp;
+      }
+
+      dir_index_entry* entry = &entries[n_entries];
+      memset(entry, 0, sizeof(dir_index_entry));
+      strncpy(entry->name, dir.d_name, 255);
+      entry->size = dir.d_stat.st_size;
+      entry->mtime = dir.d_stat.st_mtime;
+
+      const dir_index_entry* old = 0;
+      if(n_old_entries > 0)
+        old = (const dir_index_entry*)bsearch(entry->name, old_entries, n_old_entries, sizeof(dir_index_entry), compare_name_to_dir_entry);
+
+      if(old != 0 && old->size == entry->size && memcmp(&old->mtime, &entry->mtime, sizeof(SceDateTime)) == 0)
+      {
+        entry->is_psv = old->is_psv;
+        entry->flags = old->flags;
+      }
+      else
+      {
+        read_psv_summary(path, entry);
       }
+
+      n_entries++;
     }
-    while(res > 0);
+  }
+  while(res > 0);
 
-    sceIoDclose(dirId);
+  sceIoDclose(dirId);
+
+  //partial list is not published. previous index of the same directory is kept and rebuilt on next refresh
+  //because its mtime does not match. index of other directory is dropped
+  if(res < 0)
+  {
+    free(entries);
+
+    if(old_entries == 0)
+    {
+      free(g_dir_index.entries);
+      memset(&g_dir_index, 0, sizeof(dir_index));
+    }
+
+    return -1;
   }
 
-  if(max_file_position > 0)
-    max_file_position = max_file_position - 1;
+  if(n_entries > 0)
+    qsort(entries, n_entries, sizeof(dir_index_entry), compare_dir_entries);
+
+  free(g_dir_index.entries);
 
-  return max_file_position;
+  g_dir_index.entries = entries;
+  g_dir_index.n_entries = n_entries;
+  g_dir_index.mtime = *mtime;
+  strncpy(g_dir_index.path, path, 256);
+  g_dir_index.valid = 1;
+
+  return 0;
 }
 
-int get_dir_filename_at_pos(char* path, uint32_t pos, char* dest)
+//returns number of files in the directory. index is only rebuilt if directory has changed since last call
+uint32_t refresh_dir_index(const char* path)
 {
-  memset(dest, 0, 256);
+  sceKernelLockMutex(g_dir_index_mutex_id, 1, 0);
 
-  int cur_file_position = 0;
+  SceIoStat stat;
+  memset(&stat, 0, sizeof(SceIoStat));
 
-  SceUID dirId = sceIoDopen(path);
-  if(dirId >= 0)
+  if(sceIoGetstat(path, &stat) < 0)
+  {
+    free(g_dir_index.entries);
+    memset(&g_dir_index, 0, sizeof(dir_index));
+  }
+  else if(g_dir_index.valid == 0 || strncmp(g_dir_index.path, path, 256) != 0 || memcmp(&g_dir_index.mtime, &stat.st_mtime, sizeof(SceDateTime)) != 0)
   {
-    int found = -1;
+    rebuild_dir_index(path, &stat.st_mtime);
+  }
 
-    int res = 0;
-    do
-    {
-      SceIoDirent dir;
-      memset(&dir, 0, sizeof(SceIoDirent));
+  uint32_t temp = g_dir_index.n_entries;
+  sceKernelUnlockMutex(g_dir_index_mutex_id, 1);
+  return temp;
+}
 
-      res = sceIoDread(dirId, &dir);
-      if(res > 0)
-      {
-        if(SCE_S_ISREG(dir.d_stat.st_mode))
-        {
-          if(cur_file_position == pos)
-          {
-            strncpy(dest, dir.d_name, 256);
-            found = 0;
-            break;
-          }
+//forces rebuild on next refresh. used when file may change without changing mtime of the directory (dump that is written)
+void invalidate_dir_index()
+{
+  sceKernelLockMutex(g_dir_index_mutex_id, 1, 0);
+  g_dir_index.valid = 0;
+  sceKernelUnlockMutex(g_dir_index_mutex_id, 1);
+}
 
-          cur_file_position++;
-        }
-      }
-    }
-    while(res > 0);
+int get_dir_filename_at_pos(uint32_t pos, char* dest)
+{
+  memset(dest, 0, 256);
 
-    sceIoDclose(dirId);
+  int found = -1;
 
-    return found;
-  }
-  else
+  sceKernelLockMutex(g_dir_index_mutex_id, 1, 0);
+  if(pos < g_dir_index.n_entries)
   {
-    return -1;
+    strncpy(dest, g_dir_index.entries[pos].name, 256);
+    found = 0;
   }
+  sceKernelUnlockMutex(g_dir_index_mutex_id, 1);
+
+  return found;
+}
+
+void deinitialize_dir_index()
+{
+  free(g_dir_index.entries);
+  memset(&g_dir_index, 0, sizeof(dir_index));
 }
 
 int driver_mode_to_name(uint32_t mode, char* dest)
@@ -416,44 +582,30 @@ void set_dump_state_poll_running_state(uint32_t value)
 
 //---
 
-SceUID g_total_sectors_mutex_id = -1;
+//last progress snapshot taken from the driver
+SceUID g_dump_progress_mutex_id = -1;
 
-uint32_t g_total_sectors = 0;
+psvgamesd_dump_progress g_dump_progress = {0};
 
-uint32_t get_total_sectors()
+void get_dump_progress(psvgamesd_dump_progress* value)
 {
-  sceKernelLockMutex(g_total_sectors_mutex_id, 1, 0);
-  uint32_t temp = g_total_sectors;
-  sceKernelUnlockMutex(g_total_sectors_mutex_id, 1);
-  return temp;
-}
-
-void set_total_sectors(uint32_t value)
-{
-  sceKernelLockMutex(g_total_sectors_mutex_id, 1, 0);
-  g_total_sectors = value;
-  sceKernelUnlockMutex(g_total_sectors_mutex_id, 1);
+  sceKernelLockMutex(g_dump_progress_mutex_id, 1, 0);
+  memcpy(value, &g_dump_progress, sizeof(psvgamesd_dump_progress));
+  sceKernelUnlockMutex(g_dump_progress_mutex_id, 1);
 }
 
-//---
-
-SceUID g_progress_sectors_mutex_id = -1;
-
-uint32_t g_progress_sectors = 0;
-
-uint32_t get_progress_sectors()
+void set_dump_progress(const psvgamesd_dump_progress* value)
 {
-  sceKernelLockMutex(g_progress_sectors_mutex_id, 1, 0);
-  uint32_t temp = g_progress_sectors;
-  sceKernelUnlockMutex(g_progress_sectors_mutex_id, 1);
-  return temp;
+  sceKernelLockMutex(g_dump_progress_mutex_id, 1, 0);
+  memcpy(&g_dump_progress, value, sizeof(psvgamesd_dump_progress));
+  sceKernelUnlockMutex(g_dump_progress_mutex_id, 1);
 }
 
-void set_progress_sectors(uint32_t value)
+void clear_dump_progress()
 {
-  sceKernelLockMutex(g_progress_sectors_mutex_id, 1, 0);
-  g_progress_sectors = value;
-  sceKernelUnlockMutex(g_progress_sectors_mutex_id, 1);
+  sceKernelLockMutex(g_dump_progress_mutex_id, 1, 0);
+  memset(&g_dump_progress, 0, sizeof(psvgamesd_dump_progress));
+  sceKernelUnlockMutex(g_dump_progress_mutex_id, 1);
 }
 
 //---
@@ -574,8 +726,7 @@ int SCE_CTRL_UP_callback()
   uint32_t rn_state = get_dump_state_poll_running_state();
   if(rn_state != DUMP_STATE_POLL_START)
   {
-    //update max file position just in case new files were added to directory (for example during dump)
-    set_max_file_position(get_dir_max_file_pos(ISO_ROOT_DIRECTORY));
+    //max file position is updated from directory index on every redraw
 
     sceKernelLockMutex(g_file_position_mutex_id, 1, 0);
     if(g_file_position > 0)
@@ -597,8 +748,7 @@ int SCE_CTRL_DOWN_callback()
   uint32_t rn_state = get_dump_state_poll_running_state();
   if(rn_state != DUMP_STATE_POLL_START)
   {
-    //update max file position just in case new files were added to directory (for example during dump)
-    set_max_file_position(get_dir_max_file_pos(ISO_ROOT_DIRECTORY));
+    //max file position is updated from directory index on every redraw
 
     sceKernelLockMutex(g_file_position_mutex_id, 1, 0);
     if(g_file_position < get_max_file_position())
@@ -874,19 +1024,6 @@ int SCE_CTRL_LTRIGGER_callback()
   return 0;
 }
 
-int SCE_CTRL_RTRIGGER_callback()
-{
-  //psvDebugScreenPrintf("psvgamesd: SCE_CTRL_RTRIGGER\n");
-
-  //forbid to press any buttons during dump except for square (which is cancel)
-  uint32_t rn_state = get_dump_state_poll_running_state();
-  if(rn_state != DUMP_STATE_POLL_START)
-  {
-  }
-
-  return 0;
-}
-
 //exit app
 int SCE_CTRL_TRIANGLE_callback()
 {
@@ -918,7 +1055,7 @@ int SCE_CTRL_CIRCLE_callback()
     {
       //get currently selected iso
       char filepath[256];
-      int found = get_dir_filename_at_pos(g_current_directory, get_file_position(), filepath);
+      int found = get_dir_filename_at_pos(get_file_position(), filepath);
       if(found >= 0)
       {
         //get previous iso to temp var
@@ -968,47 +1105,48 @@ int SCE_CTRL_CIRCLE_callback()
 
 int dump_status_poll_thread_internal(SceSize args, void* argp)
 {
-  uint32_t prev_total_sectors = -1;
-  uint32_t prev_progress_sectors = -1;
+  uint32_t prev_seq = -1;
 
   while(1)
   {
     //wait 1 second
     sceKernelDelayThread(DUMP_STATUS_POLL_DELAY);
 
-    //get stats from kernel
-    uint32_t total_sectors = dump_mmc_get_total_sectors();
-    uint32_t progress_sectors = dump_mmc_get_progress_sectors();
+    //get consistent snapshot from kernel in one call
+    psvgamesd_dump_progress progress;
+    dump_mmc_get_progress(&progress);
 
     //set to local vars
-    set_total_sectors(total_sectors);
-    set_progress_sectors(progress_sectors);
+    set_dump_progress(&progress);
 
-    if(prev_total_sectors != total_sectors || prev_progress_sectors != progress_sectors)
+    if(prev_seq != progress.seq)
     {
       //redraw screen
       set_redraw_request(1);
     }
 
-    prev_total_sectors = total_sectors;
-    prev_progress_sectors = progress_sectors;
+    prev_seq = progress.seq;
 
     //check if cancel was requested
     uint32_t rn_state = get_dump_state_poll_running_state();
     if(rn_state == DUMP_STATE_POLL_STOP)
     {
-      set_total_sectors(0);
-      set_progress_sectors(0);
+      clear_dump_progress();
+
+      //size of the dump file changed
+      invalidate_dir_index();
 
       set_redraw_request(1);
       return 0;
     }
 
     //check if dump has finished
-    if(total_sectors == progress_sectors)
+    if(progress.total_sectors == progress.done_sectors)
     {
-      set_total_sectors(0);
-      set_progress_sectors(0);
+      clear_dump_progress();
+
+      //size of the dump file changed
+      invalidate_dir_index();
 
       set_redraw_request(1);
       return 0;
@@ -1167,10 +1305,9 @@ int deinitialize_insert_status_poll_threading()
 
 //---
 
-int SCE_CTRL_CROSS_callback()
+//starts dump of the card that is inserted. flags are DUMP_FLAG_*
+int start_dump(uint32_t flags)
 {
-  //psvDebugScreenPrintf("psvgamesd: SCE_CTRL_CROSS\n");
-
   //forbid to press any buttons during dump except for square (which is cancel)
   //also protects from re entering dump start state
   uint32_t rn_state = get_dump_state_poll_running_state();
@@ -1195,8 +1332,8 @@ int SCE_CTRL_CROSS_callback()
         strncat(full_path, cnt_id, 256);
         strncat(full_path, ".psv", 255);
 
-        //start dump process in kernel
-        dump_mmc_card_start(full_path);
+        //start dump process in kernel. chunk size is picked by the driver
+        dump_mmc_card_start(full_path, DUMP_CHUNK_SECTORS_AUTO, flags);
 
         //redraw screen
         set_redraw_request(1);
@@ -1216,6 +1353,26 @@ int SCE_CTRL_CROSS_callback()
   return 0;
 }
 
+//start raw dump
+int SCE_CTRL_CROSS_callback()
+{
+  //psvDebugScreenPrintf("psvgamesd: SCE_CTRL_CROSS\n");
+
+  start_dump(0);
+
+  return 0;
+}
+
+//start compressed dump
+int SCE_CTRL_RTRIGGER_callback()
+{
+  //psvDebugScreenPrintf("psvgamesd: SCE_CTRL_RTRIGGER\n");
+
+  start_dump(DUMP_FLAG_COMPRESSED);
+
+  return 0;
+}
+
 int SCE_CTRL_SQUARE_callback()
 {
   //psvDebugScreenPrintf("psvgamesd: SCE_CTRL_SQUARE\n");
@@ -1370,10 +1527,15 @@ int draw_dir(char* path)
   {
     if(rn_state == DUMP_STATE_POLL_START)
     {
-      uint32_t total_sectors = get_total_sectors();
-      uint32_t progress_sectors = get_progress_sectors();
+      psvgamesd_dump_progress progress;
+      get_dump_progress(&progress);
+
+      psvDebugScreenPrintf("\e[9%im dump progress: %x | %x | %u KB/s | eta %u:%02u\n", 7, progress.done_sectors, progress.total_sectors,
+        progress.bytes_per_second / 1024, progress.eta_seconds / 60, progress.eta_seconds % 60);
 
-      psvDebugScreenPrintf("\e[9%im dump progress: %x | %x\n", 7, progress_sectors, total_sectors);
+      //sectors that can not be read are stored as zeros and listed in error map of the dump
+      if(progress.bad_sectors > 0)
+        psvDebugScreenPrintf("\e[9%im bad sectors: %x\n", 1, progress.bad_sectors);
     }
     else
     {
@@ -1416,40 +1578,40 @@ int draw_dir(char* path)
 
   psvDebugScreenPrintf("\n");
 
-  SceUID dirId = sceIoDopen(path);
-  if(dirId >= 0)
+  //new files are picked up here (for example dump that was started)
+  uint32_t n_files = refresh_dir_index(path);
+
+  uint32_t max_file_position = n_files > 0 ? n_files - 1 : 0;
+  set_max_file_position(max_file_position);
+
+  //files could be removed
+  uint32_t file_position = get_file_position();
+  if(file_position > max_file_position)
   {
-    uint32_t cur_file_position = 0;
+    file_position = max_file_position;
+    set_file_position(file_position);
+  }
 
-    int res = 0;
-    do
-    {
-      SceIoDirent dir;
-      memset(&dir, 0, sizeof(SceIoDirent));
+  uint32_t page_start = file_position / DIR_PAGE_SIZE * DIR_PAGE_SIZE;
 
-      res = sceIoDread(dirId, &dir);
-      if(res > 0)
-      {
-        if(SCE_S_ISREG(dir.d_stat.st_mode))
-        {
-          if(cur_file_position == get_file_position())
-          {
-            psvDebugScreenPrintf("\e[9%im %s\n", get_color_from_poll_state(rn_state, 2, 0), dir.d_name);
-          }
-          else
-          {
-            psvDebugScreenPrintf("\e[9%im %s\n", get_color_from_poll_state(rn_state, 7, 0), dir.d_name);
-          }
+  sceKernelLockMutex(g_dir_index_mutex_id, 1, 0);
 
-          cur_file_position++;
-        }
-      }
-    }
-    while(res > 0);
+  if(g_dir_index.n_entries > DIR_PAGE_SIZE)
+    psvDebugScreenPrintf("\e[9%im files %u - %u of %u\n", get_color_from_poll_state(rn_state, 7, 0), page_start + 1, page_start + DIR_PAGE_SIZE < g_dir_index.n_entries ? page_start + DIR_PAGE_SIZE : g_dir_index.n_entries, g_dir_index.n_entries);
 
-    sceIoDclose(dirId);
+  for(uint32_t i = page_start; i < g_dir_index.n_entries && i < page_start + DIR_PAGE_SIZE; i++)
+  {
+    const dir_index_entry* entry = &g_dir_index.entries[i];
+    int color = get_color_from_poll_state(rn_state, i == file_position ? 2 : 7, 0);
+
+    if(entry->is_psv > 0)
+      psvDebugScreenPrintf("\e[9%im %s [%s %u MB]\n", color, entry->name, get_psv_layout_name(entry->flags), (uint32_t)(entry->size / (1024 * 1024)));
+    else
+      psvDebugScreenPrintf("\e[9%im %s\n", color, entry->name);
   }
 
+  sceKernelUnlockMutex(g_dir_index_mutex_id, 1);
+
   return 0;
 }
 
@@ -1491,6 +1653,8 @@ int initialize_threading()
 
   g_max_file_position_mutex_id = sceKernelCreateMutex("max_file_position", 0, 0, 0);
 
+  g_dir_index_mutex_id = sceKernelCreateMutex("dir_index", 0, 0, 0);
+
   g_selected_iso_mutex_id = sceKernelCreateMutex("selected_iso", 0, 0, 0);
 
   g_insertion_state_mutex_id = sceKernelCreateMutex("insertion_state", 0, 0, 0);
@@ -1499,9 +1663,7 @@ int initialize_threading()
 
   g_dump_state_poll_running_state_mutex_id = sceKernelCreateMutex("dump_state_poll_running_state", 0, 0, 0);
 
-  g_total_sectors_mutex_id = sceKernelCreateMutex("total_sectors_mutex", 0, 0, 0);
-
-  g_progress_sectors_mutex_id = sceKernelCreateMutex("progress_sectors_mutex", 0, 0, 0);
+  g_dump_progress_mutex_id = sceKernelCreateMutex("dump_progress_mutex", 0, 0, 0);
 
   g_physical_ins_state_mutex_id = sceKernelCreateMutex("physical_ins_state_mutex", 0, 0, 0);
 
@@ -1531,6 +1693,9 @@ int deinitialize_threading()
   sceKernelDeleteMutex(g_max_file_position_mutex_id);
   g_max_file_position_mutex_id = -1;
 
+  sceKernelDeleteMutex(g_dir_index_mutex_id);
+  g_dir_index_mutex_id = -1;
+
   sceKernelDeleteMutex(g_selected_iso_mutex_id);
   g_selected_iso_mutex_id = -1;
 
@@ -1543,11 +1708,8 @@ int deinitialize_threading()
   sceKernelDeleteMutex(g_dump_state_poll_running_state_mutex_id);
   g_dump_state_poll_running_state_mutex_id = -1;
 
-  sceKernelDeleteMutex(g_total_sectors_mutex_id);
-  g_total_sectors_mutex_id = -1;
-
-  sceKernelDeleteMutex(g_progress_sectors_mutex_id);
-  g_progress_sectors_mutex_id = -1;
+  sceKernelDeleteMutex(g_dump_progress_mutex_id);
+  g_dump_progress_mutex_id = -1;
 
   sceKernelDeleteMutex(g_physical_ins_state_mutex_id);
   g_physical_ins_state_mutex_id = -1;
@@ -1561,6 +1723,8 @@ int deinitialize_threading()
     g_ctrl_thread_id = -1;
   }
 
+  deinitialize_dir_index();
+
   return 0;
 }
 
@@ -1568,7 +1732,8 @@ int set_dir(const char* path)
 {
   strncpy(g_current_directory, path, 256);
 
-  set_max_file_position(get_dir_max_file_pos(path));
+  //index is built on first redraw
+  set_max_file_position(0);
   set_file_position(0);
 
   return 0;
@@ -1589,8 +1754,7 @@ int set_default_state()
   clear_content_id();
 
   set_dump_state_poll_running_state(DUMP_STATE_POLL_STOP);
-  set_total_sectors(0);
-  set_progress_sectors(0);
+  clear_dump_progress();
 
   set_physical_ins_state(0);
 
@@ -1612,8 +1776,7 @@ int set_state_from_ctx(const psvgamesd_ctx* ctx)
   clear_content_id();
 
   set_dump_state_poll_running_state(DUMP_STATE_POLL_STOP);
-  set_total_sectors(0);
-  set_progress_sectors(0);
+  clear_dump_progress();
 
   set_physical_ins_state(0);
 
@@ -1630,8 +1793,7 @@ int set_state_from_ctx(const psvgamesd_ctx* ctx)
 //insertion_state - should be saved
 //content_id - should be automatically updated by check_insert_update_content_id
 //dump_state_poll_running_state - should not be saved because user can not quit app while dumping
-//total_sectors - should not be saved because user can not quit app while dumping
-//progress_sectors - should not be saved because user can not quit app while dumping
+//dump_progress - should not be saved because user can not quit app while dumping
 //physical_ins_state - should be automatically updated by check_insert_update_content_id
 
 int save_state_to_kernel()
@@ -1692,6 +1854,8 @@ int main(int argc, char *argv[])
 
   deinitialize_threading();
 
+  free_sfo_structures();
+
   save_state_to_kernel();
 
   //unlock ps button back upon exit
@@ -0,0 +1,181 @@
+/* sfo_parser.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "sfo_parser.h"
+
+//this file is shared by app and host tools so it must not depend on any os api
+
+#include <string.h>
+
+#pragma pack(push, 1)
+
+//http://www.psdevwiki.com/ps3/PARAM.SFO
+//SFO stands for PSP Game Parameters File
+
+typedef struct sfo_header
+{
+   uint32_t magic;            // Always PSF
+   uint32_t version;          // Usually 1.1
+   uint32_t key_table_start;  // Start offset of key_table
+   uint32_t data_table_start; // Start offset of data_table
+   uint32_t tables_entries;   // Number of entries in all tables
+}sfo_header;
+
+typedef struct sfo_index_table_entry
+{
+   uint16_t key_offset;   // param_key offset (relative to start offset of key_table)
+   uint16_t data_fmt; // param_data data type
+   uint32_t data_len;     // param_data used bytes
+   uint32_t data_max_len; // param_data total bytes
+   uint32_t data_offset;  // param_data offset (relative to start offset of data_table)
+}sfo_index_table_entry;
+
+#pragma pack(pop)
+
+#define PSF_MAGIC 0x46535000
+
+//index table follows the header and has to end before the key table
+static const sfo_header* get_sfo_header(const void* data, uint32_t size)
+{
+  if(size < sizeof(sfo_header))
+    return 0;
+
+  const sfo_header* header = (const sfo_header*)data;
+
+  if(header->magic != PSF_MAGIC)
+    return 0;
+
+  if(header->key_table_start > size || header->data_table_start > size)
+    return 0;
+
+  if(header->tables_entries > (header->key_table_start - sizeof(sfo_header)) / sizeof(sfo_index_table_entry) || header->key_table_start < sizeof(sfo_header))
+    return 0;
+
+  return header;
+}
+
+uint32_t sfo_get_memory_size(const void* data, uint32_t size)
+{
+  const sfo_header* header = get_sfo_header(data, size);
+  if(header == 0)
+    return 0;
+
+  //file without entries still needs non zero size to be told apart from invalid one
+  return header->tables_entries > 0 ? header->tables_entries * sizeof(sfo_entry) : sizeof(sfo_entry);
+}
+
+int sfo_parse(sfo_file* sfo, const void* data, uint32_t size, void* memory, uint32_t memory_size)
+{
+  memset(sfo, 0, sizeof(sfo_file));
+
+  const sfo_header* header = get_sfo_header(data, size);
+  if(header == 0 || memory_size < sfo_get_memory_size(data, size))
+    return -1;
+
+  const uint8_t* bytes = (const uint8_t*)data;
+  const sfo_index_table_entry* index = (const sfo_index_table_entry*)(bytes + sizeof(sfo_header));
+
+  sfo_entry* entries = (sfo_entry*)memory;
+
+  for(uint32_t i = 0; i < header->tables_entries; i++)
+  {
+    const sfo_index_table_entry* te = &index[i];
+
+    //key has to be terminated inside the file
+    uint32_t key_start = header->key_table_start + te->key_offset;
+    if(key_start >= size || memchr(bytes + key_start, 0, size - key_start) == 0)
+      return -1;
+
+    uint32_t data_start = header->data_table_start + te->data_offset;
+    if(te->data_offset > size || data_start > size || te->data_max_len > size - data_start || te->data_len > te->data_max_len)
+      return -1;
+
+    sfo_entry entry;
+    entry.key = (const char*)(bytes + key_start);
+    entry.data = bytes + data_start;
+    entry.data_fmt = te->data_fmt;
+    entry.data_len = te->data_len;
+    entry.data_max_len = te->data_max_len;
+
+    //insertion sort. there are few dozens of entries and index is usually sorted already.
+    //entries with equal keys keep file order so that lookup returns the first one
+    uint32_t pos = i;
+    while(pos > 0 && strcmp(entries[pos - 1].key, entry.key) > 0)
+    {
+      entries[pos] = entries[pos - 1];
+      pos--;
+    }
+
+    entries[pos] = entry;
+  }
+
+  sfo->n_entries = header->tables_entries;
+  sfo->entries = entries;
+
+  return 0;
+}
+
+const sfo_entry* sfo_find(const sfo_file* sfo, const char* key)
+{
+  //first entry with key that is not less than the one that is looked for
+  uint32_t lo = 0;
+  uint32_t hi = sfo->n_entries;
+
+  while(lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if(strcmp(sfo->entries[mid].key, key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if(lo < sfo->n_entries && strcmp(sfo->entries[lo].key, key) == 0)
+    return &sfo->entries[lo];
+
+  return 0;
+}
+
+int sfo_get_utf8(const sfo_file* sfo, const char* key, char* value, uint32_t max_value_len)
+{
+  if(max_value_len == 0)
+    return -1;
+
+  memset(value, 0, max_value_len);
+
+  const sfo_entry* entry = sfo_find(sfo, key);
+  if(entry == 0 || entry->data_fmt != SFO_TE_DF_UTF8)
+    return -1;
+
+  //data_len includes terminator
+  if(entry->data_len > max_value_len)
+    return -1; //not enough buffer length
+
+  memcpy(value, entry->data, entry->data_len);
+
+  if(value[max_value_len - 1] != 0)
+  {
+    value[max_value_len - 1] = 0;
+    return -1; //not enough buffer length
+  }
+
+  return 0;
+}
+
+int sfo_get_int32(const sfo_file* sfo, const char* key, int32_t* value)
+{
+  *value = 0;
+
+  const sfo_entry* entry = sfo_find(sfo, key);
+  if(entry == 0 || entry->data_fmt != SFO_TE_DF_INT32 || entry->data_len != sizeof(int32_t))
+    return -1;
+
+  memcpy(value, entry->data, sizeof(int32_t));
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+//in-memory form of PARAM.SFO. whole file is loaded with one read and parsed in place,
+//entries are sorted by key so lookup is binary search and does not need any io
+
+//table entry data formats
+#define SFO_TE_DF_UTF8S 0x0004
+#define SFO_TE_DF_UTF8  0x0204
+#define SFO_TE_DF_INT32 0x0404
+
+typedef struct sfo_entry
+{
+  const char* key;     // points into the file data
+  const uint8_t* data; // points into the file data
+  uint16_t data_fmt;
+  uint32_t data_len;
+  uint32_t data_max_len;
+} sfo_entry;
+
+typedef struct sfo_file
+{
+  uint32_t n_entries;
+  sfo_entry* entries; // sorted by key
+} sfo_file;
+
+//size of memory that has to be passed to sfo_parse. 0 if header is invalid
+uint32_t sfo_get_memory_size(const void* data, uint32_t size);
+
+//checks that all keys and values lie within data. data has to stay valid while sfo is used
+int sfo_parse(sfo_file* sfo, const void* data, uint32_t size, void* memory, uint32_t memory_size);
+
+//returns entry with the key or 0
+const sfo_entry* sfo_find(const sfo_file* sfo, const char* key);
+
+//copies string value. fails if value does not fit into max_value_len including terminator
+int sfo_get_utf8(const sfo_file* sfo, const char* key, char* value, uint32_t max_value_len);
+
+int sfo_get_int32(const sfo_file* sfo, const char* key, int32_t* value);
@@ -16,6 +16,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../driver/psv_types.h"
+
 typedef int64_t SceInt64;
 typedef SceInt64 SceOff;
 
@@ -40,9 +42,11 @@ int64_t roundUp(int64_t n, int64_t m)
    return n >= 0 ? ((n + m - 1) / m) * m : (n / m) * m;
 }
 
+// file produced by this sample is compression header followed by image data as described in psv_types.h
+// offsets in the table are relative to the start of image data (end of compression header)
 int get_sizeof_header()
 {
-   return 0;
+   return sizeof(compression_header_t);
 }
 
 int test_compress_internal(FILE* outFp, FILE* inpFp, int block_bytes, const char* dicData, int64_t dicSize, SceOff* offsetsTable, int offsetsCapacity, char* compressedData, char* rawData)
@@ -54,7 +58,25 @@ int test_compress_internal(FILE* outFp, FILE* inpFp, int block_bytes, const char
 
    LZ4_resetStream(lz4Stream);
 
-   *offsetsEnd++ = get_sizeof_header();
+   int64_t fsize = get_file_size(inpFp);
+   int64_t nBlocks = roundUp(fsize, block_bytes) / block_bytes;
+   if (nBlocks + 1 > offsetsCapacity)
+      return -1;
+
+   // offset table is at the front so that reader does not have to seek to the tail
+   // reserve space for it and write it once all block sizes are known
+   compression_header_t header;
+   memset(&header, 0, sizeof(compression_header_t));
+   header.type = OPT_HEADER_TYPE_COMPRESSION;
+   header.compression_algorithm = COMPRESSION_ALGORITHM_LZ4;
+   header.uncompressed_size = fsize;
+   header.block_size = block_bytes;
+   header.n_blocks = nBlocks;
+
+   fwrite(&header, sizeof(compression_header_t), 1, outFp);
+   fwrite(offsetsTable, sizeof(SceOff), nBlocks + 1, outFp);
+
+   *offsetsEnd++ = (nBlocks + 1) * sizeof(SceOff);
 
    // Write compressed data blocks.  
    while (1)
@@ -75,8 +97,17 @@ int test_compress_internal(FILE* outFp, FILE* inpFp, int block_bytes, const char
       if (compressedDataSize <= 0)
          return -1;
 
-      // write compressed data
-      fwrite(compressedData, sizeof(char), compressedDataSize, outFp);
+      // store block raw if it does not compress
+      if (compressedDataSize >= rawDataSize)
+      {
+         compressedDataSize = rawDataSize;
+         fwrite(rawData, sizeof(char), rawDataSize, outFp);
+      }
+      else
+      {
+         // write compressed data
+         fwrite(compressedData, sizeof(char), compressedDataSize, outFp);
+      }
 
       // update offset table
       *offsetsEnd = *(offsetsEnd - 1) + compressedDataSize;
@@ -86,10 +117,12 @@ int test_compress_internal(FILE* outFp, FILE* inpFp, int block_bytes, const char
          return -1;
    }
 
-   // Write the tailing jump table
-   *offsetsEnd++ = (offsetsEnd - offsetsTable);
+   if (offsetsEnd - offsetsTable != nBlocks + 1)
+      return -1;
 
-   fwrite(offsetsTable, sizeof(SceOff), (offsetsEnd - offsetsTable), outFp);
+   // Write the leading jump table
+   _fseeki64(outFp, get_sizeof_header(), SEEK_SET);
+   fwrite(offsetsTable, sizeof(SceOff), nBlocks + 1, outFp);
 
    return 0;
 }
@@ -130,17 +163,19 @@ int test_compress(FILE* outFp, FILE* inpFp, int block_bytes, const char* dicData
    return res;
 }
 
-int test_decompress_internal(FILE* outFp, FILE* inpFp, SceOff dataOffset, int dataLength, int block_bytes, const char* dicData, int64_t dicSize, SceOff* offsetsTable, char* compressedData, char* decompressedData)
+int test_decompress_internal(FILE* outFp, FILE* inpFp, SceOff dataOffset, int dataLength, const compression_header_t* header, const char* dicData, int64_t dicSize, SceOff* offsetsTable, char* compressedData, char* decompressedData)
 {
    LZ4_streamDecode_t lz4StreamDecode_body;
    LZ4_streamDecode_t* lz4StreamDecode = &lz4StreamDecode_body;
 
+   int block_bytes = header->block_size;
+
    // The blocks [currentBlock, endBlock) contain the data we want
    SceOff startBlock = dataOffset / block_bytes;
    SceOff endBlock = ((dataOffset + dataLength - 1) / block_bytes) + 1;
 
    // Seek to the first block to read
-   _fseeki64(inpFp, offsetsTable[startBlock], SEEK_SET);
+   _fseeki64(inpFp, get_sizeof_header() + offsetsTable[startBlock], SEEK_SET);
    SceOff offset = dataOffset % block_bytes;
 
    // Start decoding
@@ -150,21 +185,37 @@ int test_decompress_internal(FILE* outFp, FILE* inpFp, SceOff dataOffset, int da
       // The difference in offsets is the size of the block
       int compressedDataSize = offsetsTable[i + 1] - offsetsTable[i];
 
-      // read compressed data
-      int readDataSize = fread(compressedData, sizeof(char), compressedDataSize, inpFp);
-      if (readDataSize != compressedDataSize)
-         return -1;
+      // only last block can be shorter than block size
+      SceOff remaining = header->uncompressed_size - i * block_bytes;
+      int uncompressedDataSize = MIN(remaining, block_bytes);
 
-      //set zero size dictionary (this kinda resets the stream?)
-      if (dicData == 0)
-         LZ4_setStreamDecode(lz4StreamDecode, NULL, 0);
-      else
-         LZ4_setStreamDecode(lz4StreamDecode, dicData, dicSize);
+      int decBytes = 0;
 
-      //decompress data
-      int decBytes = LZ4_decompress_safe_continue(lz4StreamDecode, compressedData, decompressedData, compressedDataSize, block_bytes);
-      if (decBytes <= 0)
-         return -1;
+      if (compressedDataSize == uncompressedDataSize)
+      {
+         // block is stored raw
+         decBytes = fread(decompressedData, sizeof(char), compressedDataSize, inpFp);
+         if (decBytes != compressedDataSize)
+            return -1;
+      }
+      else
+      {
+         // read compressed data
+         int readDataSize = fread(compressedData, sizeof(char), compressedDataSize, inpFp);
+         if (readDataSize != compressedDataSize)
+            return -1;
+
+         //set zero size dictionary (this kinda resets the stream?)
+         if (dicData == 0)
+            LZ4_setStreamDecode(lz4StreamDecode, NULL, 0);
+         else
+            LZ4_setStreamDecode(lz4StreamDecode, dicData, dicSize);
+
+         //decompress data
+         decBytes = LZ4_decompress_safe_continue(lz4StreamDecode, compressedData, decompressedData, compressedDataSize, block_bytes);
+         if (decBytes <= 0)
+            return -1;
+      }
 
       //write chunk of the data
 
@@ -181,11 +232,22 @@ int test_decompress_internal(FILE* outFp, FILE* inpFp, SceOff dataOffset, int da
    return 0;
 }
 
-int test_decompress(FILE* outFp, FILE* inpFp, SceOff dataOffset, int dataLength, int block_bytes, const char* dicData, int64_t dicSize)
+int test_decompress(FILE* outFp, FILE* inpFp, SceOff dataOffset, int dataLength, const char* dicData, int64_t dicSize)
 {
    if (dataLength == 0)
       return -1;
 
+   // read compression header
+   compression_header_t header;
+   _fseeki64(inpFp, 0, SEEK_SET);
+   if (fread(&header, sizeof(compression_header_t), 1, inpFp) != 1)
+      return -1;
+
+   if (header.type != OPT_HEADER_TYPE_COMPRESSION || header.compression_algorithm != COMPRESSION_ALGORITHM_LZ4)
+      return -1;
+
+   int block_bytes = header.block_size;
+
    char* compressedData = (char*)malloc(LZ4_COMPRESSBOUND(block_bytes));
    if (compressedData == 0)
       return -1;
@@ -203,10 +265,7 @@ int test_decompress(FILE* outFp, FILE* inpFp, SceOff dataOffset, int dataLength,
 
    SceOff endBlock = ((dataOffset + dataLength - 1) / block_bytes) + 1;
 
-   // read number of offsets from tail
-   SceOff numOffsets = 0;
-   _fseeki64(inpFp, -((SceOff)sizeof(SceOff)), SEEK_END); //seek to number of offsets
-   fread(&numOffsets, sizeof(SceOff), 1, inpFp);
+   SceOff numOffsets = (SceOff)header.n_blocks + 1;
 
    // validate offset arg
    if (numOffsets <= endBlock)
@@ -227,11 +286,10 @@ int test_decompress(FILE* outFp, FILE* inpFp, SceOff dataOffset, int dataLength,
 
    memset(offsetsTable, 0, numOffsets * sizeof(SceOff));
 
-   //read offset table from tail
-   _fseeki64(inpFp, -((SceOff)sizeof(SceOff)* (numOffsets + 1)), SEEK_END);
+   //read offset table that follows the header
    fread(offsetsTable, sizeof(SceOff), numOffsets, inpFp);
 
-   int res = test_decompress_internal(outFp, inpFp, dataOffset, dataLength, block_bytes, dicData, dicSize, offsetsTable, compressedData, decompressedData);
+   int res = test_decompress_internal(outFp, inpFp, dataOffset, dataLength, &header, dicData, dicSize, offsetsTable, compressedData, decompressedData);
 
    free(compressedData);
    free(decompressedData);
@@ -299,7 +357,7 @@ int decompress(const char* lz4Filename, const char* decFilename, SceOff offset,
    FILE* outFp = fopen(decFilename, "wb");
 
    printf("decompress : %s -> %s\n", lz4Filename, decFilename);
-   test_decompress(outFp, inpFp, offset, length, block_bytes, dicData, dicSize);
+   test_decompress(outFp, inpFp, offset, length, dicData, dicSize);
    printf("decompress : done\n");
 
    fclose(outFp);
@@ -354,8 +412,6 @@ int64_t load_dict(const char* dicFilename, char** dicDataArg)
 }
 
 //memory allocation should be dynamic - no MAX_BLOCKS
-//header should store information about type of compression. lz4 or smth else
-//offset table should move to top
 
 int main(int argc, char* argv[])
 {
@@ -0,0 +1,203 @@
+/* dump_journal.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "dump_journal.h"
+
+#include <psp2kern/types.h>
+#include <psp2kern/io/fcntl.h>
+#include <psp2kern/kernel/utils.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "global_log.h"
+#include "mbr_types.h"
+
+int get_dump_journal_path(const char* dump_path, char* path, int size)
+{
+  int length = strnlen(dump_path, size);
+
+  //extension and terminator
+  if(length + 9 > size)
+    return -1;
+
+  memcpy(path, dump_path, length);
+  strcpy(path + length, ".journal");
+
+  return 0;
+}
+
+void get_dump_journal_checksum(const dump_journal* journal, uint8_t* checksum)
+{
+  ksceSha256Digest(journal, offsetof(dump_journal, checksum), (char*)checksum);
+}
+
+void init_dump_journal(dump_journal* journal, const uint8_t* card_id, uint32_t nSectors)
+{
+  memset(journal, 0, sizeof(dump_journal));
+
+  journal->magic = DUMP_JOURNAL_MAGIC;
+  journal->version = DUMP_JOURNAL_VERSION;
+  memcpy(journal->card_id, card_id, 0x20);
+  journal->nSectors = nSectors;
+  journal->done_sectors = 0;
+  journal->zero_sectors = 0;
+  ksceSha256BlockInit(&journal->sha256_ctx);
+  ksceSha256BlockInit(&journal->leaf_ctx);
+}
+
+int load_dump_journal(const char* path, const uint8_t* card_id, uint32_t nSectors, dump_journal* journal)
+{
+  SceUID fd = ksceIoOpen(path, SCE_O_RDONLY, 0777);
+  if(fd < 0)
+    return -1;
+
+  int res = ksceIoRead(fd, journal, sizeof(dump_journal));
+
+  ksceIoClose(fd);
+
+  if(res != sizeof(dump_journal))
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("dump journal is truncated\n");
+    #endif
+    return -1;
+  }
+
+  uint8_t checksum[0x20];
+  get_dump_journal_checksum(journal, checksum);
+
+  if(journal->magic != DUMP_JOURNAL_MAGIC || journal->version != DUMP_JOURNAL_VERSION || memcmp(journal->checksum, checksum, 0x20) != 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("dump journal is invalid\n");
+    #endif
+    return -1;
+  }
+
+  if(memcmp(journal->card_id, card_id, 0x20) != 0 || journal->nSectors != nSectors || journal->done_sectors > nSectors || journal->zero_sectors > journal->done_sectors ||
+     journal->bad_sectors > journal->done_sectors)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("dump journal belongs to other card\n");
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
+
+SceUID open_dump_journal(const char* path)
+{
+  SceUID fd = ksceIoOpen(path, SCE_O_CREAT | SCE_O_WRONLY, 0777);
+
+  #ifdef ENABLE_DEBUG_LOG
+  if(fd < 0)
+  {
+    snprintf(sprintfBuffer, 256, "failed to open dump journal : %x\n", fd);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  }
+  #endif
+
+  return fd;
+}
+
+int save_dump_journal(SceUID fd, dump_journal* journal)
+{
+  get_dump_journal_checksum(journal, journal->checksum);
+
+  int res = ksceIoPwrite(fd, journal, sizeof(dump_journal), 0);
+  if(res != sizeof(dump_journal))
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to write dump journal : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
+
+SceUID open_dump_output(const char* dump_path, SceUID dev_fd, SceOff data_offset, const uint8_t* card_id, uint32_t nSectors, dump_journal* journal)
+{
+  char journal_path[DUMP_JOURNAL_MAX_PATH];
+  SceUID out_fd = -1;
+
+  if(get_dump_journal_path(dump_path, journal_path, DUMP_JOURNAL_MAX_PATH) >= 0 && load_dump_journal(journal_path, card_id, nSectors, journal) >= 0)
+  {
+    //leaves of hash tree that are already in the dump are read back
+    out_fd = ksceIoOpen(dump_path, SCE_O_RDWR, 0777);
+
+    //dump file can be shorter than journal says if data did not reach the card before power loss.
+    //zero sectors are not written yet so dump file continues right after the last data sector
+    SceOff done_offset = data_offset + (SceOff)(journal->done_sectors - journal->zero_sectors) * SD_DEFAULT_SECTOR_SIZE;
+
+    if(out_fd >= 0 && ksceIoLseek(out_fd, 0, SEEK_END) >= done_offset)
+    {
+      SceOff dev_offset = (SceOff)journal->done_sectors * SD_DEFAULT_SECTOR_SIZE;
+
+      if(ksceIoLseek(out_fd, done_offset, SEEK_SET) == done_offset && ksceIoLseek(dev_fd, dev_offset, SEEK_SET) == dev_offset)
+      {
+        #ifdef ENABLE_DEBUG_LOG
+        snprintf(sprintfBuffer, 256, "resuming dump at sector %x\n", journal->done_sectors);
+        FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+        #endif
+
+        return out_fd;
+      }
+    }
+
+    if(out_fd >= 0)
+      ksceIoClose(out_fd);
+  }
+
+  init_dump_journal(journal, card_id, nSectors);
+
+  if(ksceIoLseek(dev_fd, 0, SEEK_SET) != 0)
+    return -1;
+
+  return ksceIoOpen(dump_path, SCE_O_CREAT | SCE_O_TRUNC | SCE_O_RDWR, 0777);
+}
+
+int load_dump_errors(SceUID out_fd, const dump_journal* journal, dump_error_map* map)
+{
+  uint32_t n_ranges = journal->n_error_ranges;
+  if(n_ranges == 0)
+    return 0;
+
+  if(n_ranges > map->max_ranges)
+    return -1;
+
+  SceSize size = n_ranges * sizeof(error_range_t);
+
+  int res = ksceIoPread(out_fd, map->ranges, size, map->map_offset);
+  if(res != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to read error map : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  error_range_t* last = &map->ranges[n_ranges - 1];
+  if(last->sector >= journal->done_sectors)
+    return -1;
+
+  if(last->sector + last->n_sectors > journal->done_sectors)
+    last->n_sectors = journal->done_sectors - last->sector;
+
+  map->n_ranges = n_ranges;
+  map->bad_sectors = journal->bad_sectors;
+  map->flags = journal->error_flags;
+
+  return 0;
+}
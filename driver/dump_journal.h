@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <psp2kern/types.h>
+#include <psp2kern/kernel/utils.h>
+
+#include "dump_pipeline.h"
+
+//journal is kept next to the dump as <dump_path>.journal while dump is not finished.
+//dump is sequential so completed part is always single range of sectors [0, done_sectors)
+
+#define DUMP_JOURNAL_MAGIC 0x4A565350 //PSVJ
+#define DUMP_JOURNAL_VERSION 4
+
+//dump path and extension
+#define DUMP_JOURNAL_MAX_PATH (256 + 8)
+
+#pragma pack(push, 1)
+
+typedef struct dump_journal
+{
+  uint32_t magic;
+  uint32_t version;
+  uint8_t card_id[0x20];   // identifies the card and its layout. journal of other card is ignored
+  uint32_t nSectors;       // total number of sectors of the card
+  uint32_t done_sectors;   // number of sectors that are written to the dump
+  uint32_t zero_sectors;   // last zero sectors of done_sectors that are not written to the dump because of trimming
+  SceSha256Context sha256_ctx; // hash state of done_sectors
+  SceSha256Context leaf_ctx;   // hash state of hash tree leaf that contains done_sectors. completed leaves are in the dump
+  uint32_t n_error_ranges;    // ranges of unreadable sectors in done_sectors. ranges are in the dump
+  uint32_t bad_sectors;       // unreadable sectors in done_sectors
+  uint32_t error_flags;       // ERROR_MAP_FLAG_* of the error map
+  uint8_t checksum[0x20];  // sha256 of all fields above. detects torn writes
+} dump_journal;
+
+#pragma pack(pop)
+
+int get_dump_journal_path(const char* dump_path, char* path, int size);
+
+void init_dump_journal(dump_journal* journal, const uint8_t* card_id, uint32_t nSectors);
+
+//loads journal that matches the card. returns < 0 if there is no usable journal
+int load_dump_journal(const char* path, const uint8_t* card_id, uint32_t nSectors, dump_journal* journal);
+
+//journal file is rewritten in place. it is not truncated so that old journal stays valid until the first save
+SceUID open_dump_journal(const char* path);
+
+int save_dump_journal(SceUID fd, dump_journal* journal);
+
+//opens dump file for reading and writing. if journal of the same card is found and dump file has all sectors that it mentions
+//dump continues: journal is loaded, dev_fd is positioned at done_sectors and dump file at done_sectors - zero_sectors.
+//otherwise dump file is truncated, journal starts from zero and dev_fd is positioned at the start.
+//data_offset is offset of sector 0 in dump file
+SceUID open_dump_output(const char* dump_path, SceUID dev_fd, SceOff data_offset, const uint8_t* card_id, uint32_t nSectors, dump_journal* journal);
+
+//reads ranges of unreadable sectors that journal mentions back from the dump into map that is set up for the dump.
+//last range can be written after the last journal update so it is cut at done_sectors
+int load_dump_errors(SceUID out_fd, const dump_journal* journal, dump_error_map* map);
@@ -0,0 +1,867 @@
+/* dump_pipeline.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "dump_pipeline.h"
+
+#include <psp2kern/types.h>
+#include <psp2kern/io/fcntl.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/utils.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <lz4.h>
+
+#include "global_log.h"
+#include "mbr_types.h"
+#include "defines.h"
+#include "hash_tree.h"
+
+//chunk with zero sectors marks the end of the stream. every stage passes it on and exits
+
+typedef struct dump_chunk
+{
+  char* data;
+  uint32_t nSectors;
+  SceSha256Context sha256_ctx; //hash state after this chunk. only kept for checkpoints
+  SceSha256Context leaf_ctx;   //leaf hash state after this chunk. only kept for checkpoints
+  uint32_t first_leaf;         //leaves that are completed by this chunk
+  uint32_t n_leaves;
+  char* comp_data;
+  uint32_t comp_size;
+  error_range_t errors[DUMP_PIPELINE_MAX_CHUNK_ERRORS]; //unreadable sectors of the chunk, counted from the start of the card
+  uint32_t n_errors;
+  uint32_t bad_sectors;
+  uint32_t errors_incomplete; //chunk has more unreadable ranges than it can hold
+} dump_chunk;
+
+typedef struct dump_pipeline
+{
+  dump_pipeline_params params;
+
+  dump_chunk chunks[DUMP_PIPELINE_MAX_BUFFERS];
+  SceUID buffers_mem_id;
+
+  //number of buffers that each stage can take
+  SceUID free_sema;
+  SceUID hash_sema;
+  SceUID compress_sema;
+  SceUID write_sema;
+
+  SceUID hash_thread_id;
+  SceUID compress_thread_id;
+  SceUID write_thread_id;
+
+  //owned by compressor stage
+  void* lz4_state;
+  uint32_t next_block;
+  uint64_t comp_pos;
+
+  SceSha256Context sha256_ctx;
+
+  //owned by hasher stage. counts sectors from the start of the card
+  SceSha256Context leaf_ctx;
+  uint32_t hashed_sectors;
+
+  //written by writer stage only
+  volatile uint32_t written_sectors;
+  uint32_t zero_sectors; //zero sectors at the end of written_sectors that are not yet written
+  char* zero_data;
+  SceSha256Context written_ctx;
+  SceSha256Context written_leaf_ctx;
+  uint32_t checkpoint_sectors;
+
+  //set by any stage. reader stops at the next chunk
+  volatile int error;
+
+  //set by reader. hasher and writer only drain remaining chunks
+  volatile int canceled;
+} dump_pipeline;
+
+dump_pipeline g_dump_pipeline;
+
+//splits chunk at leaf boundaries. last leaf ends at the end of the card and can be shorter
+void hash_dump_leaves(dump_pipeline* p, dump_chunk* chunk)
+{
+  uint32_t leaf_sectors = p->params.leaf_sectors;
+  uint32_t end_sector = p->params.start_sector + p->params.nSectors;
+
+  chunk->first_leaf = p->hashed_sectors / leaf_sectors;
+  chunk->n_leaves = 0;
+
+  uint32_t done = 0;
+
+  while(done < chunk->nSectors)
+  {
+    uint32_t nSectors = leaf_sectors - p->hashed_sectors % leaf_sectors;
+    if(nSectors > chunk->nSectors - done)
+      nSectors = chunk->nSectors - done;
+
+    ksceSha256BlockUpdate(&p->leaf_ctx, chunk->data + done * SD_DEFAULT_SECTOR_SIZE, nSectors * SD_DEFAULT_SECTOR_SIZE);
+
+    done += nSectors;
+    p->hashed_sectors += nSectors;
+
+    if(p->hashed_sectors % leaf_sectors == 0 || p->hashed_sectors == end_sector)
+    {
+      uint32_t leaf = (p->hashed_sectors - 1) / leaf_sectors;
+      ksceSha256BlockResult(&p->leaf_ctx, (char*)p->params.leaves + leaf * HASH_TREE_NODE_SIZE);
+
+      memset((char*)&p->leaf_ctx, 0, sizeof(SceSha256Context));
+      ksceSha256BlockInit(&p->leaf_ctx);
+
+      chunk->n_leaves++;
+    }
+  }
+}
+
+int dump_hash_thread(SceSize args, void* argp)
+{
+  dump_pipeline* p = &g_dump_pipeline;
+
+  for(uint32_t i = 0; ; i++)
+  {
+    ksceKernelWaitSema(p->hash_sema, 1, 0);
+
+    dump_chunk* chunk = &p->chunks[i % p->params.n_buffers];
+
+    //chunk can be reused by reader as soon as it is passed on
+    uint32_t nSectors = chunk->nSectors;
+
+    if(nSectors > 0 && p->error == 0 && p->canceled == 0)
+    {
+      ksceSha256BlockUpdate(&p->sha256_ctx, chunk->data, nSectors * SD_DEFAULT_SECTOR_SIZE);
+
+      if(p->params.leaf_sectors > 0)
+        hash_dump_leaves(p, chunk);
+
+      //hasher runs ahead of writer so state is passed along with the chunk
+      if(p->params.checkpoint != 0)
+      {
+        memcpy(&chunk->sha256_ctx, &p->sha256_ctx, sizeof(SceSha256Context));
+        memcpy(&chunk->leaf_ctx, &p->leaf_ctx, sizeof(SceSha256Context));
+      }
+    }
+
+    //compressor is only there for compressed layout
+    ksceKernelSignalSema(p->compress_sema >= 0 ? p->compress_sema : p->write_sema, 1);
+
+    if(nSectors == 0)
+      break;
+  }
+
+  return 0;
+}
+
+//compresses every block of the chunk into comp_data and fills offset table
+void compress_dump_chunk(dump_pipeline* p, dump_chunk* chunk)
+{
+  uint32_t block_size = p->params.block_size;
+  uint32_t size = chunk->nSectors * SD_DEFAULT_SECTOR_SIZE;
+
+  chunk->comp_size = 0;
+
+  for(uint32_t offset = 0; offset < size; offset += block_size)
+  {
+    //only last block of the card can be shorter
+    uint32_t raw_size = size - offset < block_size ? size - offset : block_size;
+
+    const char* raw = chunk->data + offset;
+    char* comp = chunk->comp_data + chunk->comp_size;
+
+    int comp_size = LZ4_compress_fast_extState(p->lz4_state, raw, comp, raw_size, LZ4_COMPRESSBOUND(block_size), 1);
+
+    //block that does not compress is stored raw
+    if(comp_size <= 0 || comp_size >= raw_size)
+    {
+      memcpy(comp, raw, raw_size);
+      comp_size = raw_size;
+    }
+
+    chunk->comp_size += comp_size;
+    p->comp_pos += comp_size;
+
+    p->next_block++;
+    p->params.offsets[p->next_block] = p->comp_pos;
+  }
+}
+
+int dump_compress_thread(SceSize args, void* argp)
+{
+  dump_pipeline* p = &g_dump_pipeline;
+
+  for(uint32_t i = 0; ; i++)
+  {
+    ksceKernelWaitSema(p->compress_sema, 1, 0);
+
+    dump_chunk* chunk = &p->chunks[i % p->params.n_buffers];
+
+    //chunk can be reused by reader as soon as it is passed on
+    uint32_t nSectors = chunk->nSectors;
+
+    if(nSectors > 0 && p->error == 0 && p->canceled == 0)
+      compress_dump_chunk(p, chunk);
+
+    ksceKernelSignalSema(p->write_sema, 1);
+
+    if(nSectors == 0)
+      break;
+  }
+
+  return 0;
+}
+
+//checks 8 words per step. or-ing them together lets compiler keep the loop branch free
+int is_zero_sector(const char* data)
+{
+  const uint64_t* words = (const uint64_t*)data;
+
+  for(uint32_t i = 0; i < SD_DEFAULT_SECTOR_SIZE / sizeof(uint64_t); i += 8)
+  {
+    uint64_t acc = words[i] | words[i + 1] | words[i + 2] | words[i + 3] | words[i + 4] | words[i + 5] | words[i + 6] | words[i + 7];
+    if(acc != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+//returns number of sectors up to and including the last sector that is not zero
+uint32_t get_data_sectors(const char* data, uint32_t nSectors)
+{
+  for(uint32_t i = nSectors; i > 0; i--)
+  {
+    if(is_zero_sector(data + (i - 1) * SD_DEFAULT_SECTOR_SIZE) == 0)
+      return i;
+  }
+
+  return 0;
+}
+
+int write_dump_data(dump_pipeline* p, const char* data, SceSize size)
+{
+  int res = ksceIoWrite(p->params.out_fd, data, size);
+  if(res != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to write dump chunk : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
+
+int write_dump_chunk(dump_pipeline* p, dump_chunk* chunk)
+{
+  if(p->params.block_size > 0)
+    return write_dump_data(p, chunk->comp_data, chunk->comp_size);
+
+  if(p->params.trim == 0)
+    return write_dump_data(p, chunk->data, chunk->nSectors * SD_DEFAULT_SECTOR_SIZE);
+
+  //zero sectors are only written once they are followed by data, so zero tail of the card is never written
+  uint32_t data_sectors = get_data_sectors(chunk->data, chunk->nSectors);
+
+  if(data_sectors > 0)
+  {
+    while(p->zero_sectors > 0)
+    {
+      uint32_t nSectors = p->zero_sectors < p->params.chunk_sectors ? p->zero_sectors : p->params.chunk_sectors;
+      if(write_dump_data(p, p->zero_data, nSectors * SD_DEFAULT_SECTOR_SIZE) < 0)
+        return -1;
+
+      p->zero_sectors -= nSectors;
+    }
+
+    if(write_dump_data(p, chunk->data, data_sectors * SD_DEFAULT_SECTOR_SIZE) < 0)
+      return -1;
+  }
+
+  p->zero_sectors += chunk->nSectors - data_sectors;
+
+  return 0;
+}
+
+//leaves are written right after the data they cover so that journal never gets ahead of them
+int write_dump_leaves(dump_pipeline* p, dump_chunk* chunk)
+{
+  if(p->params.leaf_sectors == 0 || chunk->n_leaves == 0)
+    return 0;
+
+  SceSize size = chunk->n_leaves * HASH_TREE_NODE_SIZE;
+  SceOff offset = p->params.leaves_offset + (SceOff)chunk->first_leaf * HASH_TREE_NODE_SIZE;
+
+  int res = ksceIoPwrite(p->params.out_fd, p->params.leaves + chunk->first_leaf * HASH_TREE_NODE_SIZE, size, offset);
+  if(res != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to write hash tree leaves : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
+
+//unreadable ranges are merged into error map and written right after the data they cover, same as leaves
+int write_dump_errors(dump_pipeline* p, dump_chunk* chunk)
+{
+  dump_error_map* map = p->params.errors;
+  if(map == 0 || chunk->bad_sectors == 0)
+    return 0;
+
+  //last range of the map can be extended by the first range of the chunk
+  uint32_t first_range = map->n_ranges > 0 ? map->n_ranges - 1 : 0;
+
+  for(uint32_t i = 0; i < chunk->n_errors; i++)
+  {
+    const error_range_t* range = &chunk->errors[i];
+    error_range_t* last = map->n_ranges > 0 ? &map->ranges[map->n_ranges - 1] : 0;
+
+    if(last != 0 && last->sector + last->n_sectors == range->sector)
+      last->n_sectors += range->n_sectors;
+    else if(map->n_ranges < map->max_ranges)
+      memcpy(&map->ranges[map->n_ranges++], range, sizeof(error_range_t));
+    else
+      map->flags |= ERROR_MAP_FLAG_INCOMPLETE;
+  }
+
+  if(chunk->errors_incomplete > 0)
+    map->flags |= ERROR_MAP_FLAG_INCOMPLETE;
+
+  map->bad_sectors += chunk->bad_sectors;
+
+  if(map->n_ranges == first_range)
+    return 0;
+
+  SceSize size = (map->n_ranges - first_range) * sizeof(error_range_t);
+  SceOff offset = map->map_offset + (SceOff)first_range * sizeof(error_range_t);
+
+  int res = ksceIoPwrite(p->params.out_fd, &map->ranges[first_range], size, offset);
+  if(res != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to write error map : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
+
+int dump_write_thread(SceSize args, void* argp)
+{
+  dump_pipeline* p = &g_dump_pipeline;
+
+  for(uint32_t i = 0; ; i++)
+  {
+    ksceKernelWaitSema(p->write_sema, 1, 0);
+
+    dump_chunk* chunk = &p->chunks[i % p->params.n_buffers];
+
+    if(chunk->nSectors == 0)
+    {
+      if(p->params.checkpoint != 0 && p->checkpoint_sectors > 0)
+        p->params.checkpoint(p->written_sectors, p->zero_sectors, &p->written_ctx, &p->written_leaf_ctx);
+      break;
+    }
+
+    //after error or cancel chunks are only drained so that reader can reach the end
+    if(p->error == 0 && p->canceled == 0)
+    {
+      if(write_dump_chunk(p, chunk) < 0 || write_dump_leaves(p, chunk) < 0 || write_dump_errors(p, chunk) < 0)
+      {
+        p->error = 1;
+      }
+      else
+      {
+        p->written_sectors += chunk->nSectors;
+
+        if(p->params.checkpoint != 0)
+        {
+          memcpy(&p->written_ctx, &chunk->sha256_ctx, sizeof(SceSha256Context));
+          memcpy(&p->written_leaf_ctx, &chunk->leaf_ctx, sizeof(SceSha256Context));
+
+          p->checkpoint_sectors += chunk->nSectors;
+          if(p->checkpoint_sectors >= p->params.checkpoint_sectors)
+          {
+            p->params.checkpoint(p->written_sectors, p->zero_sectors, &p->written_ctx, &p->written_leaf_ctx);
+            p->checkpoint_sectors = 0;
+          }
+        }
+      }
+    }
+
+    ksceKernelSignalSema(p->free_sema, 1);
+  }
+
+  return 0;
+}
+
+int destroy_dump_pipeline(dump_pipeline* p)
+{
+  if(p->hash_thread_id >= 0)
+  {
+    int waitRet = 0;
+    ksceKernelWaitThreadEnd(p->hash_thread_id, &waitRet, 0);
+    ksceKernelDeleteThread(p->hash_thread_id);
+    p->hash_thread_id = -1;
+  }
+
+  if(p->compress_thread_id >= 0)
+  {
+    int waitRet = 0;
+    ksceKernelWaitThreadEnd(p->compress_thread_id, &waitRet, 0);
+    ksceKernelDeleteThread(p->compress_thread_id);
+    p->compress_thread_id = -1;
+  }
+
+  if(p->write_thread_id >= 0)
+  {
+    int waitRet = 0;
+    ksceKernelWaitThreadEnd(p->write_thread_id, &waitRet, 0);
+    ksceKernelDeleteThread(p->write_thread_id);
+    p->write_thread_id = -1;
+  }
+
+  if(p->free_sema >= 0)
+  {
+    ksceKernelDeleteSema(p->free_sema);
+    p->free_sema = -1;
+  }
+
+  if(p->hash_sema >= 0)
+  {
+    ksceKernelDeleteSema(p->hash_sema);
+    p->hash_sema = -1;
+  }
+
+  if(p->compress_sema >= 0)
+  {
+    ksceKernelDeleteSema(p->compress_sema);
+    p->compress_sema = -1;
+  }
+
+  if(p->write_sema >= 0)
+  {
+    ksceKernelDeleteSema(p->write_sema);
+    p->write_sema = -1;
+  }
+
+  if(p->buffers_mem_id >= 0)
+  {
+    ksceKernelFreeMemBlock(p->buffers_mem_id);
+    p->buffers_mem_id = -1;
+  }
+
+  return 0;
+}
+
+int create_dump_pipeline(dump_pipeline* p, const dump_pipeline_params* params)
+{
+  memset(p, 0, sizeof(dump_pipeline));
+  memcpy(&p->params, params, sizeof(dump_pipeline_params));
+
+  p->buffers_mem_id = -1;
+  p->free_sema = -1;
+  p->hash_sema = -1;
+  p->compress_sema = -1;
+  p->write_sema = -1;
+  p->hash_thread_id = -1;
+  p->compress_thread_id = -1;
+  p->write_thread_id = -1;
+
+  uint32_t chunk_size = params->chunk_sectors * SD_DEFAULT_SECTOR_SIZE;
+
+  //compressed data of the chunk can be slightly larger than the chunk. lz4 state follows the buffers
+  uint32_t comp_size = 0;
+  if(params->block_size > 0)
+    comp_size = ((chunk_size / params->block_size) * LZ4_COMPRESSBOUND(params->block_size) + 0xF) & ~0xF;
+
+  uint32_t state_size = params->block_size > 0 ? LZ4_sizeofState() : 0;
+
+  //chunk of zeros that deferred zero sectors are written from
+  uint32_t zero_size = params->trim > 0 ? chunk_size : 0;
+
+  //memory blocks are allocated in pages
+  uint32_t mem_size = ((chunk_size + comp_size) * params->n_buffers + state_size + zero_size + 0xFFF) & ~0xFFF;
+
+  p->buffers_mem_id = ksceKernelAllocMemBlock("dump_buffers", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, mem_size, 0);
+  if(p->buffers_mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate dump buffers : %x\n", p->buffers_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  void* base = 0;
+  ksceKernelGetMemBlockBase(p->buffers_mem_id, &base);
+
+  for(uint32_t i = 0; i < params->n_buffers; i++)
+  {
+    p->chunks[i].data = (char*)base + i * chunk_size;
+    if(params->block_size > 0)
+      p->chunks[i].comp_data = (char*)base + chunk_size * params->n_buffers + i * comp_size;
+  }
+
+  if(params->block_size > 0)
+  {
+    p->lz4_state = (char*)base + (chunk_size + comp_size) * params->n_buffers;
+    p->next_block = 0;
+    p->comp_pos = params->offsets[0];
+  }
+
+  if(params->trim > 0)
+  {
+    p->zero_data = (char*)base + (chunk_size + comp_size) * params->n_buffers + state_size;
+    memset(p->zero_data, 0, zero_size);
+  }
+
+  p->zero_sectors = params->zero_sectors;
+
+  p->free_sema = ksceKernelCreateSema("dump_free_sema", 0, params->n_buffers, params->n_buffers, 0);
+  p->hash_sema = ksceKernelCreateSema("dump_hash_sema", 0, 0, params->n_buffers, 0);
+  p->write_sema = ksceKernelCreateSema("dump_write_sema", 0, 0, params->n_buffers, 0);
+
+  if(params->block_size > 0)
+    p->compress_sema = ksceKernelCreateSema("dump_compress_sema", 0, 0, params->n_buffers, 0);
+
+  if(p->free_sema < 0 || p->hash_sema < 0 || p->write_sema < 0 || (params->block_size > 0 && p->compress_sema < 0))
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("failed to create dump semaphores\n");
+    #endif
+    return -1;
+  }
+
+  if(params->sha256_ctx != 0)
+  {
+    memcpy(&p->sha256_ctx, params->sha256_ctx, sizeof(SceSha256Context));
+  }
+  else
+  {
+    memset((char*)&p->sha256_ctx, 0, sizeof(SceSha256Context));
+    ksceSha256BlockInit(&p->sha256_ctx);
+  }
+
+  memcpy(&p->written_ctx, &p->sha256_ctx, sizeof(SceSha256Context));
+
+  if(params->leaf_ctx != 0)
+  {
+    memcpy(&p->leaf_ctx, params->leaf_ctx, sizeof(SceSha256Context));
+  }
+  else
+  {
+    memset((char*)&p->leaf_ctx, 0, sizeof(SceSha256Context));
+    ksceSha256BlockInit(&p->leaf_ctx);
+  }
+
+  memcpy(&p->written_leaf_ctx, &p->leaf_ctx, sizeof(SceSha256Context));
+
+  p->hashed_sectors = params->start_sector;
+
+  p->hash_thread_id = ksceKernelCreateThread("DumpHashThread", &dump_hash_thread, 0x64, 0x4000, 0, 0, 0);
+  p->write_thread_id = ksceKernelCreateThread("DumpWriteThread", &dump_write_thread, 0x64, 0x4000, 0, 0, 0);
+
+  if(params->block_size > 0)
+    p->compress_thread_id = ksceKernelCreateThread("DumpCompressThread", &dump_compress_thread, 0x64, 0x4000, 0, 0, 0);
+
+  if(p->hash_thread_id < 0 || p->write_thread_id < 0 || (params->block_size > 0 && p->compress_thread_id < 0))
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("failed to create dump threads\n");
+    #endif
+
+    //threads that are created but not started can be deleted right away
+    if(p->hash_thread_id >= 0)
+      ksceKernelDeleteThread(p->hash_thread_id);
+    if(p->compress_thread_id >= 0)
+      ksceKernelDeleteThread(p->compress_thread_id);
+    if(p->write_thread_id >= 0)
+      ksceKernelDeleteThread(p->write_thread_id);
+
+    p->hash_thread_id = -1;
+    p->compress_thread_id = -1;
+    p->write_thread_id = -1;
+    return -1;
+  }
+
+  ksceKernelStartThread(p->hash_thread_id, 0, 0);
+  if(p->compress_thread_id >= 0)
+    ksceKernelStartThread(p->compress_thread_id, 0, 0);
+  ksceKernelStartThread(p->write_thread_id, 0, 0);
+
+  return 0;
+}
+
+//records unreadable sector of the chunk. sectors come in increasing order
+void add_dump_chunk_error(dump_chunk* chunk, uint32_t sector)
+{
+  chunk->bad_sectors++;
+
+  error_range_t* last = chunk->n_errors > 0 ? &chunk->errors[chunk->n_errors - 1] : 0;
+
+  if(last != 0 && last->sector + last->n_sectors == sector)
+  {
+    last->n_sectors++;
+  }
+  else if(chunk->n_errors < DUMP_PIPELINE_MAX_CHUNK_ERRORS)
+  {
+    chunk->errors[chunk->n_errors].sector = sector;
+    chunk->errors[chunk->n_errors].n_sectors = 1;
+    chunk->n_errors++;
+  }
+  else
+  {
+    chunk->errors_incomplete = 1;
+  }
+}
+
+//reads part of the chunk at its absolute position. part that fails every attempt is split in halves
+//down to single sectors, so only sectors that really can not be read are lost
+void recover_dump_sectors(dump_pipeline* p, dump_chunk* chunk, uint32_t sector, uint32_t first, uint32_t nSectors, uint32_t attempts)
+{
+  char* data = chunk->data + first * SD_DEFAULT_SECTOR_SIZE;
+  SceSize size = nSectors * SD_DEFAULT_SECTOR_SIZE;
+  SceOff offset = (SceOff)(p->params.start_sector + sector + first) * SD_DEFAULT_SECTOR_SIZE;
+
+  for(uint32_t i = 0; i < attempts; i++)
+  {
+    //position of the device is not known after failed read
+    if(ksceIoLseek(p->params.dev_fd, offset, SEEK_SET) == offset && ksceIoRead(p->params.dev_fd, data, size) == size)
+      return;
+  }
+
+  if(nSectors > 1)
+  {
+    uint32_t half = nSectors / 2;
+    recover_dump_sectors(p, chunk, sector, first, half, DUMP_PIPELINE_READ_ATTEMPTS);
+    recover_dump_sectors(p, chunk, sector, first + half, nSectors - half, DUMP_PIPELINE_READ_ATTEMPTS);
+    return;
+  }
+
+  #ifdef ENABLE_DEBUG_LOG
+  snprintf(sprintfBuffer, 256, "sector %x can not be read\n", p->params.start_sector + sector + first);
+  FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  #endif
+
+  memset(data, 0, SD_DEFAULT_SECTOR_SIZE);
+  add_dump_chunk_error(chunk, p->params.start_sector + sector + first);
+}
+
+//sector is counted from start_sector. dev_fd is left right after the chunk
+int read_dump_chunk(dump_pipeline* p, dump_chunk* chunk, uint32_t sector, uint32_t nSectors)
+{
+  chunk->n_errors = 0;
+  chunk->bad_sectors = 0;
+  chunk->errors_incomplete = 0;
+
+  SceSize size = nSectors * SD_DEFAULT_SECTOR_SIZE;
+
+  int res = ksceIoRead(p->params.dev_fd, chunk->data, size);
+  if(res == size)
+    return 0;
+
+  #ifdef ENABLE_DEBUG_LOG
+  snprintf(sprintfBuffer, 256, "failed to read dump chunk at %x : %x\n", sector, res);
+  FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  #endif
+
+  if(p->params.errors == 0)
+    return -1;
+
+  //first attempt is already made
+  recover_dump_sectors(p, chunk, sector, 0, nSectors, DUMP_PIPELINE_READ_ATTEMPTS - 1);
+
+  SceOff end_offset = (SceOff)(p->params.start_sector + sector + nSectors) * SD_DEFAULT_SECTOR_SIZE;
+  if(ksceIoLseek(p->params.dev_fd, end_offset, SEEK_SET) != end_offset)
+    return -1;
+
+  return 0;
+}
+
+//passes chunk from reader to the next stage
+void push_dump_chunk(dump_pipeline* p, uint32_t index, uint32_t nSectors)
+{
+  p->chunks[index % p->params.n_buffers].nSectors = nSectors;
+  ksceKernelSignalSema(p->hash_sema, 1);
+}
+
+int dump_pipeline_run(const dump_pipeline_params* params, char* sha256_digest, uint32_t* zero_sectors)
+{
+  if(params->n_buffers == 0 || params->n_buffers > DUMP_PIPELINE_MAX_BUFFERS || params->chunk_sectors == 0)
+    return DUMP_PIPELINE_ERROR;
+
+  if(params->block_size > 0 && (params->offsets == 0 || params->checkpoint != 0 || params->trim > 0 || (params->chunk_sectors * SD_DEFAULT_SECTOR_SIZE) % params->block_size != 0))
+    return DUMP_PIPELINE_ERROR;
+
+  if(params->trim == 0 && params->zero_sectors > 0)
+    return DUMP_PIPELINE_ERROR;
+
+  if(params->leaf_sectors > 0 && params->leaves == 0)
+    return DUMP_PIPELINE_ERROR;
+
+  if(params->errors != 0 && (params->errors->ranges == 0 || params->errors->n_ranges > params->errors->max_ranges))
+    return DUMP_PIPELINE_ERROR;
+
+  dump_pipeline* p = &g_dump_pipeline;
+
+  if(create_dump_pipeline(p, params) < 0)
+  {
+    destroy_dump_pipeline(p);
+    return DUMP_PIPELINE_ERROR;
+  }
+
+  int holds_buffer = 0;
+  uint32_t sector = 0;
+  uint32_t index = 0;
+
+  //reader stage
+  while(sector < params->nSectors)
+  {
+    ksceKernelWaitSema(p->free_sema, 1, 0);
+    holds_buffer = 1;
+
+    if(p->error > 0)
+      break;
+
+    uint32_t nSectors = params->nSectors - sector;
+    if(nSectors > params->chunk_sectors)
+      nSectors = params->chunk_sectors;
+
+    //unreadable sectors are stored as zeros if there is error map. otherwise dump stops
+    if(read_dump_chunk(p, &p->chunks[index % params->n_buffers], sector, nSectors) < 0)
+    {
+      p->error = 1;
+      break;
+    }
+
+    push_dump_chunk(p, index, nSectors);
+    holds_buffer = 0;
+
+    index++;
+    sector += nSectors;
+
+    if(params->progress != 0 && params->progress(p->written_sectors, params->nSectors) < 0)
+    {
+      p->canceled = 1;
+      break;
+    }
+  }
+
+  //end of stream takes a buffer too
+  if(holds_buffer == 0)
+    ksceKernelWaitSema(p->free_sema, 1, 0);
+
+  push_dump_chunk(p, index, 0);
+
+  //waits for hasher and writer to drain
+  destroy_dump_pipeline(p);
+
+  if(p->error > 0)
+    return DUMP_PIPELINE_ERROR;
+
+  if(p->canceled > 0)
+    return DUMP_PIPELINE_CANCELED;
+
+  ksceSha256BlockResult(&p->sha256_ctx, sha256_digest);
+
+  if(zero_sectors != 0)
+    *zero_sectors = p->zero_sectors;
+
+  return DUMP_PIPELINE_DONE;
+}
+
+//candidates for chunk size probe. per request overhead of the card dominates small chunks
+//while large chunks stop paying off once transfer time dominates
+static const uint32_t g_probe_chunk_sectors[] = {0x10, 0x40, 0x100, 0x400, 0x800};
+
+#define DUMP_PROBE_N_CANDIDATES (sizeof(g_probe_chunk_sectors) / sizeof(uint32_t))
+
+//number of sectors that are read with every candidate
+#define DUMP_PROBE_SECTORS 0x1000
+
+uint32_t dump_pipeline_probe_chunk_sectors(SceUID dev_fd, uint32_t nSectors)
+{
+  //every candidate reads its own range so that no candidate is served from cache
+  if(nSectors < DUMP_PROBE_SECTORS * DUMP_PROBE_N_CANDIDATES)
+    return 0;
+
+  SceOff start_pos = ksceIoLseek(dev_fd, 0, SEEK_CUR);
+  if(start_pos < 0)
+    return 0;
+
+  SceUID mem_id = ksceKernelAllocMemBlock("dump_probe_buffer", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, DUMP_PIPELINE_MAX_CHUNK_SECTORS * SD_DEFAULT_SECTOR_SIZE, 0);
+  if(mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate probe buffer : %x\n", mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return 0;
+  }
+
+  void* buffer = 0;
+  ksceKernelGetMemBlockBase(mem_id, &buffer);
+
+  uint32_t best_chunk_sectors = 0;
+  SceInt64 best_time = 0;
+
+  for(uint32_t i = 0; i < DUMP_PROBE_N_CANDIDATES; i++)
+  {
+    uint32_t chunk_sectors = g_probe_chunk_sectors[i];
+    SceSize size = chunk_sectors * SD_DEFAULT_SECTOR_SIZE;
+
+    SceInt64 start = ksceKernelGetSystemTimeWide();
+
+    int res = size;
+    for(uint32_t sector = 0; sector < DUMP_PROBE_SECTORS && res == size; sector += chunk_sectors)
+      res = ksceIoRead(dev_fd, buffer, size);
+
+    SceInt64 elapsed = ksceKernelGetSystemTimeWide() - start;
+
+    if(res != size)
+    {
+      #ifdef ENABLE_DEBUG_LOG
+      snprintf(sprintfBuffer, 256, "failed to probe chunk size %x : %x\n", chunk_sectors, res);
+      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+      #endif
+
+      best_chunk_sectors = 0;
+      break;
+    }
+
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "probe chunk size %x : %x us\n", chunk_sectors, (uint32_t)elapsed);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+
+    //larger chunk is only taken if it is faster. on ties memory is saved
+    if(best_chunk_sectors == 0 || elapsed < best_time)
+    {
+      best_chunk_sectors = chunk_sectors;
+      best_time = elapsed;
+    }
+  }
+
+  ksceKernelFreeMemBlock(mem_id);
+
+  if(ksceIoLseek(dev_fd, start_pos, SEEK_SET) != start_pos)
+    return 0;
+
+  return best_chunk_sectors;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <psp2kern/types.h>
+#include <psp2kern/kernel/utils.h>
+
+#include "psv_types.h"
+
+//dumping is split into stages that run on separate threads and pass chunks
+//through ring of buffers: reader (calling thread) -> hasher -> [compressor] -> writer.
+//card, sha256 engine, cpu and memory card are busy at the same time
+
+#define DUMP_PIPELINE_MAX_BUFFERS 8
+#define DUMP_PIPELINE_DEFAULT_BUFFERS 4
+
+//chunk size limits. buffers take n_buffers * chunk size of kernel memory
+#define DUMP_PIPELINE_MIN_CHUNK_SECTORS 0x10
+#define DUMP_PIPELINE_MAX_CHUNK_SECTORS 0x800
+
+//failed read is retried until it was tried this many times. then it is split in halves that are read the same way.
+//single sector that still can not be read is stored as zeros and recorded in error map
+#define DUMP_PIPELINE_READ_ATTEMPTS 3
+
+//unreadable ranges that one chunk can pass to the writer. error map is marked incomplete if chunk has more
+#define DUMP_PIPELINE_MAX_CHUNK_ERRORS 8
+
+#define DUMP_PIPELINE_DONE 0
+#define DUMP_PIPELINE_CANCELED 1
+#define DUMP_PIPELINE_ERROR -1
+
+//called by reader stage after every chunk with number of sectors that are written.
+//returns < 0 to cancel the dump. chunks that are not yet written are dropped
+typedef int (*dump_progress_callback)(uint32_t done_sectors, uint32_t total_sectors);
+
+//called by writer stage with sha256 state of exactly done_sectors that are written.
+//last zero_sectors of them are zero and are not written yet because of trimming.
+//leaf_ctx is state of the hash tree leaf that is not complete yet.
+//called every checkpoint_sectors and once more when dump stops for any reason
+typedef int (*dump_checkpoint_callback)(uint32_t done_sectors, uint32_t zero_sectors, const SceSha256Context* sha256_ctx, const SceSha256Context* leaf_ctx);
+
+//unreadable sectors of the card. updated by writer stage only
+typedef struct dump_error_map
+{
+  error_range_t* ranges; //sorted by sector. written to out_fd at map_offset as soon as data they cover is written
+  uint32_t max_ranges;
+  uint32_t n_ranges;
+  uint32_t bad_sectors;
+  uint32_t flags;        //ERROR_MAP_FLAG_*
+  SceOff map_offset;
+} dump_error_map;
+
+typedef struct dump_pipeline_params
+{
+  SceUID dev_fd;          //read sequentially from current position
+  SceUID out_fd;          //written sequentially from current position
+  uint32_t nSectors;      //number of sectors to dump
+  uint32_t chunk_sectors; //number of sectors per buffer
+  uint32_t n_buffers;     //1 - DUMP_PIPELINE_MAX_BUFFERS. 1 makes stages run one after another
+  dump_progress_callback progress;
+  const SceSha256Context* sha256_ctx; //state to continue hashing from. 0 starts new hash
+  uint32_t checkpoint_sectors;
+  dump_checkpoint_callback checkpoint; //0 disables checkpoints. not supported with compression
+  uint32_t block_size;    //LZ4 block size of compressed layout. chunk must be multiple of it. 0 writes sectors as is
+  uint64_t* offsets;      //offset table of compressed layout. offsets[0] is position of the first block on input
+  int trim;               //zero sectors are only written when they are followed by data. not supported with compression
+  uint32_t zero_sectors;  //zero sectors right before dev_fd position that are not yet written to out_fd
+  uint32_t start_sector;  //sector of the card at dev_fd position. hash tree leaves are counted from sector 0
+  uint32_t leaf_sectors;  //sectors per hash tree leaf. 0 disables leaf hashes
+  uint8_t* leaves;        //leaf hashes of the card. completed leaves are stored here and written to out_fd
+  SceOff leaves_offset;   //position of leaf 0 in out_fd
+  const SceSha256Context* leaf_ctx; //state of the leaf at start_sector. 0 starts new leaf
+  dump_error_map* errors; //receives sectors that can not be read. 0 stops the dump at the first read error
+} dump_pipeline_params;
+
+//sha256_digest receives hash of all dumped data if dump is done, including zero sectors that are not written.
+//zero_sectors receives number of trailing zero sectors that are not written
+int dump_pipeline_run(const dump_pipeline_params* params, char* sha256_digest, uint32_t* zero_sectors);
+
+//reads from current position of dev_fd with every candidate chunk size and returns the fastest one.
+//dev_fd is moved back to initial position. returns 0 if device is too small or on error
+uint32_t dump_pipeline_probe_chunk_sectors(SceUID dev_fd, uint32_t nSectors);
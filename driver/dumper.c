@@ -27,6 +27,10 @@
 #include "functions.h"
 #include "reader.h"
 #include "defines.h"
+#include "dump_pipeline.h"
+#include "dump_journal.h"
+#include "hash_tree.h"
+#include "psvgamesd_api.h"
 
 #define ISO_ROOT_DIRECTORY "ux0:iso"
 
@@ -36,6 +40,8 @@
 typedef struct dump_args
 {
   char* dump_path;
+  uint32_t chunk_sectors;
+  uint32_t flags;
 } dump_args;
 
 SceUID g_dumpThreadId = -1;
@@ -50,73 +56,112 @@ SceUID dump_resp_cond = -1;
 
 int g_dump_state = 0;
 char g_dump_path[256] = {0};
+uint32_t g_dump_chunk_sectors = 0;
+uint32_t g_dump_flags = 0;
 
 //---------------
 
-SceUID g_total_sectors_mutex_id = -1;
+//running state is single word. it is written by request handler and dump thread and polled by dump thread
+volatile uint32_t g_running_state = 0;
 
-uint32_t g_total_sectors = 0;
-
-uint32_t get_total_sectors()
+uint32_t get_running_state()
 {
-  ksceKernelLockMutex(g_total_sectors_mutex_id, 1, 0);
-  uint32_t temp = g_total_sectors;
-  ksceKernelUnlockMutex(g_total_sectors_mutex_id, 1);
-  return temp;
+  return g_running_state;
 }
 
-void set_total_sectors(uint32_t value)
+void set_running_state(uint32_t value)
 {
-  ksceKernelLockMutex(g_total_sectors_mutex_id, 1, 0);
-  g_total_sectors = value;
-  ksceKernelUnlockMutex(g_total_sectors_mutex_id, 1);
+  g_running_state = value;
 }
 
 //---------------
 
-SceUID g_progress_sectors_mutex_id = -1;
-
-uint32_t g_progress_sectors = 0;
+//progress snapshot is written by dump thread only and read by syscalls without locking.
+//sequence number is odd while snapshot is updated. reader retries if it changes while snapshot is copied
+volatile uint32_t g_dump_progress_seq = 0;
+psvgamesd_dump_progress g_dump_progress;
 
-uint32_t get_progress_sectors()
+void publish_dump_progress(uint32_t total_sectors, uint32_t done_sectors, uint32_t bytes_per_second, uint32_t bad_sectors, uint32_t errors)
 {
-  ksceKernelLockMutex(g_progress_sectors_mutex_id, 1, 0);
-  uint32_t temp = g_progress_sectors;
-  ksceKernelUnlockMutex(g_progress_sectors_mutex_id, 1);
-  return temp;
+  uint32_t eta_seconds = 0;
+  if(bytes_per_second > 0 && done_sectors < total_sectors)
+    eta_seconds = (uint64_t)(total_sectors - done_sectors) * SD_DEFAULT_SECTOR_SIZE / bytes_per_second;
+
+  uint32_t seq = g_dump_progress_seq;
+
+  g_dump_progress_seq = seq + 1;
+  __sync_synchronize();
+
+  g_dump_progress.seq = seq + 2;
+  g_dump_progress.total_sectors = total_sectors;
+  g_dump_progress.done_sectors = done_sectors;
+  g_dump_progress.bytes_per_second = bytes_per_second;
+  g_dump_progress.eta_seconds = eta_seconds;
+  g_dump_progress.bad_sectors = bad_sectors;
+  g_dump_progress.errors = errors;
+
+  __sync_synchronize();
+  g_dump_progress_seq = seq + 2;
 }
 
-void set_progress_sectors(uint32_t value)
+void get_dump_progress(psvgamesd_dump_progress* progress)
 {
-  ksceKernelLockMutex(g_progress_sectors_mutex_id, 1, 0);
-  g_progress_sectors = value;
-  ksceKernelUnlockMutex(g_progress_sectors_mutex_id, 1);
+  while(1)
+  {
+    uint32_t seq = g_dump_progress_seq;
+
+    if((seq & 1) == 0)
+    {
+      __sync_synchronize();
+      memcpy(progress, &g_dump_progress, sizeof(psvgamesd_dump_progress));
+      __sync_synchronize();
+
+      if(g_dump_progress_seq == seq)
+        return;
+    }
+
+    //let dump thread finish the update if it was preempted in the middle of it
+    ksceKernelDelayThread(100);
+  }
 }
 
 //---------------
 
-SceUID g_running_state_mutex_id = -1;
-
-uint32_t g_running_state = 0;
+//space for error map is reserved for every dump because map can only be known at the end
+#define DUMP_ERROR_MAP_MAX_RANGES 0x100
 
-uint32_t get_running_state()
+//error map follows hash tree
+SceOff get_dump_error_map_offset(const hash_tree_header_t* tree)
 {
-  ksceKernelLockMutex(g_running_state_mutex_id, 1, 0);
-  uint32_t temp = g_running_state;
-  ksceKernelUnlockMutex(g_running_state_mutex_id, 1);
-  return temp;
+  SceOff tree_size = (SceOff)tree->n_nodes * HASH_TREE_NODE_SIZE;
+  return tree->tree_offset + ((tree_size + SD_DEFAULT_SECTOR_SIZE - 1) & ~(SceOff)(SD_DEFAULT_SECTOR_SIZE - 1));
 }
 
-void set_running_state(uint32_t value)
+//image data follows error map
+SceOff get_dump_data_offset(const hash_tree_header_t* tree)
 {
-  ksceKernelLockMutex(g_running_state_mutex_id, 1, 0);
-  g_running_state = value;
-  ksceKernelUnlockMutex(g_running_state_mutex_id, 1);
+  SceOff map_size = DUMP_ERROR_MAP_MAX_RANGES * sizeof(error_range_t);
+  return get_dump_error_map_offset(tree) + ((map_size + SD_DEFAULT_SECTOR_SIZE - 1) & ~(SceOff)(SD_DEFAULT_SECTOR_SIZE - 1));
 }
 
-//---------------
+int write_dump_header_data(SceUID out_fd, const void* data, SceSize size)
+{
+  int res = ksceIoWrite(out_fd, data, size);
+  if(res != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to write dump header : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
 
-int dump_header(SceUID dev_fd, SceUID out_fd, const MBR* dump_mbr, const char* sha256_digest)
+//compression header is only written for compressed dump. error map header is only written if some sectors could not be read.
+//image_size is size of the data that follows the header. image of raw dump is trimmed if image_size is less than size of the card
+int dump_header(SceUID dev_fd, SceUID out_fd, const MBR* dump_mbr, const char* sha256_digest, const compression_header_t* compression, const hash_tree_header_t* tree, const dump_error_map* errors, uint64_t image_size)
 {
   //get data from gc memory
   char data_5018_buffer[CMD56_DATA_SIZE];
@@ -127,6 +172,17 @@ int dump_header(SceUID dev_fd, SceUID out_fd, const MBR* dump_mbr, const char* s
   img_header.magic = PSV_MAGIC;
   img_header.version = PSV_VERSION_V1;
   img_header.flags = 0;
+
+  if(compression != 0)
+    img_header.flags = FLAG_COMPRESSED;
+  else if(image_size < (uint64_t)dump_mbr->sizeInBlocks * SD_DEFAULT_SECTOR_SIZE)
+    img_header.flags = FLAG_TRIMMED;
+
+  img_header.flags |= FLAG_HASH_TREE;
+
+  if(errors->bad_sectors > 0)
+    img_header.flags |= FLAG_ERROR_MAP;
+
   memcpy(img_header.key1, data_5018_buffer, 0x10);
   memcpy(img_header.key2, data_5018_buffer + 0x10, 0x10);
   memcpy(img_header.signature, data_5018_buffer + 0x20, 0x14);
@@ -136,119 +192,484 @@ int dump_header(SceUID dev_fd, SceUID out_fd, const MBR* dump_mbr, const char* s
   else
     memcpy(img_header.hash, sha256_digest, 0x20);
 
-  img_header.image_size = dump_mbr->sizeInBlocks * SD_DEFAULT_SECTOR_SIZE;
-  img_header.image_offset_sector = 1;
+  img_header.image_size = image_size;
+  img_header.image_offset_sector = get_dump_data_offset(tree) / SD_DEFAULT_SECTOR_SIZE;
 
   //seek to the beginning of the file in case of updating the header with sha256 hash
-  ksceIoLseek(out_fd, 0, SEEK_SET);
+  if(ksceIoLseek(out_fd, 0, SEEK_SET) != 0)
+    return -1;
 
   //write data
-  ksceIoWrite(out_fd, &img_header, sizeof(psv_file_header_v1));
+  if(write_dump_header_data(out_fd, &img_header, sizeof(psv_file_header_v1)) < 0)
+    return -1;
 
-  //write padding
   int padding_size = SD_DEFAULT_SECTOR_SIZE - sizeof(psv_file_header_v1);
+
+  if(compression != 0)
+  {
+    if(write_dump_header_data(out_fd, compression, sizeof(compression_header_t)) < 0)
+      return -1;
+    padding_size -= sizeof(compression_header_t);
+  }
+
+  //hash tree header follows header of the layout
+  if(write_dump_header_data(out_fd, tree, sizeof(hash_tree_header_t)) < 0)
+    return -1;
+  padding_size -= sizeof(hash_tree_header_t);
+
+  if(errors->bad_sectors > 0)
+  {
+    error_map_header_t eh;
+    memset(&eh, 0, sizeof(error_map_header_t));
+    eh.type = OPT_HEADER_TYPE_ERROR_MAP;
+    eh.flags = errors->flags;
+    eh.n_ranges = errors->n_ranges;
+    eh.bad_sectors = errors->bad_sectors;
+    eh.map_offset = errors->map_offset;
+
+    if(write_dump_header_data(out_fd, &eh, sizeof(error_map_header_t)) < 0)
+      return -1;
+    padding_size -= sizeof(error_map_header_t);
+  }
+
+  //write padding
   char padding_data[SD_DEFAULT_SECTOR_SIZE];
   memset(padding_data, 0, SD_DEFAULT_SECTOR_SIZE);
 
-  ksceIoWrite(out_fd, padding_data, padding_size);
+  return write_dump_header_data(out_fd, padding_data, padding_size);
+}
+
+//number of sectors per copy operation if probe fails
+#define DUMP_DEFAULT_CHUNK_SECTORS 0x10
+
+//number of sectors between power ticks and progress updates. does not depend on chunk size
+#define DUMP_TICK_SECTORS 0x1000
+
+//number of sectors between journal updates
+#define DUMP_JOURNAL_SECTORS 0x8000
+
+//compressed dump uses the same block size as psvtool compress
+#define DUMP_COMPRESSION_BLOCK_SIZE 0x10000
+
+//compressed dump needs space for compressed data of every buffer too
+#define DUMP_COMPRESSION_MAX_CHUNK_SECTORS 0x200
+
+//leaf of hash tree covers 1 MiB so tree of 4 GiB card takes 256 KiB
+#define DUMP_HASH_TREE_CHUNK_SIZE 0x100000
+
+uint32_t g_last_tick_sectors = 0;
+SceInt64 g_last_tick_time = 0;
+
+//throughput is smoothed over ticks so that single slow request does not make eta jump
+uint32_t g_dump_bytes_per_second = 0;
+
+//number of dumps that stopped because of read or write error since module start
+uint32_t g_dump_errors = 0;
+
+//sector where pipeline has started. pipeline counts sectors from there
+uint32_t g_dump_start_sectors = 0;
+
+SceUID g_dump_journal_fd = -1;
+dump_journal g_dump_journal;
+
+//unreadable sectors of current dump
+error_range_t g_dump_error_ranges[DUMP_ERROR_MAP_MAX_RANGES];
+dump_error_map g_dump_error_map;
+
+//called by dump pipeline after every chunk
+int dump_progress(uint32_t done_sectors, uint32_t total_sectors)
+{
+  //check dump cancel request. this is done for every chunk so that cancel is not delayed by ticks
+  uint32_t rn_state = get_running_state();
+  if(rn_state == DUMP_STATE_STOP)
+    return -1;
+
+  if(done_sectors - g_last_tick_sectors < DUMP_TICK_SECTORS)
+    return 0;
+
+  SceInt64 tick_time = ksceKernelGetSystemTimeWide();
+  SceInt64 elapsed = tick_time - g_last_tick_time;
+
+  if(elapsed > 0)
+  {
+    uint32_t bytes_per_second = (uint64_t)(done_sectors - g_last_tick_sectors) * SD_DEFAULT_SECTOR_SIZE * 1000000 / elapsed;
+    g_dump_bytes_per_second = g_dump_bytes_per_second == 0 ? bytes_per_second : (g_dump_bytes_per_second * 3 + bytes_per_second) / 4;
+  }
+
+  g_last_tick_sectors = done_sectors;
+  g_last_tick_time = tick_time;
+
+  //make sure vita does not go to sleep
+  ksceKernelPowerTick(SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND);
+
+  //report number of sectors that are dumped
+  publish_dump_progress(total_sectors + g_dump_start_sectors, g_dump_start_sectors + done_sectors, g_dump_bytes_per_second, g_dump_error_map.bad_sectors, g_dump_errors);
 
   return 0;
 }
 
-//number of blocks per copy operation
-#define DUMP_BLOCK_SIZE 0x10
+//called by dump pipeline from writer thread
+int dump_checkpoint(uint32_t done_sectors, uint32_t zero_sectors, const SceSha256Context* sha256_ctx, const SceSha256Context* leaf_ctx)
+{
+  g_dump_journal.done_sectors = g_dump_start_sectors + done_sectors;
+  g_dump_journal.zero_sectors = zero_sectors;
+  memcpy(&g_dump_journal.sha256_ctx, sha256_ctx, sizeof(SceSha256Context));
+  memcpy(&g_dump_journal.leaf_ctx, leaf_ctx, sizeof(SceSha256Context));
 
-//#define DUMP_BLOCK_TICK_SIZE 0x1000
-#define DUMP_BLOCK_TICK_SIZE 0x100
+  //error map is updated by the same thread so it matches done_sectors
+  g_dump_journal.n_error_ranges = g_dump_error_map.n_ranges;
+  g_dump_journal.bad_sectors = g_dump_error_map.bad_sectors;
+  g_dump_journal.error_flags = g_dump_error_map.flags;
 
-char dump_buffer[SD_DEFAULT_SECTOR_SIZE * DUMP_BLOCK_SIZE];
+  return save_dump_journal(g_dump_journal_fd, &g_dump_journal);
+}
 
-int dump_img(SceUID dev_fd, SceUID out_fd, const MBR* dump_mbr)
+uint32_t select_chunk_sectors(SceUID dev_fd, uint32_t nSectors, uint32_t chunk_sectors)
 {
-  //init dump status
-  set_total_sectors(dump_mbr->sizeInBlocks);
-  set_progress_sectors(0);
+  if(chunk_sectors == DUMP_CHUNK_SECTORS_AUTO)
+  {
+    chunk_sectors = dump_pipeline_probe_chunk_sectors(dev_fd, nSectors);
+    if(chunk_sectors == 0)
+      chunk_sectors = DUMP_DEFAULT_CHUNK_SECTORS;
+  }
+  else if(chunk_sectors < DUMP_PIPELINE_MIN_CHUNK_SECTORS)
+  {
+    chunk_sectors = DUMP_PIPELINE_MIN_CHUNK_SECTORS;
+  }
+  else if(chunk_sectors > DUMP_PIPELINE_MAX_CHUNK_SECTORS)
+  {
+    chunk_sectors = DUMP_PIPELINE_MAX_CHUNK_SECTORS;
+  }
 
-  //init sha256
-  SceSha256Context ctx;
-  memset((char*)&ctx, 0, sizeof(SceSha256Context));
-  ksceSha256BlockInit(&ctx);
+  #ifdef ENABLE_DEBUG_LOG
+  snprintf(sprintfBuffer, 256, "dump chunk size: %x\n", chunk_sectors);
+  FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  #endif
+
+  return chunk_sectors;
+}
+
+//offset table of compressed dump
+SceUID g_dump_offsets_mem_id = -1;
+
+//reserves space for offset table in front of the blocks and sets up pipeline for compression
+int init_compressed_dump(SceUID out_fd, SceOff data_offset, const MBR* dump_mbr, dump_pipeline_params* params, compression_header_t* ch)
+{
+  uint64_t size = (uint64_t)dump_mbr->sizeInBlocks * SD_DEFAULT_SECTOR_SIZE;
+
+  memset(ch, 0, sizeof(compression_header_t));
+  ch->type = OPT_HEADER_TYPE_COMPRESSION;
+  ch->compression_algorithm = COMPRESSION_ALGORITHM_LZ4;
+  ch->uncompressed_size = size;
+  ch->block_size = DUMP_COMPRESSION_BLOCK_SIZE;
+  ch->n_blocks = (size + DUMP_COMPRESSION_BLOCK_SIZE - 1) / DUMP_COMPRESSION_BLOCK_SIZE;
 
-  //dump sectors - main part
-  SceSize nBlocks = dump_mbr->sizeInBlocks / DUMP_BLOCK_SIZE;
-  for(int i = 0; i < nBlocks; i++)
+  uint32_t table_size = (ch->n_blocks + 1) * sizeof(uint64_t);
+
+  g_dump_offsets_mem_id = ksceKernelAllocMemBlock("dump_offsets", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, (table_size + 0xFFF) & ~0xFFF, 0);
+  if(g_dump_offsets_mem_id < 0)
   {
-    if((i % DUMP_BLOCK_TICK_SIZE) == 0)
-    {
-      #ifdef ENABLE_DEBUG_LOG
-      //snprintf(sprintfBuffer, 256, "%x from %x\n", i, nBlocks);
-      //FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-      #endif
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate offset table : %x\n", g_dump_offsets_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
 
-      //make sure vita does not go to sleep
-      ksceKernelPowerTick(SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND);
+  void* base = 0;
+  ksceKernelGetMemBlockBase(g_dump_offsets_mem_id, &base);
 
-      //report number of sectors that are dumped
-      set_progress_sectors(i * DUMP_BLOCK_SIZE);
+  //blocks follow the offset table
+  uint64_t* offsets = (uint64_t*)base;
+  offsets[0] = table_size;
 
-      //check dump cancel request
-      //maybe it can be done on each iteration
-      //but I think it will be slow
-      uint32_t rn_state = get_running_state();
-      if(rn_state == DUMP_STATE_STOP)
-      {
-        set_total_sectors(0);
-        set_progress_sectors(0);
-        return 0;
-      }
-    }
+  //chunk must consist of whole blocks
+  uint32_t block_sectors = DUMP_COMPRESSION_BLOCK_SIZE / SD_DEFAULT_SECTOR_SIZE;
+  uint32_t chunk_sectors = ((params->chunk_sectors + block_sectors - 1) / block_sectors) * block_sectors;
+  if(chunk_sectors > DUMP_COMPRESSION_MAX_CHUNK_SECTORS)
+    chunk_sectors = DUMP_COMPRESSION_MAX_CHUNK_SECTORS;
 
-    //get data
-    ksceIoRead(dev_fd, dump_buffer, SD_DEFAULT_SECTOR_SIZE * DUMP_BLOCK_SIZE);
+  params->chunk_sectors = chunk_sectors;
+  params->block_size = DUMP_COMPRESSION_BLOCK_SIZE;
+  params->offsets = offsets;
 
-    //dump data
-    ksceIoWrite(out_fd, dump_buffer, SD_DEFAULT_SECTOR_SIZE * DUMP_BLOCK_SIZE);
+  //compressed dump is not journaled and not trimmed. zero blocks compress well anyway
+  params->checkpoint = 0;
+  params->trim = 0;
+  params->zero_sectors = 0;
 
-    //update sha256
-    ksceSha256BlockUpdate(&ctx, dump_buffer, SD_DEFAULT_SECTOR_SIZE * DUMP_BLOCK_SIZE);
+  SceOff blocks_offset = data_offset + table_size;
+  if(ksceIoLseek(out_fd, blocks_offset, SEEK_SET) != blocks_offset)
+    return -1;
+
+  return 0;
+}
+
+//offset table is written last because it is only known after all blocks are compressed
+int finish_compressed_dump(SceUID out_fd, SceOff data_offset, const dump_pipeline_params* params, const compression_header_t* ch)
+{
+  uint32_t table_size = (ch->n_blocks + 1) * sizeof(uint64_t);
+
+  int res = ksceIoPwrite(out_fd, params->offsets, table_size, data_offset);
+  if(res != table_size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to write offset table : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
   }
 
-  //dump sectors - tail
-  SceSize nTail = dump_mbr->sizeInBlocks % DUMP_BLOCK_SIZE;
-  if(nTail > 0)
+  return 0;
+}
+
+void deinit_compressed_dump()
+{
+  if(g_dump_offsets_mem_id >= 0)
   {
-    //get data
-    ksceIoRead(dev_fd, dump_buffer, SD_DEFAULT_SECTOR_SIZE * nTail);
+    ksceKernelFreeMemBlock(g_dump_offsets_mem_id);
+    g_dump_offsets_mem_id = -1;
+  }
+}
 
-    //dump data
-    ksceIoWrite(out_fd, dump_buffer, SD_DEFAULT_SECTOR_SIZE * nTail);
+SceUID g_dump_tree_mem_id = -1;
+hash_tree_layout g_dump_tree_layout;
+hash_tree_header_t g_dump_tree;
+uint8_t* g_dump_tree_nodes = 0;
 
-    //update sha256
-    ksceSha256BlockUpdate(&ctx, dump_buffer, SD_DEFAULT_SECTOR_SIZE * nTail);
+//hash tree is stored between header sector and image data. its size only depends on size of the card
+int init_dump_hash_tree(const MBR* dump_mbr)
+{
+  uint64_t size = (uint64_t)dump_mbr->sizeInBlocks * SD_DEFAULT_SECTOR_SIZE;
+  uint32_t n_chunks = (size + DUMP_HASH_TREE_CHUNK_SIZE - 1) / DUMP_HASH_TREE_CHUNK_SIZE;
+
+  if(hash_tree_get_layout(n_chunks, &g_dump_tree_layout) < 0)
+    return -1;
+
+  uint32_t tree_size = g_dump_tree_layout.n_nodes * HASH_TREE_NODE_SIZE;
+
+  g_dump_tree_mem_id = ksceKernelAllocMemBlock("dump_hash_tree", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, (tree_size + 0xFFF) & ~0xFFF, 0);
+  if(g_dump_tree_mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate hash tree : %x\n", g_dump_tree_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
   }
 
-  //get sha256 digest
+  void* base = 0;
+  ksceKernelGetMemBlockBase(g_dump_tree_mem_id, &base);
+
+  g_dump_tree_nodes = (uint8_t*)base;
+  memset(g_dump_tree_nodes, 0, tree_size);
+
+  memset(&g_dump_tree, 0, sizeof(hash_tree_header_t));
+  g_dump_tree.type = OPT_HEADER_TYPE_HASH_TREE;
+  g_dump_tree.chunk_size = DUMP_HASH_TREE_CHUNK_SIZE;
+  g_dump_tree.uncompressed_size = size;
+  g_dump_tree.n_chunks = n_chunks;
+  g_dump_tree.n_nodes = g_dump_tree_layout.n_nodes;
+  g_dump_tree.tree_offset = SD_DEFAULT_SECTOR_SIZE;
+
+  return 0;
+}
+
+//leaves that are completed before interruption are only stored in the dump
+int load_dump_leaves(SceUID out_fd, uint32_t done_sectors)
+{
+  uint32_t leaf_sectors = g_dump_tree.chunk_size / SD_DEFAULT_SECTOR_SIZE;
+  uint32_t n_leaves = done_sectors / leaf_sectors;
+  if(n_leaves == 0)
+    return 0;
+
+  SceSize size = n_leaves * HASH_TREE_NODE_SIZE;
+
+  int res = ksceIoPread(out_fd, g_dump_tree_nodes, size, g_dump_tree.tree_offset);
+  if(res != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to read hash tree leaves : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
+
+//builds upper levels from the leaves and writes complete tree
+int finish_dump_hash_tree(SceUID out_fd)
+{
+  hash_tree_build(&g_dump_tree_layout, g_dump_tree_nodes);
+  memcpy(g_dump_tree.root, hash_tree_get_root(&g_dump_tree_layout, g_dump_tree_nodes), 0x20);
+
+  SceSize size = g_dump_tree.n_nodes * HASH_TREE_NODE_SIZE;
+
+  int res = ksceIoPwrite(out_fd, g_dump_tree_nodes, size, g_dump_tree.tree_offset);
+  if(res != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to write hash tree : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  return 0;
+}
+
+void deinit_dump_hash_tree()
+{
+  if(g_dump_tree_mem_id >= 0)
+  {
+    ksceKernelFreeMemBlock(g_dump_tree_mem_id);
+    g_dump_tree_mem_id = -1;
+    g_dump_tree_nodes = 0;
+  }
+}
+
+//error map is stored between hash tree and image data
+void init_dump_error_map()
+{
+  memset(&g_dump_error_map, 0, sizeof(dump_error_map));
+  g_dump_error_map.ranges = g_dump_error_ranges;
+  g_dump_error_map.max_ranges = DUMP_ERROR_MAP_MAX_RANGES;
+  g_dump_error_map.map_offset = get_dump_error_map_offset(&g_dump_tree);
+}
+
+int dump_img(SceUID dev_fd, SceUID out_fd, const MBR* dump_mbr, uint32_t chunk_sectors, uint32_t flags)
+{
+  //dump continues from the last journal update
+  g_dump_start_sectors = g_dump_journal.done_sectors;
+
+  //init dump status
+  g_last_tick_sectors = 0;
+  g_last_tick_time = ksceKernelGetSystemTimeWide();
+  g_dump_bytes_per_second = 0;
+
+  publish_dump_progress(dump_mbr->sizeInBlocks, g_dump_start_sectors, 0, g_dump_error_map.bad_sectors, g_dump_errors);
+
+  //make sure vita does not go to sleep before the first tick
+  ksceKernelPowerTick(SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND);
+
+  //card read, sha256 and file write run concurrently on rotating buffers
+  dump_pipeline_params params;
+  params.dev_fd = dev_fd;
+  params.out_fd = out_fd;
+  params.nSectors = dump_mbr->sizeInBlocks - g_dump_start_sectors;
+  params.chunk_sectors = select_chunk_sectors(dev_fd, params.nSectors, chunk_sectors);
+  params.n_buffers = DUMP_PIPELINE_DEFAULT_BUFFERS;
+  params.progress = dump_progress;
+  params.sha256_ctx = &g_dump_journal.sha256_ctx;
+  params.checkpoint_sectors = DUMP_JOURNAL_SECTORS;
+  params.checkpoint = g_dump_journal_fd >= 0 ? dump_checkpoint : 0;
+  params.block_size = 0;
+  params.offsets = 0;
+
+  //zero sectors at the end of the card are not written. zero sectors of interrupted dump are not written yet either
+  params.trim = 1;
+  params.zero_sectors = g_dump_journal.zero_sectors;
+
+  //hash tree leaves are hashed by the same stage as the image
+  params.start_sector = g_dump_start_sectors;
+  params.leaf_sectors = g_dump_tree.chunk_size / SD_DEFAULT_SECTOR_SIZE;
+  params.leaves = g_dump_tree_nodes;
+  params.leaves_offset = g_dump_tree.tree_offset;
+  params.leaf_ctx = &g_dump_journal.leaf_ctx;
+
+  //unreadable sectors are stored as zeros and dump goes on
+  params.errors = &g_dump_error_map;
+
+  SceOff data_offset = get_dump_data_offset(&g_dump_tree);
+
+  //compression runs on its own thread so card reads are not slowed down. hash still covers raw data
+  compression_header_t ch;
+  int compressed = (flags & DUMP_FLAG_COMPRESSED) > 0;
+
+  int res = load_dump_leaves(out_fd, g_dump_start_sectors);
+  if(res == 0)
+    res = load_dump_errors(out_fd, &g_dump_journal, &g_dump_error_map);
+  if(res == 0 && compressed > 0)
+    res = init_compressed_dump(out_fd, data_offset, dump_mbr, &params, &ch);
+
   char sha256_digest[0x20];
   memset(sha256_digest, 0, 0x20);
-  ksceSha256BlockResult(&ctx, sha256_digest);
+
+  uint32_t zero_sectors = 0;
+
+  if(res == 0)
+    res = dump_pipeline_run(&params, sha256_digest, &zero_sectors);
+
+  if(res == DUMP_PIPELINE_DONE && compressed > 0)
+    res = finish_compressed_dump(out_fd, data_offset, &params, &ch);
+
+  if(res == DUMP_PIPELINE_DONE)
+    res = finish_dump_hash_tree(out_fd);
+
+  //hash covers the whole card but zero tail is not stored
+  uint64_t image_size = (uint64_t)(dump_mbr->sizeInBlocks - zero_sectors) * SD_DEFAULT_SECTOR_SIZE;
+  if(res == DUMP_PIPELINE_DONE && compressed > 0)
+    image_size = params.offsets[ch.n_blocks];
+
+  deinit_compressed_dump();
+
+  if(res != DUMP_PIPELINE_DONE)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "dump pipeline stopped : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+
+    if(res == DUMP_PIPELINE_ERROR)
+      g_dump_errors++;
+
+    publish_dump_progress(0, 0, 0, 0, g_dump_errors);
+    return res;
+  }
+
+  #ifdef ENABLE_DEBUG_LOG
+  if(g_dump_error_map.bad_sectors > 0)
+  {
+    snprintf(sprintfBuffer, 256, "%x sectors can not be read\n", g_dump_error_map.bad_sectors);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  }
+  #endif
 
   //rewrite header
-  dump_header(dev_fd, out_fd, dump_mbr, sha256_digest);
+  if(dump_header(dev_fd, out_fd, dump_mbr, sha256_digest, compressed > 0 ? &ch : 0, &g_dump_tree, &g_dump_error_map, image_size) < 0)
+  {
+    g_dump_errors++;
+    publish_dump_progress(0, 0, 0, 0, g_dump_errors);
+    return DUMP_PIPELINE_ERROR;
+  }
 
   //report number of sectors that are dumped
-  set_progress_sectors(dump_mbr->sizeInBlocks);
+  publish_dump_progress(dump_mbr->sizeInBlocks, dump_mbr->sizeInBlocks, g_dump_bytes_per_second, g_dump_error_map.bad_sectors, g_dump_errors);
 
   return 0;
 }
 
-int dump_core(SceUID dev_fd, SceUID out_fd)
+//card is identified by partition layout and per card keys
+void get_dump_card_id(const MBR* dump_mbr, uint8_t* card_id)
+{
+  char data_5018_buffer[CMD56_DATA_SIZE];
+  get_5018_data(data_5018_buffer);
+
+  SceSha256Context ctx;
+  memset((char*)&ctx, 0, sizeof(SceSha256Context));
+  ksceSha256BlockInit(&ctx);
+  ksceSha256BlockUpdate(&ctx, dump_mbr, sizeof(MBR));
+  ksceSha256BlockUpdate(&ctx, data_5018_buffer, CMD56_DATA_SIZE);
+  ksceSha256BlockResult(&ctx, (char*)card_id);
+}
+
+int dump_core(SceUID dev_fd, const char* dump_path, uint32_t chunk_sectors, uint32_t flags)
 {
   //get mbr data
   MBR dump_mbr;
 
-  ksceIoRead(dev_fd, &dump_mbr, sizeof(MBR));
-
-  if(memcmp(dump_mbr.header, SCEHeader, 0x20) != 0)
+  if(ksceIoRead(dev_fd, &dump_mbr, sizeof(MBR)) != sizeof(MBR) || memcmp(dump_mbr.header, SCEHeader, 0x20) != 0)
   {
     #ifdef ENABLE_DEBUG_LOG
     FILE_GLOBAL_WRITE_LEN("SCE header is invalid\n");
@@ -261,16 +682,91 @@ int dump_core(SceUID dev_fd, SceUID out_fd)
   FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
   #endif
 
-  //seek to beginning
-  ksceIoLseek(dev_fd, 0, SEEK_SET);
+  uint8_t card_id[0x20];
+  get_dump_card_id(&dump_mbr, card_id);
+
+  char journal_path[DUMP_JOURNAL_MAX_PATH];
+  int journal_path_res = get_dump_journal_path(dump_path, journal_path, DUMP_JOURNAL_MAX_PATH);
+
+  //size of hash tree decides where image data starts
+  if(init_dump_hash_tree(&dump_mbr) < 0)
+    return -1;
+
+  init_dump_error_map();
+
+  SceOff data_offset = get_dump_data_offset(&g_dump_tree);
+
+  SceUID out_fd = -1;
+
+  if((flags & DUMP_FLAG_COMPRESSED) > 0)
+  {
+    //compressed dump always starts from the beginning. journal of previous raw dump does not apply to it
+    if(journal_path_res >= 0)
+      ksceIoRemove(journal_path);
+
+    init_dump_journal(&g_dump_journal, card_id, dump_mbr.sizeInBlocks);
+
+    ksceIoLseek(dev_fd, 0, SEEK_SET);
+    out_fd = ksceIoOpen(dump_path, SCE_O_CREAT | SCE_O_TRUNC | SCE_O_WRONLY, 0777);
+  }
+  else
+  {
+    //continue interrupted dump of the same card or start from the beginning
+    out_fd = open_dump_output(dump_path, dev_fd, data_offset, card_id, dump_mbr.sizeInBlocks, &g_dump_journal);
+  }
+
+  if(out_fd < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("Failed to open output file\n");
+    #endif
+    deinit_dump_hash_tree();
+    return -1;
+  }
+
+  #ifdef ENABLE_DEBUG_LOG
+  FILE_GLOBAL_WRITE_LEN("Opened output file\n");
+  #endif
+
+  //header of interrupted dump is already written.
+  //header of compressed dump is only written when it is finished so unfinished dump is not taken for raw one
+  if(g_dump_journal.done_sectors == 0 && (flags & DUMP_FLAG_COMPRESSED) == 0)
+  {
+    //write header info. image data of raw dump is written from current position
+    if(dump_header(dev_fd, out_fd, &dump_mbr, 0, 0, &g_dump_tree, &g_dump_error_map, (uint64_t)dump_mbr.sizeInBlocks * SD_DEFAULT_SECTOR_SIZE) < 0 ||
+       ksceIoLseek(out_fd, data_offset, SEEK_SET) != data_offset)
+    {
+      ksceIoClose(out_fd);
+      deinit_dump_hash_tree();
+      return -1;
+    }
+  }
+
+  //dump can still be done if journal can not be written. it just can not be continued
+  if(journal_path_res >= 0 && (flags & DUMP_FLAG_COMPRESSED) == 0)
+    g_dump_journal_fd = open_dump_journal(journal_path);
 
-  //write header info
-  dump_header(dev_fd, out_fd, &dump_mbr, 0);
+  if(g_dump_journal_fd >= 0)
+    save_dump_journal(g_dump_journal_fd, &g_dump_journal);
 
   //dump image itself
-  dump_img(dev_fd, out_fd, &dump_mbr);
+  int res = dump_img(dev_fd, out_fd, &dump_mbr, chunk_sectors, flags);
 
-  return 0;
+  if(g_dump_journal_fd >= 0)
+  {
+    ksceIoClose(g_dump_journal_fd);
+    g_dump_journal_fd = -1;
+
+    //journal is kept after cancel or error
+    if(res == 0)
+      ksceIoRemove(journal_path);
+  }
+
+  ksceIoClose(out_fd);
+
+  deinit_dump_hash_tree();
+
+  return res;
 }
 
 int dump_thread_internal(SceSize args, void* argp)
@@ -297,25 +793,8 @@ int dump_thread_internal(SceSize args, void* argp)
   FILE_GLOBAL_WRITE_LEN("Opened sd dev\n");
   #endif
 
-  SceUID out_fd = ksceIoOpen(da->dump_path, SCE_O_CREAT | SCE_O_TRUNC | SCE_O_WRONLY, 0777);
-
-  if(out_fd < 0)
-  {
-    #ifdef ENABLE_DEBUG_LOG
-    FILE_GLOBAL_WRITE_LEN("Failed to open output file\n");
-    #endif
-
-    ksceIoClose(dev_fd);
-    return -1;
-  }
-
-  #ifdef ENABLE_DEBUG_LOG
-  FILE_GLOBAL_WRITE_LEN("Opened output file\n");
-  #endif
-
-  dump_core(dev_fd, out_fd);
+  dump_core(dev_fd, da->dump_path, da->chunk_sectors, da->flags);
 
-  ksceIoClose(out_fd);
   ksceIoClose(dev_fd);
 
   return 0;
@@ -345,7 +824,7 @@ int dump_thread(SceSize args, void* argp)
 dump_args da_inst;
 char da_inst_dump_path[256] = {0};
 
-int initialize_dump_thread(const char* dump_path)
+int initialize_dump_thread(const char* dump_path, uint32_t chunk_sectors, uint32_t flags)
 {
   g_dumpThreadId = ksceKernelCreateThread("DumpThread", &dump_thread, 0x64, 0x10000, 0, 0, 0);
 
@@ -365,6 +844,8 @@ int initialize_dump_thread(const char* dump_path)
     strncpy(da_inst_dump_path, dump_path, 256);
     da_inst_dump_path[255] = 0;
     da_inst.dump_path = da_inst_dump_path;
+    da_inst.chunk_sectors = chunk_sectors;
+    da_inst.flags = flags;
 
     int res = ksceKernelStartThread(g_dumpThreadId, sizeof(dump_args), &da_inst);
   }
@@ -395,7 +876,7 @@ int deinitialize_dump_thread()
   return 0;
 }
 
-int handle_dump_request(int dump_state, const char* dump_path)
+int handle_dump_request(int dump_state, const char* dump_path, uint32_t chunk_sectors, uint32_t flags)
 {
   #ifdef ENABLE_DEBUG_LOG
   FILE_GLOBAL_WRITE_LEN("handle_dump_request\n");
@@ -414,7 +895,7 @@ int handle_dump_request(int dump_state, const char* dump_path)
         //if previous dump operation was not canceled - dump thread will not be deinitialized
         deinitialize_dump_thread();
 
-        initialize_dump_thread(dump_path);
+        initialize_dump_thread(dump_path, chunk_sectors, flags);
       }
 
       break;
@@ -489,7 +970,7 @@ int dump_poll_thread(SceSize args, void* argp)
     }
     #endif
 
-    handle_dump_request(g_dump_state, g_dump_path);
+    handle_dump_request(g_dump_state, g_dump_path, g_dump_chunk_sectors, g_dump_flags);
 
     //return response
     ksceKernelSignalCond(dump_resp_cond);
@@ -535,24 +1016,6 @@ int initialize_dump_threading()
 {
   create_iso_directory();
 
-  g_total_sectors_mutex_id = ksceKernelCreateMutex("total_sectors_mutex", 0, 0, 0);
-  #ifdef ENABLE_DEBUG_LOG
-  if(g_total_sectors_mutex_id >= 0)
-    FILE_GLOBAL_WRITE_LEN("Created g_total_sectors_mutex\n");
-  #endif
-
-  g_progress_sectors_mutex_id = ksceKernelCreateMutex("progress_sectors_mutex", 0, 0, 0);
-  #ifdef ENABLE_DEBUG_LOG
-  if(g_progress_sectors_mutex_id >= 0)
-    FILE_GLOBAL_WRITE_LEN("Created g_progress_sectors_mutex\n");
-  #endif
-
-  g_running_state_mutex_id = ksceKernelCreateMutex("running_state_mutex", 0, 0, 0);
-  #ifdef ENABLE_DEBUG_LOG
-  if(g_running_state_mutex_id >= 0)
-    FILE_GLOBAL_WRITE_LEN("Created g_running_state_mutex\n");
-  #endif
-
   dump_req_lock = ksceKernelCreateMutex("dump_req_lock", 0, 0, 0);
   #ifdef ENABLE_DEBUG_LOG
   if(dump_req_lock >= 0)
@@ -637,24 +1100,6 @@ int deinitialize_dump_threading()
     dump_resp_lock = -1;
   }
 
-  if(g_total_sectors_mutex_id >= 0)
-  {
-    ksceKernelDeleteMutex(g_total_sectors_mutex_id);
-    g_total_sectors_mutex_id = -1;
-  }
-
-  if(g_progress_sectors_mutex_id >= 0)
-  {
-    ksceKernelDeleteMutex(g_progress_sectors_mutex_id);
-    g_progress_sectors_mutex_id = -1;
-  }
-
-  if(g_running_state_mutex_id >= 0)
-  {
-    ksceKernelDeleteMutex(g_running_state_mutex_id);
-    g_running_state_mutex_id = -1;
-  }
-
   return 0;
 }
 
@@ -698,9 +1143,11 @@ int dump_request_response_base()
   return 0;
 }
 
-int dump_mmc_card_start_internal(const char* dump_path)
+int dump_mmc_card_start_internal(const char* dump_path, uint32_t chunk_sectors, uint32_t flags)
 {
   g_dump_state = DUMP_STATE_START;
+  g_dump_chunk_sectors = chunk_sectors;
+  g_dump_flags = flags;
   memset(g_dump_path, 0, 256);
   strncpy(g_dump_path, dump_path, 256);
   g_dump_path[255] = 0;
@@ -2,11 +2,12 @@
 
 #include <stdint.h>
 
+#include "psvgamesd_api.h"
+
 int initialize_dump_threading();
 int deinitialize_dump_threading();
 
-int dump_mmc_card_start_internal(const char* dump_path);
+int dump_mmc_card_start_internal(const char* dump_path, uint32_t chunk_sectors, uint32_t flags);
 int dump_mmc_card_stop_internal();
 
-uint32_t get_total_sectors();
-uint32_t get_progress_sectors();
\ No newline at end of file
+void get_dump_progress(psvgamesd_dump_progress* progress);
\ No newline at end of file
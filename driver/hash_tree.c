@@ -0,0 +1,83 @@
+/* hash_tree.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "hash_tree.h"
+
+#include <psp2kern/types.h>
+#include <psp2kern/kernel/utils.h>
+
+#include <string.h>
+#include <stdint.h>
+
+//this file is shared by driver and host tools. host tools get sha256 from the kernel shim
+
+int hash_tree_get_layout(uint32_t n_leaves, hash_tree_layout* layout)
+{
+  if(n_leaves == 0)
+    return -1;
+
+  memset(layout, 0, sizeof(hash_tree_layout));
+  layout->n_leaves = n_leaves;
+
+  uint32_t size = n_leaves;
+  uint32_t offset = 0;
+
+  while(1)
+  {
+    if(layout->n_levels == HASH_TREE_MAX_LEVELS)
+      return -1;
+
+    layout->level_offsets[layout->n_levels] = offset;
+    layout->level_sizes[layout->n_levels] = size;
+    layout->n_levels++;
+
+    offset += size;
+
+    if(size == 1)
+      break;
+
+    size = (size + 1) / 2;
+  }
+
+  layout->n_nodes = offset;
+
+  return 0;
+}
+
+void hash_tree_hash_pair(const uint8_t* left, const uint8_t* right, uint8_t* parent)
+{
+  uint8_t pair[HASH_TREE_NODE_SIZE * 2];
+  memcpy(pair, left, HASH_TREE_NODE_SIZE);
+  memcpy(pair + HASH_TREE_NODE_SIZE, right, HASH_TREE_NODE_SIZE);
+
+  ksceSha256Digest(pair, HASH_TREE_NODE_SIZE * 2, (char*)parent);
+}
+
+int hash_tree_build(const hash_tree_layout* layout, uint8_t* nodes)
+{
+  for(uint32_t level = 1; level < layout->n_levels; level++)
+  {
+    const uint8_t* children = nodes + layout->level_offsets[level - 1] * HASH_TREE_NODE_SIZE;
+    uint32_t n_children = layout->level_sizes[level - 1];
+
+    uint8_t* parents = nodes + layout->level_offsets[level] * HASH_TREE_NODE_SIZE;
+
+    for(uint32_t i = 0; i < layout->level_sizes[level]; i++)
+    {
+      const uint8_t* left = children + i * 2 * HASH_TREE_NODE_SIZE;
+
+      //odd node is moved up unchanged
+      if(i * 2 + 1 == n_children)
+        memcpy(parents + i * HASH_TREE_NODE_SIZE, left, HASH_TREE_NODE_SIZE);
+      else
+        hash_tree_hash_pair(left, left + HASH_TREE_NODE_SIZE, parents + i * HASH_TREE_NODE_SIZE);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+//hash tree over fixed size chunks of the image. see Sample Usage 7 in psv_types.h.
+//nodes of all levels are kept in single array, leaves first and root last
+
+#define HASH_TREE_NODE_SIZE 0x20
+
+//enough for 2^31 leaves
+#define HASH_TREE_MAX_LEVELS 32
+
+typedef struct hash_tree_layout
+{
+  uint32_t n_leaves;
+  uint32_t n_levels;
+  uint32_t n_nodes;
+  uint32_t level_offsets[HASH_TREE_MAX_LEVELS]; //index of the first node of the level
+  uint32_t level_sizes[HASH_TREE_MAX_LEVELS];   //number of nodes of the level
+} hash_tree_layout;
+
+int hash_tree_get_layout(uint32_t n_leaves, hash_tree_layout* layout);
+
+//parent is sha256 over concatenated children
+void hash_tree_hash_pair(const uint8_t* left, const uint8_t* right, uint8_t* parent);
+
+//computes all levels above the leaves. leaves must already be in nodes
+int hash_tree_build(const hash_tree_layout* layout, uint8_t* nodes);
+
+static inline const uint8_t* hash_tree_get_root(const hash_tree_layout* layout, const uint8_t* nodes)
+{
+  return nodes + (layout->n_nodes - 1) * HASH_TREE_NODE_SIZE;
+}
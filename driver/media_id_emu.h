@@ -1,10 +1,12 @@
 #pragma once
 
-#include "mbr_types.h"
+#include "partition_map.h"
 
-int write_media_id(const MBR* mbr, int sector, char* buffer, int nSectors);
+//media id sector is taken from partition map of mounted image so requests to other sectors take single compare
 
-int read_media_id(const MBR* mbr, int sector, char* buffer, int nSectors);
+int write_media_id(const partition_map* map, int sector, char* buffer, int nSectors);
+
+int read_media_id(const partition_map* map, int sector, char* buffer, int nSectors);
 
 int init_media_id_emu();
 
@@ -395,17 +395,7 @@ int emulate_mmc_command(sd_context_global* ctx, cmd_input* cmd_data1, cmd_input*
             cmd_data1->unk_64 = 3;
             cmd_data1->wide_time1 = ksceKernelGetSystemTimeWide();
 
-            {
-                g_ctx_part = ctx->ctx_data.ctx;
-                g_sector = cmd_data1->argument;
-                g_buffer = cmd_data1->buffer;
-                g_nSectors = 1;
-
-                ksceKernelSignalCond(req_cond); //send request
-                ksceKernelLockMutex(resp_lock, 1, 0); //lock mutex
-                ksceKernelWaitCond(resp_cond, 0); //wait for response
-                ksceKernelUnlockMutex(resp_lock, 1); //unlock mutex
-            }
+            submit_read_request(ctx->ctx_data.ctx, cmd_data1->argument, cmd_data1->buffer, 1); //send request and wait for response
 
             //not sure if this is needed
             if(cmd_data1->base_198 > 0)
@@ -441,17 +431,7 @@ int emulate_mmc_command(sd_context_global* ctx, cmd_input* cmd_data1, cmd_input*
                     cmd_data2->unk_64 = 3;
                     cmd_data2->wide_time1 = ksceKernelGetSystemTimeWide();
 
-                    {
-                        g_ctx_part = ctx->ctx_data.ctx;
-                        g_sector = cmd_data2->argument;
-                        g_buffer = cmd_data2->buffer;
-                        g_nSectors = cmd_data1->argument;
-
-                        ksceKernelSignalCond(req_cond); //send request
-                        ksceKernelLockMutex(resp_lock, 1, 0); //lock mutex
-                        ksceKernelWaitCond(resp_cond, 0); //wait for response
-                        ksceKernelUnlockMutex(resp_lock, 1); //unlock mutex
-                    }
+                    submit_read_request(ctx->ctx_data.ctx, cmd_data2->argument, cmd_data2->buffer, cmd_data1->argument); //send request and wait for response
 
                     //not sure if this is needed
                     if(cmd_data1->base_198 > 0)
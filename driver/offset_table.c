@@ -0,0 +1,66 @@
+/* offset_table.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "offset_table.h"
+
+//this file is shared by driver and host tools so it must not depend on any os api
+
+static uint32_t get_checkpoint_count(uint32_t n_entries)
+{
+  return (n_entries + OFFSET_TABLE_CHECKPOINT_INTERVAL - 1) / OFFSET_TABLE_CHECKPOINT_INTERVAL;
+}
+
+uint64_t offset_table_get_memory_size(uint32_t n_entries)
+{
+  return (uint64_t)get_checkpoint_count(n_entries) * sizeof(uint64_t) + (uint64_t)n_entries * sizeof(uint32_t);
+}
+
+int offset_table_init(offset_table* table, void* memory, uint32_t n_entries)
+{
+  if(n_entries == 0 || memory == 0)
+    return -1;
+
+  table->n_entries = n_entries;
+  table->n_filled = 0;
+
+  //checkpoints go first to keep them 8 byte aligned
+  table->checkpoints = (uint64_t*)memory;
+  table->deltas = (uint32_t*)(table->checkpoints + get_checkpoint_count(n_entries));
+
+  return 0;
+}
+
+int offset_table_append(offset_table* table, uint64_t offset)
+{
+  uint32_t index = table->n_filled;
+  if(index >= table->n_entries)
+    return -1;
+
+  uint32_t checkpoint = index / OFFSET_TABLE_CHECKPOINT_INTERVAL;
+
+  if(index % OFFSET_TABLE_CHECKPOINT_INTERVAL == 0)
+  {
+    if(index > 0 && offset < offset_table_get(table, index - 1))
+      return -1;
+
+    table->checkpoints[checkpoint] = offset;
+  }
+  else
+  {
+    if(offset < offset_table_get(table, index - 1))
+      return -1;
+
+    if(offset - table->checkpoints[checkpoint] > UINT32_MAX)
+      return -1;
+  }
+
+  table->deltas[index] = offset - table->checkpoints[checkpoint];
+  table->n_filled++;
+
+  return 0;
+}
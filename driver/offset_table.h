@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+//compact in-memory form of the offset table of compressed image.
+//each entry is stored as 32 bit delta from 64 bit checkpoint that is kept every
+//OFFSET_TABLE_CHECKPOINT_INTERVAL entries. lookup is constant time.
+//blocks are at most COMPRESSION_MAX_BLOCK_SIZE so delta always fits 32 bits
+
+#define OFFSET_TABLE_CHECKPOINT_INTERVAL 0x400
+
+typedef struct offset_table
+{
+  uint32_t n_entries; //n_blocks + 1
+  uint32_t n_filled;
+  uint64_t* checkpoints;
+  uint32_t* deltas;
+} offset_table;
+
+//size of memory that has to be passed to offset_table_init. it does not fit 32 bits for the largest tables
+uint64_t offset_table_get_memory_size(uint32_t n_entries);
+
+int offset_table_init(offset_table* table, void* memory, uint32_t n_entries);
+
+//entries have to be appended in order. offsets have to be non decreasing
+int offset_table_append(offset_table* table, uint64_t offset);
+
+static inline uint64_t offset_table_get(const offset_table* table, uint32_t index)
+{
+  return table->checkpoints[index / OFFSET_TABLE_CHECKPOINT_INTERVAL] + table->deltas[index];
+}
@@ -0,0 +1,82 @@
+/* partition_map.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "partition_map.h"
+
+#include <string.h>
+
+//this file is shared by driver and host tools so it must not depend on any os api
+
+void partition_map_clear(partition_map* map)
+{
+  memset(map, 0, sizeof(partition_map));
+  map->media_id_sector = -1;
+}
+
+int partition_map_build(partition_map* map, const MBR* mbr)
+{
+  partition_map_clear(map);
+
+  for(int i = 0; i < MAX_MBR_PARTITIONS; i++)
+  {
+    const PartitionEntry* pe = &mbr->partitions[i];
+
+    //media id lives in the first cardsExt partition, both for game card and memory card block device
+    if(pe->partitionCode == cardsExt && map->media_id_sector < 0 && pe->partitionOffset <= INT32_MAX)
+      map->media_id_sector = pe->partitionOffset;
+
+    if(pe->partitionCode == empty_c || pe->partitionSize == 0)
+      continue;
+
+    //insertion sort. there are at most 16 entries
+    uint32_t pos = map->n_extents;
+    while(pos > 0 && map->extents[pos - 1].offset > pe->partitionOffset)
+    {
+      map->extents[pos] = map->extents[pos - 1];
+      pos--;
+    }
+
+    partition_extent* e = &map->extents[pos];
+    e->offset = pe->partitionOffset;
+    e->size = pe->partitionSize;
+    e->code = pe->partitionCode;
+    e->type = pe->partitionType;
+    e->index = i;
+
+    map->n_extents++;
+  }
+
+  return 0;
+}
+
+const partition_extent* partition_map_find(const partition_map* map, uint32_t sector)
+{
+  //last extent that starts at or before sector
+  uint32_t lo = 0;
+  uint32_t hi = map->n_extents;
+
+  while(lo < hi)
+  {
+    uint32_t mid = (lo + hi) / 2;
+    if(map->extents[mid].offset <= sector)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if(lo == 0)
+    return 0;
+
+  const partition_extent* e = &map->extents[lo - 1];
+
+  //DO NOT REMOVE THE CASTS!
+  if((uint64_t)sector >= (uint64_t)e->offset + (uint64_t)e->size)
+    return 0;
+
+  return e;
+}
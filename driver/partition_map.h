@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mbr_types.h"
+
+//partitions of mounted image in sector order. map is built once when MBR is loaded and is not changed
+//while image is mounted. users get it from reader (acquire_partition_map) so that it is not rebuilt while it is read
+
+typedef struct partition_extent
+{
+  uint32_t offset; //first sector
+  uint32_t size;   //in sectors
+  uint8_t code;    //PartitionCodes
+  uint8_t type;    //PartitionTypes
+  uint8_t index;   //index of the entry in MBR
+} partition_extent;
+
+typedef struct partition_map
+{
+  uint32_t n_extents;
+  partition_extent extents[MAX_MBR_PARTITIONS];
+  int32_t media_id_sector; //first sector of cardsExt partition that holds media id. -1 if there is no such partition
+} partition_map;
+
+//map without partitions
+void partition_map_clear(partition_map* map);
+
+//empty entries are skipped. entries that start at the same sector are kept in MBR order
+int partition_map_build(partition_map* map, const MBR* mbr);
+
+//returns partition that contains sector or 0
+const partition_extent* partition_map_find(const partition_map* map, uint32_t sector);
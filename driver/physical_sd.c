@@ -32,6 +32,9 @@ psv_file_header_v1* g_img_header_sd = 0;
 char g_mbr_sd_raw_data[SD_DEFAULT_SECTOR_SIZE] = {0};
 MBR* g_mbr_sd = 0;
 
+//built once mbr is read
+partition_map g_partitions_sd;
+
 int initialize_img_header()
 {
   if(g_img_header_sd > 0)
@@ -111,6 +114,8 @@ int initialize_mbr_header()
     return -1;
   }
 
+  partition_map_build(&g_partitions_sd, (MBR*)g_mbr_sd_raw_data);
+
   g_mbr_sd = (MBR*)g_mbr_sd_raw_data;
 
   return 0;
@@ -121,6 +126,8 @@ int deinitialize_mbr_header()
   memset(g_mbr_sd_raw_data, 0, SD_DEFAULT_SECTOR_SIZE);
 
   g_mbr_sd = 0;
+
+  partition_map_clear(&g_partitions_sd);
   return 0;
 }
 
@@ -139,7 +146,7 @@ int sd_read_hook_through(void* ctx_part, int sector, char* buffer, int nSectors)
       if(g_mbr_sd > 0)
       {
         //check if media-id read is requested
-        int media_id_res = read_media_id(g_mbr_sd, sector, buffer, nSectors);
+        int media_id_res = read_media_id(&g_partitions_sd, sector, buffer, nSectors);
         if(media_id_res > 0)
           return 0;
       }
@@ -184,7 +191,7 @@ int sd_write_hook_physical(void* ctx_part, int sector, char* buffer, int nSector
         //second (internal) read that will be requested will initialize mbr - at this point we can start emulating mediaid
         if(g_mbr_sd > 0)
         {
-          int media_id_res = write_media_id(g_mbr_sd, sector, buffer, nSectors);
+          int media_id_res = write_media_id(&g_partitions_sd, sector, buffer, nSectors);
           if(media_id_res > 0)
             return 0;
         }
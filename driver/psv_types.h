@@ -64,15 +64,75 @@ typedef struct digital_header_t
 typedef struct compression_header_t
 {
   uint32_t type; // 0x2 indicates header for compression
-  uint32_t compression_algorithm; // not yet specified
-  uint64_t uncompressed_size;
+  uint32_t compression_algorithm; // see COMPRESSION_ALGORITHM_*
+  uint64_t uncompressed_size; // size of the image before compression
+  uint32_t block_size; // size of uncompressed block in bytes. multiple of 512
+  uint32_t n_blocks; // number of compressed blocks. offset table has n_blocks + 1 entries
+  uint32_t dictionary_size; // size of LZ4 dictionary that all blocks are compressed with. 0 == no dictionary
+  uint64_t dictionary_offset; // offset of embedded dictionary relative to image data. 0 == dictionary is stored in separate file
+  uint8_t dictionary_hash[0x20]; // sha256 of the dictionary. separate file is named <hash in lowercase hex>.dic
 } compression_header_t;
 
+typedef struct sparse_header_t
+{
+  uint32_t type; // 0x3 indicates header for sparse image
+  uint32_t block_size; // size of block in bytes. multiple of 512
+  uint64_t uncompressed_size; // size of the image including elided zero blocks
+  uint32_t n_blocks; // number of blocks in the bitmap
+  uint32_t n_present; // number of blocks that are stored in the file
+} sparse_header_t;
+
+typedef struct hash_tree_header_t
+{
+  uint32_t type; // 0x4 indicates header for hash tree
+  uint32_t chunk_size; // size of image data covered by one leaf in bytes. multiple of 512
+  uint64_t uncompressed_size; // size of the image that is covered, including trimmed or elided bytes
+  uint32_t n_chunks; // number of leaves
+  uint32_t n_nodes; // number of nodes in the tree, including leaves and root
+  uint64_t tree_offset; // offset of the tree in the file
+  uint8_t root[0x20]; // last node of the tree
+} hash_tree_header_t;
+
+typedef struct error_map_header_t
+{
+  uint32_t type; // 0x5 indicates header for error map
+  uint32_t flags; // see ERROR_MAP_FLAG_*
+  uint32_t n_ranges; // number of ranges in the map
+  uint32_t bad_sectors; // number of unreadable sectors in all ranges
+  uint64_t map_offset; // offset of the map in the file
+} error_map_header_t;
+
+typedef struct error_range_t
+{
+  uint32_t sector; // first unreadable sector
+  uint32_t n_sectors; // number of unreadable sectors that follow
+} error_range_t;
+
+typedef struct chunked_header_t
+{
+  uint32_t type; // 0x6 indicates header for chunked image
+  uint32_t chunk_size; // size of chunk in bytes. multiple of 512
+  uint64_t uncompressed_size; // size of the image including zero chunks
+  uint32_t n_chunks; // number of entries in the chunk table
+  uint32_t n_stored; // number of chunks that are not all zeros
+  uint64_t hashes_offset; // offset of chunk hashes relative to image data
+} chunked_header_t;
+
+typedef struct chunk_location_t
+{
+  uint32_t pack; // number of pack file that holds the chunk. see CHUNK_PACK_ZERO
+  uint32_t sector; // offset of the chunk in the pack file in multiple of 512 bytes
+} chunk_location_t;
+
 typedef union opt_header_t
 {
   uint32_t type;
   digital_header_t digital;
   compression_header_t compression;
+  sparse_header_t sparse;
+  hash_tree_header_t hash_tree;
+  error_map_header_t error_map;
+  chunked_header_t chunked;
 } opt_header_t;
 
 typedef struct psv_file_header_base
@@ -102,8 +162,41 @@ typedef struct psv_file_header_v1
 #define FLAG_TRIMMED (1 << 0)  // if set, the file is trimmed and 'image_size' is the actual size
 #define FLAG_DIGITAL (1 << 1)  // if set, RIF is present and an encrypted PKG file follows
 #define FLAG_COMPRESSED (1 << 2)  // undefined if set with `FLAG_TRIMMED` or `FLAG_DIGITAL`. if set, the data must start with a compression header (not currently defined)
+#define FLAG_SPARSE (1 << 3)  // undefined if set with any other flag except `FLAG_HASH_TREE` or `FLAG_ERROR_MAP`. if set, the data starts with bitmap of stored blocks and all zero blocks are not stored
+#define FLAG_HASH_TREE (1 << 4)  // if set, hash tree header follows all other optional headers
+#define FLAG_ERROR_MAP (1 << 5)  // if set, error map header follows all other optional headers. sectors that could not be read are stored as zeros
+#define FLAG_CHUNKED (1 << 6)  // undefined if set with any other flag except `FLAG_HASH_TREE` or `FLAG_ERROR_MAP`. if set, the data is table of chunks that are stored in shared pack files
 #define FLAG_LICENSE_ONLY (FLAG_TRIMMED | FLAG_DIGITAL) // if set, the actual PKG is NOT stored and only RIF is present. 'image_size' will be size of actual package.
 
+#define OPT_HEADER_TYPE_DIGITAL 0x1
+#define OPT_HEADER_TYPE_COMPRESSION 0x2
+#define OPT_HEADER_TYPE_SPARSE 0x3
+#define OPT_HEADER_TYPE_HASH_TREE 0x4
+#define OPT_HEADER_TYPE_ERROR_MAP 0x5
+#define OPT_HEADER_TYPE_CHUNKED 0x6
+
+#define COMPRESSION_ALGORITHM_LZ4 1 // each block is independent LZ4 block (no frame)
+
+#define COMPRESSION_MIN_BLOCK_SIZE 0x200
+#define COMPRESSION_MAX_BLOCK_SIZE 0x10000
+
+#define COMPRESSION_MAX_DICTIONARY_SIZE 0x10000 // LZ4 only uses last 64 KiB of dictionary
+
+#define PSV_MAX_UNCOMPRESSED_SIZE 0x1FFFFFFFE00ULL // sectors of the card are addressed with 32 bit numbers
+
+#define SPARSE_MIN_BLOCK_SIZE 0x1000
+#define SPARSE_MAX_BLOCK_SIZE 0x100000
+
+#define HASH_TREE_MIN_CHUNK_SIZE 0x10000
+#define HASH_TREE_MAX_CHUNK_SIZE 0x1000000
+
+#define ERROR_MAP_FLAG_INCOMPLETE (1 << 0) // there are more unreadable sectors than the map could hold
+
+#define CHUNKED_MIN_CHUNK_SIZE 0x10000 // keeps chunk table of the largest cart small enough for kernel memory
+#define CHUNKED_MAX_CHUNK_SIZE 0x100000
+
+#define CHUNK_PACK_ZERO 0xFFFFFFFF // chunk is all zeros and is not stored
+
 #pragma pack(pop)
 
 /** 
@@ -120,4 +213,54 @@ typedef struct psv_file_header_v1
  * Sample Usage 4: Backup of license for digital content
  *   flag = FLAG_DIGITAL | FLAG_TRIMMED, rif_size = 0x200, image_size = 
  *   size of PKG from PSN servers, header is followed by RIF
+ * Sample Usage 5: Compressed game cart archival
+ *   flag = FLAG_COMPRESSED, headers[0] is compression_header_t,
+ *   image_size = size of compressed data (offset table and blocks).
+ *   Data at image_offset_sector is laid out as:
+ *     uint64_t offsets[n_blocks + 1] - offsets of the blocks relative to
+ *       image_offset_sector * 512. offsets[n_blocks] is end of the last block.
+ *     compressed blocks - block i covers uncompressed bytes
+ *       [i * block_size, (i + 1) * block_size). only last block can be shorter.
+ *       block that takes as many bytes as its uncompressed size is stored raw.
+ *   If dictionary_size > 0 every block is compressed with the same LZ4
+ *   dictionary. Embedded dictionary is stored between offset table and the
+ *   first block at dictionary_offset. Shared dictionary is not stored in the
+ *   image and is looked up as <dictionary_hash>.dic in the directory of the image.
+ * Sample Usage 6: Sparse game cart archival
+ *   flag = FLAG_SPARSE, headers[0] is sparse_header_t,
+ *   image_size = size of sparse data (bitmap and stored blocks).
+ *   Data at image_offset_sector is laid out as:
+ *     uint64_t bitmap[(n_blocks + 63) / 64] - bit (i % 64) of word (i / 64)
+ *       is set if block i is stored. clear bit means that block is all zeros.
+ *     stored blocks - start at the end of the bitmap rounded up to 512 bytes.
+ *       only blocks with set bit are stored, in block order. block i covers
+ *       bytes [i * block_size, (i + 1) * block_size). only last block can be shorter.
+ * Sample Usage 7: Hash tree
+ *   flag = any of the above | FLAG_HASH_TREE. hash_tree_header_t follows the
+ *   optional header of the layout (if any). tree is stored at tree_offset,
+ *   usually between header sector and image_offset_sector.
+ *   Leaf i is sha256 over uncompressed image bytes [i * chunk_size, (i + 1) * chunk_size).
+ *   only last chunk can be shorter. Each upper level is built from the level below:
+ *   node j is sha256 over nodes 2j and 2j + 1 of the level below (64 bytes).
+ *   last node of the level with odd number of nodes is moved up unchanged.
+ *   Levels are stored one after another starting with the leaves, 0x20 bytes per node.
+ *   The last node is the root. Any range of chunks can be checked against the root
+ *   by reading the chunks and one sibling per level.
+ * Sample Usage 8: Dump of damaged cart
+ *   flag = any of the above | FLAG_ERROR_MAP. error_map_header_t follows
+ *   all other optional headers. error_range_t map[n_ranges] is stored at
+ *   map_offset, sorted by sector and not overlapping. Sectors in the map could
+ *   not be read from the cart and are stored as zeros, so sha256 and hash tree
+ *   cover zeros in their place.
+ * Sample Usage 9: Deduplicated game cart archival
+ *   flag = FLAG_CHUNKED, headers[0] is chunked_header_t,
+ *   image_size = size of chunk table and hashes.
+ *   Data at image_offset_sector is laid out as:
+ *     chunk_location_t chunks[n_chunks] - chunk i covers bytes
+ *       [i * chunk_size, (i + 1) * chunk_size). only last chunk can be shorter.
+ *     uint8_t hashes[n_chunks][0x20] - at hashes_offset. sha256 of each chunk,
+ *       all zeros for chunks that are not stored.
+ *   Chunks are stored in pack files that are shared by all images of the
+ *   directory and are named <pack in 8 lowercase hex digits>.pck. Chunk starts
+ *   at sector boundary of the pack. Chunks with the same hash are stored once.
  **/
@@ -154,18 +154,18 @@ int deinitialize_virtual_sd()
   return 0;
 }
 
-int dump_mmc_card_start(const char* path)
+int dump_mmc_card_start(const char* path, uint32_t chunk_sectors, uint32_t flags)
 {
   char path_kernel[256];
   memset(path_kernel, 0, 256);
   ksceKernelStrncpyUserToKernel(path_kernel, (uintptr_t)path, 256);
 
   #ifdef ENABLE_DEBUG_LOG
-  snprintf(sprintfBuffer, 256, "dump_mmc_card_start %s\n", path_kernel);
+  snprintf(sprintfBuffer, 256, "dump_mmc_card_start %s %x %x\n", path_kernel, chunk_sectors, flags);
   FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
   #endif
 
-  dump_mmc_card_start_internal(path_kernel);
+  dump_mmc_card_start_internal(path_kernel, chunk_sectors, flags);
 
   return 0;
 }
@@ -180,30 +180,6 @@ int dump_mmc_card_cancel()
   return 0;
 }
 
-uint32_t dump_mmc_get_total_sectors()
-{
-  uint32_t value = get_total_sectors();
-
-  #ifdef ENABLE_DEBUG_LOG
-  snprintf(sprintfBuffer, 256, "dump_mmc_get_total_sectors %x\n", value);
-  FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-  #endif
-
-  return value;
-}
-
-uint32_t dump_mmc_get_progress_sectors()
-{
-  uint32_t value = get_progress_sectors();
-
-  #ifdef ENABLE_DEBUG_LOG
-  snprintf(sprintfBuffer, 256, "dump_mmc_get_progress_sectors %x\n", value);
-  FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-  #endif
-
-  return value;
-}
-
 int get_phys_ins_state()
 {
   int res = ksceSdifGetCardInsertState1(SCE_SDIF_DEV_GAME_CARD);
@@ -243,3 +219,30 @@ int load_psvgamesd_state(psvgamesd_ctx* state)
   #endif
   return 0;
 }
+
+int get_read_cache_stats(psvgamesd_read_cache_stats* stats)
+{
+  psvgamesd_read_cache_stats stats_kernel;
+  get_read_cache_stats_internal(&stats_kernel);
+
+  ksceKernelMemcpyKernelToUser((uintptr_t)stats, &stats_kernel, sizeof(psvgamesd_read_cache_stats));
+
+  #ifdef ENABLE_DEBUG_LOG
+  FILE_GLOBAL_WRITE_LEN("get_read_cache_stats\n");
+  #endif
+  return 0;
+}
+
+int dump_mmc_get_progress(psvgamesd_dump_progress* progress)
+{
+  psvgamesd_dump_progress progress_kernel;
+  get_dump_progress(&progress_kernel);
+
+  ksceKernelMemcpyKernelToUser((uintptr_t)progress, &progress_kernel, sizeof(psvgamesd_dump_progress));
+
+  #ifdef ENABLE_DEBUG_LOG
+  snprintf(sprintfBuffer, 256, "dump_mmc_get_progress %x %x %x\n", progress_kernel.seq, progress_kernel.done_sectors, progress_kernel.total_sectors);
+  FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  #endif
+  return 0;
+}
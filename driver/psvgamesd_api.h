@@ -26,13 +26,16 @@ int initialize_virtual_sd();
 
 int deinitialize_virtual_sd();
 
-int dump_mmc_card_start(const char* path);
+//chunk size is probed at dump start
+#define DUMP_CHUNK_SECTORS_AUTO 0
 
-int dump_mmc_card_cancel();
+//dump is written as LZ4 block-compressed image. compressed dump can not be continued after interruption
+#define DUMP_FLAG_COMPRESSED (1 << 0)
 
-uint32_t dump_mmc_get_total_sectors();
+//chunk_sectors is number of sectors per card read and file write. it is clamped to 0x10 - 0x800
+int dump_mmc_card_start(const char* path, uint32_t chunk_sectors, uint32_t flags);
 
-uint32_t dump_mmc_get_progress_sectors();
+int dump_mmc_card_cancel();
 
 int get_phys_ins_state();
 
@@ -46,8 +49,33 @@ typedef struct psvgamesd_ctx
   uint32_t insertion_state;
 }psvgamesd_ctx;
 
+typedef struct psvgamesd_read_cache_stats
+{
+  uint32_t hits;             // block lookups served from cache
+  uint32_t misses;           // block lookups that went to the image file
+  uint32_t bypass_reads;     // large requests that were read directly
+  uint32_t readahead_blocks; // blocks prefetched by readahead
+  uint32_t readahead_hits;   // prefetched blocks that were used later
+}psvgamesd_read_cache_stats;
+
+typedef struct psvgamesd_dump_progress
+{
+  uint32_t seq;              // changes with every update. same seq means same snapshot
+  uint32_t total_sectors;    // 0 if dump is not running
+  uint32_t done_sectors;
+  uint32_t bytes_per_second; // smoothed over last progress updates
+  uint32_t eta_seconds;      // 0 if not known yet
+  uint32_t bad_sectors;      // sectors of current dump that can not be read and are stored as zeros
+  uint32_t errors;           // number of dumps that stopped because of read or write error
+}psvgamesd_dump_progress;
+
 #pragma pack(pop)
 
 int save_psvgamesd_state(const psvgamesd_ctx* state);
 
-int load_psvgamesd_state(psvgamesd_ctx* state);
\ No newline at end of file
+int load_psvgamesd_state(psvgamesd_ctx* state);
+
+int get_read_cache_stats(psvgamesd_read_cache_stats* stats);
+
+//all fields are taken from the same moment of the dump
+int dump_mmc_get_progress(psvgamesd_dump_progress* progress);
\ No newline at end of file
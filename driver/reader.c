@@ -7,201 +7,1882 @@
  */
 
 #include "reader.h"
+#include "psvgamesd_api.h"
 
 #include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/kernel/sysmem.h>
+#include <psp2kern/kernel/utils.h>
 #include <psp2kern/io/fcntl.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 
+#include <lz4.h>
+
 #include "global_log.h"
 #include "mbr_types.h"
-#include "functions.h"
+#include "sector_api.h"
 #include "defines.h"
+#include "offset_table.h"
+#include "sparse_map.h"
+#include "partition_map.h"
+
+//parsed headers of mounted image. they are parsed into separate copy and replaced as a whole on mount
+//while no read is in progress. reads hold image file (acquire_iso_fd) for the whole request
+//so image does not change under them
+typedef struct reader_image
+{
+  psv_file_header_v1 header;
+
+  compression_header_t compression;
+  int compression_valid; // set if image is compressed and compression header is supported
+
+  sparse_header_t sparse;
+  int sparse_valid;      // set if image is sparse and sparse header is supported
 
-SceUID readThreadId = -1;
+  chunked_header_t chunked;
+  int chunked_valid;     // set if image is chunked and chunked header is supported
 
-SceUID req_lock = -1;
-SceUID resp_lock = -1;
+  MBR mbr;
+  partition_map partitions; // built from mbr once it is loaded
+} reader_image;
 
-SceUID req_cond = -1;
-SceUID resp_cond = -1;
+reader_image g_image;
 
-void* g_ctx_part = 0;
-int g_sector = 0;
-char* g_buffer = 0;
-int g_nSectors = 0;
-int g_res = 0;
+//image that is being mounted. it is published to g_image once all reads are finished
+reader_image g_mount_image;
 
-MBR g_mbr;
+//map that is used while no image is mounted
+const partition_map g_empty_partition_map = { .media_id_sector = -1 };
 
 const MBR* get_mbr_ptr()
 {
-  return &g_mbr;
+  return &g_image.mbr;
+}
+
+int validate_compression_header(const compression_header_t* ch)
+{
+  if(ch->type != OPT_HEADER_TYPE_COMPRESSION || ch->compression_algorithm != COMPRESSION_ALGORITHM_LZ4)
+    return -1;
+
+  if(ch->block_size < COMPRESSION_MIN_BLOCK_SIZE || ch->block_size > COMPRESSION_MAX_BLOCK_SIZE || (ch->block_size % SD_DEFAULT_SECTOR_SIZE) != 0)
+    return -1;
+
+  if(ch->uncompressed_size > PSV_MAX_UNCOMPRESSED_SIZE)
+    return -1;
+
+  //offset table is allocated for n_blocks so it has to match the data exactly
+  //DO NOT REMOVE THE CASTS!
+  if((uint64_t)ch->n_blocks != (ch->uncompressed_size + (uint64_t)ch->block_size - 1) / (uint64_t)ch->block_size)
+    return -1;
+
+  if(ch->dictionary_size > COMPRESSION_MAX_DICTIONARY_SIZE)
+    return -1;
+
+  //embedded dictionary can not overlap offset table
+  if(ch->dictionary_size > 0 && ch->dictionary_offset > 0 && ch->dictionary_offset < ((uint64_t)ch->n_blocks + 1) * sizeof(uint64_t))
+    return -1;
+
+  return 0;
+}
+
+int validate_sparse_header(const sparse_header_t* sh)
+{
+  if(sh->type != OPT_HEADER_TYPE_SPARSE)
+    return -1;
+
+  if(sh->block_size < SPARSE_MIN_BLOCK_SIZE || sh->block_size > SPARSE_MAX_BLOCK_SIZE || (sh->block_size % SD_DEFAULT_SECTOR_SIZE) != 0)
+    return -1;
+
+  //DO NOT REMOVE THE CASTS!
+  if(sh->n_blocks == 0 || (uint64_t)sh->n_blocks * (uint64_t)sh->block_size < sh->uncompressed_size)
+    return -1;
+
+  if((uint64_t)(sh->n_blocks - 1) * (uint64_t)sh->block_size >= sh->uncompressed_size)
+    return -1;
+
+  return 0;
+}
+
+int validate_chunked_header(const chunked_header_t* ch)
+{
+  if(ch->type != OPT_HEADER_TYPE_CHUNKED)
+    return -1;
+
+  if(ch->chunk_size < CHUNKED_MIN_CHUNK_SIZE || ch->chunk_size > CHUNKED_MAX_CHUNK_SIZE || (ch->chunk_size % SD_DEFAULT_SECTOR_SIZE) != 0)
+    return -1;
+
+  //chunk table is allocated for n_chunks. with size of the card bounded it stays far below 32 bits
+  if(ch->uncompressed_size > PSV_MAX_UNCOMPRESSED_SIZE || ch->n_chunks > PSV_MAX_UNCOMPRESSED_SIZE / CHUNKED_MIN_CHUNK_SIZE + 1)
+    return -1;
+
+  //DO NOT REMOVE THE CASTS!
+  if(ch->n_chunks == 0 || (uint64_t)ch->n_chunks * (uint64_t)ch->chunk_size < ch->uncompressed_size)
+    return -1;
+
+  if((uint64_t)(ch->n_chunks - 1) * (uint64_t)ch->chunk_size >= ch->uncompressed_size)
+    return -1;
+
+  return 0;
 }
 
-int get_mbr(const char* path)
+//parses version header and optional header of the layout from the beginning of the file
+int parse_img_header(reader_image* image, const char* data, int size)
 {
-  if(strnlen(path, 256) > 0)
+  memset(image, 0, sizeof(reader_image));
+  partition_map_clear(&image->partitions);
+
+  if(size < (int)SD_DEFAULT_SECTOR_SIZE)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("Failed to read iso header\n");
+    #endif
+    return -1;
+  }
+
+  const psv_file_header_base* header_base = (const psv_file_header_base*)data;
+
+  if(header_base->magic != PSV_MAGIC || header_base->version != PSV_VERSION_V1)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("ISO magic or version is invalid\n");
+    #endif
+    return -1;
+  }
+
+  memcpy(&image->header, data, sizeof(psv_file_header_v1));
+
+  //header of the layout follows version header
+  const char* opt_header = data + sizeof(psv_file_header_v1);
+
+  if((image->header.flags & FLAG_COMPRESSED) > 0)
   {
-    SceUID iso_fd = ksceIoOpen(path, SCE_O_RDONLY, 0777);
+    memcpy(&image->compression, opt_header, sizeof(compression_header_t));
 
-    if(iso_fd >= 0)
+    if(validate_compression_header(&image->compression) == 0)
+    {
+      image->compression_valid = 1;
+    }
+    else
     {
       #ifdef ENABLE_DEBUG_LOG
-      FILE_GLOBAL_WRITE_LEN("Opened iso\n");
+      FILE_GLOBAL_WRITE_LEN("Compression header is not supported\n");
       #endif
+    }
+  }
 
-      //read base header
+  if((image->header.flags & FLAG_SPARSE) > 0)
+  {
+    memcpy(&image->sparse, opt_header, sizeof(sparse_header_t));
 
-      psv_file_header_base header_base;
-      ksceIoRead(iso_fd, &header_base, sizeof(psv_file_header_base));
+    if(validate_sparse_header(&image->sparse) == 0)
+    {
+      image->sparse_valid = 1;
+    }
+    else
+    {
+      #ifdef ENABLE_DEBUG_LOG
+      FILE_GLOBAL_WRITE_LEN("Sparse header is not supported\n");
+      #endif
+    }
+  }
 
-      if(header_base.magic != PSV_MAGIC || header_base.version != PSV_VERSION_V1)
-      {
-        #ifdef ENABLE_DEBUG_LOG
-        FILE_GLOBAL_WRITE_LEN("Iso magic or version is invalid\n");
-        #endif
+  if((image->header.flags & FLAG_CHUNKED) > 0)
+  {
+    memcpy(&image->chunked, opt_header, sizeof(chunked_header_t));
 
-        ksceIoClose(iso_fd);
-        return -1;
-      }
+    if(validate_chunked_header(&image->chunked) == 0)
+    {
+      image->chunked_valid = 1;
+    }
+    else
+    {
+      #ifdef ENABLE_DEBUG_LOG
+      FILE_GLOBAL_WRITE_LEN("Chunked header is not supported\n");
+      #endif
+    }
+  }
+
+  return 0;
+}
+
+int get_cmd56_data_base(psv_file_header_v1* ih, char* buffer)
+{
+  memcpy(buffer, ih->key1, 0x10);
+  memcpy(buffer + 0x10, ih->key2, 0x10);
+  memcpy(buffer + 0x20, ih->signature, 0x14);
+
+  return 0;
+}
+
+char iso_path[256] = {0};
+
+//image file is opened once on mount and reused by every read request
+//instead of doing open/seek/read/close for each sector request
+SceUID g_iso_fd = -1;
+
+//guards g_iso_fd against being closed while read threads are using it
+SceUID iso_fd_lock = -1;
+
+//signaled when the last read releases g_iso_fd
+SceUID iso_fd_idle_cond = -1;
+
+//serializes mount and unmount. only one thread replaces the image at a time
+SceUID mount_lock = -1;
+
+//number of reads that are currently using g_iso_fd
+int g_iso_fd_users = 0;
+
+//mount_lock and iso_fd_lock must be held. new reads fail from now on. waits till all reads are finished and closes the file.
+//once it returns nothing uses mounted image until iso_fd_lock is released
+void close_iso_fd_locked()
+{
+  SceUID iso_fd = g_iso_fd;
+  g_iso_fd = -1;
+
+  while(g_iso_fd_users > 0)
+    ksceKernelWaitCond(iso_fd_idle_cond, 0);
+
+  if(iso_fd >= 0)
+    ksceIoClose(iso_fd);
+}
+
+int close_iso_fd()
+{
+  ksceKernelLockMutex(mount_lock, 1, 0);
+  ksceKernelLockMutex(iso_fd_lock, 1, 0);
+
+  close_iso_fd_locked();
+
+  ksceKernelUnlockMutex(iso_fd_lock, 1);
+  ksceKernelUnlockMutex(mount_lock, 1);
+
+  return 0;
+}
+
+//positioned reads are independent so several read threads can use the file at the same time
+SceUID acquire_iso_fd()
+{
+  ksceKernelLockMutex(iso_fd_lock, 1, 0);
+
+  SceUID fd = g_iso_fd;
+  if(fd >= 0)
+    g_iso_fd_users++;
+
+  ksceKernelUnlockMutex(iso_fd_lock, 1);
+
+  return fd;
+}
+
+void release_iso_fd()
+{
+  ksceKernelLockMutex(iso_fd_lock, 1, 0);
+
+  g_iso_fd_users--;
+  if(g_iso_fd_users == 0)
+    ksceKernelSignalCond(iso_fd_idle_cond);
+
+  ksceKernelUnlockMutex(iso_fd_lock, 1);
+}
+
+//map is used under reference to image file so that mount does not rebuild it while it is read
+const partition_map* acquire_partition_map()
+{
+  if(acquire_iso_fd() < 0)
+    return &g_empty_partition_map;
+
+  return &g_image.partitions;
+}
+
+void release_partition_map(const partition_map* map)
+{
+  if(map == &g_image.partitions)
+    release_iso_fd();
+}
+
+int get_cmd56_data(char* buffer)
+{
+  ksceKernelLockMutex(iso_fd_lock, 1, 0);
+  int res = get_cmd56_data_base(&g_image.header, buffer);
+  ksceKernelUnlockMutex(iso_fd_lock, 1);
 
-      //read version header
+  return res;
+}
+
+//======= read cache =======
+
+//number of sectors in one cache block
+#define READ_CACHE_BLOCK_SECTORS 0x40
+
+//number of cache blocks. total cache size is READ_CACHE_N_BLOCKS * READ_CACHE_BLOCK_SECTORS * 512
+#define READ_CACHE_N_BLOCKS 8
+
+//requests that are larger than this are read directly to not evict whole cache
+#define READ_CACHE_BYPASS_SECTORS 0x80
+
+//number of sequential requests that have to be detected before readahead is started
+#define READAHEAD_SEQ_THRESHOLD 2
+
+//number of blocks that are prefetched on each readahead request
+#define READAHEAD_N_BLOCKS 2
+
+#define READ_CACHE_ENTRY_FREE 0
+#define READ_CACHE_ENTRY_FILLING 1
+#define READ_CACHE_ENTRY_READY 2
+
+//block of entry that is still being filled for previous image. it is not found by lookups
+#define READ_CACHE_BLOCK_STALE 0xFFFFFFFF
+
+typedef struct read_cache_entry
+{
+  uint32_t state;
+  uint32_t block;
+  uint32_t nSectors; //number of valid sectors in block (last block of the image can be shorter)
+  uint32_t last_use;
+  uint32_t prefetched; //block was filled by readahead and was not yet hit
+} read_cache_entry;
+
+#define READ_CACHE_BLOCK_SIZE (READ_CACHE_BLOCK_SECTORS * SD_DEFAULT_SECTOR_SIZE)
+
+read_cache_entry g_read_cache[READ_CACHE_N_BLOCKS];
+
+//data of cache blocks is allocated on mount and freed on unmount. if it can not be allocated reads bypass the cache
+char* g_read_cache_data = 0;
+SceUID g_read_cache_mem_id = -1;
+
+//guards g_read_cache entries, counters and statistics
+SceUID read_cache_lock = -1;
+
+//incremented on each mount/unmount so that blocks that are being filled for previous image are dropped
+uint32_t g_read_cache_generation = 0;
+
+uint32_t g_read_cache_use_counter = 0;
+
+psvgamesd_read_cache_stats g_read_cache_stats;
+
+//sequential stream detection
+int g_last_read_end_sector = -1;
+int g_seq_read_count = 0;
+
+SceUID readaheadThreadId = -1;
+
+SceUID readahead_lock = -1;
+SceUID readahead_cond = -1;
+
+int g_readahead_block = -1;
+
+//set when readahead is scheduled. guarded by readahead_lock so that request
+//that comes while readahead thread is busy is not lost
+int g_readahead_pending = 0;
+
+int reset_read_cache()
+{
+  ksceKernelLockMutex(read_cache_lock, 1, 0);
+
+  g_read_cache_generation++;
+  g_read_cache_use_counter = 0;
+
+  //entries that are being filled still receive data from the read in flight.
+  //they can not be reused until that read is done so only the thread that fills them frees them
+  for(int i = 0; i < READ_CACHE_N_BLOCKS; i++)
+  {
+    read_cache_entry* e = &g_read_cache[i];
+
+    if(e->state == READ_CACHE_ENTRY_FILLING)
+    {
+      e->block = READ_CACHE_BLOCK_STALE;
+      e->prefetched = 0;
+    }
+    else
+    {
+      memset(e, 0, sizeof(read_cache_entry));
+    }
+  }
+
+  memset(&g_read_cache_stats, 0, sizeof(psvgamesd_read_cache_stats));
+
+  g_last_read_end_sector = -1;
+  g_seq_read_count = 0;
+
+  g_readahead_block = -1;
+
+  ksceKernelUnlockMutex(read_cache_lock, 1);
+
+  return 0;
+}
+
+//reads must be finished
+int unload_read_cache_memory()
+{
+  if(g_read_cache_mem_id >= 0)
+  {
+    ksceKernelFreeMemBlock(g_read_cache_mem_id);
+    g_read_cache_mem_id = -1;
+  }
+
+  g_read_cache_data = 0;
+
+  return 0;
+}
+
+//reads must be finished
+int load_read_cache_memory()
+{
+  if(g_read_cache_mem_id >= 0)
+    return 0;
+
+  //size is multiple of page size
+  g_read_cache_mem_id = ksceKernelAllocMemBlock("read_cache", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, READ_CACHE_N_BLOCKS * READ_CACHE_BLOCK_SIZE, 0);
+  if(g_read_cache_mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate read cache : %x\n", g_read_cache_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+
+    g_read_cache_mem_id = -1;
+    return -1;
+  }
+
+  void* base = 0;
+  ksceKernelGetMemBlockBase(g_read_cache_mem_id, &base);
+
+  g_read_cache_data = (char*)base;
+
+  return 0;
+}
 
-      ksceIoLseek(iso_fd, 0, SEEK_SET);
+char* get_read_cache_block_data(const read_cache_entry* e)
+{
+  return g_read_cache_data + (e - g_read_cache) * READ_CACHE_BLOCK_SIZE;
+}
+
+int get_read_cache_stats_internal(psvgamesd_read_cache_stats* stats)
+{
+  ksceKernelLockMutex(read_cache_lock, 1, 0);
+  memcpy(stats, &g_read_cache_stats, sizeof(psvgamesd_read_cache_stats));
+  ksceKernelUnlockMutex(read_cache_lock, 1);
+
+  return 0;
+}
+
+//cache lock must be held
+read_cache_entry* find_read_cache_entry(uint32_t block)
+{
+  for(int i = 0; i < READ_CACHE_N_BLOCKS; i++)
+  {
+    read_cache_entry* e = &g_read_cache[i];
+    if(e->state != READ_CACHE_ENTRY_FREE && e->block == block && block != READ_CACHE_BLOCK_STALE)
+      return e;
+  }
+
+  return 0;
+}
+
+//cache lock must be held. returns free or least recently used entry that is not being filled
+read_cache_entry* alloc_read_cache_entry(uint32_t block)
+{
+  read_cache_entry* victim = 0;
+
+  for(int i = 0; i < READ_CACHE_N_BLOCKS; i++)
+  {
+    read_cache_entry* e = &g_read_cache[i];
+
+    if(e->state == READ_CACHE_ENTRY_FREE)
+    {
+      victim = e;
+      break;
+    }
+
+    if(e->state == READ_CACHE_ENTRY_READY && (victim == 0 || e->last_use < victim->last_use))
+      victim = e;
+  }
+
+  if(victim == 0)
+    return 0;
+
+  victim->state = READ_CACHE_ENTRY_FILLING;
+  victim->block = block;
+  victim->nSectors = 0;
+  victim->last_use = ++g_read_cache_use_counter;
+  victim->prefetched = 0;
+
+  return victim;
+}
+
+//======= compressed image =======
+
+//number of blocks that can be read and decompressed at the same time.
+//one per read thread and one for readahead thread
+#define DECOMPRESSION_N_SLOTS 3
+
+//slot is owned by the read that loads it. once loaded it is shared by reads of the same block
+typedef struct decompression_slot
+{
+  int block;         // block that is held in data. -1 if data is not valid
+  int users;         // reads that are loading or copying data
+  uint32_t last_use;
+  uint32_t generation;
+
+  //compressed blocks are either stored raw or are not larger than uncompressed block
+  char* compressed;
+  char* data;
+} decompression_slot;
 
-      psv_file_header_v1 header_ver;
+decompression_slot g_decompression_slots[DECOMPRESSION_N_SLOTS] = { [0 ... DECOMPRESSION_N_SLOTS - 1] = { -1, 0, 0, 0, 0, 0 } };
+
+uint32_t g_decompression_clock = 0;
+
+//incremented on mount/unmount so that blocks that are being loaded for previous image are dropped
+uint32_t g_decompression_generation = 0;
+
+//guards slot states and offset table that are shared by read threads.
+//file reads and decompression are done without the lock
+SceUID compression_lock = -1;
+
+//signaled when slot is released so that read that found no free slot can retry
+SceUID decompression_slot_cond = -1;
+
+//buffers of slots and dictionary are allocated on mount of compressed image and freed on unmount
+SceUID g_decompression_mem_id = -1;
+
+//raw offset table is read in chunks on mount
+uint64_t g_offset_table_chunk[0x200];
+
+//offset table of mounted compressed image is loaded once on mount
+//and is kept in compact form (4 bytes per block instead of 8)
+offset_table g_offset_table;
+SceUID g_offset_table_mem_id = -1;
+
+//dictionary of mounted compressed image is loaded once on mount
+char* g_dictionary = 0;
+uint32_t g_dictionary_size = 0;
+
+//size of the uncompressed data in the block. only last block can be shorter than block_size
+uint32_t get_uncompressed_block_size(uint32_t block)
+{
+  //DO NOT REMOVE THE CASTS!
+  uint64_t block_start = (uint64_t)block * (uint64_t)g_image.compression.block_size;
+  uint64_t remaining = g_image.compression.uncompressed_size - block_start;
+
+  if(remaining < g_image.compression.block_size)
+    return remaining;
+
+  return g_image.compression.block_size;
+}
+
+//compression lock must be held and reads must be finished
+int unload_decompression_memory()
+{
+  if(g_decompression_mem_id >= 0)
+  {
+    ksceKernelFreeMemBlock(g_decompression_mem_id);
+    g_decompression_mem_id = -1;
+  }
+
+  for(int i = 0; i < DECOMPRESSION_N_SLOTS; i++)
+  {
+    g_decompression_slots[i].compressed = 0;
+    g_decompression_slots[i].data = 0;
+  }
+
+  g_dictionary = 0;
+  g_dictionary_size = 0;
+
+  return 0;
+}
+
+//compression lock must be held and reads must be finished. buffers are sized for block and dictionary of mounted image
+int load_decompression_memory()
+{
+  unload_decompression_memory();
+
+  uint32_t block_size = g_image.compression.block_size;
+  uint32_t dictionary_size = g_image.compression.dictionary_size;
+
+  //memory blocks are allocated in pages
+  uint32_t mem_size = (dictionary_size + DECOMPRESSION_N_SLOTS * 2 * block_size + 0xFFF) & ~0xFFF;
+
+  g_decompression_mem_id = ksceKernelAllocMemBlock("decompression", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, mem_size, 0);
+  if(g_decompression_mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate decompression buffers : %x\n", g_decompression_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+
+    g_decompression_mem_id = -1;
+    return -1;
+  }
+
+  void* base = 0;
+  ksceKernelGetMemBlockBase(g_decompression_mem_id, &base);
+
+  //blocks go first, dictionary size is not aligned
+  char* mem = (char*)base;
+
+  for(int i = 0; i < DECOMPRESSION_N_SLOTS; i++)
+  {
+    g_decompression_slots[i].compressed = mem;
+    g_decompression_slots[i].data = mem + block_size;
+    mem += 2 * block_size;
+  }
+
+  g_dictionary = mem;
+
+  return 0;
+}
+
+//compression lock must be held
+int unload_offset_table()
+{
+  if(g_offset_table_mem_id >= 0)
+  {
+    ksceKernelFreeMemBlock(g_offset_table_mem_id);
+    g_offset_table_mem_id = -1;
+  }
+
+  memset(&g_offset_table, 0, sizeof(offset_table));
+
+  return 0;
+}
+
+//compression lock must be held
+int load_offset_table(SceUID iso_fd)
+{
+  unload_offset_table();
+
+  uint32_t n_entries = g_image.compression.n_blocks + 1;
+
+  //table of the largest image does not fit kernel memory block
+  uint64_t table_size = offset_table_get_memory_size(n_entries);
+  if(n_entries == 0 || table_size > UINT32_MAX - 0xFFF)
+    return -1;
+
+  //memory blocks are allocated in pages
+  uint32_t mem_size = (table_size + 0xFFF) & ~0xFFF;
+
+  g_offset_table_mem_id = ksceKernelAllocMemBlock("offset_table", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, mem_size, 0);
+  if(g_offset_table_mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate offset table : %x\n", g_offset_table_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  void* base = 0;
+  ksceKernelGetMemBlockBase(g_offset_table_mem_id, &base);
+
+  if(offset_table_init(&g_offset_table, base, n_entries) < 0)
+  {
+    unload_offset_table();
+    return -1;
+  }
+
+  //DO NOT REMOVE THE CASTS!
+  SceOff data_offset = (SceOff)g_image.header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+  uint64_t* chunk = g_offset_table_chunk;
+  uint32_t chunk_capacity = sizeof(g_offset_table_chunk) / sizeof(uint64_t);
+
+  for(uint32_t i = 0; i < n_entries; i += chunk_capacity)
+  {
+    uint32_t n = n_entries - i;
+    if(n > chunk_capacity)
+      n = chunk_capacity;
+
+    int nbytes = ksceIoPread(iso_fd, chunk, n * sizeof(uint64_t), data_offset + (SceOff)i * sizeof(uint64_t));
+    if(nbytes != n * sizeof(uint64_t))
+    {
+      unload_offset_table();
+      return -1;
+    }
+
+    for(uint32_t j = 0; j < n; j++)
+    {
+      if(offset_table_append(&g_offset_table, chunk[j]) < 0)
+      {
+        #ifdef ENABLE_DEBUG_LOG
+        FILE_GLOBAL_WRITE_LEN("Offset table is invalid\n");
+        #endif
+
+        unload_offset_table();
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+//shared dictionary is looked up as <hash>.dic in the directory of the image
+int get_dictionary_path(char* path, int size)
+{
+  strncpy(path, iso_path, size);
+  path[size - 1] = 0;
+
+  char* name = strrchr(path, '/');
+  if(name == 0)
+    name = strchr(path, ':');
+
+  int dir_length = (name == 0) ? 0 : (name + 1 - path);
+
+  //hash in hex, extension and terminator
+  if(dir_length + 0x40 + 5 > size)
+    return -1;
+
+  for(int i = 0; i < 0x20; i++)
+    snprintf(path + dir_length + i * 2, 3, "%02x", g_image.compression.dictionary_hash[i]);
+
+  strcpy(path + dir_length + 0x40, ".dic");
+
+  return 0;
+}
+
+//compression lock must be held
+int load_dictionary(SceUID iso_fd)
+{
+  g_dictionary_size = 0;
+
+  uint32_t size = g_image.compression.dictionary_size;
+  if(size == 0)
+    return 0;
+
+  int nbytes = -1;
+
+  if(g_image.compression.dictionary_offset > 0)
+  {
+    //DO NOT REMOVE THE CASTS!
+    SceOff data_offset = (SceOff)g_image.header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+    nbytes = ksceIoPread(iso_fd, g_dictionary, size, data_offset + (SceOff)g_image.compression.dictionary_offset);
+  }
+  else
+  {
+    char dict_path[256];
+    if(get_dictionary_path(dict_path, 256) < 0)
+      return -1;
+
+    SceUID dict_fd = ksceIoOpen(dict_path, SCE_O_RDONLY, 0777);
+    if(dict_fd >= 0)
+    {
+      nbytes = ksceIoRead(dict_fd, g_dictionary, size);
+      ksceIoClose(dict_fd);
+    }
+  }
+
+  if(nbytes != size)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("Failed to read dictionary\n");
+    #endif
+    return -1;
+  }
+
+  //wrong dictionary would silently produce garbage instead of decompression error
+  char digest[0x20];
+  ksceSha256Digest(g_dictionary, size, digest);
+
+  if(memcmp(digest, g_image.compression.dictionary_hash, 0x20) != 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("Dictionary hash mismatch\n");
+    #endif
+    return -1;
+  }
+
+  g_dictionary_size = size;
+
+  return 0;
+}
+
+//compression lock must be held. slots that are in use are kept, their data is dropped when they are released
+int reset_decompression_slots()
+{
+  g_decompression_generation++;
+
+  for(int i = 0; i < DECOMPRESSION_N_SLOTS; i++)
+  {
+    if(g_decompression_slots[i].users == 0)
+      g_decompression_slots[i].block = -1;
+  }
+
+  return 0;
+}
+
+//compression lock must be held. returns slot that holds the block or free slot that is reserved for loading it.
+//every reader uses one slot at a time so there is always a free slot unless there are more readers than slots
+decompression_slot* find_decompression_slot(uint32_t block, int* loaded)
+{
+  decompression_slot* victim = 0;
+
+  for(int i = 0; i < DECOMPRESSION_N_SLOTS; i++)
+  {
+    decompression_slot* slot = &g_decompression_slots[i];
+
+    if(slot->block == (int)block && slot->generation == g_decompression_generation)
+    {
+      slot->users++;
+      slot->last_use = ++g_decompression_clock;
+      *loaded = 1;
+      return slot;
+    }
+
+    if(slot->users == 0 && (victim == 0 || (victim->block >= 0 && (slot->block < 0 || slot->last_use < victim->last_use))))
+      victim = slot;
+  }
+
+  if(victim == 0)
+    return 0;
+
+  victim->block = -1;
+  victim->users = 1;
+  victim->last_use = ++g_decompression_clock;
+  victim->generation = g_decompression_generation;
+
+  *loaded = 0;
+  return victim;
+}
+
+void release_decompression_slot(decompression_slot* slot)
+{
+  ksceKernelLockMutex(compression_lock, 1, 0);
+
+  slot->users--;
+
+  if(slot->users == 0)
+  {
+    //block of previous image
+    if(slot->generation != g_decompression_generation)
+      slot->block = -1;
+
+    ksceKernelSignalCondAll(decompression_slot_cond);
+  }
+
+  ksceKernelUnlockMutex(compression_lock, 1);
+}
+
+//returns slot with decompressed block that has to be released or 0.
+//only slot lookup and offset table are accessed under the lock, so reads of different blocks run in parallel
+decompression_slot* acquire_decompressed_block(SceUID iso_fd, uint32_t block)
+{
+  ksceKernelLockMutex(compression_lock, 1, 0);
+
+  int loaded = 0;
+  decompression_slot* slot = find_decompression_slot(block, &loaded);
+
+  while(slot == 0)
+  {
+    ksceKernelWaitCond(decompression_slot_cond, 0);
+
+    slot = find_decompression_slot(block, &loaded);
+  }
+
+  //slot that is being loaded by other read is found only after it is loaded
+  if(loaded > 0)
+  {
+    ksceKernelUnlockMutex(compression_lock, 1);
+    return slot;
+  }
+
+  //offsets of this block and the next one give size of the block
+  uint64_t offsets[2];
+  offsets[0] = offset_table_get(&g_offset_table, block);
+  offsets[1] = offset_table_get(&g_offset_table, block + 1);
+
+  ksceKernelUnlockMutex(compression_lock, 1);
+
+  //DO NOT REMOVE THE CASTS!
+  SceOff data_offset = (SceOff)g_image.header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+  uint32_t uncompressed_size = get_uncompressed_block_size(block);
+
+  int res = -1;
+
+  if(offsets[1] > offsets[0] && offsets[1] - offsets[0] <= uncompressed_size)
+  {
+    int compressed_size = offsets[1] - offsets[0];
+
+    //block that could not be compressed is stored raw
+    char* dst = (compressed_size == uncompressed_size) ? slot->data : slot->compressed;
+
+    if(ksceIoPread(iso_fd, dst, compressed_size, data_offset + (SceOff)offsets[0]) == compressed_size)
+    {
+      if(compressed_size == uncompressed_size)
+      {
+        res = 0;
+      }
+      else
+      {
+        int dec_size = (g_dictionary_size > 0)
+          ? LZ4_decompress_safe_usingDict(slot->compressed, slot->data, compressed_size, uncompressed_size, g_dictionary, g_dictionary_size)
+          : LZ4_decompress_safe(slot->compressed, slot->data, compressed_size, uncompressed_size);
+
+        if(dec_size == uncompressed_size)
+          res = 0;
+      }
+    }
+  }
+
+  ksceKernelLockMutex(compression_lock, 1, 0);
+
+  if(res == 0 && slot->generation == g_decompression_generation)
+  {
+    slot->block = block;
+    ksceKernelUnlockMutex(compression_lock, 1);
+    return slot;
+  }
+
+  slot->users--;
+
+  if(slot->users == 0)
+    ksceKernelSignalCondAll(decompression_slot_cond);
+
+  ksceKernelUnlockMutex(compression_lock, 1);
+
+  return 0;
+}
+
+int read_compressed_sectors(SceUID iso_fd, int sector, char* buffer, int nSectors)
+{
+  if(g_image.compression_valid == 0)
+  {
+    memset(buffer, 0, nSectors * SD_DEFAULT_SECTOR_SIZE);
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  //DO NOT REMOVE THE CASTS!
+  uint64_t pos = (uint64_t)sector * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
+  uint64_t end = pos + (uint64_t)nSectors * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
+
+  char* dst = buffer;
+
+  while(pos < end)
+  {
+    uint32_t block = pos / g_image.compression.block_size;
+    if(block >= g_image.compression.n_blocks)
+      break;
+
+    decompression_slot* slot = acquire_decompressed_block(iso_fd, block);
+    if(slot == 0)
+      break;
+
+    uint32_t offset_in_block = pos % g_image.compression.block_size;
+    uint32_t n = get_uncompressed_block_size(block) - offset_in_block;
+    if(n > end - pos)
+      n = end - pos;
+
+    memcpy(dst, slot->data + offset_in_block, n);
+
+    release_decompression_slot(slot);
+
+    pos += n;
+    dst += n;
+  }
+
+  if(pos < end)
+  {
+    memset(dst, 0, end - pos);
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  return 0;
+}
+
+//======= sparse image =======
+
+//guards sparse map that is replaced on mount
+SceUID sparse_lock = -1;
+
+//bitmap of stored blocks of mounted sparse image is loaded once on mount
+sparse_map g_sparse_map;
+SceUID g_sparse_map_mem_id = -1;
+
+//file offset of the first stored block
+SceOff g_sparse_blocks_offset = 0;
+
+//sparse lock must be held
+int unload_sparse_map()
+{
+  if(g_sparse_map_mem_id >= 0)
+  {
+    ksceKernelFreeMemBlock(g_sparse_map_mem_id);
+    g_sparse_map_mem_id = -1;
+  }
+
+  memset(&g_sparse_map, 0, sizeof(sparse_map));
+
+  return 0;
+}
+
+//sparse lock must be held
+int load_sparse_map(SceUID iso_fd)
+{
+  unload_sparse_map();
+
+  uint32_t n_blocks = g_image.sparse.n_blocks;
+
+  //memory blocks are allocated in pages
+  uint32_t mem_size = (sparse_map_get_memory_size(n_blocks) + 0xFFF) & ~0xFFF;
+
+  g_sparse_map_mem_id = ksceKernelAllocMemBlock("sparse_map", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, mem_size, 0);
+  if(g_sparse_map_mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate sparse map : %x\n", g_sparse_map_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  void* base = 0;
+  ksceKernelGetMemBlockBase(g_sparse_map_mem_id, &base);
+
+  if(sparse_map_init(&g_sparse_map, base, n_blocks) < 0)
+  {
+    unload_sparse_map();
+    return -1;
+  }
+
+  //DO NOT REMOVE THE CASTS!
+  SceOff data_offset = (SceOff)g_image.header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+  //bitmap is read directly into the map
+  uint32_t bitmap_size = sparse_map_get_bitmap_size(n_blocks);
+
+  int nbytes = ksceIoPread(iso_fd, g_sparse_map.bits, bitmap_size, data_offset);
+
+  if(nbytes != bitmap_size || sparse_map_build(&g_sparse_map) < 0 || g_sparse_map.n_present != g_image.sparse.n_present)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("Sparse bitmap is invalid\n");
+    #endif
+
+    unload_sparse_map();
+    return -1;
+  }
+
+  g_sparse_blocks_offset = data_offset + (SceOff)((bitmap_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE) * SD_DEFAULT_SECTOR_SIZE;
+
+  return 0;
+}
+
+//finds run of blocks starting at block that are either all stored or all zero.
+//returns number of blocks in the run. offset is file offset of the first block if run is stored
+int get_sparse_run(uint32_t block, uint32_t last_block, int* present, SceOff* offset)
+{
+  int n = -1;
+
+  ksceKernelLockMutex(sparse_lock, 1, 0);
+
+  if(g_image.sparse_valid > 0 && block < g_sparse_map.n_blocks)
+  {
+    if(last_block >= g_sparse_map.n_blocks)
+      last_block = g_sparse_map.n_blocks - 1;
+
+    *present = sparse_map_is_present(&g_sparse_map, block);
+    *offset = g_sparse_blocks_offset + (SceOff)sparse_map_get_rank(&g_sparse_map, block) * (SceOff)g_image.sparse.block_size;
+
+    n = 1;
+    while(block + n <= last_block && sparse_map_is_present(&g_sparse_map, block + n) == *present)
+      n++;
+  }
+
+  ksceKernelUnlockMutex(sparse_lock, 1);
+
+  return n;
+}
+
+//zero blocks are satisfied with memset. consecutive stored blocks are consecutive in the file
+//so every run of stored blocks takes single read
+int read_sparse_sectors(SceUID iso_fd, int sector, char* buffer, int nSectors)
+{
+  //DO NOT REMOVE THE CASTS!
+  uint64_t pos = (uint64_t)sector * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
+  uint64_t end = pos + (uint64_t)nSectors * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
+
+  uint32_t block_size = g_image.sparse.block_size;
+
+  char* dst = buffer;
+
+  while(pos < end)
+  {
+    uint32_t block = pos / block_size;
+    uint32_t last_block = (end - 1) / block_size;
+
+    int present = 0;
+    SceOff block_offset = 0;
+
+    int n = get_sparse_run(block, last_block, &present, &block_offset);
+    if(n <= 0)
+      break;
+
+    uint64_t run_end = (uint64_t)(block + n) * (uint64_t)block_size;
+    if(run_end > end)
+      run_end = end;
+
+    SceSize size = run_end - pos;
+
+    if(present > 0)
+    {
+      SceOff offset = block_offset + (SceOff)(pos - (uint64_t)block * (uint64_t)block_size);
+
+      if(ksceIoPread(iso_fd, dst, size, offset) != size)
+        break;
+    }
+    else
+    {
+      memset(dst, 0, size);
+    }
+
+    pos += size;
+    dst += size;
+  }
+
+  if(pos < end)
+  {
+    memset(dst, 0, end - pos);
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  return 0;
+}
+
+//======= chunked image =======
+
+//number of pack files that are kept open. every read thread and readahead thread uses at most one pack at a time
+#define CHUNK_PACK_CACHE_SIZE 4
+
+typedef struct chunk_pack_entry
+{
+  uint32_t pack;
+  SceUID fd;
+  int users;         // number of reads that are using fd
+  uint32_t last_use;
+} chunk_pack_entry;
+
+//guards chunk table and pack cache that are replaced on mount
+SceUID chunk_lock = -1;
+
+//chunk table of mounted chunked image is loaded once on mount
+chunk_location_t* g_chunk_table = 0;
+SceUID g_chunk_table_mem_id = -1;
+
+//packs are shared by all images of the directory and are opened on demand
+chunk_pack_entry g_chunk_packs[CHUNK_PACK_CACHE_SIZE] = { [0 ... CHUNK_PACK_CACHE_SIZE - 1] = { 0, -1, 0, 0 } };
+uint32_t g_chunk_pack_clock = 0;
+
+//pack is looked up as <pack>.pck in the directory of the image
+int get_pack_path(uint32_t pack, char* path, int size)
+{
+  strncpy(path, iso_path, size);
+  path[size - 1] = 0;
+
+  char* name = strrchr(path, '/');
+  if(name == 0)
+    name = strchr(path, ':');
+
+  int dir_length = (name == 0) ? 0 : (name + 1 - path);
+
+  //pack in hex, extension and terminator
+  if(dir_length + 8 + 5 > size)
+    return -1;
+
+  snprintf(path + dir_length, 13, "%08x.pck", pack);
+
+  return 0;
+}
+
+//chunk lock must be held
+int unload_chunk_table()
+{
+  for(int i = 0; i < CHUNK_PACK_CACHE_SIZE; i++)
+  {
+    if(g_chunk_packs[i].fd >= 0)
+      ksceIoClose(g_chunk_packs[i].fd);
+
+    g_chunk_packs[i].fd = -1;
+    g_chunk_packs[i].users = 0;
+  }
+
+  if(g_chunk_table_mem_id >= 0)
+  {
+    ksceKernelFreeMemBlock(g_chunk_table_mem_id);
+    g_chunk_table_mem_id = -1;
+  }
+
+  g_chunk_table = 0;
+
+  return 0;
+}
+
+//chunk lock must be held
+int load_chunk_table(SceUID iso_fd)
+{
+  unload_chunk_table();
+
+  uint32_t n_chunks = g_image.chunked.n_chunks;
+
+  //DO NOT REMOVE THE CASTS!
+  uint64_t table_size = (uint64_t)n_chunks * (uint64_t)sizeof(chunk_location_t);
+  if(table_size > UINT32_MAX - 0xFFF)
+    return -1;
+
+  //memory blocks are allocated in pages
+  uint32_t mem_size = (table_size + 0xFFF) & ~0xFFF;
+
+  g_chunk_table_mem_id = ksceKernelAllocMemBlock("chunk_table", SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW, mem_size, 0);
+  if(g_chunk_table_mem_id < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to allocate chunk table : %x\n", g_chunk_table_mem_id);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
+
+  void* base = 0;
+  ksceKernelGetMemBlockBase(g_chunk_table_mem_id, &base);
+
+  g_chunk_table = (chunk_location_t*)base;
+
+  //DO NOT REMOVE THE CASTS!
+  SceOff data_offset = (SceOff)g_image.header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+  int nbytes = ksceIoPread(iso_fd, g_chunk_table, table_size, data_offset);
+
+  uint32_t n_stored = 0;
+  for(uint32_t i = 0; nbytes == table_size && i < n_chunks; i++)
+  {
+    if(g_chunk_table[i].pack != CHUNK_PACK_ZERO)
+      n_stored++;
+  }
+
+  if(nbytes != table_size || n_stored != g_image.chunked.n_stored)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("Chunk table is invalid\n");
+    #endif
+
+    unload_chunk_table();
+    return -1;
+  }
+
+  return 0;
+}
+
+//chunk lock must be held. returns cache entry with open pack or < 0
+int acquire_chunk_pack(uint32_t pack)
+{
+  int victim = -1;
+
+  for(int i = 0; i < CHUNK_PACK_CACHE_SIZE; i++)
+  {
+    chunk_pack_entry* e = &g_chunk_packs[i];
+
+    if(e->fd >= 0 && e->pack == pack)
+    {
+      e->users++;
+      e->last_use = ++g_chunk_pack_clock;
+      return i;
+    }
+
+    //pack that is being read can not be closed
+    if(e->users > 0)
+      continue;
+
+    if(victim < 0 || e->fd < 0 || (g_chunk_packs[victim].fd >= 0 && e->last_use < g_chunk_packs[victim].last_use))
+      victim = i;
+  }
+
+  if(victim < 0)
+    return -1;
+
+  chunk_pack_entry* e = &g_chunk_packs[victim];
+
+  if(e->fd >= 0)
+  {
+    ksceIoClose(e->fd);
+    e->fd = -1;
+  }
+
+  char path[256];
+  if(get_pack_path(pack, path, 256) < 0)
+    return -1;
+
+  e->fd = ksceIoOpen(path, SCE_O_RDONLY, 0777);
+  if(e->fd < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to open pack %x : %x\n", pack, e->fd);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+
+    e->fd = -1;
+    return -1;
+  }
+
+  e->pack = pack;
+  e->users = 1;
+  e->last_use = ++g_chunk_pack_clock;
+
+  return victim;
+}
+
+void release_chunk_pack(int entry)
+{
+  ksceKernelLockMutex(chunk_lock, 1, 0);
+  g_chunk_packs[entry].users--;
+  ksceKernelUnlockMutex(chunk_lock, 1);
+}
+
+//finds run of chunks starting at chunk that are either all zero or follow each other in the same pack.
+//returns number of chunks in the run. if run is stored entry is pack cache entry that has to be released
+//and offset is offset of the first chunk in the pack. entry is < 0 for zero run
+int get_chunk_run(uint32_t chunk, uint32_t last_chunk, int* entry, SceOff* offset)
+{
+  int n = -1;
+
+  ksceKernelLockMutex(chunk_lock, 1, 0);
+
+  if(g_image.chunked_valid > 0 && g_chunk_table != 0 && chunk < g_image.chunked.n_chunks)
+  {
+    if(last_chunk >= g_image.chunked.n_chunks)
+      last_chunk = g_image.chunked.n_chunks - 1;
+
+    const chunk_location_t* first = &g_chunk_table[chunk];
+    uint32_t chunk_sectors = g_image.chunked.chunk_size / SD_DEFAULT_SECTOR_SIZE;
+
+    n = 1;
+    while(chunk + n <= last_chunk && g_chunk_table[chunk + n].pack == first->pack &&
+          (first->pack == CHUNK_PACK_ZERO || g_chunk_table[chunk + n].sector == first->sector + n * chunk_sectors))
+      n++;
+
+    *entry = -1;
+    *offset = (SceOff)first->sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+    if(first->pack != CHUNK_PACK_ZERO)
+    {
+      *entry = acquire_chunk_pack(first->pack);
+      if(*entry < 0)
+        n = -1;
+    }
+  }
+
+  ksceKernelUnlockMutex(chunk_lock, 1);
+
+  return n;
+}
+
+//zero chunks are satisfied with memset. chunks that follow each other in the same pack take single read.
+//caller holds image file so that unmount waits for the read to finish before packs are closed
+int read_chunked_sectors(int sector, char* buffer, int nSectors)
+{
+  //DO NOT REMOVE THE CASTS!
+  uint64_t pos = (uint64_t)sector * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
+  uint64_t end = pos + (uint64_t)nSectors * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
+
+  uint32_t chunk_size = g_image.chunked.chunk_size;
+
+  char* dst = buffer;
+
+  while(pos < end)
+  {
+    uint32_t chunk = pos / chunk_size;
+    uint32_t last_chunk = (end - 1) / chunk_size;
+
+    int entry = -1;
+    SceOff chunk_offset = 0;
+
+    int n = get_chunk_run(chunk, last_chunk, &entry, &chunk_offset);
+    if(n <= 0)
+      break;
+
+    uint64_t run_end = (uint64_t)(chunk + n) * (uint64_t)chunk_size;
+    if(run_end > end)
+      run_end = end;
+
+    SceSize size = run_end - pos;
+
+    if(entry >= 0)
+    {
+      SceOff offset = chunk_offset + (SceOff)(pos - (uint64_t)chunk * (uint64_t)chunk_size);
+
+      int nbytes = ksceIoPread(g_chunk_packs[entry].fd, dst, size, offset);
+
+      release_chunk_pack(entry);
+
+      if(nbytes != size)
+        break;
+    }
+    else
+    {
+      memset(dst, 0, size);
+    }
+
+    pos += size;
+    dst += size;
+  }
+
+  if(pos < end)
+  {
+    memset(dst, 0, end - pos);
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  return 0;
+}
+
+//======= raw image =======
+
+int read_raw_sectors(SceUID iso_fd, int sector, char* buffer, int nSectors)
+{
+  //DO NOT REMOVE THE CASTS!
+  SceOff offset = (SceOff)g_image.header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+  offset = offset + (SceOff)sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+  SceSize size = nSectors * SD_DEFAULT_SECTOR_SIZE;
+  SceSize stored = size;
+
+  //trimmed image ends before the end of the last partition. data is only read up to image_size
+  //because resumed dump can leave stale bytes after it
+  if((g_image.header.flags & FLAG_TRIMMED) > 0)
+  {
+    //DO NOT REMOVE THE CASTS!
+    uint64_t pos = (uint64_t)sector * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
+
+    if(pos >= g_image.header.image_size)
+      stored = 0;
+    else if(g_image.header.image_size - pos < size)
+      stored = g_image.header.image_size - pos;
+  }
+
+  //positioned read does not need separate seek
+  int nbytes = (stored > 0) ? ksceIoPread(iso_fd, buffer, stored, offset) : 0;
+  if(nbytes != stored)
+  {
+    memset(buffer, 0, size);
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  memset(buffer + stored, 0, size - stored);
+
+  return 0;
+}
+
+//reads sectors from image file bypassing the cache. iso_fd is acquired by the caller
+int read_layout_sectors(SceUID iso_fd, int sector, char* buffer, int nSectors)
+{
+  if((g_image.header.flags & FLAG_COMPRESSED) > 0)
+    return read_compressed_sectors(iso_fd, sector, buffer, nSectors);
+  else if((g_image.header.flags & FLAG_SPARSE) > 0)
+    return read_sparse_sectors(iso_fd, sector, buffer, nSectors);
+  else if((g_image.header.flags & FLAG_CHUNKED) > 0)
+    return read_chunked_sectors(sector, buffer, nSectors);
+  else
+    return read_raw_sectors(iso_fd, sector, buffer, nSectors);
+}
+
+int read_image_sectors(int sector, char* buffer, int nSectors)
+{
+  SceUID iso_fd = acquire_iso_fd();
+
+  if(iso_fd < 0)
+  {
+    memset(buffer, 0, nSectors * SD_DEFAULT_SECTOR_SIZE);
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  int res = read_layout_sectors(iso_fd, sector, buffer, nSectors);
+
+  release_iso_fd();
+
+  return res;
+}
+
+//fills cache entry with data from image. cache lock must not be held
+int fill_read_cache_entry(SceUID iso_fd, read_cache_entry* e, uint32_t block, uint32_t generation)
+{
+  int nSectors = READ_CACHE_BLOCK_SECTORS;
+  int first_sector = block * READ_CACHE_BLOCK_SECTORS;
+  if(first_sector + nSectors > g_image.mbr.sizeInBlocks)
+    nSectors = g_image.mbr.sizeInBlocks - first_sector;
+
+  int res = read_layout_sectors(iso_fd, first_sector, get_read_cache_block_data(e), nSectors);
+
+  ksceKernelLockMutex(read_cache_lock, 1, 0);
+
+  //entry that was filled for previous image is freed here and not in reset_read_cache
+  if(res == 0 && generation == g_read_cache_generation)
+  {
+    e->state = READ_CACHE_ENTRY_READY;
+    e->nSectors = nSectors;
+  }
+  else
+  {
+    e->state = READ_CACHE_ENTRY_FREE;
+    res = SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  ksceKernelUnlockMutex(read_cache_lock, 1);
+
+  return res;
+}
+
+//reads part of single cache block
+int read_cached_sectors(SceUID iso_fd, uint32_t block, int sector_in_block, char* buffer, int nSectors)
+{
+  ksceKernelLockMutex(read_cache_lock, 1, 0);
+
+  read_cache_entry* e = find_read_cache_entry(block);
+
+  if(e != 0 && e->state == READ_CACHE_ENTRY_READY && sector_in_block + nSectors <= e->nSectors)
+  {
+    memcpy(buffer, get_read_cache_block_data(e) + sector_in_block * SD_DEFAULT_SECTOR_SIZE, nSectors * SD_DEFAULT_SECTOR_SIZE);
+
+    e->last_use = ++g_read_cache_use_counter;
+
+    g_read_cache_stats.hits++;
+    if(e->prefetched > 0)
+    {
+      g_read_cache_stats.readahead_hits++;
+      e->prefetched = 0;
+    }
+
+    ksceKernelUnlockMutex(read_cache_lock, 1);
+    return 0;
+  }
+
+  g_read_cache_stats.misses++;
+
+  //block is being prefetched or does not fit cache - read directly
+  if(e != 0)
+  {
+    ksceKernelUnlockMutex(read_cache_lock, 1);
+    return read_layout_sectors(iso_fd, block * READ_CACHE_BLOCK_SECTORS + sector_in_block, buffer, nSectors);
+  }
+
+  e = alloc_read_cache_entry(block);
+  uint32_t generation = g_read_cache_generation;
+
+  ksceKernelUnlockMutex(read_cache_lock, 1);
+
+  if(e == 0)
+    return read_layout_sectors(iso_fd, block * READ_CACHE_BLOCK_SECTORS + sector_in_block, buffer, nSectors);
+
+  int res = fill_read_cache_entry(iso_fd, e, block, generation);
+  if(res < 0)
+    return read_layout_sectors(iso_fd, block * READ_CACHE_BLOCK_SECTORS + sector_in_block, buffer, nSectors);
+
+  ksceKernelLockMutex(read_cache_lock, 1, 0);
+
+  //entry can not be evicted by readahead thread while lock is held
+  if(e->state == READ_CACHE_ENTRY_READY && e->block == block && sector_in_block + nSectors <= e->nSectors)
+  {
+    memcpy(buffer, get_read_cache_block_data(e) + sector_in_block * SD_DEFAULT_SECTOR_SIZE, nSectors * SD_DEFAULT_SECTOR_SIZE);
+    ksceKernelUnlockMutex(read_cache_lock, 1);
+    return 0;
+  }
+
+  ksceKernelUnlockMutex(read_cache_lock, 1);
+
+  return read_layout_sectors(iso_fd, block * READ_CACHE_BLOCK_SECTORS + sector_in_block, buffer, nSectors);
+}
+
+//detects sequential stream and schedules readahead of the blocks that follow the request
+int update_readahead(int sector, int nSectors)
+{
+  int schedule = 0;
+
+  ksceKernelLockMutex(read_cache_lock, 1, 0);
+
+  if(sector == g_last_read_end_sector)
+    g_seq_read_count++;
+  else
+    g_seq_read_count = 0;
+
+  g_last_read_end_sector = sector + nSectors;
+
+  if(g_seq_read_count >= READAHEAD_SEQ_THRESHOLD)
+  {
+    uint32_t next_block = (sector + nSectors + READ_CACHE_BLOCK_SECTORS - 1) / READ_CACHE_BLOCK_SECTORS;
+    if(next_block * READ_CACHE_BLOCK_SECTORS < g_image.mbr.sizeInBlocks && find_read_cache_entry(next_block) == 0)
+    {
+      g_readahead_block = next_block;
+      schedule = 1;
+    }
+  }
+
+  ksceKernelUnlockMutex(read_cache_lock, 1);
+
+  //signal is sent under the lock of the condition. if thread is busy it picks up the latest block when it is done
+  if(schedule > 0)
+  {
+    ksceKernelLockMutex(readahead_lock, 1, 0);
+    g_readahead_pending = 1;
+    ksceKernelSignalCond(readahead_cond);
+    ksceKernelUnlockMutex(readahead_lock, 1);
+  }
+
+  return 0;
+}
+
+int readahead_thread(SceSize args, void *argp)
+{
+  #ifdef ENABLE_DEBUG_LOG
+  FILE_GLOBAL_WRITE_LEN("Started Readahead Thread\n");
+  #endif
+
+  while(1)
+  {
+    ksceKernelLockMutex(readahead_lock, 1, 0);
+    while(g_readahead_pending == 0)
+      ksceKernelWaitCond(readahead_cond, 0);
+    g_readahead_pending = 0;
+    ksceKernelUnlockMutex(readahead_lock, 1);
+
+    for(int i = 0; i < READAHEAD_N_BLOCKS; i++)
+    {
+      //image is held for each block so that unmount does not wait for whole readahead
+      SceUID iso_fd = acquire_iso_fd();
+      if(iso_fd < 0)
+        break;
+
+      ksceKernelLockMutex(read_cache_lock, 1, 0);
+
+      if(g_readahead_block < 0 || g_read_cache_data == 0)
+      {
+        ksceKernelUnlockMutex(read_cache_lock, 1);
+        release_iso_fd();
+        break;
+      }
 
-      ksceIoRead(iso_fd, &header_ver, sizeof(psv_file_header_v1));
+      uint32_t block = g_readahead_block + i;
+      read_cache_entry* e = 0;
 
-      //read mbr
+      if(block * READ_CACHE_BLOCK_SECTORS < g_image.mbr.sizeInBlocks && find_read_cache_entry(block) == 0)
+        e = alloc_read_cache_entry(block);
 
-      //DO NOT REMOVE THE CASTS!
-      SceOff mbr_offset = (SceOff)header_ver.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+      uint32_t generation = g_read_cache_generation;
 
-      ksceIoLseek(iso_fd, mbr_offset, SEEK_SET);
+      if(e != 0)
+        g_read_cache_stats.readahead_blocks++;
 
-      ksceIoRead(iso_fd, &g_mbr, sizeof(MBR));
+      ksceKernelUnlockMutex(read_cache_lock, 1);
 
-      #ifdef ENABLE_DEBUG_LOG
-      snprintf(sprintfBuffer, 256, "max sector: %x\n", g_mbr.sizeInBlocks);
-      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-      #endif
+      if(e != 0)
+      {
+        if(fill_read_cache_entry(iso_fd, e, block, generation) == 0)
+        {
+          ksceKernelLockMutex(read_cache_lock, 1, 0);
+          if(e->block == block)
+            e->prefetched = 1;
+          ksceKernelUnlockMutex(read_cache_lock, 1);
+        }
+      }
 
-      ksceIoClose(iso_fd);
-    }
-    else
-    {
-      #ifdef ENABLE_DEBUG_LOG
-      FILE_GLOBAL_WRITE_LEN("Failed to open iso\n");
-      #endif
-      return -1;
+      release_iso_fd();
     }
   }
 
-  return -1;
+  return 0;
 }
 
-psv_file_header_v1 g_img_header;
+//======= mount / read =======
 
-int get_img_header(const char* path)
-{
-  if(strnlen(path, 256) > 0)
-  {
-    SceUID iso_fd = ksceIoOpen(path, SCE_O_RDONLY, 0777);
+//beginning of the file is read once on mount. it holds header sector and, for raw images
+//that start right after the header, the MBR as well
+#define MOUNT_READ_SIZE 0x8000
 
-    if(iso_fd >= 0)
-    {
-      #ifdef ENABLE_DEBUG_LOG
-      FILE_GLOBAL_WRITE_LEN("Opened iso\n");
-      #endif
+char g_mount_buffer[MOUNT_READ_SIZE];
 
-      //read base header
+//size of data in g_mount_buffer
+int g_mount_buffer_size = 0;
 
-      psv_file_header_base header_base;
-      ksceIoRead(iso_fd, &header_base, sizeof(psv_file_header_base));
+int read_mount_buffer(SceUID iso_fd)
+{
+  g_mount_buffer_size = 0;
 
-      if(header_base.magic != PSV_MAGIC || header_base.version != PSV_VERSION_V1)
-      {
-        #ifdef ENABLE_DEBUG_LOG
-        FILE_GLOBAL_WRITE_LEN("ISO magic or version is invalid\n");
-        #endif
+  int nbytes = ksceIoPread(iso_fd, g_mount_buffer, MOUNT_READ_SIZE, 0);
+  if(nbytes < 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    snprintf(sprintfBuffer, 256, "failed to read iso header : %x\n", nbytes);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    #endif
+    return -1;
+  }
 
-        ksceIoClose(iso_fd);
-        return -1;
-      }
+  g_mount_buffer_size = nbytes;
+
+  return 0;
+}
+
+//mbr of raw image is taken from mount buffer if it is there.
+//otherwise it is read through the same path as sectors so that other layouts are handled.
+//image has to be published already
+int load_mbr(SceUID iso_fd)
+{
+  int res = 0;
 
-      //read version header
+  //DO NOT REMOVE THE CASTS!
+  uint64_t mbr_offset = (uint64_t)g_image.header.image_offset_sector * (uint64_t)SD_DEFAULT_SECTOR_SIZE;
 
-      ksceIoLseek(iso_fd, 0, SEEK_SET);
+  if((g_image.header.flags & (FLAG_COMPRESSED | FLAG_SPARSE | FLAG_CHUNKED)) == 0 && mbr_offset + SD_DEFAULT_SECTOR_SIZE <= g_mount_buffer_size)
+    memcpy(&g_image.mbr, g_mount_buffer + mbr_offset, SD_DEFAULT_SECTOR_SIZE);
+  else
+    res = read_layout_sectors(iso_fd, 0, (char*)&g_image.mbr, 1);
 
-      ksceIoRead(iso_fd, &g_img_header, sizeof(psv_file_header_v1));
+  partition_map_build(&g_image.partitions, &g_image.mbr);
 
-      ksceIoClose(iso_fd);
-    }
-    else
-    {
-      #ifdef ENABLE_DEBUG_LOG
-      FILE_GLOBAL_WRITE_LEN("Failed to open iso\n");
-      #endif
-      return -1;
-    }
-  }
+  #ifdef ENABLE_DEBUG_LOG
+  snprintf(sprintfBuffer, 256, "max sector: %x\n", g_image.mbr.sizeInBlocks);
+  FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  #endif
 
-  return -1;
+  return res;
 }
 
-int get_cmd56_data_base(psv_file_header_v1* ih, char* buffer)
+//iso_fd_lock must be held and reads must be finished
+int unload_image_tables()
 {
-  memcpy(buffer, ih->key1, 0x10);
-  memcpy(buffer + 0x10, ih->key2, 0x10);
-  memcpy(buffer + 0x20, ih->signature, 0x14);
+  ksceKernelLockMutex(compression_lock, 1, 0);
+  reset_decompression_slots();
+  unload_offset_table();
+  unload_decompression_memory();
+  ksceKernelUnlockMutex(compression_lock, 1);
+
+  ksceKernelLockMutex(sparse_lock, 1, 0);
+  unload_sparse_map();
+  ksceKernelUnlockMutex(sparse_lock, 1);
+
+  ksceKernelLockMutex(chunk_lock, 1, 0);
+  unload_chunk_table();
+  ksceKernelUnlockMutex(chunk_lock, 1);
 
   return 0;
 }
 
-int get_cmd56_data(char* buffer)
+//iso_fd_lock must be held and image has to be published already. layout is marked invalid if its table can not be loaded
+int load_image_tables(SceUID iso_fd)
 {
-  return get_cmd56_data_base(&g_img_header, buffer);
-}
+  ksceKernelLockMutex(compression_lock, 1, 0);
+  if(g_image.compression_valid > 0 && (load_decompression_memory() < 0 || load_offset_table(iso_fd) < 0 || load_dictionary(iso_fd) < 0))
+    g_image.compression_valid = 0;
+  ksceKernelUnlockMutex(compression_lock, 1);
 
-char iso_path[256] = {0};
+  ksceKernelLockMutex(sparse_lock, 1, 0);
+  if(g_image.sparse_valid > 0 && load_sparse_map(iso_fd) < 0)
+    g_image.sparse_valid = 0;
+  ksceKernelUnlockMutex(sparse_lock, 1);
+
+  ksceKernelLockMutex(chunk_lock, 1, 0);
+  if(g_image.chunked_valid > 0 && load_chunk_table(iso_fd) < 0)
+    g_image.chunked_valid = 0;
+  ksceKernelUnlockMutex(chunk_lock, 1);
 
+  return 0;
+}
+
+//mounts are serialized by mount_lock. whole mount is done under iso_fd_lock after reads of previous image are finished.
+//reads that come meanwhile wait for the lock and see either no image or completely loaded one
 int set_reader_iso_path(const char* path)
 {
+  ksceKernelLockMutex(mount_lock, 1, 0);
+  ksceKernelLockMutex(iso_fd_lock, 1, 0);
+
+  close_iso_fd_locked();
+
+  //nothing is read from previous image anymore. cache is dropped before new image is parsed
+  reset_read_cache();
+
+  unload_image_tables();
+
   strncpy(iso_path, path, 256);
   iso_path[255] = 0;
 
-  get_img_header(iso_path);
+  //image is opened once. headers are parsed from the first read
+  SceUID iso_fd = ksceIoOpen(iso_path, SCE_O_RDONLY, 0777);
+
+  #ifdef ENABLE_DEBUG_LOG
+  if(iso_fd < 0)
+  {
+    snprintf(sprintfBuffer, 256, "failed to open iso for reading : %x\n", iso_fd);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  }
+  #endif
+
+  if(iso_fd < 0 || read_mount_buffer(iso_fd) < 0)
+    g_mount_buffer_size = 0;
+
+  parse_img_header(&g_mount_image, g_mount_buffer, g_mount_buffer_size);
+
+  memcpy(&g_image, &g_mount_image, sizeof(reader_image));
+
+  if(iso_fd >= 0)
+  {
+    //cache memory is kept from previous mount
+    load_read_cache_memory();
+    load_image_tables(iso_fd);
+    load_mbr(iso_fd);
+  }
+  else
+  {
+    unload_read_cache_memory();
+  }
+
+  g_iso_fd = iso_fd;
 
-  get_mbr(iso_path);
+  ksceKernelUnlockMutex(iso_fd_lock, 1);
+  ksceKernelUnlockMutex(mount_lock, 1);
 
   return 0;
 }
 
 int clear_reader_iso_path()
 {
+  ksceKernelLockMutex(mount_lock, 1, 0);
+  ksceKernelLockMutex(iso_fd_lock, 1, 0);
+
+  close_iso_fd_locked();
+
+  reset_read_cache();
+  unload_read_cache_memory();
+
+  unload_image_tables();
+
+  memset(&g_image, 0, sizeof(reader_image));
+  partition_map_clear(&g_image.partitions);
+
   memset(iso_path, 0, 256);
 
+  ksceKernelUnlockMutex(iso_fd_lock, 1);
+  ksceKernelUnlockMutex(mount_lock, 1);
+
   return 0;
 }
 
+//image file is held for the whole request so that image can not be replaced while it is read
 int emulate_read(int sector, char* buffer, int nSectors)
 {
   int res = 0;
 
-  //DO NOT REMOVE THE CASTS!
-  SceOff offset = (SceOff)g_img_header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
-  offset = offset + (SceOff)sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
-
   SceSize size = nSectors * SD_DEFAULT_SECTOR_SIZE;
 
-  if(sector >= g_mbr.sizeInBlocks)
+  SceUID iso_fd = acquire_iso_fd();
+
+  if(iso_fd < 0)
+  {
+    memset(buffer, 0, size);
+    res = SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+  else if(sector >= g_image.mbr.sizeInBlocks)
   {
     //handling trimmed image
-    if((g_img_header.flags & FLAG_TRIMMED) > 0)
+    if((g_image.header.flags & FLAG_TRIMMED) > 0)
     {
       memset(buffer, 0, size);
       res = 0;
@@ -212,35 +1893,46 @@ int emulate_read(int sector, char* buffer, int nSectors)
       res = SD_UNKNOWN_READ_WRITE_ERROR;
     }
   }
+  else if(nSectors > READ_CACHE_BYPASS_SECTORS || g_read_cache_data == 0)
+  {
+    ksceKernelLockMutex(read_cache_lock, 1, 0);
+    g_read_cache_stats.bypass_reads++;
+    ksceKernelUnlockMutex(read_cache_lock, 1);
+
+    res = read_layout_sectors(iso_fd, sector, buffer, nSectors);
+
+    update_readahead(sector, nSectors);
+  }
   else
   {
-    SceUID iso_fd = ksceIoOpen(iso_path, SCE_O_RDONLY, 0777);
-    if(iso_fd > 0)
-    {
-      SceOff newPos = ksceIoLseek(iso_fd, offset, SEEK_SET);
-      if(newPos != offset)
-      {
-        memset(buffer, 0, size);
-        res = SD_UNKNOWN_READ_WRITE_ERROR;
-      }
-      else
-      {
-        int nbytes = ksceIoRead(iso_fd, buffer, size);
-        if(nbytes != size)
-          res = SD_UNKNOWN_READ_WRITE_ERROR;
-        else
-          res = 0;
-      }
+    int current = sector;
+    int remaining = nSectors;
+    char* dst = buffer;
 
-      ksceIoClose(iso_fd);
-    }
-    else
+    while(remaining > 0)
     {
-      memset(buffer, 0, size);
-      res = SD_UNKNOWN_READ_WRITE_ERROR;
+      uint32_t block = current / READ_CACHE_BLOCK_SECTORS;
+      int sector_in_block = current % READ_CACHE_BLOCK_SECTORS;
+
+      int n = READ_CACHE_BLOCK_SECTORS - sector_in_block;
+      if(n > remaining)
+        n = remaining;
+
+      int block_res = read_cached_sectors(iso_fd, block, sector_in_block, dst, n);
+      if(block_res < 0)
+        res = block_res;
+
+      current += n;
+      remaining -= n;
+      dst += n * SD_DEFAULT_SECTOR_SIZE;
     }
+
+    update_readahead(sector, nSectors);
   }
 
+  if(iso_fd >= 0)
+    release_iso_fd();
+
   #ifdef ENABLE_DEBUG_LOG
   //snprintf(sprintfBuffer, 256, "sector: %x nSectors: %x result: %x\n", sector, nSectors, res);
   //FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
@@ -249,48 +1941,149 @@ int emulate_read(int sector, char* buffer, int nSectors)
   return res;
 }
 
-int read_thread(SceSize args, void *argp)
+//======= read request queue =======
+
+//maximum number of requests that can be in flight at the same time
+#define READ_QUEUE_CAPACITY 8
+
+//number of threads that serve read requests
+#define READ_QUEUE_N_WORKERS 2
+
+#define READ_REQUEST_FREE 0
+#define READ_REQUEST_PENDING 1
+#define READ_REQUEST_IN_PROGRESS 2
+
+typedef struct read_request
+{
+  uint32_t state;
+  void* ctx_part;
+  int sector;
+  char* buffer;
+  int nSectors;
+  int res;
+  SceUID done_sema; //signaled by worker when request is complete
+} read_request;
+
+read_request g_read_requests[READ_QUEUE_CAPACITY];
+
+//ring of indexes into g_read_requests in submission order
+uint32_t g_read_queue[READ_QUEUE_CAPACITY];
+uint32_t g_read_queue_head = 0;
+uint32_t g_read_queue_tail = 0;
+
+//guards request states and the ring
+SceUID read_queue_lock = -1;
+
+//counts free request descriptors
+SceUID read_queue_free_sema = -1;
+
+//counts requests that are waiting for a worker
+SceUID read_queue_pending_sema = -1;
+
+SceUID readThreadIds[READ_QUEUE_N_WORKERS] = { [0 ... READ_QUEUE_N_WORKERS - 1] = -1 };
+
+int submit_read_request(void* ctx_part, int sector, char* buffer, int nSectors)
 {
+  //wait for free descriptor
+  int res = ksceKernelWaitSema(read_queue_free_sema, 1, 0);
   #ifdef ENABLE_DEBUG_LOG
-  FILE_GLOBAL_WRITE_LEN("Started Read Thread\n");
+  if(res < 0)
+  {
+    snprintf(sprintfBuffer, 256, "failed to ksceKernelWaitSema read_queue_free_sema : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  }
   #endif
 
-  while(1)
+  ksceKernelLockMutex(read_queue_lock, 1, 0);
+
+  read_request* req = 0;
+  for(int i = 0; i < READ_QUEUE_CAPACITY; i++)
   {
-    //lock mutex
-    int res = ksceKernelLockMutex(req_lock, 1, 0);
-    #ifdef ENABLE_DEBUG_LOG
-    if(res < 0)
+    if(g_read_requests[i].state == READ_REQUEST_FREE)
     {
-      snprintf(sprintfBuffer, 256, "failed to ksceKernelLockMutex req_lock : %x\n", res);
-      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+      req = &g_read_requests[i];
+      break;
     }
-    #endif
+  }
+
+  //can not happen while free semaphore is consistent with descriptor states
+  if(req == 0)
+  {
+    ksceKernelUnlockMutex(read_queue_lock, 1);
+    ksceKernelSignalSema(read_queue_free_sema, 1);
+
+    memset(buffer, 0, nSectors * SD_DEFAULT_SECTOR_SIZE);
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+  }
+
+  req->state = READ_REQUEST_PENDING;
+  req->ctx_part = ctx_part;
+  req->sector = sector;
+  req->buffer = buffer;
+  req->nSectors = nSectors;
+  req->res = 0;
+
+  g_read_queue[g_read_queue_tail % READ_QUEUE_CAPACITY] = req - g_read_requests;
+  g_read_queue_tail++;
+
+  ksceKernelUnlockMutex(read_queue_lock, 1);
+
+  //send request
+  ksceKernelSignalSema(read_queue_pending_sema, 1);
+
+  //wait for response
+  res = ksceKernelWaitSema(req->done_sema, 1, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(res < 0)
+  {
+    snprintf(sprintfBuffer, 256, "failed to ksceKernelWaitSema done_sema : %x\n", res);
+    FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+  }
+  #endif
+
+  int req_res = req->res;
+
+  //release descriptor
+  ksceKernelLockMutex(read_queue_lock, 1, 0);
+  req->state = READ_REQUEST_FREE;
+  ksceKernelUnlockMutex(read_queue_lock, 1);
+
+  ksceKernelSignalSema(read_queue_free_sema, 1);
+
+  return req_res;
+}
+
+int read_thread(SceSize args, void *argp)
+{
+  #ifdef ENABLE_DEBUG_LOG
+  FILE_GLOBAL_WRITE_LEN("Started Read Thread\n");
+  #endif
 
+  while(1)
+  {
     //wait for request
-    res = ksceKernelWaitCond(req_cond, 0);
+    int res = ksceKernelWaitSema(read_queue_pending_sema, 1, 0);
     #ifdef ENABLE_DEBUG_LOG
     if(res < 0)
     {
-      snprintf(sprintfBuffer, 256, "failed to ksceKernelWaitCond req_cond : %x\n", res);
+      snprintf(sprintfBuffer, 256, "failed to ksceKernelWaitSema read_queue_pending_sema : %x\n", res);
       FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
     }
     #endif
 
-    //unlock mutex
-    res = ksceKernelUnlockMutex(req_lock, 1);
-    #ifdef ENABLE_DEBUG_LOG
-    if(res < 0)
-    {
-      snprintf(sprintfBuffer, 256, "failed to ksceKernelUnlockMutex req_lock : %x\n", res);
-      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-    }
-    #endif
+    ksceKernelLockMutex(read_queue_lock, 1, 0);
+
+    read_request* req = &g_read_requests[g_read_queue[g_read_queue_head % READ_QUEUE_CAPACITY]];
+    g_read_queue_head++;
+
+    req->state = READ_REQUEST_IN_PROGRESS;
+
+    ksceKernelUnlockMutex(read_queue_lock, 1);
 
-    g_res = emulate_read(g_sector, g_buffer, g_nSectors);
+    req->res = emulate_read(req->sector, req->buffer, req->nSectors);
 
     //return response
-    ksceKernelSignalCond(resp_cond);
+    ksceKernelSignalSema(req->done_sema, 1);
   }
 
   return 0;
@@ -298,39 +2091,123 @@ int read_thread(SceSize args, void *argp)
 
 int initialize_read_threading()
 {
-  req_lock = ksceKernelCreateMutex("req_lock", 0, 0, 0);
+  iso_fd_lock = ksceKernelCreateMutex("iso_fd_lock", 0, 0, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(iso_fd_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created iso_fd_lock\n");
+  #endif
+
+  iso_fd_idle_cond = ksceKernelCreateCond("iso_fd_idle_cond", 0, iso_fd_lock, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(iso_fd_idle_cond >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created iso_fd_idle_cond\n");
+  #endif
+
+  mount_lock = ksceKernelCreateMutex("mount_lock", 0, 0, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(mount_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created mount_lock\n");
+  #endif
+
+  compression_lock = ksceKernelCreateMutex("compression_lock", 0, 0, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(compression_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created compression_lock\n");
+  #endif
+
+  decompression_slot_cond = ksceKernelCreateCond("decompression_slot_cond", 0, compression_lock, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(decompression_slot_cond >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created decompression_slot_cond\n");
+  #endif
+
+  sparse_lock = ksceKernelCreateMutex("sparse_lock", 0, 0, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(sparse_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created sparse_lock\n");
+  #endif
+
+  chunk_lock = ksceKernelCreateMutex("chunk_lock", 0, 0, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(chunk_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created chunk_lock\n");
+  #endif
+
+  read_cache_lock = ksceKernelCreateMutex("read_cache_lock", 0, 0, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(read_cache_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created read_cache_lock\n");
+  #endif
+
+  readahead_lock = ksceKernelCreateMutex("readahead_lock", 0, 0, 0);
   #ifdef ENABLE_DEBUG_LOG
-  if(req_lock >= 0)
-    FILE_GLOBAL_WRITE_LEN("Created req_lock\n");
+  if(readahead_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created readahead_lock\n");
   #endif
 
-  req_cond = ksceKernelCreateCond("req_cond", 0, req_lock, 0);
+  readahead_cond = ksceKernelCreateCond("readahead_cond", 0, readahead_lock, 0);
   #ifdef ENABLE_DEBUG_LOG
-  if(req_cond >= 0)
-    FILE_GLOBAL_WRITE_LEN("Created req_cond\n");
+  if(readahead_cond >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created readahead_cond\n");
   #endif
 
-  resp_lock = ksceKernelCreateMutex("resp_lock", 0, 0, 0);
+  readaheadThreadId = ksceKernelCreateThread("ReadaheadThread", &readahead_thread, 0x64, 0x1000, 0, 0, 0);
+
+  if(readaheadThreadId >= 0)
+  {
+    #ifdef ENABLE_DEBUG_LOG
+    FILE_GLOBAL_WRITE_LEN("Created Readahead Thread\n");
+    #endif
+
+    int res = ksceKernelStartThread(readaheadThreadId, 0, 0);
+  }
+
+  read_queue_lock = ksceKernelCreateMutex("read_queue_lock", 0, 0, 0);
+  #ifdef ENABLE_DEBUG_LOG
+  if(read_queue_lock >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created read_queue_lock\n");
+  #endif
+
+  read_queue_free_sema = ksceKernelCreateSema("read_queue_free_sema", 0, READ_QUEUE_CAPACITY, READ_QUEUE_CAPACITY, 0);
   #ifdef ENABLE_DEBUG_LOG
-  if(resp_lock >= 0)
-    FILE_GLOBAL_WRITE_LEN("Created resp_lock\n");
+  if(read_queue_free_sema >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created read_queue_free_sema\n");
   #endif
 
-  resp_cond = ksceKernelCreateCond("resp_cond", 0, resp_lock, 0);
+  read_queue_pending_sema = ksceKernelCreateSema("read_queue_pending_sema", 0, 0, READ_QUEUE_CAPACITY, 0);
   #ifdef ENABLE_DEBUG_LOG
-  if(resp_cond >= 0)
-    FILE_GLOBAL_WRITE_LEN("Created resp_cond\n");
+  if(read_queue_pending_sema >= 0)
+    FILE_GLOBAL_WRITE_LEN("Created read_queue_pending_sema\n");
   #endif
 
-  readThreadId = ksceKernelCreateThread("ReadThread", &read_thread, 0x64, 0x1000, 0, 0, 0);
+  memset(g_read_requests, 0, sizeof(g_read_requests));
+  g_read_queue_head = 0;
+  g_read_queue_tail = 0;
 
-  if(readThreadId >= 0)
+  for(int i = 0; i < READ_QUEUE_CAPACITY; i++)
   {
+    g_read_requests[i].done_sema = ksceKernelCreateSema("read_done_sema", 0, 0, 1, 0);
     #ifdef ENABLE_DEBUG_LOG
-    FILE_GLOBAL_WRITE_LEN("Created Read Thread\n");
+    if(g_read_requests[i].done_sema < 0)
+    {
+      snprintf(sprintfBuffer, 256, "failed to create read_done_sema %d : %x\n", i, g_read_requests[i].done_sema);
+      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
+    }
     #endif
+  }
+
+  for(int i = 0; i < READ_QUEUE_N_WORKERS; i++)
+  {
+    readThreadIds[i] = ksceKernelCreateThread("ReadThread", &read_thread, 0x64, 0x1000, 0, 0, 0);
 
-    int res = ksceKernelStartThread(readThreadId, 0, 0);
+    if(readThreadIds[i] >= 0)
+    {
+      #ifdef ENABLE_DEBUG_LOG
+      FILE_GLOBAL_WRITE_LEN("Created Read Thread\n");
+      #endif
+
+      int res = ksceKernelStartThread(readThreadIds[i], 0, 0);
+    }
   }
 
   return 0;
@@ -338,37 +2215,123 @@ int initialize_read_threading()
 
 int deinitialize_read_threading()
 {
-  if(readThreadId >= 0)
+  if(readaheadThreadId >= 0)
   {
     int waitRet = 0;
-    ksceKernelWaitThreadEnd(readThreadId, &waitRet, 0);
+    ksceKernelWaitThreadEnd(readaheadThreadId, &waitRet, 0);
+
+    int delret = ksceKernelDeleteThread(readaheadThreadId);
+    readaheadThreadId = -1;
+  }
+
+  for(int i = 0; i < READ_QUEUE_N_WORKERS; i++)
+  {
+    if(readThreadIds[i] >= 0)
+    {
+      int waitRet = 0;
+      ksceKernelWaitThreadEnd(readThreadIds[i], &waitRet, 0);
+
+      int delret = ksceKernelDeleteThread(readThreadIds[i]);
+      readThreadIds[i] = -1;
+    }
+  }
+
+  for(int i = 0; i < READ_QUEUE_CAPACITY; i++)
+  {
+    if(g_read_requests[i].done_sema >= 0)
+    {
+      ksceKernelDeleteSema(g_read_requests[i].done_sema);
+      g_read_requests[i].done_sema = -1;
+    }
+  }
+
+  if(read_queue_pending_sema >= 0)
+  {
+    ksceKernelDeleteSema(read_queue_pending_sema);
+    read_queue_pending_sema = -1;
+  }
+
+  if(read_queue_free_sema >= 0)
+  {
+    ksceKernelDeleteSema(read_queue_free_sema);
+    read_queue_free_sema = -1;
+  }
+
+  if(read_queue_lock >= 0)
+  {
+    ksceKernelDeleteMutex(read_queue_lock);
+    read_queue_lock = -1;
+  }
+
+  if(readahead_cond >= 0)
+  {
+    ksceKernelDeleteCond(readahead_cond);
+    readahead_cond = -1;
+  }
+
+  if(readahead_lock >= 0)
+  {
+    ksceKernelDeleteMutex(readahead_lock);
+    readahead_lock = -1;
+  }
+
+  if(read_cache_lock >= 0)
+  {
+    unload_read_cache_memory();
+
+    ksceKernelDeleteMutex(read_cache_lock);
+    read_cache_lock = -1;
+  }
+
+  if(decompression_slot_cond >= 0)
+  {
+    ksceKernelDeleteCond(decompression_slot_cond);
+    decompression_slot_cond = -1;
+  }
 
-    int delret = ksceKernelDeleteThread(readThreadId);
-    readThreadId = -1;
+  if(compression_lock >= 0)
+  {
+    unload_offset_table();
+    unload_decompression_memory();
+
+    ksceKernelDeleteMutex(compression_lock);
+    compression_lock = -1;
   }
 
-  if(req_cond >= 0)
+  if(sparse_lock >= 0)
   {
-    ksceKernelDeleteCond(req_cond);
-    req_cond = -1;
+    unload_sparse_map();
+
+    ksceKernelDeleteMutex(sparse_lock);
+    sparse_lock = -1;
   }
 
-  if(resp_cond >= 0)
+  if(chunk_lock >= 0)
   {
-    ksceKernelDeleteCond(resp_cond);
-    resp_cond = -1;
+    unload_chunk_table();
+
+    ksceKernelDeleteMutex(chunk_lock);
+    chunk_lock = -1;
   }
 
-  if(req_lock >= 0)
+  if(iso_fd_lock >= 0)
   {
-    ksceKernelDeleteMutex(req_lock);
-    req_lock = -1;
+    close_iso_fd();
+
+    if(iso_fd_idle_cond >= 0)
+    {
+      ksceKernelDeleteCond(iso_fd_idle_cond);
+      iso_fd_idle_cond = -1;
+    }
+
+    ksceKernelDeleteMutex(iso_fd_lock);
+    iso_fd_lock = -1;
   }
 
-  if(resp_lock >= 0)
+  if(mount_lock >= 0)
   {
-    ksceKernelDeleteMutex(resp_lock);
-    resp_lock = -1;
+    ksceKernelDeleteMutex(mount_lock);
+    mount_lock = -1;
   }
 
   return 0;
@@ -3,29 +3,34 @@
  #include <psp2kern/types.h>
 
  #include "mbr_types.h"
+ #include "partition_map.h"
  #include "psv_types.h"
-
-extern SceUID req_lock;
-extern SceUID resp_lock;
-
-extern SceUID req_cond;
-extern SceUID resp_cond;
-
-extern void* g_ctx_part;
-extern int g_sector;
-extern char* g_buffer;
-extern int g_nSectors; 
-extern int g_res;
+ #include "psvgamesd_api.h"
 
 const MBR* get_mbr_ptr();
 
+//partition map of mounted image. it is not changed until it is released because mount waits for all users
+const partition_map* acquire_partition_map();
+void release_partition_map(const partition_map* map);
+
 int set_reader_iso_path(const char* path);
 int clear_reader_iso_path();
 
+int get_read_cache_stats_internal(psvgamesd_read_cache_stats* stats);
+
 #define CMD56_DATA_SIZE 0x34
 
 int get_cmd56_data_base(psv_file_header_v1* ih, char* buffer);
 int get_cmd56_data(char* buffer);
 
+//reads sectors of mounted image through the read cache. used by read threads and host benchmarks
+int emulate_read(int sector, char* buffer, int nSectors);
+
+//reads sectors of mounted image bypassing the cache
+int read_image_sectors(int sector, char* buffer, int nSectors);
+
+//queues read request to read threads and waits for its completion
+int submit_read_request(void* ctx_part, int sector, char* buffer, int nSectors);
+
 int initialize_read_threading();
 int deinitialize_read_threading();
\ No newline at end of file
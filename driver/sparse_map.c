@@ -0,0 +1,63 @@
+/* sparse_map.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "sparse_map.h"
+
+//this file is shared by driver and host tools so it must not depend on any os api
+
+static uint32_t get_word_count(uint32_t n_blocks)
+{
+  return (n_blocks + 63) / 64;
+}
+
+uint32_t sparse_map_get_bitmap_size(uint32_t n_blocks)
+{
+  return get_word_count(n_blocks) * sizeof(uint64_t);
+}
+
+uint32_t sparse_map_get_memory_size(uint32_t n_blocks)
+{
+  return get_word_count(n_blocks) * (sizeof(uint64_t) + sizeof(uint32_t));
+}
+
+int sparse_map_init(sparse_map* map, void* memory, uint32_t n_blocks)
+{
+  if(n_blocks == 0 || memory == 0)
+    return -1;
+
+  map->n_blocks = n_blocks;
+  map->n_present = 0;
+
+  //bits go first to keep them 8 byte aligned
+  map->bits = (uint64_t*)memory;
+  map->ranks = (uint32_t*)(map->bits + get_word_count(n_blocks));
+
+  return 0;
+}
+
+int sparse_map_build(sparse_map* map)
+{
+  uint32_t n_words = get_word_count(map->n_blocks);
+
+  //bits past the last block must be clear
+  uint32_t n_tail = map->n_blocks % 64;
+  if(n_tail > 0 && (map->bits[n_words - 1] >> n_tail) != 0)
+    return -1;
+
+  uint32_t rank = 0;
+
+  for(uint32_t i = 0; i < n_words; i++)
+  {
+    map->ranks[i] = rank;
+    rank += __builtin_popcountll(map->bits[i]);
+  }
+
+  map->n_present = rank;
+
+  return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+//in-memory form of the block bitmap of sparse image.
+//set bit means that block is stored in the file, clear bit means that block is all zeros.
+//rank (number of stored blocks before the block) is kept for every bitmap word
+//so that position of the stored block is found in constant time
+
+typedef struct sparse_map
+{
+  uint32_t n_blocks;
+  uint32_t n_present;
+  uint64_t* bits;
+  uint32_t* ranks;
+} sparse_map;
+
+uint32_t sparse_map_get_bitmap_size(uint32_t n_blocks);
+
+//size of memory that has to be passed to sparse_map_init
+uint32_t sparse_map_get_memory_size(uint32_t n_blocks);
+
+//bitmap has to be copied to map->bits before calling sparse_map_build
+int sparse_map_init(sparse_map* map, void* memory, uint32_t n_blocks);
+
+//computes ranks. fails if bits past the last block are set
+int sparse_map_build(sparse_map* map);
+
+static inline int sparse_map_is_present(const sparse_map* map, uint32_t block)
+{
+  return (map->bits[block / 64] >> (block % 64)) & 1;
+}
+
+//number of stored blocks before the block
+static inline uint32_t sparse_map_get_rank(const sparse_map* map, uint32_t block)
+{
+  uint64_t mask = (((uint64_t)1) << (block % 64)) - 1;
+  return map->ranks[block / 64] + __builtin_popcountll(map->bits[block / 64] & mask);
+}
@@ -33,49 +33,14 @@ int mmc_read_hook_threaded(void* ctx_part, int sector,	char* buffer, int nSector
   if(ksceSdifGetSdContextGlobal(SCE_SDIF_DEV_GAME_CARD) == ((sd_context_part_base*)ctx_part)->gctx_ptr)
   {
     //check if media-id read is requested
-    int media_id_res = read_media_id(get_mbr_ptr(), sector, buffer, nSectors);
+    const partition_map* map = acquire_partition_map();
+    int media_id_res = read_media_id(map, sector, buffer, nSectors);
+    release_partition_map(map);
     if(media_id_res > 0)
       return 0;
 
-    g_ctx_part = ctx_part;
-    g_sector = sector;
-    g_buffer = buffer;
-    g_nSectors = nSectors;
-
-    //send request
-    ksceKernelSignalCond(req_cond);
-
-    //lock mutex
-    int res = ksceKernelLockMutex(resp_lock, 1, 0);
-    #ifdef ENABLE_DEBUG_LOG
-    if(res < 0)
-    {
-      snprintf(sprintfBuffer, 256, "failed to ksceKernelLockMutex resp_lock : %x\n", res);
-      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-    }
-    #endif
-
-    //wait for response
-    res = ksceKernelWaitCond(resp_cond, 0);
-    #ifdef ENABLE_DEBUG_LOG
-    if(res < 0)
-    {
-      snprintf(sprintfBuffer, 256, "failed to ksceKernelWaitCond resp_cond : %x\n", res);
-      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-    }
-    #endif
-
-    //unlock mutex
-    res = ksceKernelUnlockMutex(resp_lock, 1);
-    #ifdef ENABLE_DEBUG_LOG
-    if(res < 0)
-    {
-      snprintf(sprintfBuffer, 256, "failed to ksceKernelUnlockMutex resp_lock : %x\n", res);
-      FILE_GLOBAL_WRITE_LEN(sprintfBuffer);
-    }
-    #endif
-
-    return g_res;
+    //send request and wait for response
+    return submit_read_request(ctx_part, sector, buffer, nSectors);
   }
   else
   {
@@ -89,7 +54,9 @@ int mmc_write_hook(void* ctx_part, int sector, char* buffer, int nSectors)
   //make sure that only mmc operations are redirected
   if(ksceSdifGetSdContextGlobal(SCE_SDIF_DEV_GAME_CARD) == ((sd_context_part_base*)ctx_part)->gctx_ptr)
   {
-    int media_id_res = write_media_id(get_mbr_ptr(), sector, buffer, nSectors);
+    const partition_map* map = acquire_partition_map();
+    int media_id_res = write_media_id(map, sector, buffer, nSectors);
+    release_partition_map(map);
     if(media_id_res > 0)
       return 0;
 
@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+
+rm -rf build
+mkdir build
+cd build
+cmake ../
+make
+cd ..
@@ -0,0 +1,839 @@
+/* kernel_shim.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "kernel_shim.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+//kernel objects are kept in single table. uid is index + 1
+
+#define SHIM_MAX_OBJECTS 0x100
+#define SHIM_MAX_FDS 0x400
+#define SHIM_MAX_IO_FAULTS 0x40
+
+#define SHIM_OBJECT_THREAD 1
+#define SHIM_OBJECT_MUTEX 2
+#define SHIM_OBJECT_COND 3
+#define SHIM_OBJECT_MEMBLOCK 4
+#define SHIM_OBJECT_SEMA 5
+
+typedef struct shim_sema
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int count;
+  int max;
+} shim_sema;
+
+typedef struct shim_mutex
+{
+  pthread_mutex_t lock;
+} shim_mutex;
+
+//condition is bound to mutex on creation like in kernel
+typedef struct shim_cond
+{
+  pthread_cond_t cond;
+  shim_mutex* mutex;
+} shim_cond;
+
+typedef struct shim_thread
+{
+  pthread_t thread;
+  SceKernelThreadEntry entry;
+  void* args;
+  SceSize arglen;
+  int started;
+  int status;
+} shim_thread;
+
+typedef struct shim_io_fault
+{
+  SceUID fd;
+  SceOff offset;
+  SceOff size;
+} shim_io_fault;
+
+typedef struct shim_object
+{
+  int type;
+  void* data;
+} shim_object;
+
+static pthread_mutex_t g_objects_lock = PTHREAD_MUTEX_INITIALIZER;
+static shim_object g_objects[SHIM_MAX_OBJECTS];
+
+static double g_io_bandwidth[SHIM_MAX_FDS];
+static double g_io_latency[SHIM_MAX_FDS];
+static double g_sha256_bandwidth = 0;
+static double g_open_latency = 0;
+static double g_default_io_latency = 0;
+
+static pthread_mutex_t g_io_faults_lock = PTHREAD_MUTEX_INITIALIZER;
+static shim_io_fault g_io_faults[SHIM_MAX_IO_FAULTS];
+static int g_n_io_faults = 0;
+static double g_io_fault_rate[SHIM_MAX_FDS];
+static int g_io_fault_retry[SHIM_MAX_FDS]; //last read had transient fault
+static uint32_t g_io_fault_seed = 1;
+
+static SceUID add_object(int type, void* data)
+{
+  SceUID uid = -1;
+
+  pthread_mutex_lock(&g_objects_lock);
+
+  for(int i = 0; i < SHIM_MAX_OBJECTS; i++)
+  {
+    if(g_objects[i].type == 0)
+    {
+      g_objects[i].type = type;
+      g_objects[i].data = data;
+      uid = i + 1;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&g_objects_lock);
+
+  return uid;
+}
+
+static void* get_object(SceUID uid, int type)
+{
+  if(uid <= 0 || uid > SHIM_MAX_OBJECTS || g_objects[uid - 1].type != type)
+    return 0;
+
+  return g_objects[uid - 1].data;
+}
+
+static void remove_object(SceUID uid)
+{
+  pthread_mutex_lock(&g_objects_lock);
+  g_objects[uid - 1].type = 0;
+  g_objects[uid - 1].data = 0;
+  pthread_mutex_unlock(&g_objects_lock);
+}
+
+//sleeps for the time that device with given bandwidth and request latency needs to transfer size bytes
+static void throttle(double bytes_per_second, double latency, uint64_t size, const struct timespec* start)
+{
+  if(bytes_per_second <= 0 && latency <= 0)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+  double wanted = latency;
+  if(bytes_per_second > 0)
+    wanted += size / bytes_per_second;
+
+  if(wanted > elapsed)
+    usleep((wanted - elapsed) * 1e6);
+}
+
+//returns 1 if read of size bytes at offset hits emulated fault
+static int is_io_fault(SceUID fd, SceOff offset, SceSize size)
+{
+  int fault = 0;
+
+  pthread_mutex_lock(&g_io_faults_lock);
+
+  for(int i = 0; i < g_n_io_faults && fault == 0; i++)
+  {
+    if(g_io_faults[i].fd == fd && offset < g_io_faults[i].offset + g_io_faults[i].size && g_io_faults[i].offset < offset + size)
+      fault = 1;
+  }
+
+  //transient fault does not repeat for the read that follows it
+  if(fault == 0 && g_io_fault_rate[fd] > 0)
+  {
+    g_io_fault_seed = g_io_fault_seed * 1103515245 + 12345;
+    fault = g_io_fault_retry[fd] == 0 && ((g_io_fault_seed >> 16) & 0x7FFF) < g_io_fault_rate[fd] * 0x8000;
+    g_io_fault_retry[fd] = fault;
+  }
+
+  pthread_mutex_unlock(&g_io_faults_lock);
+
+  return fault;
+}
+
+//======= io =======
+
+SceUID ksceIoOpen(const char* file, int flags, SceMode mode)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int oflags = 0;
+
+  if((flags & SCE_O_RDWR) == SCE_O_RDWR)
+    oflags = O_RDWR;
+  else if((flags & SCE_O_WRONLY) > 0)
+    oflags = O_WRONLY;
+  else
+    oflags = O_RDONLY;
+
+  if((flags & SCE_O_APPEND) > 0)
+    oflags |= O_APPEND;
+  if((flags & SCE_O_CREAT) > 0)
+    oflags |= O_CREAT;
+  if((flags & SCE_O_TRUNC) > 0)
+    oflags |= O_TRUNC;
+
+  int fd = open(file, oflags, mode & 0777);
+  if(fd >= SHIM_MAX_FDS)
+  {
+    close(fd);
+    return -1;
+  }
+
+  if(fd >= 0)
+  {
+    g_io_bandwidth[fd] = 0;
+    g_io_latency[fd] = g_default_io_latency;
+    g_io_fault_rate[fd] = 0;
+    g_io_fault_retry[fd] = 0;
+  }
+
+  throttle(0, g_open_latency, 0, &start);
+
+  return fd;
+}
+
+int ksceIoClose(SceUID fd)
+{
+  //faults belong to the device that is closed, not to the next file that gets the same fd
+  pthread_mutex_lock(&g_io_faults_lock);
+
+  for(int i = 0; i < g_n_io_faults; )
+  {
+    if(g_io_faults[i].fd == fd)
+      g_io_faults[i] = g_io_faults[--g_n_io_faults];
+    else
+      i++;
+  }
+
+  pthread_mutex_unlock(&g_io_faults_lock);
+
+  return close(fd);
+}
+
+int ksceIoRead(SceUID fd, void* data, SceSize size)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if(is_io_fault(fd, lseek(fd, 0, SEEK_CUR), size) > 0)
+    return SHIM_ERROR_IO;
+
+  int n = read(fd, data, size);
+
+  if(n > 0)
+    throttle(g_io_bandwidth[fd], g_io_latency[fd], n, &start);
+
+  return n;
+}
+
+int ksceIoWrite(SceUID fd, const void* data, SceSize size)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int n = write(fd, data, size);
+
+  if(n > 0)
+    throttle(g_io_bandwidth[fd], g_io_latency[fd], n, &start);
+
+  return n;
+}
+
+int ksceIoPread(SceUID fd, void* data, SceSize size, SceOff offset)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if(is_io_fault(fd, offset, size) > 0)
+    return SHIM_ERROR_IO;
+
+  int n = pread(fd, data, size, offset);
+
+  if(n > 0)
+    throttle(g_io_bandwidth[fd], g_io_latency[fd], n, &start);
+
+  return n;
+}
+
+int ksceIoPwrite(SceUID fd, const void* data, SceSize size, SceOff offset)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int n = pwrite(fd, data, size, offset);
+
+  if(n > 0)
+    throttle(g_io_bandwidth[fd], g_io_latency[fd], n, &start);
+
+  return n;
+}
+
+int ksceIoRemove(const char* file)
+{
+  return unlink(file);
+}
+
+SceOff ksceIoLseek(SceUID fd, SceOff offset, int whence)
+{
+  return lseek(fd, offset, whence);
+}
+
+int kernel_shim_set_io_bandwidth(SceUID fd, double bytes_per_second)
+{
+  if(fd < 0 || fd >= SHIM_MAX_FDS)
+    return -1;
+
+  g_io_bandwidth[fd] = bytes_per_second;
+  return 0;
+}
+
+int kernel_shim_set_io_latency(SceUID fd, double seconds)
+{
+  if(fd < 0 || fd >= SHIM_MAX_FDS)
+    return -1;
+
+  g_io_latency[fd] = seconds;
+  return 0;
+}
+
+int kernel_shim_set_open_latency(double seconds)
+{
+  g_open_latency = seconds;
+  return 0;
+}
+
+int kernel_shim_set_default_io_latency(double seconds)
+{
+  g_default_io_latency = seconds;
+  return 0;
+}
+
+int kernel_shim_add_io_fault(SceUID fd, SceOff offset, SceOff size)
+{
+  if(fd < 0 || fd >= SHIM_MAX_FDS)
+    return -1;
+
+  int res = -1;
+
+  pthread_mutex_lock(&g_io_faults_lock);
+
+  if(g_n_io_faults < SHIM_MAX_IO_FAULTS)
+  {
+    g_io_faults[g_n_io_faults].fd = fd;
+    g_io_faults[g_n_io_faults].offset = offset;
+    g_io_faults[g_n_io_faults].size = size;
+    g_n_io_faults++;
+    res = 0;
+  }
+
+  pthread_mutex_unlock(&g_io_faults_lock);
+
+  return res;
+}
+
+int kernel_shim_set_io_fault_rate(SceUID fd, double rate)
+{
+  if(fd < 0 || fd >= SHIM_MAX_FDS)
+    return -1;
+
+  g_io_fault_rate[fd] = rate;
+  return 0;
+}
+
+//======= semaphores =======
+
+SceUID ksceKernelCreateSema(const char* name, SceUInt attr, int initVal, int maxVal, void* option)
+{
+  shim_sema* sema = (shim_sema*)calloc(1, sizeof(shim_sema));
+  if(sema == 0)
+    return -1;
+
+  pthread_mutex_init(&sema->lock, 0);
+  pthread_cond_init(&sema->cond, 0);
+  sema->count = initVal;
+  sema->max = maxVal;
+
+  SceUID uid = add_object(SHIM_OBJECT_SEMA, sema);
+  if(uid < 0)
+    free(sema);
+
+  return uid;
+}
+
+int ksceKernelWaitSema(SceUID semaid, int signal, SceUInt* timeout)
+{
+  shim_sema* sema = (shim_sema*)get_object(semaid, SHIM_OBJECT_SEMA);
+  if(sema == 0)
+    return -1;
+
+  pthread_mutex_lock(&sema->lock);
+  while(sema->count < signal)
+    pthread_cond_wait(&sema->cond, &sema->lock);
+  sema->count -= signal;
+  pthread_mutex_unlock(&sema->lock);
+
+  return 0;
+}
+
+int ksceKernelSignalSema(SceUID semaid, int signal)
+{
+  shim_sema* sema = (shim_sema*)get_object(semaid, SHIM_OBJECT_SEMA);
+  if(sema == 0)
+    return -1;
+
+  int res = 0;
+
+  pthread_mutex_lock(&sema->lock);
+  if(sema->count + signal > sema->max)
+  {
+    res = -1;
+  }
+  else
+  {
+    sema->count += signal;
+    pthread_cond_broadcast(&sema->cond);
+  }
+  pthread_mutex_unlock(&sema->lock);
+
+  return res;
+}
+
+int ksceKernelDeleteSema(SceUID semaid)
+{
+  shim_sema* sema = (shim_sema*)get_object(semaid, SHIM_OBJECT_SEMA);
+  if(sema == 0)
+    return -1;
+
+  remove_object(semaid);
+
+  pthread_cond_destroy(&sema->cond);
+  pthread_mutex_destroy(&sema->lock);
+  free(sema);
+
+  return 0;
+}
+
+//======= mutexes =======
+
+SceUID ksceKernelCreateMutex(const char* name, SceUInt attr, int initCount, void* option)
+{
+  shim_mutex* mutex = (shim_mutex*)calloc(1, sizeof(shim_mutex));
+  if(mutex == 0)
+    return -1;
+
+  pthread_mutex_init(&mutex->lock, 0);
+
+  SceUID uid = add_object(SHIM_OBJECT_MUTEX, mutex);
+  if(uid < 0)
+  {
+    pthread_mutex_destroy(&mutex->lock);
+    free(mutex);
+    return -1;
+  }
+
+  if(initCount > 0)
+    pthread_mutex_lock(&mutex->lock);
+
+  return uid;
+}
+
+int ksceKernelLockMutex(SceUID mutexid, int lockCount, unsigned int* timeout)
+{
+  shim_mutex* mutex = (shim_mutex*)get_object(mutexid, SHIM_OBJECT_MUTEX);
+  if(mutex == 0)
+    return -1;
+
+  pthread_mutex_lock(&mutex->lock);
+  return 0;
+}
+
+int ksceKernelUnlockMutex(SceUID mutexid, int unlockCount)
+{
+  shim_mutex* mutex = (shim_mutex*)get_object(mutexid, SHIM_OBJECT_MUTEX);
+  if(mutex == 0)
+    return -1;
+
+  pthread_mutex_unlock(&mutex->lock);
+  return 0;
+}
+
+int ksceKernelDeleteMutex(SceUID mutexid)
+{
+  shim_mutex* mutex = (shim_mutex*)get_object(mutexid, SHIM_OBJECT_MUTEX);
+  if(mutex == 0)
+    return -1;
+
+  remove_object(mutexid);
+
+  pthread_mutex_destroy(&mutex->lock);
+  free(mutex);
+
+  return 0;
+}
+
+//======= conditions =======
+
+SceUID ksceKernelCreateCond(const char* name, SceUInt attr, SceUID mutexId, void* option)
+{
+  shim_mutex* mutex = (shim_mutex*)get_object(mutexId, SHIM_OBJECT_MUTEX);
+  if(mutex == 0)
+    return -1;
+
+  shim_cond* cond = (shim_cond*)calloc(1, sizeof(shim_cond));
+  if(cond == 0)
+    return -1;
+
+  pthread_cond_init(&cond->cond, 0);
+  cond->mutex = mutex;
+
+  SceUID uid = add_object(SHIM_OBJECT_COND, cond);
+  if(uid < 0)
+  {
+    pthread_cond_destroy(&cond->cond);
+    free(cond);
+  }
+
+  return uid;
+}
+
+//mutex of the condition has to be locked by the caller
+int ksceKernelWaitCond(SceUID condId, unsigned int* timeout)
+{
+  shim_cond* cond = (shim_cond*)get_object(condId, SHIM_OBJECT_COND);
+  if(cond == 0)
+    return -1;
+
+  pthread_cond_wait(&cond->cond, &cond->mutex->lock);
+  return 0;
+}
+
+int ksceKernelSignalCond(SceUID condId)
+{
+  shim_cond* cond = (shim_cond*)get_object(condId, SHIM_OBJECT_COND);
+  if(cond == 0)
+    return -1;
+
+  pthread_cond_signal(&cond->cond);
+  return 0;
+}
+
+int ksceKernelSignalCondAll(SceUID condId)
+{
+  shim_cond* cond = (shim_cond*)get_object(condId, SHIM_OBJECT_COND);
+  if(cond == 0)
+    return -1;
+
+  pthread_cond_broadcast(&cond->cond);
+  return 0;
+}
+
+int ksceKernelDeleteCond(SceUID condId)
+{
+  shim_cond* cond = (shim_cond*)get_object(condId, SHIM_OBJECT_COND);
+  if(cond == 0)
+    return -1;
+
+  remove_object(condId);
+
+  pthread_cond_destroy(&cond->cond);
+  free(cond);
+
+  return 0;
+}
+
+//======= threads =======
+
+static void* thread_start(void* arg)
+{
+  shim_thread* thread = (shim_thread*)arg;
+  thread->status = thread->entry(thread->arglen, thread->args);
+  return 0;
+}
+
+SceUID ksceKernelCreateThread(const char* name, SceKernelThreadEntry entry, int initPriority, int stackSize, SceUInt attr, int cpuAffinityMask, void* option)
+{
+  shim_thread* thread = (shim_thread*)calloc(1, sizeof(shim_thread));
+  if(thread == 0)
+    return -1;
+
+  thread->entry = entry;
+
+  SceUID uid = add_object(SHIM_OBJECT_THREAD, thread);
+  if(uid < 0)
+    free(thread);
+
+  return uid;
+}
+
+int ksceKernelStartThread(SceUID thid, SceSize arglen, void* argp)
+{
+  shim_thread* thread = (shim_thread*)get_object(thid, SHIM_OBJECT_THREAD);
+  if(thread == 0 || thread->started > 0)
+    return -1;
+
+  //kernel copies arguments to the stack of the new thread
+  if(arglen > 0)
+  {
+    thread->args = malloc(arglen);
+    if(thread->args == 0)
+      return -1;
+    memcpy(thread->args, argp, arglen);
+  }
+
+  thread->arglen = arglen;
+
+  if(pthread_create(&thread->thread, 0, thread_start, thread) != 0)
+    return -1;
+
+  thread->started = 1;
+  return 0;
+}
+
+int ksceKernelWaitThreadEnd(SceUID thid, int* stat, SceUInt* timeout)
+{
+  shim_thread* thread = (shim_thread*)get_object(thid, SHIM_OBJECT_THREAD);
+  if(thread == 0)
+    return -1;
+
+  //thread can be waited for multiple times
+  if(thread->started == 1)
+  {
+    pthread_join(thread->thread, 0);
+    thread->started = 2;
+  }
+
+  if(stat != 0)
+    *stat = thread->status;
+
+  return 0;
+}
+
+int ksceKernelDeleteThread(SceUID thid)
+{
+  shim_thread* thread = (shim_thread*)get_object(thid, SHIM_OBJECT_THREAD);
+  if(thread == 0 || thread->started == 1)
+    return -1;
+
+  remove_object(thid);
+
+  free(thread->args);
+  free(thread);
+
+  return 0;
+}
+
+int ksceKernelDelayThread(SceUInt delay)
+{
+  return usleep(delay);
+}
+
+SceInt64 ksceKernelGetSystemTimeWide(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (SceInt64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//======= memory =======
+
+SceUID ksceKernelAllocMemBlock(const char* name, SceUInt32 type, SceSize size, void* optp)
+{
+  void* base = 0;
+  if(posix_memalign(&base, 0x1000, size) != 0)
+    return -1;
+
+  SceUID uid = add_object(SHIM_OBJECT_MEMBLOCK, base);
+  if(uid < 0)
+    free(base);
+
+  return uid;
+}
+
+int ksceKernelGetMemBlockBase(SceUID uid, void** basep)
+{
+  *basep = get_object(uid, SHIM_OBJECT_MEMBLOCK);
+  return *basep == 0 ? -1 : 0;
+}
+
+int ksceKernelFreeMemBlock(SceUID uid)
+{
+  void* base = get_object(uid, SHIM_OBJECT_MEMBLOCK);
+  if(base == 0)
+    return -1;
+
+  remove_object(uid);
+  free(base);
+
+  return 0;
+}
+
+int ksceKernelPowerTick(int type)
+{
+  return 0;
+}
+
+//======= sha256 =======
+
+static const uint32_t g_sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t* h, const uint8_t* data)
+{
+  uint32_t w[64];
+
+  for(int i = 0; i < 16; i++)
+    w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) | ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+
+  for(int i = 16; i < 64; i++)
+  {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+
+  for(int i = 0; i < 64; i++)
+  {
+    uint32_t t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + g_sha256_k[i] + w[i];
+    uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    hh = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+  h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+int ksceSha256BlockInit(SceSha256Context* pContext)
+{
+  static const uint32_t h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+  memset(pContext, 0, sizeof(SceSha256Context));
+  memcpy(pContext->h, h0, sizeof(h0));
+  return 0;
+}
+
+int ksceSha256BlockUpdate(SceSha256Context* pContext, const void* plain, uint32_t len)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  const uint8_t* data = (const uint8_t*)plain;
+  uint32_t left = len;
+
+  pContext->ullTotalLen += len;
+
+  //usRemains is number of bytes that wait in buf for the block to fill up
+  if(pContext->usRemains > 0)
+  {
+    uint32_t n = 64 - pContext->usRemains;
+    if(n > left)
+      n = left;
+
+    memcpy(pContext->buf + pContext->usRemains, data, n);
+    pContext->usRemains += n;
+    data += n;
+    left -= n;
+
+    if(pContext->usRemains == 64)
+    {
+      sha256_block(pContext->h, (const uint8_t*)pContext->buf);
+      pContext->usRemains = 0;
+    }
+  }
+
+  for(; left >= 64; data += 64, left -= 64)
+    sha256_block(pContext->h, data);
+
+  if(left > 0)
+  {
+    memcpy(pContext->buf, data, left);
+    pContext->usRemains = left;
+  }
+
+  throttle(g_sha256_bandwidth, 0, len, &start);
+
+  return 0;
+}
+
+int ksceSha256BlockResult(SceSha256Context* pContext, char* digest)
+{
+  uint64_t bits = pContext->ullTotalLen * 8;
+
+  uint8_t tail[128];
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, pContext->buf, pContext->usRemains);
+  tail[pContext->usRemains] = 0x80;
+
+  uint32_t tail_size = pContext->usRemains < 56 ? 64 : 128;
+  for(int i = 0; i < 8; i++)
+    tail[tail_size - 1 - i] = (uint8_t)(bits >> (i * 8));
+
+  for(uint32_t i = 0; i < tail_size; i += 64)
+    sha256_block(pContext->h, tail + i);
+
+  for(int i = 0; i < 8; i++)
+  {
+    pContext->result[i * 4] = (char)(pContext->h[i] >> 24);
+    pContext->result[i * 4 + 1] = (char)(pContext->h[i] >> 16);
+    pContext->result[i * 4 + 2] = (char)(pContext->h[i] >> 8);
+    pContext->result[i * 4 + 3] = (char)pContext->h[i];
+  }
+
+  pContext->usComputed = 1;
+  memcpy(digest, pContext->result, 0x20);
+
+  return 0;
+}
+
+int ksceSha256Digest(const void* plain, uint32_t len, char* digest)
+{
+  SceSha256Context ctx;
+  ksceSha256BlockInit(&ctx);
+  ksceSha256BlockUpdate(&ctx, plain, len);
+  return ksceSha256BlockResult(&ctx, digest);
+}
+
+int kernel_shim_set_sha256_bandwidth(double bytes_per_second)
+{
+  g_sha256_bandwidth = bytes_per_second;
+  return 0;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+//minimal user space implementation of kernel api that is used by driver code
+//shared with host tools (dump pipeline, reader). only what that code needs is provided
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int SceUID;
+typedef unsigned int SceSize;
+typedef int64_t SceOff;
+typedef int SceMode;
+typedef unsigned int SceUInt;
+typedef uint32_t SceUInt32;
+typedef int64_t SceInt64;
+
+typedef int (*SceKernelThreadEntry)(SceSize args, void* argp);
+
+#define SCE_O_RDONLY 0x0001
+#define SCE_O_WRONLY 0x0002
+#define SCE_O_RDWR (SCE_O_RDONLY | SCE_O_WRONLY)
+#define SCE_O_APPEND 0x0100
+#define SCE_O_CREAT 0x0200
+#define SCE_O_TRUNC 0x0400
+
+#define SCE_KERNEL_MEMBLOCK_TYPE_KERNEL_RW 0x1020D006
+#define SCE_KERNEL_POWER_TICK_DISABLE_AUTO_SUSPEND 1
+
+//same layout as kernel context. state has no pointers and can be saved and restored
+typedef struct SceSha256Context
+{
+  uint32_t h[8];
+  uint32_t pad;
+  uint16_t usRemains;
+  uint16_t usComputed;
+  uint64_t ullTotalLen;
+  char buf[64];
+  char result[32];
+} SceSha256Context;
+
+SceUID ksceIoOpen(const char* file, int flags, SceMode mode);
+int ksceIoClose(SceUID fd);
+int ksceIoRead(SceUID fd, void* data, SceSize size);
+int ksceIoWrite(SceUID fd, const void* data, SceSize size);
+int ksceIoPread(SceUID fd, void* data, SceSize size, SceOff offset);
+int ksceIoPwrite(SceUID fd, const void* data, SceSize size, SceOff offset);
+int ksceIoRemove(const char* file);
+SceOff ksceIoLseek(SceUID fd, SceOff offset, int whence);
+
+SceUID ksceKernelCreateSema(const char* name, SceUInt attr, int initVal, int maxVal, void* option);
+int ksceKernelWaitSema(SceUID semaid, int signal, SceUInt* timeout);
+int ksceKernelSignalSema(SceUID semaid, int signal);
+int ksceKernelDeleteSema(SceUID semaid);
+
+SceUID ksceKernelCreateMutex(const char* name, SceUInt attr, int initCount, void* option);
+int ksceKernelLockMutex(SceUID mutexid, int lockCount, unsigned int* timeout);
+int ksceKernelUnlockMutex(SceUID mutexid, int unlockCount);
+int ksceKernelDeleteMutex(SceUID mutexid);
+
+SceUID ksceKernelCreateCond(const char* name, SceUInt attr, SceUID mutexId, void* option);
+int ksceKernelWaitCond(SceUID condId, unsigned int* timeout);
+int ksceKernelSignalCond(SceUID condId);
+int ksceKernelSignalCondAll(SceUID condId);
+int ksceKernelDeleteCond(SceUID condId);
+
+SceUID ksceKernelCreateThread(const char* name, SceKernelThreadEntry entry, int initPriority, int stackSize, SceUInt attr, int cpuAffinityMask, void* option);
+int ksceKernelStartThread(SceUID thid, SceSize arglen, void* argp);
+int ksceKernelWaitThreadEnd(SceUID thid, int* stat, SceUInt* timeout);
+int ksceKernelDeleteThread(SceUID thid);
+int ksceKernelDelayThread(SceUInt delay);
+SceInt64 ksceKernelGetSystemTimeWide(void);
+
+SceUID ksceKernelAllocMemBlock(const char* name, SceUInt32 type, SceSize size, void* optp);
+int ksceKernelGetMemBlockBase(SceUID uid, void** basep);
+int ksceKernelFreeMemBlock(SceUID uid);
+
+int ksceKernelPowerTick(int type);
+
+int ksceSha256BlockInit(SceSha256Context* pContext);
+int ksceSha256BlockUpdate(SceSha256Context* pContext, const void* plain, uint32_t len);
+int ksceSha256BlockResult(SceSha256Context* pContext, char* digest);
+int ksceSha256Digest(const void* plain, uint32_t len, char* digest);
+
+//emulates device bandwidth. io on the fd takes at least latency + size / bytes_per_second. 0 disables
+int kernel_shim_set_io_bandwidth(SceUID fd, double bytes_per_second);
+
+//emulates fixed cost of every request to the device in seconds. 0 disables
+int kernel_shim_set_io_latency(SceUID fd, double seconds);
+
+//emulates cost of opening file on the device in seconds. 0 disables
+int kernel_shim_set_open_latency(double seconds);
+
+//request latency of files that are opened after the call, for code that opens files itself. 0 disables
+int kernel_shim_set_default_io_latency(double seconds);
+
+//error that reads from unreadable area of emulated device return
+#define SHIM_ERROR_IO 0x80010005
+
+//emulates unreadable area of the device. every read that touches [offset, offset + size) fails
+int kernel_shim_add_io_fault(SceUID fd, SceOff offset, SceOff size);
+
+//emulates flaky device. given fraction of reads fails once and succeeds when it is retried. 0 disables
+int kernel_shim_set_io_fault_rate(SceUID fd, double rate);
+
+//emulates sha256 engine bandwidth. 0 disables
+int kernel_shim_set_sha256_bandwidth(double bytes_per_second);
@@ -0,0 +1,3 @@
+#pragma once
+
+#include "kernel_shim.h"
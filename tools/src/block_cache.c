@@ -0,0 +1,173 @@
+/* block_cache.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "block_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int block_cache_init(block_cache* cache, uint32_t block_size, uint64_t n_blocks, uint64_t budget_bytes)
+{
+  memset(cache, 0, sizeof(block_cache));
+
+  cache->block_size = block_size;
+  cache->n_blocks = n_blocks;
+  cache->mru = -1;
+  cache->lru = -1;
+
+  uint64_t n_entries = budget_bytes / block_size;
+  if(n_entries > n_blocks)
+    n_entries = n_blocks;
+  if(n_entries > INT32_MAX)
+    n_entries = INT32_MAX;
+
+  cache->n_entries = n_entries;
+  if(cache->n_entries == 0)
+    return 0;
+
+  cache->entries = (block_cache_entry*)calloc(cache->n_entries, sizeof(block_cache_entry));
+  cache->data = (char*)malloc((uint64_t)cache->n_entries * block_size);
+  cache->entry_of_block = (int32_t*)malloc(n_blocks * sizeof(int32_t));
+
+  if(cache->entries == 0 || cache->data == 0 || cache->entry_of_block == 0)
+  {
+    block_cache_free(cache);
+    return -1;
+  }
+
+  memset(cache->entry_of_block, 0xFF, n_blocks * sizeof(int32_t));
+
+  for(int32_t i = 0; i < cache->n_entries; i++)
+    cache->entries[i].data = cache->data + (uint64_t)i * block_size;
+
+  return 0;
+}
+
+int block_cache_free(block_cache* cache)
+{
+  free(cache->entries);
+  free(cache->data);
+  free(cache->entry_of_block);
+
+  memset(cache, 0, sizeof(block_cache));
+  cache->mru = -1;
+  cache->lru = -1;
+
+  return 0;
+}
+
+static void unlink_entry(block_cache* cache, int32_t idx)
+{
+  block_cache_entry* e = &cache->entries[idx];
+
+  if(e->prev >= 0)
+    cache->entries[e->prev].next = e->next;
+  else
+    cache->mru = e->next;
+
+  if(e->next >= 0)
+    cache->entries[e->next].prev = e->prev;
+  else
+    cache->lru = e->prev;
+}
+
+static void push_front(block_cache* cache, int32_t idx)
+{
+  block_cache_entry* e = &cache->entries[idx];
+
+  e->prev = -1;
+  e->next = cache->mru;
+
+  if(cache->mru >= 0)
+    cache->entries[cache->mru].prev = idx;
+
+  cache->mru = idx;
+
+  if(cache->lru < 0)
+    cache->lru = idx;
+}
+
+char* block_cache_get(block_cache* cache, uint64_t block)
+{
+  if(cache->n_entries == 0 || block >= cache->n_blocks || cache->entry_of_block[block] < 0)
+  {
+    cache->misses++;
+    return 0;
+  }
+
+  int32_t idx = cache->entry_of_block[block];
+
+  if(cache->mru != idx)
+  {
+    unlink_entry(cache, idx);
+    push_front(cache, idx);
+  }
+
+  cache->hits++;
+  return cache->entries[idx].data;
+}
+
+char* block_cache_insert(block_cache* cache, uint64_t block)
+{
+  if(cache->n_entries == 0 || block >= cache->n_blocks)
+    return 0;
+
+  //already cached - caller refills it
+  if(cache->entry_of_block[block] >= 0)
+    return block_cache_get(cache, block);
+
+  int32_t idx = 0;
+
+  if(cache->n_used < cache->n_entries)
+  {
+    idx = cache->n_used++;
+  }
+  else
+  {
+    idx = cache->lru;
+    unlink_entry(cache, idx);
+
+    //dropped entries do not map to any block
+    if(cache->entries[idx].block < cache->n_blocks)
+      cache->entry_of_block[cache->entries[idx].block] = -1;
+    cache->evictions++;
+  }
+
+  cache->entries[idx].block = block;
+  cache->entry_of_block[block] = idx;
+  push_front(cache, idx);
+
+  return cache->entries[idx].data;
+}
+
+int block_cache_drop(block_cache* cache, uint64_t block)
+{
+  if(cache->n_entries == 0 || block >= cache->n_blocks || cache->entry_of_block[block] < 0)
+    return 0;
+
+  int32_t idx = cache->entry_of_block[block];
+
+  cache->entry_of_block[block] = -1;
+
+  //move entry to the tail so that it is reused first
+  unlink_entry(cache, idx);
+
+  block_cache_entry* e = &cache->entries[idx];
+  e->next = -1;
+  e->prev = cache->lru;
+  if(cache->lru >= 0)
+    cache->entries[cache->lru].next = idx;
+  else
+    cache->mru = idx;
+  cache->lru = idx;
+
+  //entry stays in the list with a block that maps to nothing
+  e->block = cache->n_blocks;
+
+  return 0;
+}
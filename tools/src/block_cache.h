@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+//LRU cache of fixed size blocks keyed by block index
+
+typedef struct block_cache_entry
+{
+  uint64_t block;
+  int32_t prev; //towards most recently used
+  int32_t next; //towards least recently used
+  char* data;
+} block_cache_entry;
+
+typedef struct block_cache
+{
+  uint32_t block_size;
+  uint64_t n_blocks;
+
+  int32_t n_entries;
+  block_cache_entry* entries;
+  char* data;
+
+  int32_t* entry_of_block; //n_blocks items. -1 if block is not cached
+
+  int32_t mru;
+  int32_t lru;
+  int32_t n_used;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} block_cache;
+
+//budget_bytes is rounded down to whole blocks. zero budget disables caching
+int block_cache_init(block_cache* cache, uint32_t block_size, uint64_t n_blocks, uint64_t budget_bytes);
+
+int block_cache_free(block_cache* cache);
+
+//returns cached block data or 0 on miss
+char* block_cache_get(block_cache* cache, uint64_t block);
+
+//evicts least recently used block if needed and returns buffer that caller has to fill.
+//returns 0 if caching is disabled
+char* block_cache_insert(block_cache* cache, uint64_t block);
+
+//removes block from cache. used when buffer returned by block_cache_insert could not be filled
+int block_cache_drop(block_cache* cache, uint64_t block);
@@ -0,0 +1,418 @@
+/* compress.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <lz4.h>
+
+#include "dictionary.h"
+
+//blocks go through slots in order: reader fills slot, any worker compresses it,
+//writer drains slots strictly in block order. number of slots bounds memory and reorder distance
+
+#define SLOT_EMPTY 0
+#define SLOT_READING 1
+#define SLOT_FILLED 2
+#define SLOT_COMPRESSING 3
+#define SLOT_DONE 4
+
+//number of slots per worker thread
+#define SLOTS_PER_THREAD 4
+
+typedef struct compress_slot
+{
+  int state;
+  uint64_t block;
+  uint32_t raw_size;
+  uint32_t out_size;
+  int stored_raw; //block did not compress and is written as is
+  char* raw;
+  char* comp;
+} compress_slot;
+
+typedef struct compress_ctx
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  const psv_image* in;
+  const compress_options* opts;
+
+  compress_slot* slots;
+  int n_slots;
+
+  uint64_t n_blocks;
+  uint64_t next_compress; //next block to be picked by worker
+
+  int error;
+} compress_ctx;
+
+double get_time_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void set_error(compress_ctx* ctx)
+{
+  pthread_mutex_lock(&ctx->lock);
+  ctx->error = 1;
+  pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static uint32_t get_block_raw_size(const compress_ctx* ctx, uint64_t block)
+{
+  uint64_t remaining = ctx->in->full_size - block * ctx->opts->block_size;
+  return remaining < ctx->opts->block_size ? remaining : ctx->opts->block_size;
+}
+
+static void* reader_thread(void* arg)
+{
+  compress_ctx* ctx = (compress_ctx*)arg;
+
+  for(uint64_t block = 0; block < ctx->n_blocks; block++)
+  {
+    compress_slot* slot = &ctx->slots[block % ctx->n_slots];
+
+    pthread_mutex_lock(&ctx->lock);
+    while(slot->state != SLOT_EMPTY && ctx->error == 0)
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+    if(ctx->error > 0)
+    {
+      pthread_mutex_unlock(&ctx->lock);
+      break;
+    }
+
+    slot->state = SLOT_READING;
+    slot->block = block;
+    pthread_mutex_unlock(&ctx->lock);
+
+    slot->raw_size = get_block_raw_size(ctx, block);
+
+    if(psv_image_read_raw(ctx->in, block * ctx->opts->block_size, slot->raw, slot->raw_size) < 0)
+    {
+      fprintf(stderr, "failed to read block %llu\n", (unsigned long long)block);
+      set_error(ctx);
+      break;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    slot->state = SLOT_FILLED;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  return 0;
+}
+
+static void* worker_thread(void* arg)
+{
+  compress_ctx* ctx = (compress_ctx*)arg;
+
+  LZ4_stream_t* dict_stream = 0;
+  LZ4_stream_t* stream = 0;
+
+  if(ctx->opts->dictionary != 0)
+  {
+    dict_stream = (LZ4_stream_t*)malloc(sizeof(LZ4_stream_t));
+    stream = (LZ4_stream_t*)malloc(sizeof(LZ4_stream_t));
+
+    if(dict_stream == 0 || stream == 0)
+    {
+      fprintf(stderr, "failed to allocate memory\n");
+      set_error(ctx);
+      free(dict_stream);
+      free(stream);
+      return 0;
+    }
+
+    LZ4_resetStream(dict_stream);
+    LZ4_loadDict(dict_stream, ctx->opts->dictionary, ctx->opts->dictionary_size);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+
+  while(ctx->error == 0 && ctx->next_compress < ctx->n_blocks)
+  {
+    compress_slot* slot = &ctx->slots[ctx->next_compress % ctx->n_slots];
+
+    if(slot->state != SLOT_FILLED || slot->block != ctx->next_compress)
+    {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+      continue;
+    }
+
+    slot->state = SLOT_COMPRESSING;
+    ctx->next_compress++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    int comp_size = 0;
+
+    if(dict_stream != 0)
+    {
+      //copy of the stream with loaded dictionary is cheaper than loading dictionary for every block
+      memcpy(stream, dict_stream, sizeof(LZ4_stream_t));
+      comp_size = LZ4_compress_fast_continue(stream, slot->raw, slot->comp, slot->raw_size, LZ4_COMPRESSBOUND(ctx->opts->block_size), ctx->opts->acceleration);
+    }
+    else
+    {
+      comp_size = LZ4_compress_fast(slot->raw, slot->comp, slot->raw_size, LZ4_COMPRESSBOUND(ctx->opts->block_size), ctx->opts->acceleration);
+    }
+
+    //block that does not compress is stored raw
+    if(comp_size <= 0 || comp_size >= slot->raw_size)
+    {
+      slot->stored_raw = 1;
+      slot->out_size = slot->raw_size;
+    }
+    else
+    {
+      slot->stored_raw = 0;
+      slot->out_size = comp_size;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&ctx->cond);
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  free(dict_stream);
+  free(stream);
+
+  return 0;
+}
+
+//embedded dictionary is placed right after the offset table
+static uint64_t get_dictionary_offset(const compress_ctx* ctx)
+{
+  if(ctx->opts->dictionary == 0 || ctx->opts->shared_dictionary > 0)
+    return 0;
+
+  return (ctx->n_blocks + 1) * sizeof(uint64_t);
+}
+
+static int write_blocks(compress_ctx* ctx, int out_fd, uint64_t* offsets)
+{
+  //image data starts right after the header sector. blocks follow the offset table and embedded dictionary
+  uint64_t data_offset = SD_DEFAULT_SECTOR_SIZE;
+  uint64_t pos = (ctx->n_blocks + 1) * sizeof(uint64_t);
+
+  uint64_t dictionary_offset = get_dictionary_offset(ctx);
+  if(dictionary_offset > 0)
+  {
+    if(pwrite_full(out_fd, ctx->opts->dictionary, ctx->opts->dictionary_size, data_offset + dictionary_offset) < 0)
+    {
+      fprintf(stderr, "failed to write dictionary\n");
+      set_error(ctx);
+      return -1;
+    }
+
+    pos += ctx->opts->dictionary_size;
+  }
+
+  offsets[0] = pos;
+
+  for(uint64_t block = 0; block < ctx->n_blocks; block++)
+  {
+    compress_slot* slot = &ctx->slots[block % ctx->n_slots];
+
+    pthread_mutex_lock(&ctx->lock);
+    while((slot->state != SLOT_DONE || slot->block != block) && ctx->error == 0)
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+    if(ctx->error > 0)
+    {
+      pthread_mutex_unlock(&ctx->lock);
+      return -1;
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    const char* data = slot->stored_raw > 0 ? slot->raw : slot->comp;
+    if(pwrite_full(out_fd, data, slot->out_size, data_offset + pos) < 0)
+    {
+      fprintf(stderr, "failed to write block %llu\n", (unsigned long long)block);
+      set_error(ctx);
+      return -1;
+    }
+
+    pos += slot->out_size;
+    offsets[block + 1] = pos;
+
+    pthread_mutex_lock(&ctx->lock);
+    slot->state = SLOT_EMPTY;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  return 0;
+}
+
+static int write_compressed_header(const compress_ctx* ctx, int out_fd, uint64_t image_size, const psv_carried_tables* carried)
+{
+  const psv_image* in = ctx->in;
+  const compress_options* opts = ctx->opts;
+
+  psv_file_header_v1 header;
+  memcpy(&header, &in->header, sizeof(psv_file_header_v1));
+
+  //hash is kept as is because it covers uncompressed data
+  header.flags = FLAG_COMPRESSED;
+  header.image_size = image_size;
+  header.image_offset_sector = 1;
+
+  compression_header_t ch;
+  memset(&ch, 0, sizeof(compression_header_t));
+  ch.type = OPT_HEADER_TYPE_COMPRESSION;
+  ch.compression_algorithm = COMPRESSION_ALGORITHM_LZ4;
+  ch.uncompressed_size = in->full_size;
+  ch.block_size = opts->block_size;
+  ch.n_blocks = ctx->n_blocks;
+
+  if(opts->dictionary != 0)
+  {
+    ch.dictionary_size = opts->dictionary_size;
+    ch.dictionary_offset = get_dictionary_offset(ctx);
+    get_dictionary_hash(opts->dictionary, opts->dictionary_size, ch.dictionary_hash);
+  }
+
+  return psv_write_header_area_carried(out_fd, &header, &ch, sizeof(compression_header_t), carried);
+}
+
+int compress_image(const psv_image* in, int out_fd, const compress_options* opts, compress_stats* stats)
+{
+  if((in->header.flags & (FLAG_COMPRESSED | FLAG_DIGITAL)) > 0)
+  {
+    fprintf(stderr, "only raw and trimmed cart images can be compressed\n");
+    return -1;
+  }
+
+  if(opts->block_size < COMPRESSION_MIN_BLOCK_SIZE || opts->block_size > COMPRESSION_MAX_BLOCK_SIZE || (opts->block_size % SD_DEFAULT_SECTOR_SIZE) != 0)
+  {
+    fprintf(stderr, "block size must be multiple of 0x%x in range 0x%x - 0x%x\n", SD_DEFAULT_SECTOR_SIZE, COMPRESSION_MIN_BLOCK_SIZE, COMPRESSION_MAX_BLOCK_SIZE);
+    return -1;
+  }
+
+  if(opts->dictionary != 0 && (opts->dictionary_size == 0 || opts->dictionary_size > COMPRESSION_MAX_DICTIONARY_SIZE))
+  {
+    fprintf(stderr, "dictionary must be 1 - 0x%x bytes\n", COMPRESSION_MAX_DICTIONARY_SIZE);
+    return -1;
+  }
+
+  double start = get_time_seconds();
+
+  compress_ctx ctx;
+  memset(&ctx, 0, sizeof(compress_ctx));
+  pthread_mutex_init(&ctx.lock, 0);
+  pthread_cond_init(&ctx.cond, 0);
+
+  int n_threads = opts->n_threads > 0 ? opts->n_threads : 1;
+
+  ctx.in = in;
+  ctx.opts = opts;
+  ctx.n_blocks = (in->full_size + opts->block_size - 1) / opts->block_size;
+  ctx.n_slots = n_threads * SLOTS_PER_THREAD;
+  ctx.slots = (compress_slot*)calloc(ctx.n_slots, sizeof(compress_slot));
+
+  uint64_t* offsets = (uint64_t*)calloc(ctx.n_blocks + 1, sizeof(uint64_t));
+  pthread_t* workers = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+  int res = 0;
+
+  if(ctx.slots == 0 || offsets == 0 || workers == 0)
+    res = -1;
+
+  for(int i = 0; i < ctx.n_slots && res == 0; i++)
+  {
+    ctx.slots[i].raw = (char*)malloc(opts->block_size);
+    ctx.slots[i].comp = (char*)malloc(LZ4_COMPRESSBOUND(opts->block_size));
+    if(ctx.slots[i].raw == 0 || ctx.slots[i].comp == 0)
+      res = -1;
+  }
+
+  if(res < 0)
+  {
+    fprintf(stderr, "failed to allocate memory\n");
+  }
+  else
+  {
+    posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_t reader;
+    pthread_create(&reader, 0, reader_thread, &ctx);
+
+    for(int i = 0; i < n_threads; i++)
+      pthread_create(&workers[i], 0, worker_thread, &ctx);
+
+    res = write_blocks(&ctx, out_fd, offsets);
+
+    pthread_join(reader, 0);
+    for(int i = 0; i < n_threads; i++)
+      pthread_join(workers[i], 0);
+  }
+
+  //hash tree and error map are kept. they go after compressed data
+  psv_carried_tables carried;
+  uint64_t file_end = 0;
+
+  if(res == 0 && psv_load_carried_tables(in, &carried) < 0)
+  {
+    fprintf(stderr, "failed to read hash tree or error map\n");
+    res = -1;
+  }
+
+  if(res == 0)
+  {
+    //offset table is written last because it is only known after all blocks are compressed
+    if(pwrite_full(out_fd, offsets, (ctx.n_blocks + 1) * sizeof(uint64_t), SD_DEFAULT_SECTOR_SIZE) < 0)
+      res = -1;
+    else if(psv_write_carried_tables(out_fd, &carried, SD_DEFAULT_SECTOR_SIZE + offsets[ctx.n_blocks], &file_end) < 0)
+      res = -1;
+    else if(write_compressed_header(&ctx, out_fd, offsets[ctx.n_blocks], &carried) < 0)
+      res = -1;
+
+    if(res < 0)
+      fprintf(stderr, "failed to write header\n");
+
+    psv_free_carried_tables(&carried);
+  }
+
+  if(res == 0 && stats != 0)
+  {
+    stats->in_bytes = in->full_size;
+    stats->out_bytes = file_end;
+    stats->seconds = get_time_seconds() - start;
+  }
+
+  for(int i = 0; ctx.slots != 0 && i < ctx.n_slots; i++)
+  {
+    free(ctx.slots[i].raw);
+    free(ctx.slots[i].comp);
+  }
+
+  free(ctx.slots);
+  free(offsets);
+  free(workers);
+
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.lock);
+
+  return res;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "psv_image.h"
+
+#define COMPRESS_DEFAULT_BLOCK_SIZE 0x10000
+
+typedef struct compress_options
+{
+  uint32_t block_size;
+  int n_threads;
+  int acceleration; //LZ4 acceleration. 1 is default, higher is faster with worse ratio
+  const char* dictionary; //0 == compress without dictionary
+  uint32_t dictionary_size;
+  int shared_dictionary; //dictionary is not embedded and is referenced by hash only
+} compress_options;
+
+typedef struct compress_stats
+{
+  uint64_t in_bytes;
+  uint64_t out_bytes;
+  double seconds;
+} compress_stats;
+
+//compresses raw or trimmed image into LZ4 block-compressed image.
+//output does not depend on number of threads
+int compress_image(const psv_image* in, int out_fd, const compress_options* opts, compress_stats* stats);
+
+double get_time_seconds();
@@ -0,0 +1,580 @@
+/* convert.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lz4.h>
+#include <openssl/evp.h>
+
+#include "compress.h"
+#include "sparsify.h"
+
+//blocks go through slots in order: any worker takes next block, reads it through its own psv_image
+//(decompressing if needed) and compresses it if output is compressed. writer hashes and writes slots strictly in block order
+
+#define SLOT_EMPTY 0
+#define SLOT_BUSY 1
+#define SLOT_DONE 2
+
+//number of slots per worker thread
+#define SLOTS_PER_THREAD 4
+
+typedef struct convert_slot
+{
+  int state;
+  uint64_t block;
+  uint32_t raw_size;
+  uint32_t out_size;
+  int zero;
+  int stored_raw; //block did not compress and is written as is
+  char* raw;
+  char* comp;
+} convert_slot;
+
+typedef struct convert_ctx
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  const char* in_path;
+  const psv_image* in;
+  const convert_options* opts;
+  uint32_t block_size;
+
+  convert_slot* slots;
+  int n_slots;
+
+  uint64_t n_blocks;
+  uint64_t next_block; //next block to be picked by worker
+  uint64_t next_write; //next block to be written. slots of blocks before it are free
+
+  int error;
+} convert_ctx;
+
+typedef struct layout_name
+{
+  const char* name;
+  int layout;
+} layout_name;
+
+static const layout_name g_layout_names[] =
+{
+  { "raw", CONVERT_LAYOUT_RAW },
+  { "trimmed", CONVERT_LAYOUT_TRIMMED },
+  { "sparse", CONVERT_LAYOUT_SPARSE },
+  { "compressed", CONVERT_LAYOUT_COMPRESSED },
+};
+
+int get_convert_layout(const char* name)
+{
+  for(int i = 0; i < sizeof(g_layout_names) / sizeof(layout_name); i++)
+  {
+    if(strcmp(name, g_layout_names[i].name) == 0)
+      return g_layout_names[i].layout;
+  }
+
+  return -1;
+}
+
+static void set_error(convert_ctx* ctx)
+{
+  pthread_mutex_lock(&ctx->lock);
+  ctx->error = 1;
+  pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+//size of the block without zero sectors at its end
+static uint32_t get_data_size(const char* data, uint32_t size)
+{
+  const uint64_t* words = (const uint64_t*)data;
+  uint32_t n_words = size / sizeof(uint64_t);
+
+  while(n_words > 0 && words[n_words - 1] == 0)
+    n_words--;
+
+  uint32_t data_size = n_words * sizeof(uint64_t);
+  return (data_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+}
+
+static void* worker_thread(void* arg)
+{
+  convert_ctx* ctx = (convert_ctx*)arg;
+
+  //psv_image_read is not thread safe so every worker has its own image
+  psv_image img;
+  if(psv_image_open(&img, ctx->in_path) < 0)
+  {
+    set_error(ctx);
+    return 0;
+  }
+
+  posix_fadvise(img.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  pthread_mutex_lock(&ctx->lock);
+
+  while(ctx->error == 0 && ctx->next_block < ctx->n_blocks)
+  {
+    uint64_t block = ctx->next_block++;
+    convert_slot* slot = &ctx->slots[block % ctx->n_slots];
+
+    //slot is free once writer is done with the block that is n_slots before.
+    //state alone is not enough: worker with later block of the same slot could take it first
+    while(block >= ctx->next_write + ctx->n_slots && ctx->error == 0)
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+    if(ctx->error > 0)
+      break;
+
+    slot->state = SLOT_BUSY;
+    slot->block = block;
+    pthread_mutex_unlock(&ctx->lock);
+
+    uint64_t offset = block * ctx->block_size;
+    uint64_t remaining = ctx->in->full_size - offset;
+    slot->raw_size = remaining < ctx->block_size ? remaining : ctx->block_size;
+
+    if(psv_image_read(&img, offset, slot->raw, slot->raw_size) < 0)
+    {
+      fprintf(stderr, "failed to read block %llu\n", (unsigned long long)block);
+      set_error(ctx);
+      pthread_mutex_lock(&ctx->lock);
+      break;
+    }
+
+    slot->zero = get_data_size(slot->raw, slot->raw_size) == 0;
+    slot->stored_raw = 1;
+    slot->out_size = slot->raw_size;
+
+    if(ctx->opts->layout == CONVERT_LAYOUT_COMPRESSED)
+    {
+      int comp_size = LZ4_compress_fast(slot->raw, slot->comp, slot->raw_size, LZ4_COMPRESSBOUND(ctx->block_size), ctx->opts->acceleration);
+
+      //block that does not compress is stored raw
+      if(comp_size > 0 && comp_size < slot->raw_size)
+      {
+        slot->stored_raw = 0;
+        slot->out_size = comp_size;
+      }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&ctx->cond);
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  psv_image_close(&img);
+
+  return 0;
+}
+
+typedef struct convert_output
+{
+  int fd;
+  uint64_t data_offset; //image data starts right after the header sector
+  uint64_t pos;         //end of stored data relative to data_offset
+  uint64_t stored_end;  //end of the last sector that is not zero. only used for trimmed layout
+  uint64_t* bitmap;     //sparse layout
+  uint32_t bitmap_size;
+  uint64_t* offsets;    //compressed layout
+} convert_output;
+
+static int write_block(convert_ctx* ctx, convert_output* out, const convert_slot* slot)
+{
+  uint64_t offset = slot->block * ctx->block_size;
+
+  switch(ctx->opts->layout)
+  {
+    case CONVERT_LAYOUT_RAW:
+    case CONVERT_LAYOUT_TRIMMED:
+      //zero blocks are skipped. file is extended over them at the end, so they take no space on disk
+      if(slot->zero > 0)
+        return 0;
+
+      out->stored_end = offset + get_data_size(slot->raw, slot->raw_size);
+      return pwrite_full(out->fd, slot->raw, slot->raw_size, out->data_offset + offset);
+
+    case CONVERT_LAYOUT_SPARSE:
+      if(slot->zero > 0)
+        return 0;
+
+      if(pwrite_full(out->fd, slot->raw, slot->raw_size, out->data_offset + out->pos) < 0)
+        return -1;
+
+      out->bitmap[slot->block / 64] |= ((uint64_t)1) << (slot->block % 64);
+      out->pos += slot->raw_size;
+      return 0;
+
+    case CONVERT_LAYOUT_COMPRESSED:
+      if(pwrite_full(out->fd, slot->stored_raw > 0 ? slot->raw : slot->comp, slot->out_size, out->data_offset + out->pos) < 0)
+        return -1;
+
+      out->pos += slot->out_size;
+      out->offsets[slot->block + 1] = out->pos;
+      return 0;
+
+    default:
+      return -1;
+  }
+}
+
+static int write_blocks(convert_ctx* ctx, convert_output* out, EVP_MD_CTX* md, convert_stats* stats)
+{
+  for(uint64_t block = 0; block < ctx->n_blocks; block++)
+  {
+    convert_slot* slot = &ctx->slots[block % ctx->n_slots];
+
+    pthread_mutex_lock(&ctx->lock);
+    while((slot->state != SLOT_DONE || slot->block != block) && ctx->error == 0)
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+    if(ctx->error > 0)
+    {
+      pthread_mutex_unlock(&ctx->lock);
+      return -1;
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(EVP_DigestUpdate(md, slot->raw, slot->raw_size) != 1)
+    {
+      set_error(ctx);
+      return -1;
+    }
+
+    if(write_block(ctx, out, slot) < 0)
+    {
+      fprintf(stderr, "failed to write block %llu\n", (unsigned long long)block);
+      set_error(ctx);
+      return -1;
+    }
+
+    if(slot->zero > 0)
+      stats->n_zero_blocks++;
+
+    pthread_mutex_lock(&ctx->lock);
+    slot->state = SLOT_EMPTY;
+    ctx->next_write = block + 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  return 0;
+}
+
+//writes tables that are only known after all blocks, truncates the file and writes the header
+static int finish_output(convert_ctx* ctx, convert_output* out, const uint8_t* hash, convert_stats* stats)
+{
+  const psv_image* in = ctx->in;
+
+  psv_file_header_v1 header;
+  memcpy(&header, &in->header, sizeof(psv_file_header_v1));
+
+  //hash covers uncompressed data so it is the same for all layouts
+  memcpy(header.hash, hash, 0x20);
+  header.image_offset_sector = 1;
+
+  sparse_header_t sh;
+  compression_header_t ch;
+  const void* opt_header = 0;
+  uint32_t opt_header_size = 0;
+
+  uint64_t file_size = 0;
+
+  switch(ctx->opts->layout)
+  {
+    case CONVERT_LAYOUT_RAW:
+    case CONVERT_LAYOUT_TRIMMED:
+    {
+      uint64_t image_size = ctx->opts->layout == CONVERT_LAYOUT_RAW ? in->full_size : out->stored_end;
+
+      header.flags = image_size < in->full_size ? FLAG_TRIMMED : 0;
+      header.image_size = image_size;
+      file_size = out->data_offset + image_size;
+      break;
+    }
+
+    case CONVERT_LAYOUT_SPARSE:
+    {
+      memset(&sh, 0, sizeof(sparse_header_t));
+      sh.type = OPT_HEADER_TYPE_SPARSE;
+      sh.block_size = ctx->block_size;
+      sh.uncompressed_size = in->full_size;
+      sh.n_blocks = ctx->n_blocks;
+      sh.n_present = ctx->n_blocks - stats->n_zero_blocks;
+
+      //padding between bitmap and first block is written as zeros
+      uint64_t blocks_offset = (out->bitmap_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+      char* bitmap_area = (char*)calloc(1, blocks_offset);
+      if(bitmap_area == 0)
+        return -1;
+
+      memcpy(bitmap_area, out->bitmap, out->bitmap_size);
+      int res = pwrite_full(out->fd, bitmap_area, blocks_offset, out->data_offset);
+      free(bitmap_area);
+
+      if(res < 0)
+        return -1;
+
+      header.flags = FLAG_SPARSE;
+      header.image_size = out->pos;
+      opt_header = &sh;
+      opt_header_size = sizeof(sparse_header_t);
+      file_size = out->data_offset + out->pos;
+      break;
+    }
+
+    case CONVERT_LAYOUT_COMPRESSED:
+    {
+      if(pwrite_full(out->fd, out->offsets, (ctx->n_blocks + 1) * sizeof(uint64_t), out->data_offset) < 0)
+        return -1;
+
+      memset(&ch, 0, sizeof(compression_header_t));
+      ch.type = OPT_HEADER_TYPE_COMPRESSION;
+      ch.compression_algorithm = COMPRESSION_ALGORITHM_LZ4;
+      ch.uncompressed_size = in->full_size;
+      ch.block_size = ctx->block_size;
+      ch.n_blocks = ctx->n_blocks;
+
+      header.flags = FLAG_COMPRESSED;
+      header.image_size = out->pos;
+      opt_header = &ch;
+      opt_header_size = sizeof(compression_header_t);
+      file_size = out->data_offset + out->pos;
+      break;
+    }
+
+    default:
+      return -1;
+  }
+
+  //raw and trimmed files end at the last written block, zero blocks after it are added here
+  if(ftruncate(out->fd, file_size) < 0)
+    return -1;
+
+  //hash tree and error map describe uncompressed data so they are copied after data of the new layout
+  psv_carried_tables carried;
+  if(psv_load_carried_tables(in, &carried) < 0)
+  {
+    fprintf(stderr, "failed to read hash tree or error map\n");
+    return -1;
+  }
+
+  int res = 0;
+
+  if(psv_write_carried_tables(out->fd, &carried, file_size, &file_size) < 0 ||
+     psv_write_header_area_carried(out->fd, &header, opt_header, opt_header_size, &carried) < 0)
+    res = -1;
+
+  psv_free_carried_tables(&carried);
+
+  if(res < 0)
+    return -1;
+
+  stats->out_bytes = file_size;
+  return 0;
+}
+
+static uint32_t get_default_block_size(int layout)
+{
+  switch(layout)
+  {
+    case CONVERT_LAYOUT_SPARSE:
+      return SPARSIFY_DEFAULT_BLOCK_SIZE;
+    case CONVERT_LAYOUT_COMPRESSED:
+      return COMPRESS_DEFAULT_BLOCK_SIZE;
+    default:
+      return CONVERT_DEFAULT_BLOCK_SIZE;
+  }
+}
+
+static int check_block_size(int layout, uint32_t block_size)
+{
+  uint32_t min_size = SD_DEFAULT_SECTOR_SIZE;
+  uint32_t max_size = 0x1000000;
+
+  if(layout == CONVERT_LAYOUT_SPARSE)
+  {
+    min_size = SPARSE_MIN_BLOCK_SIZE;
+    max_size = SPARSE_MAX_BLOCK_SIZE;
+  }
+  else if(layout == CONVERT_LAYOUT_COMPRESSED)
+  {
+    min_size = COMPRESSION_MIN_BLOCK_SIZE;
+    max_size = COMPRESSION_MAX_BLOCK_SIZE;
+  }
+
+  if(block_size < min_size || block_size > max_size || (block_size % SD_DEFAULT_SECTOR_SIZE) != 0)
+  {
+    fprintf(stderr, "block size must be multiple of 0x%x in range 0x%x - 0x%x\n", SD_DEFAULT_SECTOR_SIZE, min_size, max_size);
+    return -1;
+  }
+
+  return 0;
+}
+
+int convert_image(const char* in_path, int out_fd, const convert_options* opts, convert_stats* stats)
+{
+  memset(stats, 0, sizeof(convert_stats));
+
+  if(opts->layout < CONVERT_LAYOUT_RAW || opts->layout > CONVERT_LAYOUT_COMPRESSED)
+    return -1;
+
+  uint32_t block_size = opts->block_size > 0 ? opts->block_size : get_default_block_size(opts->layout);
+  if(check_block_size(opts->layout, block_size) < 0)
+    return -1;
+
+  psv_image in;
+  if(psv_image_open(&in, in_path) < 0)
+    return -1;
+
+  if((in.header.flags & FLAG_DIGITAL) > 0)
+  {
+    fprintf(stderr, "%s: only cart images can be converted\n", in_path);
+    psv_image_close(&in);
+    return -1;
+  }
+
+  double start = get_time_seconds();
+
+  convert_ctx ctx;
+  memset(&ctx, 0, sizeof(convert_ctx));
+  pthread_mutex_init(&ctx.lock, 0);
+  pthread_cond_init(&ctx.cond, 0);
+
+  int n_threads = opts->n_threads > 0 ? opts->n_threads : 1;
+
+  ctx.in_path = in_path;
+  ctx.in = &in;
+  ctx.opts = opts;
+  ctx.block_size = block_size;
+  ctx.n_blocks = (in.full_size + block_size - 1) / block_size;
+  ctx.n_slots = n_threads * SLOTS_PER_THREAD;
+  ctx.slots = (convert_slot*)calloc(ctx.n_slots, sizeof(convert_slot));
+
+  convert_output out;
+  memset(&out, 0, sizeof(convert_output));
+  out.fd = out_fd;
+  out.data_offset = SD_DEFAULT_SECTOR_SIZE;
+
+  int res = 0;
+
+  if(opts->layout == CONVERT_LAYOUT_SPARSE)
+  {
+    out.bitmap_size = sparse_map_get_bitmap_size(ctx.n_blocks);
+    out.bitmap = (uint64_t*)calloc(1, out.bitmap_size);
+    out.pos = (out.bitmap_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+    if(out.bitmap == 0)
+      res = -1;
+  }
+  else if(opts->layout == CONVERT_LAYOUT_COMPRESSED)
+  {
+    out.offsets = (uint64_t*)calloc(ctx.n_blocks + 1, sizeof(uint64_t));
+    out.pos = (ctx.n_blocks + 1) * sizeof(uint64_t);
+    if(out.offsets == 0)
+      res = -1;
+    else
+      out.offsets[0] = out.pos;
+  }
+
+  pthread_t* workers = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+  if(ctx.slots == 0 || workers == 0)
+    res = -1;
+
+  for(int i = 0; i < ctx.n_slots && res == 0; i++)
+  {
+    ctx.slots[i].raw = (char*)malloc(block_size);
+    if(opts->layout == CONVERT_LAYOUT_COMPRESSED)
+      ctx.slots[i].comp = (char*)malloc(LZ4_COMPRESSBOUND(block_size));
+    if(ctx.slots[i].raw == 0 || (opts->layout == CONVERT_LAYOUT_COMPRESSED && ctx.slots[i].comp == 0))
+      res = -1;
+  }
+
+  EVP_MD_CTX* md = EVP_MD_CTX_new();
+  if(md == 0 || EVP_DigestInit_ex(md, EVP_sha256(), 0) != 1)
+    res = -1;
+
+  if(res < 0)
+  {
+    fprintf(stderr, "failed to allocate memory\n");
+  }
+  else
+  {
+    for(int i = 0; i < n_threads; i++)
+      pthread_create(&workers[i], 0, worker_thread, &ctx);
+
+    res = write_blocks(&ctx, &out, md, stats);
+
+    for(int i = 0; i < n_threads; i++)
+      pthread_join(workers[i], 0);
+  }
+
+  uint8_t hash[0x20];
+  uint8_t no_hash[0x20];
+  memset(no_hash, 0, 0x20);
+
+  if(res == 0 && EVP_DigestFinal_ex(md, hash, 0) != 1)
+    res = -1;
+
+  if(res == 0)
+  {
+    //data that does not match the hash is not converted, so that damage is not hidden under new hash
+    if(memcmp(in.header.hash, no_hash, 0x20) == 0)
+    {
+      stats->hash_added = 1;
+    }
+    else if(memcmp(in.header.hash, hash, 0x20) != 0)
+    {
+      fprintf(stderr, "%s: data does not match sha256 in the header\n", in_path);
+      res = -1;
+    }
+  }
+
+  if(res == 0 && finish_output(&ctx, &out, hash, stats) < 0)
+  {
+    fprintf(stderr, "failed to write header\n");
+    res = -1;
+  }
+
+  if(res == 0)
+  {
+    stats->in_bytes = in.full_size;
+    stats->n_blocks = ctx.n_blocks;
+    stats->seconds = get_time_seconds() - start;
+  }
+
+  EVP_MD_CTX_free(md);
+
+  for(int i = 0; ctx.slots != 0 && i < ctx.n_slots; i++)
+  {
+    free(ctx.slots[i].raw);
+    free(ctx.slots[i].comp);
+  }
+
+  free(ctx.slots);
+  free(workers);
+  free(out.bitmap);
+  free(out.offsets);
+
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.lock);
+
+  psv_image_close(&in);
+
+  return res;
+}
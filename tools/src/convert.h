@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "psv_image.h"
+
+//block size of raw and trimmed output. blocks are only the unit of reading and hashing there
+#define CONVERT_DEFAULT_BLOCK_SIZE 0x100000
+
+#define CONVERT_LAYOUT_RAW 0
+#define CONVERT_LAYOUT_TRIMMED 1
+#define CONVERT_LAYOUT_SPARSE 2
+#define CONVERT_LAYOUT_COMPRESSED 3
+
+typedef struct convert_options
+{
+  int layout;
+  uint32_t block_size; //0 == default block size of the layout
+  int n_threads;
+  int acceleration; //LZ4 acceleration of compressed layout
+} convert_options;
+
+typedef struct convert_stats
+{
+  uint64_t in_bytes;
+  uint64_t out_bytes;
+  uint64_t n_blocks;
+  uint64_t n_zero_blocks;
+  int hash_added; //input had no hash. computed hash is stored in the output
+  double seconds;
+} convert_stats;
+
+//returns CONVERT_LAYOUT_* by name or -1
+int get_convert_layout(const char* name);
+
+//converts cart image of any layout into raw, trimmed, sparse or compressed image in one pass.
+//blocks are read (and decompressed) and compressed on n_threads threads, output is written in block order
+//so it does not depend on number of threads. sha256 of the data is computed on the way and has to match the header
+int convert_image(const char* in_path, int out_fd, const convert_options* opts, convert_stats* stats);
@@ -0,0 +1,929 @@
+/* dedup.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "dedup.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <openssl/evp.h>
+
+#include "psv_image.h"
+#include "compress.h"
+
+//images are split into batches of chunks. workers read and hash batches of all images in parallel,
+//calling thread looks chunks up in the pool and adds new ones strictly in batch order
+
+#define BATCH_EMPTY 0
+#define BATCH_HASHING 1
+#define BATCH_DONE 2
+
+//amount of image data that worker reads at once
+#define DEDUP_BATCH_SIZE 0x100000
+
+//number of batches per worker thread
+#define BATCHES_PER_THREAD 4
+
+#define POOL_INDEX_MAGIC 0x50565350 //PSVP
+#define POOL_INDEX_VERSION 1
+
+//number of entries that are read from index at once
+#define POOL_INDEX_READ_ENTRIES 0x100000
+
+#define POOL_TABLE_EMPTY 0xFFFFFFFF
+
+#pragma pack(push, 1)
+
+//index file is header followed by entries in the order they were added
+typedef struct pool_index_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t chunk_size;
+  uint32_t n_packs;
+  uint64_t n_entries;
+  uint64_t last_pack_size; // bytes of the last pack that entries refer to. anything after it is left by interrupted run
+} pool_index_header;
+
+typedef struct pool_entry
+{
+  uint8_t hash[0x20];
+  uint32_t pack;
+  uint32_t sector;
+} pool_entry;
+
+#pragma pack(pop)
+
+typedef struct dedup_pool
+{
+  char index_path[PATH_MAX];
+  int index_fd;
+  uint32_t chunk_size;
+
+  //entries after n_saved are not in the index file yet
+  pool_entry* entries;
+  uint64_t n_entries;
+  uint64_t max_entries;
+  uint64_t n_saved;
+
+  //open addressing table of entry numbers keyed by hash. kept at most half full
+  uint32_t* table;
+  uint64_t table_size;
+
+  //only the last pack is written
+  uint32_t n_packs;
+  int pack_fd;
+  uint64_t pack_size;
+} dedup_pool;
+
+typedef struct dedup_image
+{
+  const char* path;
+  psv_file_header_v1 header;
+  uint64_t full_size;
+  uint32_t n_chunks;
+  uint64_t first_batch;
+  uint64_t n_batches;
+  psv_carried_tables carried; //hash tree and error map are kept in the manifest
+} dedup_image;
+
+typedef struct dedup_batch
+{
+  int state;
+  uint64_t batch;
+  int image;
+  uint32_t first_chunk;
+  uint32_t n_chunks;
+  char* data;
+  uint8_t* hashes; //0x20 bytes per chunk
+  uint8_t* zero;   //set for chunks that are all zeros
+} dedup_batch;
+
+typedef struct dedup_ctx
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  dedup_image* images;
+  int n_images;
+
+  uint32_t chunk_size;
+  uint32_t batch_chunks;
+
+  dedup_batch* batches;
+  int n_slots;
+
+  uint64_t n_batches;
+  uint64_t next_batch; //next batch to be picked by worker
+
+  int error;
+} dedup_ctx;
+
+int get_pack_path(const char* image_path, uint32_t pack, char* path, int size)
+{
+  int dir_length = 0;
+
+  if(image_path != 0)
+  {
+    const char* name = strrchr(image_path, '/');
+    if(name != 0)
+      dir_length = name + 1 - image_path;
+  }
+
+  //pack in hex, extension and terminator
+  if(dir_length + 8 + 5 > size)
+    return -1;
+
+  if(dir_length > 0)
+    memcpy(path, image_path, dir_length);
+
+  snprintf(path + dir_length, 13, "%08x.pck", pack);
+
+  return 0;
+}
+
+static uint64_t get_hash_key(const uint8_t* hash)
+{
+  //hash is uniform so any part of it is good key
+  uint64_t key;
+  memcpy(&key, hash, sizeof(uint64_t));
+  return key;
+}
+
+static void insert_table_entry(uint32_t* table, uint64_t table_size, const pool_entry* entries, uint32_t entry)
+{
+  uint64_t mask = table_size - 1;
+  uint64_t i = get_hash_key(entries[entry].hash) & mask;
+
+  while(table[i] != POOL_TABLE_EMPTY)
+    i = (i + 1) & mask;
+
+  table[i] = entry;
+}
+
+static int64_t find_pool_entry(const dedup_pool* pool, const uint8_t* hash)
+{
+  if(pool->table_size == 0)
+    return -1;
+
+  uint64_t mask = pool->table_size - 1;
+
+  for(uint64_t i = get_hash_key(hash) & mask; pool->table[i] != POOL_TABLE_EMPTY; i = (i + 1) & mask)
+  {
+    if(memcmp(pool->entries[pool->table[i]].hash, hash, 0x20) == 0)
+      return pool->table[i];
+  }
+
+  return -1;
+}
+
+static int reserve_pool_entries(dedup_pool* pool, uint64_t n_entries)
+{
+  if(n_entries >= POOL_TABLE_EMPTY)
+    return -1;
+
+  if(n_entries > pool->max_entries)
+  {
+    uint64_t max_entries = pool->max_entries > 0 ? pool->max_entries : 0x10000;
+    while(max_entries < n_entries)
+      max_entries *= 2;
+
+    pool_entry* entries = (pool_entry*)realloc(pool->entries, max_entries * sizeof(pool_entry));
+    if(entries == 0)
+      return -1;
+
+    pool->entries = entries;
+    pool->max_entries = max_entries;
+  }
+
+  if(n_entries * 2 > pool->table_size)
+  {
+    uint64_t table_size = pool->table_size > 0 ? pool->table_size : 0x20000;
+    while(n_entries * 2 > table_size)
+      table_size *= 2;
+
+    uint32_t* table = (uint32_t*)malloc(table_size * sizeof(uint32_t));
+    if(table == 0)
+      return -1;
+
+    memset(table, 0xFF, table_size * sizeof(uint32_t));
+
+    for(uint64_t i = 0; i < pool->n_entries; i++)
+      insert_table_entry(table, table_size, pool->entries, i);
+
+    free(pool->table);
+    pool->table = table;
+    pool->table_size = table_size;
+  }
+
+  return 0;
+}
+
+static int add_pool_entry(dedup_pool* pool, const uint8_t* hash, uint32_t pack, uint32_t sector)
+{
+  if(reserve_pool_entries(pool, pool->n_entries + 1) < 0)
+    return -1;
+
+  pool_entry* entry = &pool->entries[pool->n_entries];
+  memcpy(entry->hash, hash, 0x20);
+  entry->pack = pack;
+  entry->sector = sector;
+
+  insert_table_entry(pool->table, pool->table_size, pool->entries, pool->n_entries);
+  pool->n_entries++;
+
+  return 0;
+}
+
+static int close_pool(dedup_pool* pool)
+{
+  int res = 0;
+
+  if(pool->pack_fd >= 0 && close(pool->pack_fd) < 0)
+    res = -1;
+
+  if(pool->index_fd >= 0 && close(pool->index_fd) < 0)
+    res = -1;
+
+  pool->pack_fd = -1;
+  pool->index_fd = -1;
+
+  free(pool->entries);
+  pool->entries = 0;
+
+  free(pool->table);
+  pool->table = 0;
+
+  return res;
+}
+
+static int load_pool_index(dedup_pool* pool, const pool_index_header* header)
+{
+  if(reserve_pool_entries(pool, header->n_entries) < 0)
+  {
+    fprintf(stderr, "failed to allocate memory\n");
+    return -1;
+  }
+
+  for(uint64_t i = 0; i < header->n_entries; i += POOL_INDEX_READ_ENTRIES)
+  {
+    uint64_t n = header->n_entries - i;
+    if(n > POOL_INDEX_READ_ENTRIES)
+      n = POOL_INDEX_READ_ENTRIES;
+
+    if(pread_full(pool->index_fd, pool->entries + i, n * sizeof(pool_entry), sizeof(pool_index_header) + i * sizeof(pool_entry)) != n * sizeof(pool_entry))
+      return -1;
+  }
+
+  for(uint64_t i = 0; i < header->n_entries; i++)
+  {
+    const pool_entry* entry = &pool->entries[i];
+
+    if(entry->pack >= header->n_packs || (entry->pack == header->n_packs - 1 && (uint64_t)entry->sector * SD_DEFAULT_SECTOR_SIZE >= header->last_pack_size))
+      return -1;
+
+    insert_table_entry(pool->table, pool->table_size, pool->entries, i);
+  }
+
+  pool->n_entries = header->n_entries;
+  pool->n_saved = header->n_entries;
+
+  return 0;
+}
+
+static int open_pool(dedup_pool* pool, const char* dir, uint32_t chunk_size)
+{
+  memset(pool, 0, sizeof(dedup_pool));
+  pool->index_fd = -1;
+  pool->pack_fd = -1;
+
+  if(snprintf(pool->index_path, PATH_MAX, "%s/%s", dir, DEDUP_INDEX_NAME) >= PATH_MAX)
+  {
+    fprintf(stderr, "%s: path is too long\n", dir);
+    return -1;
+  }
+
+  pool->index_fd = open(pool->index_path, O_CREAT | O_RDWR, 0666);
+  if(pool->index_fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", pool->index_path, strerror(errno));
+    return -1;
+  }
+
+  pool_index_header header;
+  int n = pread_full(pool->index_fd, &header, sizeof(pool_index_header), 0);
+
+  //new pool
+  if(n == 0)
+  {
+    pool->chunk_size = chunk_size > 0 ? chunk_size : DEDUP_DEFAULT_CHUNK_SIZE;
+    return 0;
+  }
+
+  if(n != sizeof(pool_index_header) || header.magic != POOL_INDEX_MAGIC || header.version != POOL_INDEX_VERSION ||
+     header.chunk_size < CHUNKED_MIN_CHUNK_SIZE || header.chunk_size > CHUNKED_MAX_CHUNK_SIZE || (header.chunk_size % SD_DEFAULT_SECTOR_SIZE) != 0 ||
+     header.last_pack_size > DEDUP_MAX_PACK_SIZE || load_pool_index(pool, &header) < 0)
+  {
+    fprintf(stderr, "%s: pool index is invalid\n", pool->index_path);
+    close_pool(pool);
+    return -1;
+  }
+
+  if(chunk_size > 0 && chunk_size != header.chunk_size)
+  {
+    fprintf(stderr, "%s: pool is split into chunks of 0x%x bytes\n", dir, header.chunk_size);
+    close_pool(pool);
+    return -1;
+  }
+
+  pool->chunk_size = header.chunk_size;
+  pool->n_packs = header.n_packs;
+  pool->pack_size = header.last_pack_size;
+
+  if(pool->n_packs > 0)
+  {
+    char pack_path[PATH_MAX];
+    get_pack_path(pool->index_path, pool->n_packs - 1, pack_path, PATH_MAX);
+
+    //chunks that were written after the last index update are not referenced by any manifest
+    pool->pack_fd = open(pack_path, O_WRONLY);
+    if(pool->pack_fd < 0 || ftruncate(pool->pack_fd, pool->pack_size) < 0)
+    {
+      fprintf(stderr, "%s: failed to open: %s\n", pack_path, strerror(errno));
+      close_pool(pool);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+//packs must reach the disk before index that refers to their chunks
+static int save_pool_index(dedup_pool* pool)
+{
+  if(pool->pack_fd >= 0 && fdatasync(pool->pack_fd) < 0)
+    return -1;
+
+  uint64_t n_new = pool->n_entries - pool->n_saved;
+
+  if(pwrite_full(pool->index_fd, pool->entries + pool->n_saved, n_new * sizeof(pool_entry), sizeof(pool_index_header) + pool->n_saved * sizeof(pool_entry)) < 0 ||
+     fdatasync(pool->index_fd) < 0)
+    return -1;
+
+  pool_index_header header;
+  memset(&header, 0, sizeof(pool_index_header));
+  header.magic = POOL_INDEX_MAGIC;
+  header.version = POOL_INDEX_VERSION;
+  header.chunk_size = pool->chunk_size;
+  header.n_packs = pool->n_packs;
+  header.n_entries = pool->n_entries;
+  header.last_pack_size = pool->pack_size;
+
+  if(pwrite_full(pool->index_fd, &header, sizeof(pool_index_header), 0) < 0 || fdatasync(pool->index_fd) < 0)
+    return -1;
+
+  pool->n_saved = pool->n_entries;
+
+  return 0;
+}
+
+//appends chunk to the last pack. chunks start at sector boundary
+static int write_pool_chunk(dedup_pool* pool, const char* data, uint32_t size, chunk_location_t* location)
+{
+  uint64_t stored_size = (size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+
+  if(pool->pack_fd >= 0 && pool->pack_size + stored_size > DEDUP_MAX_PACK_SIZE)
+  {
+    int res = fdatasync(pool->pack_fd);
+    if(close(pool->pack_fd) < 0)
+      res = -1;
+
+    pool->pack_fd = -1;
+
+    if(res < 0)
+      return -1;
+  }
+
+  if(pool->pack_fd < 0)
+  {
+    char pack_path[PATH_MAX];
+    get_pack_path(pool->index_path, pool->n_packs, pack_path, PATH_MAX);
+
+    //pack with this number can only be left by interrupted run
+    pool->pack_fd = open(pack_path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if(pool->pack_fd < 0)
+    {
+      fprintf(stderr, "%s: failed to open: %s\n", pack_path, strerror(errno));
+      return -1;
+    }
+
+    pool->n_packs++;
+    pool->pack_size = 0;
+  }
+
+  if(pwrite_full(pool->pack_fd, data, size, pool->pack_size) < 0)
+    return -1;
+
+  location->pack = pool->n_packs - 1;
+  location->sector = pool->pack_size / SD_DEFAULT_SECTOR_SIZE;
+
+  pool->pack_size += stored_size;
+
+  return 0;
+}
+
+static void set_error(dedup_ctx* ctx)
+{
+  pthread_mutex_lock(&ctx->lock);
+  ctx->error = 1;
+  pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static uint32_t get_chunk_size(const dedup_ctx* ctx, const dedup_image* image, uint32_t chunk)
+{
+  uint64_t remaining = image->full_size - (uint64_t)chunk * ctx->chunk_size;
+  return remaining < ctx->chunk_size ? remaining : ctx->chunk_size;
+}
+
+static int is_zero_chunk(const char* data, uint32_t size)
+{
+  const uint64_t* words = (const uint64_t*)data;
+  uint32_t n_words = size / sizeof(uint64_t);
+
+  for(uint32_t i = 0; i < n_words; i++)
+  {
+    if(words[i] != 0)
+      return 0;
+  }
+
+  for(uint32_t i = n_words * sizeof(uint64_t); i < size; i++)
+  {
+    if(data[i] != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+static int hash_batch(dedup_ctx* ctx, psv_image* img, dedup_batch* batch)
+{
+  const dedup_image* image = &ctx->images[batch->image];
+
+  uint64_t offset = (uint64_t)batch->first_chunk * ctx->chunk_size;
+  uint64_t size = (uint64_t)batch->n_chunks * ctx->chunk_size;
+  if(size > image->full_size - offset)
+    size = image->full_size - offset;
+
+  if(psv_image_read(img, offset, batch->data, size) < 0)
+  {
+    fprintf(stderr, "%s: failed to read chunk %u\n", image->path, batch->first_chunk);
+    return -1;
+  }
+
+  for(uint32_t i = 0; i < batch->n_chunks; i++)
+  {
+    const char* data = batch->data + (uint64_t)i * ctx->chunk_size;
+    uint32_t chunk_size = get_chunk_size(ctx, image, batch->first_chunk + i);
+    uint8_t* hash = batch->hashes + i * 0x20;
+
+    //zero chunks are not stored so they are not hashed
+    batch->zero[i] = is_zero_chunk(data, chunk_size);
+
+    if(batch->zero[i] > 0)
+      memset(hash, 0, 0x20);
+    else if(EVP_Digest(data, chunk_size, hash, 0, EVP_sha256(), 0) != 1)
+      return -1;
+  }
+
+  return 0;
+}
+
+static void* hash_thread(void* arg)
+{
+  dedup_ctx* ctx = (dedup_ctx*)arg;
+
+  //psv_image_read is not thread safe so each thread opens images itself
+  psv_image img;
+  int open_image = -1;
+
+  //batches are picked in order so image of the next batch is never before image of the previous one
+  int image = 0;
+
+  pthread_mutex_lock(&ctx->lock);
+
+  while(ctx->error == 0 && ctx->next_batch < ctx->n_batches)
+  {
+    dedup_batch* batch = &ctx->batches[ctx->next_batch % ctx->n_slots];
+
+    if(batch->state != BATCH_EMPTY)
+    {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+      continue;
+    }
+
+    batch->state = BATCH_HASHING;
+    batch->batch = ctx->next_batch++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    while(batch->batch >= ctx->images[image].first_batch + ctx->images[image].n_batches)
+      image++;
+
+    const dedup_image* di = &ctx->images[image];
+
+    batch->image = image;
+    batch->first_chunk = (batch->batch - di->first_batch) * ctx->batch_chunks;
+    batch->n_chunks = di->n_chunks - batch->first_chunk;
+    if(batch->n_chunks > ctx->batch_chunks)
+      batch->n_chunks = ctx->batch_chunks;
+
+    int res = 0;
+
+    if(open_image != image)
+    {
+      if(open_image >= 0)
+        psv_image_close(&img);
+
+      open_image = -1;
+
+      if(psv_image_open(&img, di->path) < 0)
+        res = -1;
+      else
+        open_image = image;
+    }
+
+    if(res == 0)
+      res = hash_batch(ctx, &img, batch);
+
+    pthread_mutex_lock(&ctx->lock);
+
+    if(res < 0)
+      ctx->error = 1;
+    else
+      batch->state = BATCH_DONE;
+
+    pthread_cond_broadcast(&ctx->cond);
+  }
+
+  pthread_mutex_unlock(&ctx->lock);
+
+  if(open_image >= 0)
+    psv_image_close(&img);
+
+  return 0;
+}
+
+//manifest is written to temporary file and renamed so that existing manifest stays valid until the new one is complete
+static int write_manifest(const dedup_pool* pool, const char* pool_dir, dedup_image* image, const chunk_location_t* locations, const uint8_t* hashes, uint32_t n_stored)
+{
+  const char* name = strrchr(image->path, '/');
+  name = (name != 0) ? name + 1 : image->path;
+
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+
+  if(snprintf(path, PATH_MAX, "%s/%s", pool_dir, name) >= PATH_MAX || snprintf(tmp_path, PATH_MAX, "%s.tmp", path) >= PATH_MAX)
+  {
+    fprintf(stderr, "%s: path is too long\n", name);
+    return -1;
+  }
+
+  chunked_header_t ch;
+  memset(&ch, 0, sizeof(chunked_header_t));
+  ch.type = OPT_HEADER_TYPE_CHUNKED;
+  ch.chunk_size = pool->chunk_size;
+  ch.uncompressed_size = image->full_size;
+  ch.n_chunks = image->n_chunks;
+  ch.n_stored = n_stored;
+  ch.hashes_offset = (uint64_t)image->n_chunks * sizeof(chunk_location_t);
+
+  //hash is kept as is because it covers complete data
+  psv_file_header_v1 header;
+  memcpy(&header, &image->header, sizeof(psv_file_header_v1));
+  header.flags = FLAG_CHUNKED;
+  header.image_size = ch.hashes_offset + (uint64_t)image->n_chunks * 0x20;
+  header.image_offset_sector = 1;
+
+  int fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", tmp_path, strerror(errno));
+    return -1;
+  }
+
+  int res = 0;
+  uint64_t file_end = 0;
+
+  //hash tree and error map go after chunk hashes
+  if(pwrite_full(fd, locations, ch.hashes_offset, SD_DEFAULT_SECTOR_SIZE) < 0 ||
+     pwrite_full(fd, hashes, (uint64_t)image->n_chunks * 0x20, SD_DEFAULT_SECTOR_SIZE + ch.hashes_offset) < 0 ||
+     psv_write_carried_tables(fd, &image->carried, SD_DEFAULT_SECTOR_SIZE + header.image_size, &file_end) < 0 ||
+     psv_write_header_area_carried(fd, &header, &ch, sizeof(chunked_header_t), &image->carried) < 0 || fdatasync(fd) < 0)
+    res = -1;
+
+  if(close(fd) < 0)
+    res = -1;
+
+  if(res == 0 && rename(tmp_path, path) < 0)
+    res = -1;
+
+  if(res < 0)
+  {
+    fprintf(stderr, "%s: failed to write manifest\n", path);
+    unlink(tmp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int commit_batches(dedup_ctx* ctx, dedup_pool* pool, const char* pool_dir, dedup_stats* stats)
+{
+  chunk_location_t* locations = 0;
+  uint8_t* hashes = 0;
+
+  //chunks of current image
+  uint32_t n_stored = 0;
+  uint32_t n_dup = 0;
+  uint64_t new_bytes = 0;
+
+  int res = 0;
+
+  for(uint64_t b = 0; b < ctx->n_batches && res == 0; b++)
+  {
+    dedup_batch* batch = &ctx->batches[b % ctx->n_slots];
+
+    pthread_mutex_lock(&ctx->lock);
+    while((batch->state != BATCH_DONE || batch->batch != b) && ctx->error == 0)
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+    int error = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(error > 0)
+    {
+      res = -1;
+      break;
+    }
+
+    dedup_image* image = &ctx->images[batch->image];
+
+    if(batch->first_chunk == 0)
+    {
+      locations = (chunk_location_t*)malloc((uint64_t)image->n_chunks * sizeof(chunk_location_t));
+      hashes = (uint8_t*)malloc((uint64_t)image->n_chunks * 0x20);
+
+      n_stored = 0;
+      n_dup = 0;
+      new_bytes = 0;
+
+      if(locations == 0 || hashes == 0)
+      {
+        fprintf(stderr, "failed to allocate memory\n");
+        res = -1;
+      }
+    }
+
+    for(uint32_t i = 0; i < batch->n_chunks && res == 0; i++)
+    {
+      uint32_t chunk = batch->first_chunk + i;
+      const uint8_t* hash = batch->hashes + i * 0x20;
+
+      memcpy(hashes + (uint64_t)chunk * 0x20, hash, 0x20);
+
+      if(batch->zero[i] > 0)
+      {
+        locations[chunk].pack = CHUNK_PACK_ZERO;
+        locations[chunk].sector = 0;
+        continue;
+      }
+
+      n_stored++;
+
+      int64_t entry = find_pool_entry(pool, hash);
+      if(entry >= 0)
+      {
+        locations[chunk].pack = pool->entries[entry].pack;
+        locations[chunk].sector = pool->entries[entry].sector;
+        n_dup++;
+        continue;
+      }
+
+      uint32_t chunk_size = get_chunk_size(ctx, image, chunk);
+
+      if(write_pool_chunk(pool, batch->data + (uint64_t)i * ctx->chunk_size, chunk_size, &locations[chunk]) < 0 ||
+         add_pool_entry(pool, hash, locations[chunk].pack, locations[chunk].sector) < 0)
+      {
+        fprintf(stderr, "%s: failed to add chunk %u to the pool\n", image->path, chunk);
+        res = -1;
+      }
+
+      new_bytes += chunk_size;
+    }
+
+    int last_batch = (batch->first_chunk + batch->n_chunks == image->n_chunks);
+
+    pthread_mutex_lock(&ctx->lock);
+    batch->state = BATCH_EMPTY;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(res == 0 && last_batch > 0)
+    {
+      //index has to refer to all chunks of the manifest before manifest is written
+      if(save_pool_index(pool) < 0)
+      {
+        fprintf(stderr, "%s: failed to update pool index\n", pool->index_path);
+        res = -1;
+      }
+      else
+      {
+        res = write_manifest(pool, pool_dir, image, locations, hashes, n_stored);
+      }
+
+      if(res == 0)
+      {
+        printf("%s: %u chunks, %u zero, %u duplicate, %llu new bytes\n", image->path,
+          image->n_chunks, image->n_chunks - n_stored, n_dup, (unsigned long long)new_bytes);
+
+        stats->in_bytes += image->full_size;
+        stats->new_bytes += new_bytes;
+        stats->n_chunks += image->n_chunks;
+        stats->n_zero_chunks += image->n_chunks - n_stored;
+        stats->n_dup_chunks += n_dup;
+      }
+
+      free(locations);
+      free(hashes);
+      locations = 0;
+      hashes = 0;
+    }
+  }
+
+  if(res < 0)
+    set_error(ctx);
+
+  free(locations);
+  free(hashes);
+
+  return res;
+}
+
+static int open_images(dedup_ctx* ctx, const char* const* paths, int n_paths)
+{
+  for(int i = 0; i < n_paths; i++)
+  {
+    const char* name = strrchr(paths[i], '/');
+    name = (name != 0) ? name + 1 : paths[i];
+
+    //manifest is named after the image
+    for(int j = 0; j < i; j++)
+    {
+      const char* other = strrchr(paths[j], '/');
+      other = (other != 0) ? other + 1 : paths[j];
+
+      if(strcmp(name, other) == 0)
+      {
+        fprintf(stderr, "%s: image with the same name is already added\n", paths[i]);
+        return -1;
+      }
+    }
+
+    psv_image img;
+    if(psv_image_open(&img, paths[i]) < 0)
+      return -1;
+
+    dedup_image* image = &ctx->images[i];
+    image->path = paths[i];
+    memcpy(&image->header, &img.header, sizeof(psv_file_header_v1));
+    image->full_size = img.full_size;
+
+    int res = psv_load_carried_tables(&img, &image->carried);
+
+    psv_image_close(&img);
+
+    if(res < 0)
+    {
+      fprintf(stderr, "%s: failed to read hash tree or error map\n", paths[i]);
+      return -1;
+    }
+
+    if((image->header.flags & FLAG_DIGITAL) > 0 || image->full_size == 0)
+    {
+      fprintf(stderr, "%s: only cart images can be deduplicated\n", paths[i]);
+      return -1;
+    }
+
+    image->n_chunks = (image->full_size + ctx->chunk_size - 1) / ctx->chunk_size;
+    image->n_batches = (image->n_chunks + ctx->batch_chunks - 1) / ctx->batch_chunks;
+    image->first_batch = ctx->n_batches;
+
+    ctx->n_batches += image->n_batches;
+  }
+
+  ctx->n_images = n_paths;
+
+  return 0;
+}
+
+int dedup_images(const char* pool_dir, const char* const* paths, int n_paths, const dedup_options* opts, dedup_stats* stats)
+{
+  if(opts->chunk_size > 0 && (opts->chunk_size < CHUNKED_MIN_CHUNK_SIZE || opts->chunk_size > CHUNKED_MAX_CHUNK_SIZE || (opts->chunk_size % SD_DEFAULT_SECTOR_SIZE) != 0))
+  {
+    fprintf(stderr, "chunk size must be multiple of 0x%x in range 0x%x - 0x%x\n", SD_DEFAULT_SECTOR_SIZE, CHUNKED_MIN_CHUNK_SIZE, CHUNKED_MAX_CHUNK_SIZE);
+    return -1;
+  }
+
+  double start = get_time_seconds();
+
+  dedup_pool pool;
+  if(open_pool(&pool, pool_dir, opts->chunk_size) < 0)
+    return -1;
+
+  dedup_ctx ctx;
+  memset(&ctx, 0, sizeof(dedup_ctx));
+  pthread_mutex_init(&ctx.lock, 0);
+  pthread_cond_init(&ctx.cond, 0);
+
+  int n_threads = opts->n_threads > 0 ? opts->n_threads : 1;
+
+  ctx.chunk_size = pool.chunk_size;
+  ctx.batch_chunks = DEDUP_BATCH_SIZE / pool.chunk_size;
+  ctx.n_slots = n_threads * BATCHES_PER_THREAD;
+  ctx.images = (dedup_image*)calloc(n_paths, sizeof(dedup_image));
+  ctx.batches = (dedup_batch*)calloc(ctx.n_slots, sizeof(dedup_batch));
+
+  pthread_t* workers = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+  int res = 0;
+
+  if(ctx.images == 0 || ctx.batches == 0 || workers == 0)
+    res = -1;
+
+  for(int i = 0; i < ctx.n_slots && res == 0; i++)
+  {
+    ctx.batches[i].data = (char*)malloc((uint64_t)ctx.batch_chunks * ctx.chunk_size);
+    ctx.batches[i].hashes = (uint8_t*)malloc(ctx.batch_chunks * 0x20);
+    ctx.batches[i].zero = (uint8_t*)malloc(ctx.batch_chunks);
+    if(ctx.batches[i].data == 0 || ctx.batches[i].hashes == 0 || ctx.batches[i].zero == 0)
+      res = -1;
+  }
+
+  if(res < 0)
+    fprintf(stderr, "failed to allocate memory\n");
+  else
+    res = open_images(&ctx, paths, n_paths);
+
+  dedup_stats total;
+  memset(&total, 0, sizeof(dedup_stats));
+
+  if(res == 0)
+  {
+    for(int i = 0; i < n_threads; i++)
+      pthread_create(&workers[i], 0, hash_thread, &ctx);
+
+    res = commit_batches(&ctx, &pool, pool_dir, &total);
+
+    for(int i = 0; i < n_threads; i++)
+      pthread_join(workers[i], 0);
+  }
+
+  if(close_pool(&pool) < 0)
+    res = -1;
+
+  if(res == 0 && stats != 0)
+  {
+    memcpy(stats, &total, sizeof(dedup_stats));
+    stats->seconds = get_time_seconds() - start;
+  }
+
+  for(int i = 0; ctx.batches != 0 && i < ctx.n_slots; i++)
+  {
+    free(ctx.batches[i].data);
+    free(ctx.batches[i].hashes);
+    free(ctx.batches[i].zero);
+  }
+
+  for(int i = 0; ctx.images != 0 && i < n_paths; i++)
+    psv_free_carried_tables(&ctx.images[i].carried);
+
+  free(ctx.batches);
+  free(ctx.images);
+  free(workers);
+
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.lock);
+
+  return res;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "psv_types.h"
+
+#define DEDUP_DEFAULT_CHUNK_SIZE 0x10000
+
+//pack is closed once next chunk does not fit. packs stay below 4 GiB for any file system
+#define DEDUP_MAX_PACK_SIZE 0x40000000
+
+//index of all chunks that are stored in the packs of the pool
+#define DEDUP_INDEX_NAME "pool.idx"
+
+typedef struct dedup_options
+{
+  uint32_t chunk_size; //0 == chunk size of existing pool or default. pool can not be split into chunks of other size
+  int n_threads;
+} dedup_options;
+
+typedef struct dedup_stats
+{
+  uint64_t in_bytes;
+  uint64_t new_bytes; //bytes of chunks that were added to the pool
+  uint64_t n_chunks;
+  uint64_t n_zero_chunks;
+  uint64_t n_dup_chunks; //chunks that are already in the pool or earlier in the images
+  double seconds;
+} dedup_stats;
+
+//splits cart images of any layout into fixed size chunks, adds chunks that are not in the pool yet to pack files
+//and writes manifest of every image (see Sample Usage 9 in psv_types.h) into pool directory under the name of the image.
+//chunks are read and hashed in parallel, pool is updated in image order so output does not depend on number of threads
+int dedup_images(const char* pool_dir, const char* const* paths, int n_paths, const dedup_options* opts, dedup_stats* stats);
+
+//pack is named <pack>.pck. if image_path is not 0 the name is placed in the directory of the image
+int get_pack_path(const char* image_path, uint32_t pack, char* path, int size);
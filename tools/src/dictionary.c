@@ -0,0 +1,234 @@
+/* dictionary.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "dictionary.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lz4.h>
+#include <zdict.h>
+#include <openssl/evp.h>
+
+#include "psv_image.h"
+
+//number of candidate blocks that are looked at per wanted sample.
+//most of the cart is encrypted or empty so only some candidates make it into samples
+#define CANDIDATES_PER_SAMPLE 8
+
+//samples that do not compress by at least 1/16 are encrypted data and only add noise
+static int is_useful_sample(const char* data, uint32_t size, char* comp_buffer)
+{
+  uint32_t i = 0;
+  while(i < size && data[i] == 0)
+    i++;
+
+  if(i == size)
+    return 0;
+
+  int comp_size = LZ4_compress_fast(data, comp_buffer, size, LZ4_COMPRESSBOUND(size), 1);
+  return comp_size > 0 && comp_size < size - size / 16;
+}
+
+static int collect_samples(const char* path, const train_options* opts, uint32_t max_samples, char* samples, uint32_t* n_samples, char* comp_buffer)
+{
+  psv_image img;
+  if(psv_image_open(&img, path) < 0)
+    return -1;
+
+  uint64_t n_blocks = img.full_size / opts->sample_size;
+  uint64_t n_candidates = (uint64_t)max_samples * CANDIDATES_PER_SAMPLE;
+
+  //candidates are spread evenly over the image
+  uint64_t stride = n_blocks / n_candidates;
+  if(stride == 0)
+    stride = 1;
+
+  uint32_t n = 0;
+  int res = 0;
+
+  for(uint64_t block = 0; block < n_blocks && n < max_samples; block += stride)
+  {
+    char* dst = samples + (uint64_t)n * opts->sample_size;
+
+    if(psv_image_read(&img, block * opts->sample_size, dst, opts->sample_size) < 0)
+    {
+      res = -1;
+      break;
+    }
+
+    if(is_useful_sample(dst, opts->sample_size, comp_buffer) > 0)
+      n++;
+  }
+
+  psv_image_close(&img);
+
+  *n_samples = n;
+  return res;
+}
+
+int train_dictionary(const char* const* paths, int n_paths, const train_options* opts, char* dictionary, uint32_t* dictionary_size)
+{
+  if(n_paths <= 0 || opts->sample_size == 0 || opts->dictionary_size == 0 || opts->dictionary_size > COMPRESSION_MAX_DICTIONARY_SIZE)
+    return -1;
+
+  uint32_t max_samples = opts->sample_budget / opts->sample_size;
+  uint32_t max_samples_per_image = max_samples / n_paths;
+  if(max_samples_per_image == 0)
+  {
+    fprintf(stderr, "sample budget is too small\n");
+    return -1;
+  }
+
+  max_samples = max_samples_per_image * n_paths;
+
+  char* samples = (char*)malloc((uint64_t)max_samples * opts->sample_size);
+  size_t* sample_sizes = (size_t*)malloc(max_samples * sizeof(size_t));
+  char* comp_buffer = (char*)malloc(LZ4_COMPRESSBOUND(opts->sample_size));
+
+  int res = 0;
+  uint32_t n_samples = 0;
+
+  if(samples == 0 || sample_sizes == 0 || comp_buffer == 0)
+  {
+    fprintf(stderr, "failed to allocate memory\n");
+    res = -1;
+  }
+
+  for(int i = 0; i < n_paths && res == 0; i++)
+  {
+    uint32_t n = 0;
+    res = collect_samples(paths[i], opts, max_samples_per_image, samples + (uint64_t)n_samples * opts->sample_size, &n, comp_buffer);
+
+    printf("%s: %u samples\n", paths[i], n);
+
+    n_samples += n;
+  }
+
+  if(res == 0)
+  {
+    for(uint32_t i = 0; i < n_samples; i++)
+      sample_sizes[i] = opts->sample_size;
+
+    size_t size = ZDICT_trainFromBuffer(dictionary, opts->dictionary_size, samples, sample_sizes, n_samples);
+    if(ZDICT_isError(size))
+    {
+      fprintf(stderr, "failed to train dictionary on %u samples: %s\n", n_samples, ZDICT_getErrorName(size));
+      res = -1;
+    }
+    else
+    {
+      //trainer produces zstd dictionary. LZ4 only needs raw content that follows entropy tables
+      size_t header_size = ZDICT_getDictHeaderSize(dictionary, size);
+      if(ZDICT_isError(header_size) || header_size >= size)
+      {
+        fprintf(stderr, "trained dictionary is invalid\n");
+        res = -1;
+      }
+      else
+      {
+        memmove(dictionary, dictionary + header_size, size - header_size);
+        *dictionary_size = size - header_size;
+      }
+    }
+  }
+
+  free(samples);
+  free(sample_sizes);
+  free(comp_buffer);
+
+  return res;
+}
+
+int load_dictionary(const char* path, char* dictionary, uint32_t* dictionary_size)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  //one extra byte detects dictionary that is too large
+  char* buffer = (char*)malloc(COMPRESSION_MAX_DICTIONARY_SIZE + 1);
+  int n = buffer != 0 ? pread_full(fd, buffer, COMPRESSION_MAX_DICTIONARY_SIZE + 1, 0) : -1;
+
+  close(fd);
+
+  if(n <= 0 || n > COMPRESSION_MAX_DICTIONARY_SIZE)
+  {
+    fprintf(stderr, "%s: dictionary must be 1 - 0x%x bytes\n", path, COMPRESSION_MAX_DICTIONARY_SIZE);
+    free(buffer);
+    return -1;
+  }
+
+  memcpy(dictionary, buffer, n);
+  *dictionary_size = n;
+
+  free(buffer);
+  return 0;
+}
+
+int save_dictionary(const char* path, const char* dictionary, uint32_t dictionary_size)
+{
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int res = pwrite_full(fd, dictionary, dictionary_size, 0);
+
+  if(close(fd) < 0)
+    res = -1;
+
+  if(res < 0)
+  {
+    fprintf(stderr, "%s: failed to write\n", path);
+    unlink(path);
+    return -1;
+  }
+
+  return 0;
+}
+
+void get_dictionary_hash(const char* dictionary, uint32_t dictionary_size, uint8_t* hash)
+{
+  EVP_Digest(dictionary, dictionary_size, hash, 0, EVP_sha256(), 0);
+}
+
+int get_dictionary_path(const char* image_path, const uint8_t* hash, char* path, int size)
+{
+  int dir_length = 0;
+
+  if(image_path != 0)
+  {
+    const char* name = strrchr(image_path, '/');
+    if(name != 0)
+      dir_length = name + 1 - image_path;
+  }
+
+  //hash in hex, extension and terminator
+  if(dir_length + 0x40 + 5 > size)
+    return -1;
+
+  if(dir_length > 0)
+    memcpy(path, image_path, dir_length);
+
+  for(int i = 0; i < 0x20; i++)
+    snprintf(path + dir_length + i * 2, 3, "%02x", hash[i]);
+
+  strcpy(path + dir_length + 0x40, ".dic");
+
+  return 0;
+}
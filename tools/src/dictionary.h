@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "psv_types.h"
+
+//samples should be of the same size as blocks that are later compressed with the dictionary
+#define DICTIONARY_DEFAULT_SAMPLE_SIZE 0x1000
+
+//total size of samples taken from all images. trainer works best with ~100x dictionary size
+#define DICTIONARY_DEFAULT_SAMPLE_BUDGET (32 * 1024 * 1024)
+
+typedef struct train_options
+{
+  uint32_t dictionary_size;
+  uint32_t sample_size;
+  uint64_t sample_budget;
+} train_options;
+
+//trains LZ4 dictionary on blocks sampled from images of any layout.
+//dictionary must have space for opts->dictionary_size bytes
+int train_dictionary(const char* const* paths, int n_paths, const train_options* opts, char* dictionary, uint32_t* dictionary_size);
+
+//loads dictionary file. dictionary must have space for COMPRESSION_MAX_DICTIONARY_SIZE bytes
+int load_dictionary(const char* path, char* dictionary, uint32_t* dictionary_size);
+
+int save_dictionary(const char* path, const char* dictionary, uint32_t dictionary_size);
+
+void get_dictionary_hash(const char* dictionary, uint32_t dictionary_size, uint8_t* hash);
+
+//shared dictionary is named <hash>.dic. if image_path is not 0 the name is placed in the directory of the image
+int get_dictionary_path(const char* image_path, const uint8_t* hash, char* path, int size);
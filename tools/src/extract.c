@@ -0,0 +1,272 @@
+/* extract.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "extract.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "compress.h"
+
+typedef struct partition_name
+{
+  const char* name;
+  uint8_t code;
+} partition_name;
+
+static const partition_name g_partition_names[] =
+{
+  { "gro0", gro0 },
+  { "grw0", (uint8_t)grw0 },
+  { "cardsExt", cardsExt },
+};
+
+int find_partition(const MBR* mbr, const char* partition)
+{
+  for(int i = 0; i < sizeof(g_partition_names) / sizeof(partition_name); i++)
+  {
+    if(strcmp(partition, g_partition_names[i].name) != 0)
+      continue;
+
+    for(int j = 0; j < MAX_MBR_PARTITIONS; j++)
+    {
+      if(mbr->partitions[j].partitionCode == g_partition_names[i].code && mbr->partitions[j].partitionSize > 0)
+        return j;
+    }
+
+    return -1;
+  }
+
+  char* end = 0;
+  long index = strtol(partition, &end, 0);
+  if(end == partition || *end != 0 || index < 0 || index >= MAX_MBR_PARTITIONS)
+    return -1;
+
+  if(mbr->partitions[index].partitionCode == empty_c || mbr->partitions[index].partitionSize == 0)
+    return -1;
+
+  return index;
+}
+
+static int write_full(int fd, const char* buffer, uint64_t size)
+{
+  while(size > 0)
+  {
+    ssize_t n = write(fd, buffer, size);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    buffer += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+//copies size bytes from in_fd at offset to current position of out_fd.
+//copy_file_range is tried first, then sendfile. returns number of bytes that were copied by the kernel,
+//the rest has to be copied through user memory because neither call supports these files
+static int64_t copy_in_kernel(int in_fd, uint64_t offset, int out_fd, uint64_t size)
+{
+  uint64_t done = 0;
+  int use_copy_file_range = 1;
+
+  while(done < size)
+  {
+    uint64_t chunk = size - done;
+    if(chunk > 0x40000000)
+      chunk = 0x40000000;
+
+    ssize_t n = -1;
+    off_t in_offset = offset + done;
+
+    if(use_copy_file_range > 0)
+    {
+      //output offset is 0 so that position of out_fd is used and advanced
+      n = copy_file_range(in_fd, &in_offset, out_fd, 0, chunk, 0);
+      if(n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+      {
+        use_copy_file_range = 0;
+        continue;
+      }
+    }
+    else
+    {
+      n = sendfile(out_fd, in_fd, &in_offset, chunk);
+      if(n < 0 && (errno == EINVAL || errno == ENOSYS))
+        break;
+    }
+
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    //input is shorter than expected
+    if(n == 0)
+      return -1;
+
+    done += n;
+  }
+
+  return done;
+}
+
+static int copy_buffered(psv_image* in, uint64_t offset, int out_fd, uint64_t size, char* buffer)
+{
+  while(size > 0)
+  {
+    uint64_t chunk = size < EXTRACT_BUFFER_SIZE ? size : EXTRACT_BUFFER_SIZE;
+
+    if(psv_image_read(in, offset, buffer, chunk) < 0)
+    {
+      fprintf(stderr, "failed to read image at 0x%llx\n", (unsigned long long)offset);
+      return -1;
+    }
+
+    if(write_full(out_fd, buffer, chunk) < 0)
+    {
+      fprintf(stderr, "failed to write output: %s\n", strerror(errno));
+      return -1;
+    }
+
+    offset += chunk;
+    size -= chunk;
+  }
+
+  return 0;
+}
+
+//trimmed tail is zeros. regular file is extended without writing them
+static int write_zeros(int out_fd, uint64_t size, char* buffer)
+{
+  struct stat st;
+  if(fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode))
+  {
+    off_t end = lseek(out_fd, 0, SEEK_CUR);
+    if(end >= 0 && ftruncate(out_fd, end + size) == 0 && lseek(out_fd, end + size, SEEK_SET) == end + size)
+      return 0;
+  }
+
+  memset(buffer, 0, size < EXTRACT_BUFFER_SIZE ? size : EXTRACT_BUFFER_SIZE);
+
+  while(size > 0)
+  {
+    uint64_t chunk = size < EXTRACT_BUFFER_SIZE ? size : EXTRACT_BUFFER_SIZE;
+
+    if(write_full(out_fd, buffer, chunk) < 0)
+      return -1;
+
+    size -= chunk;
+  }
+
+  return 0;
+}
+
+int extract_partition(psv_image* in, const char* partition, int out_fd, extract_stats* stats)
+{
+  memset(stats, 0, sizeof(extract_stats));
+
+  if((in->header.flags & FLAG_DIGITAL) > 0)
+  {
+    fprintf(stderr, "only cart images have partitions\n");
+    return -1;
+  }
+
+  double start = get_time_seconds();
+
+  MBR mbr;
+  if(psv_image_read(in, 0, (char*)&mbr, sizeof(MBR)) < 0 || memcmp(mbr.header, SCEHeader, 0x20) != 0)
+  {
+    fprintf(stderr, "SCE header is invalid\n");
+    return -1;
+  }
+
+  int index = find_partition(&mbr, partition);
+  if(index < 0)
+  {
+    fprintf(stderr, "partition %s is not found\n", partition);
+    return -1;
+  }
+
+  const PartitionEntry* pe = &mbr.partitions[index];
+
+  stats->index = index;
+  stats->offset = (uint64_t)pe->partitionOffset * SD_DEFAULT_SECTOR_SIZE;
+  stats->size = (uint64_t)pe->partitionSize * SD_DEFAULT_SECTOR_SIZE;
+
+  if(stats->offset + stats->size > in->full_size)
+  {
+    fprintf(stderr, "partition %s ends after the end of the image\n", partition);
+    return -1;
+  }
+
+  char* buffer = (char*)malloc(EXTRACT_BUFFER_SIZE);
+  if(buffer == 0)
+  {
+    fprintf(stderr, "failed to allocate memory\n");
+    return -1;
+  }
+
+  uint64_t offset = stats->offset;
+  uint64_t size = stats->size;
+  int res = 0;
+
+  if((in->header.flags & (FLAG_COMPRESSED | FLAG_SPARSE | FLAG_CHUNKED)) == 0)
+  {
+    //raw or trimmed image stores the partition as is up to the stored size
+    uint64_t stored = offset < in->stored_size ? in->stored_size - offset : 0;
+    if(stored > size)
+      stored = size;
+
+    int64_t copied = copy_in_kernel(in->fd, in->data_offset + offset, out_fd, stored);
+    if(copied < 0)
+    {
+      fprintf(stderr, "failed to copy partition: %s\n", strerror(errno));
+      res = -1;
+    }
+    else
+    {
+      stats->kernel_bytes = copied;
+      offset += copied;
+      size -= copied;
+      stored -= copied;
+
+      res = copy_buffered(in, offset, out_fd, stored, buffer);
+
+      if(res == 0)
+      {
+        stats->zero_bytes = size - stored;
+        res = write_zeros(out_fd, size - stored, buffer);
+        if(res < 0)
+          fprintf(stderr, "failed to write output: %s\n", strerror(errno));
+      }
+    }
+  }
+  else
+  {
+    res = copy_buffered(in, offset, out_fd, size, buffer);
+  }
+
+  free(buffer);
+
+  stats->seconds = get_time_seconds() - start;
+
+  return res;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "psv_image.h"
+
+//size of buffer that is used when data can not be copied by the kernel
+#define EXTRACT_BUFFER_SIZE (8 * 1024 * 1024)
+
+typedef struct extract_stats
+{
+  uint32_t index;         //index of partition entry in MBR
+  uint64_t offset;        //offset of the partition in the image
+  uint64_t size;
+  uint64_t kernel_bytes;  //bytes copied by copy_file_range or sendfile without passing through user memory
+  uint64_t zero_bytes;    //trimmed tail of the partition that is not stored in the image
+  double seconds;
+} extract_stats;
+
+//returns index of partition entry in MBR. partition is given by name (gro0, grw0, cardsExt) or by index of the entry
+int find_partition(const MBR* mbr, const char* partition);
+
+//writes partition of cart image of any layout to out_fd. out_fd can be a pipe.
+//data of raw and trimmed images is copied by the kernel where possible, other layouts are streamed through psv_image_read
+int extract_partition(psv_image* in, const char* partition, int out_fd, extract_stats* stats);
@@ -0,0 +1,1813 @@
+/* main.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "psv_image.h"
+#include "compress.h"
+#include "dictionary.h"
+#include "sparsify.h"
+#include "dedup.h"
+#include "extract.h"
+#include "convert.h"
+#include "verify.h"
+#include "dump_pipeline.h"
+#include "dump_journal.h"
+#include "hash_tree.h"
+#include "partition_map.h"
+#include "sfo_parser.h"
+#include "kernel_shim.h"
+
+int get_default_thread_count()
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+char g_dictionary[COMPRESSION_MAX_DICTIONARY_SIZE];
+
+int cmd_compress(int argc, char* argv[])
+{
+  compress_options opts;
+  memset(&opts, 0, sizeof(compress_options));
+  opts.block_size = COMPRESS_DEFAULT_BLOCK_SIZE;
+  opts.n_threads = get_default_thread_count();
+  opts.acceleration = 1;
+
+  int c;
+  while((c = getopt(argc, argv, "b:t:a:D:S")) != -1)
+  {
+    switch(c)
+    {
+      case 'D':
+        if(load_dictionary(optarg, g_dictionary, &opts.dictionary_size) < 0)
+          return -1;
+        opts.dictionary = g_dictionary;
+        break;
+      case 'S':
+        opts.shared_dictionary = 1;
+        break;
+      case 'b':
+        opts.block_size = strtoul(optarg, 0, 0);
+        break;
+      case 't':
+        opts.n_threads = atoi(optarg);
+        break;
+      case 'a':
+        opts.acceleration = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 2)
+  {
+    fprintf(stderr, "usage: psvtool compress [-b block_size] [-t threads] [-a acceleration] [-D dictionary.dic [-S]] <input.psv> <output.psv>\n");
+    return -1;
+  }
+
+  if(opts.shared_dictionary > 0 && opts.dictionary == 0)
+  {
+    fprintf(stderr, "shared dictionary requires -D\n");
+    return -1;
+  }
+
+  psv_image in;
+  if(psv_image_open(&in, argv[optind]) < 0)
+    return -1;
+
+  int out_fd = open(argv[optind + 1], O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(out_fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", argv[optind + 1], strerror(errno));
+    psv_image_close(&in);
+    return -1;
+  }
+
+  compress_stats stats;
+  int res = compress_image(&in, out_fd, &opts, &stats);
+
+  if(close(out_fd) < 0)
+    res = -1;
+
+  psv_image_close(&in);
+
+  if(res < 0)
+  {
+    unlink(argv[optind + 1]);
+    return -1;
+  }
+
+  printf("%llu -> %llu bytes (%.1f%%) in %.2f s, %.1f MB/s\n",
+    (unsigned long long)stats.in_bytes, (unsigned long long)stats.out_bytes,
+    stats.in_bytes > 0 ? 100.0 * stats.out_bytes / stats.in_bytes : 0.0,
+    stats.seconds, stats.in_bytes / stats.seconds / 1e6);
+
+  if(opts.shared_dictionary > 0)
+  {
+    uint8_t hash[0x20];
+    get_dictionary_hash(opts.dictionary, opts.dictionary_size, hash);
+
+    char dict_path[PATH_MAX];
+    get_dictionary_path(argv[optind + 1], hash, dict_path, PATH_MAX);
+
+    printf("dictionary is not embedded. it must be available as %s\n", dict_path);
+  }
+
+  return 0;
+}
+
+int cmd_sparsify(int argc, char* argv[])
+{
+  uint32_t block_size = SPARSIFY_DEFAULT_BLOCK_SIZE;
+
+  int c;
+  while((c = getopt(argc, argv, "b:")) != -1)
+  {
+    switch(c)
+    {
+      case 'b':
+        block_size = strtoul(optarg, 0, 0);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 2)
+  {
+    fprintf(stderr, "usage: psvtool sparsify [-b block_size] <input.psv> <output.psv>\n");
+    return -1;
+  }
+
+  psv_image in;
+  if(psv_image_open(&in, argv[optind]) < 0)
+    return -1;
+
+  int out_fd = open(argv[optind + 1], O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(out_fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", argv[optind + 1], strerror(errno));
+    psv_image_close(&in);
+    return -1;
+  }
+
+  sparsify_stats stats;
+  int res = sparsify_image(&in, out_fd, block_size, &stats);
+
+  if(close(out_fd) < 0)
+    res = -1;
+
+  psv_image_close(&in);
+
+  if(res < 0)
+  {
+    unlink(argv[optind + 1]);
+    return -1;
+  }
+
+  printf("%llu -> %llu bytes (%.1f%%), %u of %u blocks are zero, in %.2f s\n",
+    (unsigned long long)stats.in_bytes, (unsigned long long)stats.out_bytes,
+    stats.in_bytes > 0 ? 100.0 * stats.out_bytes / stats.in_bytes : 0.0,
+    stats.n_zero_blocks, stats.n_blocks, stats.seconds);
+
+  return 0;
+}
+
+//writes partition of the image to file or to stdout if output is -
+int cmd_extract(int argc, char* argv[])
+{
+  const char* partition = "gro0";
+
+  int c;
+  while((c = getopt(argc, argv, "p:")) != -1)
+  {
+    switch(c)
+    {
+      case 'p':
+        partition = optarg;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 2)
+  {
+    fprintf(stderr, "usage: psvtool extract [-p gro0|grw0|cardsExt|entry_index] <input.psv> <output.bin|->\n");
+    return -1;
+  }
+
+  const char* out_path = argv[optind + 1];
+  int to_stdout = strcmp(out_path, "-") == 0;
+
+  psv_image in;
+  if(psv_image_open(&in, argv[optind]) < 0)
+    return -1;
+
+  int out_fd = to_stdout > 0 ? STDOUT_FILENO : open(out_path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(out_fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", out_path, strerror(errno));
+    psv_image_close(&in);
+    return -1;
+  }
+
+  extract_stats stats;
+  int res = extract_partition(&in, partition, out_fd, &stats);
+
+  if(to_stdout == 0 && close(out_fd) < 0)
+    res = -1;
+
+  psv_image_close(&in);
+
+  if(res < 0)
+  {
+    if(to_stdout == 0)
+      unlink(out_path);
+    return -1;
+  }
+
+  //summary goes to stderr so that it does not mix with partition data written to stdout
+  fprintf(to_stdout > 0 ? stderr : stdout, "partition %u at 0x%llx: %llu bytes (%llu copied by kernel, %llu trimmed zeros) in %.2f s, %.1f MB/s\n",
+    stats.index, (unsigned long long)stats.offset, (unsigned long long)stats.size,
+    (unsigned long long)stats.kernel_bytes, (unsigned long long)stats.zero_bytes,
+    stats.seconds, stats.seconds > 0 ? stats.size / stats.seconds / 1e6 : 0.0);
+
+  return 0;
+}
+
+//output must not be the input. it is truncated before the input is read
+int convert_one(const char* in_path, const char* out_path, const convert_options* opts)
+{
+  struct stat in_st;
+  struct stat out_st;
+  if(stat(in_path, &in_st) == 0 && stat(out_path, &out_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino)
+  {
+    fprintf(stderr, "%s: output is the same file as input\n", out_path);
+    return -1;
+  }
+
+  int out_fd = open(out_path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+  if(out_fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", out_path, strerror(errno));
+    return -1;
+  }
+
+  convert_stats stats;
+  int res = convert_image(in_path, out_fd, opts, &stats);
+
+  if(close(out_fd) < 0)
+    res = -1;
+
+  if(res < 0)
+  {
+    unlink(out_path);
+    return -1;
+  }
+
+  printf("%s: %llu -> %llu bytes (%.1f%%), %llu of %llu blocks are zero, in %.2f s, %.1f MB/s%s\n", out_path,
+    (unsigned long long)stats.in_bytes, (unsigned long long)stats.out_bytes,
+    stats.in_bytes > 0 ? 100.0 * stats.out_bytes / stats.in_bytes : 0.0,
+    (unsigned long long)stats.n_zero_blocks, (unsigned long long)stats.n_blocks,
+    stats.seconds, stats.seconds > 0 ? stats.in_bytes / stats.seconds / 1e6 : 0.0,
+    stats.hash_added > 0 ? ", sha256 added" : "");
+
+  return 0;
+}
+
+//converts one image into output file or many images into output directory under the same names
+int cmd_convert(int argc, char* argv[])
+{
+  convert_options opts;
+  memset(&opts, 0, sizeof(convert_options));
+  opts.layout = -1;
+  opts.n_threads = get_default_thread_count();
+  opts.acceleration = 1;
+
+  int c;
+  while((c = getopt(argc, argv, "l:b:t:a:")) != -1)
+  {
+    switch(c)
+    {
+      case 'l':
+        opts.layout = get_convert_layout(optarg);
+        break;
+      case 'b':
+        opts.block_size = strtoul(optarg, 0, 0);
+        break;
+      case 't':
+        opts.n_threads = atoi(optarg);
+        break;
+      case 'a':
+        opts.acceleration = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  int n_inputs = argc - optind - 1;
+
+  if(opts.layout < 0 || n_inputs < 1)
+  {
+    fprintf(stderr, "usage: psvtool convert -l raw|trimmed|sparse|compressed [-b block_size] [-t threads] [-a acceleration] <input.psv> <output.psv>\n"
+                    "       psvtool convert -l raw|trimmed|sparse|compressed [-b block_size] [-t threads] [-a acceleration] <input.psv>... <output directory>\n");
+    return -1;
+  }
+
+  const char* out = argv[argc - 1];
+
+  struct stat st;
+  int out_is_dir = stat(out, &st) == 0 && S_ISDIR(st.st_mode);
+
+  if(out_is_dir == 0)
+  {
+    if(n_inputs > 1)
+    {
+      fprintf(stderr, "%s: is not a directory\n", out);
+      return -1;
+    }
+
+    return convert_one(argv[optind], out, &opts);
+  }
+
+  //images are converted one after another. each of them already uses all threads
+  int n_failed = 0;
+
+  for(int i = 0; i < n_inputs; i++)
+  {
+    const char* in_path = argv[optind + i];
+    const char* name = strrchr(in_path, '/');
+    name = name != 0 ? name + 1 : in_path;
+
+    char out_path[PATH_MAX];
+    if(snprintf(out_path, PATH_MAX, "%s/%s", out, name) >= PATH_MAX || convert_one(in_path, out_path, &opts) < 0)
+    {
+      fprintf(stderr, "%s: conversion failed\n", in_path);
+      n_failed++;
+    }
+  }
+
+  return n_failed > 0 ? -1 : 0;
+}
+
+int cmd_dedup(int argc, char* argv[])
+{
+  dedup_options opts;
+  memset(&opts, 0, sizeof(dedup_options));
+  opts.n_threads = get_default_thread_count();
+
+  int c;
+  while((c = getopt(argc, argv, "c:t:")) != -1)
+  {
+    switch(c)
+    {
+      case 'c':
+        opts.chunk_size = strtoul(optarg, 0, 0);
+        break;
+      case 't':
+        opts.n_threads = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind < 2)
+  {
+    fprintf(stderr, "usage: psvtool dedup [-c chunk_size] [-t threads] <pool directory> <input.psv>...\n");
+    return -1;
+  }
+
+  dedup_stats stats;
+  if(dedup_images(argv[optind], (const char* const*)(argv + optind + 1), argc - optind - 1, &opts, &stats) < 0)
+    return -1;
+
+  printf("%llu chunks, %llu zero, %llu duplicate. %llu -> %llu new bytes in %.2f s, %.1f MB/s\n",
+    (unsigned long long)stats.n_chunks, (unsigned long long)stats.n_zero_chunks, (unsigned long long)stats.n_dup_chunks,
+    (unsigned long long)stats.in_bytes, (unsigned long long)stats.new_bytes,
+    stats.seconds, stats.in_bytes / stats.seconds / 1e6);
+
+  return 0;
+}
+
+//compresses image to /dev/null with increasing number of threads
+int cmd_bench_compress(int argc, char* argv[])
+{
+  compress_options opts;
+  memset(&opts, 0, sizeof(compress_options));
+  opts.block_size = COMPRESS_DEFAULT_BLOCK_SIZE;
+  opts.n_threads = 1;
+  opts.acceleration = 1;
+
+  int max_threads = get_default_thread_count();
+
+  int c;
+  while((c = getopt(argc, argv, "b:t:a:D:")) != -1)
+  {
+    switch(c)
+    {
+      case 'D':
+        if(load_dictionary(optarg, g_dictionary, &opts.dictionary_size) < 0)
+          return -1;
+        opts.dictionary = g_dictionary;
+        break;
+      case 'b':
+        opts.block_size = strtoul(optarg, 0, 0);
+        break;
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+      case 'a':
+        opts.acceleration = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 1)
+  {
+    fprintf(stderr, "usage: psvtool bench-compress [-b block_size] [-t max_threads] [-a acceleration] [-D dictionary.dic] <input.psv>\n");
+    return -1;
+  }
+
+  psv_image in;
+  if(psv_image_open(&in, argv[optind]) < 0)
+    return -1;
+
+  int out_fd = open("/dev/null", O_WRONLY);
+  if(out_fd < 0)
+  {
+    psv_image_close(&in);
+    return -1;
+  }
+
+  printf("%8s %12s %12s %8s\n", "threads", "MB/s", "MB/s/thread", "ratio");
+
+  int res = 0;
+
+  for(int n = 1; n <= max_threads && res == 0; n = (n * 2 <= max_threads || n == max_threads) ? n * 2 : max_threads)
+  {
+    opts.n_threads = n;
+
+    compress_stats stats;
+    res = compress_image(&in, out_fd, &opts, &stats);
+    if(res < 0)
+      break;
+
+    double mbps = stats.in_bytes / stats.seconds / 1e6;
+    printf("%8d %12.1f %12.1f %7.1f%%\n", n, mbps, mbps / n, 100.0 * stats.out_bytes / stats.in_bytes);
+  }
+
+  close(out_fd);
+  psv_image_close(&in);
+
+  return res;
+}
+
+//trains dictionary on blocks sampled from set of images
+int cmd_train_dict(int argc, char* argv[])
+{
+  train_options opts;
+  opts.dictionary_size = COMPRESSION_MAX_DICTIONARY_SIZE;
+  opts.sample_size = DICTIONARY_DEFAULT_SAMPLE_SIZE;
+  opts.sample_budget = DICTIONARY_DEFAULT_SAMPLE_BUDGET;
+
+  const char* out_path = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "s:b:m:o:")) != -1)
+  {
+    switch(c)
+    {
+      case 's':
+        opts.dictionary_size = strtoul(optarg, 0, 0);
+        break;
+      case 'b':
+        opts.sample_size = strtoul(optarg, 0, 0);
+        break;
+      case 'm':
+        opts.sample_budget = strtoull(optarg, 0, 0) * 1024 * 1024;
+        break;
+      case 'o':
+        out_path = optarg;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind < 1 || opts.dictionary_size == 0 || opts.dictionary_size > COMPRESSION_MAX_DICTIONARY_SIZE || opts.sample_size == 0)
+  {
+    fprintf(stderr, "usage: psvtool train-dict [-s dictionary_size] [-b block_size] [-m samples_mb] [-o output.dic] <input.psv>...\n");
+    return -1;
+  }
+
+  uint32_t dict_size = 0;
+  if(train_dictionary((const char* const*)argv + optind, argc - optind, &opts, g_dictionary, &dict_size) < 0)
+    return -1;
+
+  uint8_t hash[0x20];
+  get_dictionary_hash(g_dictionary, dict_size, hash);
+
+  //by default dictionary is named so that it can be used as shared dictionary
+  char dict_path[PATH_MAX];
+  if(out_path == 0)
+  {
+    get_dictionary_path(0, hash, dict_path, PATH_MAX);
+    out_path = dict_path;
+  }
+
+  if(save_dictionary(out_path, g_dictionary, dict_size) < 0)
+    return -1;
+
+  printf("%u bytes dictionary written to %s\n", dict_size, out_path);
+
+  return 0;
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+  return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+//adds path of the file or paths of all .psv files in the directory. list is grown as needed
+int collect_psv_paths(const char* path, char*** paths, int* n_paths)
+{
+  struct stat st;
+  if(stat(path, &st) < 0)
+  {
+    fprintf(stderr, "%s: failed to stat: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if(!S_ISDIR(st.st_mode))
+  {
+    char** list = (char**)realloc(*paths, (*n_paths + 1) * sizeof(char*));
+    if(list == 0)
+      return -1;
+
+    *paths = list;
+    (*paths)[(*n_paths)++] = strdup(path);
+    return 0;
+  }
+
+  DIR* dir = opendir(path);
+  if(dir == 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int first = *n_paths;
+  int res = 0;
+
+  struct dirent* entry;
+  while((entry = readdir(dir)) != 0 && res == 0)
+  {
+    int length = strlen(entry->d_name);
+    if(length < 4 || strcasecmp(entry->d_name + length - 4, ".psv") != 0)
+      continue;
+
+    char** list = (char**)realloc(*paths, (*n_paths + 1) * sizeof(char*));
+    char* full_path = (char*)malloc(strlen(path) + length + 2);
+
+    if(list == 0 || full_path == 0)
+    {
+      if(list != 0)
+        *paths = list;
+      free(full_path);
+      res = -1;
+      break;
+    }
+
+    sprintf(full_path, "%s/%s", path, entry->d_name);
+
+    *paths = list;
+    (*paths)[(*n_paths)++] = full_path;
+  }
+
+  closedir(dir);
+
+  qsort(*paths + first, *n_paths - first, sizeof(char*), compare_paths);
+
+  return res;
+}
+
+void free_psv_paths(char** paths, int n_paths)
+{
+  for(int i = 0; i < n_paths; i++)
+    free(paths[i]);
+
+  free(paths);
+}
+
+//checks sha256 in the header of images against their data
+int cmd_verify(int argc, char* argv[])
+{
+  int n_threads = get_default_thread_count();
+
+  int c;
+  while((c = getopt(argc, argv, "t:")) != -1)
+  {
+    switch(c)
+    {
+      case 't':
+        n_threads = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind < 1)
+  {
+    fprintf(stderr, "usage: psvtool verify [-t threads] <input.psv | directory>...\n");
+    return -1;
+  }
+
+  char** paths = 0;
+  int n_paths = 0;
+
+  for(int i = optind; i < argc; i++)
+  {
+    if(collect_psv_paths(argv[i], &paths, &n_paths) < 0)
+    {
+      free_psv_paths(paths, n_paths);
+      return -1;
+    }
+  }
+
+  double start = get_time_seconds();
+
+  int n_failed = verify_images((const char* const*)paths, n_paths, n_threads);
+
+  if(n_paths > 1)
+    printf("%d of %d images failed in %.2f s\n", n_failed, n_paths, get_time_seconds() - start);
+
+  free_psv_paths(paths, n_paths);
+
+  return n_failed > 0 ? -1 : 0;
+}
+
+//checks range of image data against hash tree of the image. reads only chunks that overlap the range
+int cmd_verify_range(int argc, char* argv[])
+{
+  int n_threads = get_default_thread_count();
+
+  int c;
+  while((c = getopt(argc, argv, "t:")) != -1)
+  {
+    switch(c)
+    {
+      case 't':
+        n_threads = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 3)
+  {
+    fprintf(stderr, "usage: psvtool verify-range [-t threads] <input.psv> <offset> <size>\n");
+    return -1;
+  }
+
+  const char* path = argv[optind];
+  uint64_t offset = strtoull(argv[optind + 1], 0, 0);
+  uint64_t size = strtoull(argv[optind + 2], 0, 0);
+
+  verify_range_result result;
+  if(verify_image_range(path, offset, size, n_threads, &result) < 0)
+  {
+    printf("%s: FAILED\n", path);
+    return -1;
+  }
+
+  int res = 0;
+
+  switch(result.status)
+  {
+    case VERIFY_OK:
+      printf("%s: OK (%u chunks in %.2f s)\n", path, result.n_chunks, result.seconds);
+      break;
+    case VERIFY_NO_TREE:
+      printf("%s: image does not have hash tree\n", path);
+      res = -1;
+      break;
+    default:
+      printf("%s: HASH MISMATCH\n", path);
+      res = -1;
+      break;
+  }
+
+  for(uint32_t i = 0; i < result.n_bad_chunks; i++)
+    printf("  bad chunk %u\n", result.bad_chunks[i]);
+
+  if(result.status == VERIFY_MISMATCH && result.n_bad_chunks == 0)
+    printf("  hash tree is damaged\n");
+
+  free(result.bad_chunks);
+
+  return res;
+}
+
+//dumps file that stands in for the card device through driver dump pipeline with increasing number of buffers.
+//bandwidth of card, sha256 engine and memory card can be emulated to see how stages overlap.
+//with -s auto chunk size is probed the same way as the driver does it
+int cmd_bench_dump(int argc, char* argv[])
+{
+  uint32_t chunk_sectors = 0x10;
+  int probe = 0;
+  double read_latency = 0;
+  double read_bandwidth = 0;
+  double hash_bandwidth = 0;
+  double write_bandwidth = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "s:l:r:h:w:")) != -1)
+  {
+    switch(c)
+    {
+      case 's':
+        probe = strcmp(optarg, "auto") == 0;
+        chunk_sectors = probe > 0 ? 0 : strtoul(optarg, 0, 0);
+        break;
+      case 'l':
+        read_latency = atof(optarg) / 1e6;
+        break;
+      case 'r':
+        read_bandwidth = atof(optarg) * 1e6;
+        break;
+      case 'h':
+        hash_bandwidth = atof(optarg) * 1e6;
+        break;
+      case 'w':
+        write_bandwidth = atof(optarg) * 1e6;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind < 1 || argc - optind > 2 || (chunk_sectors == 0 && probe == 0) || chunk_sectors > DUMP_PIPELINE_MAX_CHUNK_SECTORS)
+  {
+    fprintf(stderr, "usage: psvtool bench-dump [-s sectors_per_chunk|auto] [-l card_latency_us] [-r card_MBps] [-h sha256_MBps] [-w memcard_MBps] <card.bin> [output.bin]\n");
+    return -1;
+  }
+
+  const char* dev_path = argv[optind];
+  const char* out_path = (argc - optind == 2) ? argv[optind + 1] : "/dev/null";
+
+  struct stat st;
+  if(stat(dev_path, &st) < 0)
+  {
+    fprintf(stderr, "%s: failed to stat: %s\n", dev_path, strerror(errno));
+    return -1;
+  }
+
+  kernel_shim_set_sha256_bandwidth(hash_bandwidth);
+
+  if(probe > 0)
+  {
+    SceUID dev_fd = ksceIoOpen(dev_path, SCE_O_RDONLY, 0);
+    if(dev_fd < 0)
+    {
+      fprintf(stderr, "%s: failed to open\n", dev_path);
+      return -1;
+    }
+
+    kernel_shim_set_io_latency(dev_fd, read_latency);
+    kernel_shim_set_io_bandwidth(dev_fd, read_bandwidth);
+
+    chunk_sectors = dump_pipeline_probe_chunk_sectors(dev_fd, st.st_size / SD_DEFAULT_SECTOR_SIZE);
+
+    ksceIoClose(dev_fd);
+
+    if(chunk_sectors == 0)
+    {
+      fprintf(stderr, "%s: chunk size probe failed\n", dev_path);
+      return -1;
+    }
+
+    printf("probed chunk size: 0x%x sectors\n", chunk_sectors);
+  }
+
+  printf("%8s %10s %8s\n", "buffers", "MB/s", "sha256");
+
+  char first_digest[0x20];
+  int res = 0;
+
+  for(uint32_t n_buffers = 1; n_buffers <= DUMP_PIPELINE_MAX_BUFFERS && res == 0; n_buffers *= 2)
+  {
+    SceUID dev_fd = ksceIoOpen(dev_path, SCE_O_RDONLY, 0);
+    SceUID out_fd = ksceIoOpen(out_path, SCE_O_CREAT | SCE_O_TRUNC | SCE_O_WRONLY, 0666);
+
+    if(dev_fd < 0 || out_fd < 0)
+    {
+      fprintf(stderr, "failed to open files\n");
+      res = -1;
+    }
+    else
+    {
+      kernel_shim_set_io_latency(dev_fd, read_latency);
+      kernel_shim_set_io_bandwidth(dev_fd, read_bandwidth);
+      kernel_shim_set_io_bandwidth(out_fd, write_bandwidth);
+
+      dump_pipeline_params params;
+      params.dev_fd = dev_fd;
+      params.out_fd = out_fd;
+      params.nSectors = st.st_size / SD_DEFAULT_SECTOR_SIZE;
+      params.chunk_sectors = chunk_sectors;
+      params.n_buffers = n_buffers;
+      params.progress = 0;
+      params.sha256_ctx = 0;
+      params.checkpoint_sectors = 0;
+      params.checkpoint = 0;
+      params.block_size = 0;
+      params.offsets = 0;
+      params.trim = 0;
+      params.zero_sectors = 0;
+      params.start_sector = 0;
+      params.leaf_sectors = 0;
+      params.leaves = 0;
+      params.leaves_offset = 0;
+      params.leaf_ctx = 0;
+      params.errors = 0;
+
+      char digest[0x20];
+      double start = get_time_seconds();
+
+      if(dump_pipeline_run(&params, digest, 0) != DUMP_PIPELINE_DONE)
+      {
+        fprintf(stderr, "dump failed\n");
+        res = -1;
+      }
+      else
+      {
+        double seconds = get_time_seconds() - start;
+
+        //hash must not depend on number of buffers
+        if(n_buffers == 1)
+          memcpy(first_digest, digest, 0x20);
+
+        printf("%8u %10.1f %8s\n", n_buffers, (double)params.nSectors * SD_DEFAULT_SECTOR_SIZE / seconds / 1e6,
+          memcmp(first_digest, digest, 0x20) == 0 ? "same" : "DIFFERS");
+      }
+    }
+
+    if(dev_fd >= 0)
+      ksceIoClose(dev_fd);
+    if(out_fd >= 0)
+      ksceIoClose(out_fd);
+  }
+
+  return res;
+}
+
+//fake dump stops the process when this many sectors are written. emulates power loss
+uint32_t g_fake_dump_kill_sectors = 0;
+
+uint32_t g_fake_dump_start_sectors = 0;
+SceUID g_fake_dump_journal_fd = -1;
+dump_journal g_fake_dump_journal;
+
+//same capacity as error map of the driver
+#define FAKE_DUMP_ERROR_MAP_MAX_RANGES 0x100
+
+error_range_t g_fake_dump_error_ranges[FAKE_DUMP_ERROR_MAP_MAX_RANGES];
+dump_error_map g_fake_dump_error_map;
+
+int fake_dump_progress(uint32_t done_sectors, uint32_t total_sectors)
+{
+  if(g_fake_dump_kill_sectors > 0 && g_fake_dump_start_sectors + done_sectors >= g_fake_dump_kill_sectors)
+  {
+    printf("interrupted at sector 0x%x\n", g_fake_dump_start_sectors + done_sectors);
+    fflush(stdout);
+    _exit(2);
+  }
+
+  return 0;
+}
+
+int fake_dump_checkpoint(uint32_t done_sectors, uint32_t zero_sectors, const SceSha256Context* sha256_ctx, const SceSha256Context* leaf_ctx)
+{
+  g_fake_dump_journal.done_sectors = g_fake_dump_start_sectors + done_sectors;
+  g_fake_dump_journal.zero_sectors = zero_sectors;
+  memcpy(&g_fake_dump_journal.sha256_ctx, sha256_ctx, sizeof(SceSha256Context));
+  memcpy(&g_fake_dump_journal.leaf_ctx, leaf_ctx, sizeof(SceSha256Context));
+
+  g_fake_dump_journal.n_error_ranges = g_fake_dump_error_map.n_ranges;
+  g_fake_dump_journal.bad_sectors = g_fake_dump_error_map.bad_sectors;
+  g_fake_dump_journal.error_flags = g_fake_dump_error_map.flags;
+
+  return save_dump_journal(g_fake_dump_journal_fd, &g_fake_dump_journal);
+}
+
+//writes header area of fake dump the same way as the driver. keys are not known and are left zero
+int write_fake_dump_header(int out_fd, uint32_t flags, const char* digest, const compression_header_t* ch, const hash_tree_header_t* th, const dump_error_map* errors, uint64_t image_size, uint64_t data_offset)
+{
+  psv_file_header_v1 header;
+  memset(&header, 0, sizeof(psv_file_header_v1));
+  header.magic = PSV_MAGIC;
+  header.version = PSV_VERSION_V1;
+  header.flags = flags | FLAG_HASH_TREE;
+  if(digest != 0)
+    memcpy(header.hash, digest, 0x20);
+  header.image_size = image_size;
+  header.image_offset_sector = data_offset / SD_DEFAULT_SECTOR_SIZE;
+
+  char opt_headers[sizeof(compression_header_t) + sizeof(hash_tree_header_t) + sizeof(error_map_header_t)];
+  uint32_t opt_headers_size = 0;
+
+  if(ch != 0)
+  {
+    memcpy(opt_headers, ch, sizeof(compression_header_t));
+    opt_headers_size += sizeof(compression_header_t);
+  }
+
+  memcpy(opt_headers + opt_headers_size, th, sizeof(hash_tree_header_t));
+  opt_headers_size += sizeof(hash_tree_header_t);
+
+  if(errors->bad_sectors > 0)
+  {
+    error_map_header_t eh;
+    memset(&eh, 0, sizeof(error_map_header_t));
+    eh.type = OPT_HEADER_TYPE_ERROR_MAP;
+    eh.flags = errors->flags;
+    eh.n_ranges = errors->n_ranges;
+    eh.bad_sectors = errors->bad_sectors;
+    eh.map_offset = errors->map_offset;
+
+    header.flags |= FLAG_ERROR_MAP;
+    memcpy(opt_headers + opt_headers_size, &eh, sizeof(error_map_header_t));
+    opt_headers_size += sizeof(error_map_header_t);
+  }
+
+  return psv_write_header_area(out_fd, &header, opt_headers, opt_headers_size);
+}
+
+//unreadable areas that can be given to fake dump
+#define FAKE_DUMP_MAX_FAULTS 0x10
+
+//dumps file that stands in for the card the same way as the driver does, including journal and hash tree.
+//zero tail of the card is trimmed same as in the driver. -k exits the process when given number of sectors is written,
+//so that running the command again continues from the journal.
+//-c writes compressed .psv with given block size instead. it is not journaled, same as in the driver.
+//-e makes sectors of the card unreadable and -E fails given fraction of reads once, to exercise read retries
+int cmd_fake_dump(int argc, char* argv[])
+{
+  uint32_t chunk_sectors = 0x10;
+  uint32_t journal_sectors = 0x8000;
+  uint32_t block_size = 0;
+  uint32_t tree_chunk_size = 0x100000;
+  double fault_rate = 0;
+
+  uint32_t fault_sectors[FAKE_DUMP_MAX_FAULTS];
+  uint32_t fault_counts[FAKE_DUMP_MAX_FAULTS];
+  int n_faults = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "s:j:k:c:t:e:E:")) != -1)
+  {
+    switch(c)
+    {
+      case 'e':
+      {
+        if(n_faults == FAKE_DUMP_MAX_FAULTS)
+          return -1;
+
+        char* end = 0;
+        fault_sectors[n_faults] = strtoul(optarg, &end, 0);
+        fault_counts[n_faults] = *end == ':' ? strtoul(end + 1, 0, 0) : 1;
+        n_faults++;
+        break;
+      }
+      case 'E':
+        fault_rate = atof(optarg);
+        break;
+      case 's':
+        chunk_sectors = strtoul(optarg, 0, 0);
+        break;
+      case 'c':
+        block_size = strtoul(optarg, 0, 0);
+        break;
+      case 'j':
+        journal_sectors = strtoul(optarg, 0, 0);
+        break;
+      case 'k':
+        g_fake_dump_kill_sectors = strtoul(optarg, 0, 0);
+        break;
+      case 't':
+        tree_chunk_size = strtoul(optarg, 0, 0);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 2 || chunk_sectors == 0 || chunk_sectors > DUMP_PIPELINE_MAX_CHUNK_SECTORS)
+  {
+    fprintf(stderr, "usage: psvtool fake-dump [-s sectors_per_chunk] [-j journal_sectors] [-k kill_at_sector] [-c block_size] [-t tree_chunk_size] [-e sector[:count]]... [-E fault_rate] <card.bin> <output.psv>\n");
+    return -1;
+  }
+
+  if(block_size > 0 && (block_size < COMPRESSION_MIN_BLOCK_SIZE || block_size > COMPRESSION_MAX_BLOCK_SIZE || (block_size % SD_DEFAULT_SECTOR_SIZE) != 0))
+  {
+    fprintf(stderr, "block size must be multiple of 0x%x in range 0x%x - 0x%x\n", SD_DEFAULT_SECTOR_SIZE, COMPRESSION_MIN_BLOCK_SIZE, COMPRESSION_MAX_BLOCK_SIZE);
+    return -1;
+  }
+
+  if(tree_chunk_size < HASH_TREE_MIN_CHUNK_SIZE || tree_chunk_size > HASH_TREE_MAX_CHUNK_SIZE || (tree_chunk_size % SD_DEFAULT_SECTOR_SIZE) != 0)
+  {
+    fprintf(stderr, "tree chunk size must be multiple of 0x%x in range 0x%x - 0x%x\n", SD_DEFAULT_SECTOR_SIZE, HASH_TREE_MIN_CHUNK_SIZE, HASH_TREE_MAX_CHUNK_SIZE);
+    return -1;
+  }
+
+  const char* dev_path = argv[optind];
+  const char* out_path = argv[optind + 1];
+
+  SceUID dev_fd = ksceIoOpen(dev_path, SCE_O_RDONLY, 0);
+  if(dev_fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open\n", dev_path);
+    return -1;
+  }
+
+  //first sector stands in for mbr and card keys
+  char mbr[SD_DEFAULT_SECTOR_SIZE];
+  SceOff size = ksceIoLseek(dev_fd, 0, SEEK_END);
+
+  if(size < SD_DEFAULT_SECTOR_SIZE || ksceIoPread(dev_fd, mbr, SD_DEFAULT_SECTOR_SIZE, 0) != SD_DEFAULT_SECTOR_SIZE)
+  {
+    fprintf(stderr, "%s: failed to read\n", dev_path);
+    ksceIoClose(dev_fd);
+    return -1;
+  }
+
+  uint8_t card_id[0x20];
+  ksceSha256Digest(mbr, SD_DEFAULT_SECTOR_SIZE, (char*)card_id);
+
+  uint32_t nSectors = size / SD_DEFAULT_SECTOR_SIZE;
+
+  for(int i = 0; i < n_faults; i++)
+    kernel_shim_add_io_fault(dev_fd, (SceOff)fault_sectors[i] * SD_DEFAULT_SECTOR_SIZE, (SceOff)fault_counts[i] * SD_DEFAULT_SECTOR_SIZE);
+
+  kernel_shim_set_io_fault_rate(dev_fd, fault_rate);
+
+  //hash tree and error map are stored between header sector and image data
+  hash_tree_header_t th;
+  memset(&th, 0, sizeof(hash_tree_header_t));
+  th.type = OPT_HEADER_TYPE_HASH_TREE;
+  th.chunk_size = tree_chunk_size;
+  th.uncompressed_size = (uint64_t)nSectors * SD_DEFAULT_SECTOR_SIZE;
+  th.n_chunks = (th.uncompressed_size + tree_chunk_size - 1) / tree_chunk_size;
+  th.tree_offset = SD_DEFAULT_SECTOR_SIZE;
+
+  hash_tree_layout layout;
+  hash_tree_get_layout(th.n_chunks, &layout);
+  th.n_nodes = layout.n_nodes;
+
+  uint64_t tree_size = (uint64_t)th.n_nodes * HASH_TREE_NODE_SIZE;
+  uint64_t map_size = FAKE_DUMP_ERROR_MAP_MAX_RANGES * sizeof(error_range_t);
+
+  memset(&g_fake_dump_error_map, 0, sizeof(dump_error_map));
+  g_fake_dump_error_map.ranges = g_fake_dump_error_ranges;
+  g_fake_dump_error_map.max_ranges = FAKE_DUMP_ERROR_MAP_MAX_RANGES;
+  g_fake_dump_error_map.map_offset = th.tree_offset + (tree_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+
+  uint64_t data_offset = g_fake_dump_error_map.map_offset + (map_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+
+  uint8_t* nodes = (uint8_t*)calloc(th.n_nodes, HASH_TREE_NODE_SIZE);
+
+  char journal_path[DUMP_JOURNAL_MAX_PATH];
+  get_dump_journal_path(out_path, journal_path, DUMP_JOURNAL_MAX_PATH);
+
+  SceUID out_fd = -1;
+
+  compression_header_t ch;
+  uint64_t* offsets = 0;
+
+  if(block_size > 0)
+  {
+    ksceIoRemove(journal_path);
+    init_dump_journal(&g_fake_dump_journal, card_id, nSectors);
+
+    memset(&ch, 0, sizeof(compression_header_t));
+    ch.type = OPT_HEADER_TYPE_COMPRESSION;
+    ch.compression_algorithm = COMPRESSION_ALGORITHM_LZ4;
+    ch.uncompressed_size = (uint64_t)nSectors * SD_DEFAULT_SECTOR_SIZE;
+    ch.block_size = block_size;
+    ch.n_blocks = (ch.uncompressed_size + block_size - 1) / block_size;
+
+    offsets = (uint64_t*)calloc(ch.n_blocks + 1, sizeof(uint64_t));
+    offsets[0] = (ch.n_blocks + 1) * sizeof(uint64_t);
+
+    //chunk must consist of whole blocks
+    uint32_t block_sectors = block_size / SD_DEFAULT_SECTOR_SIZE;
+    chunk_sectors = ((chunk_sectors + block_sectors - 1) / block_sectors) * block_sectors;
+
+    ksceIoLseek(dev_fd, 0, SEEK_SET);
+    out_fd = ksceIoOpen(out_path, SCE_O_CREAT | SCE_O_TRUNC | SCE_O_WRONLY, 0666);
+    if(out_fd >= 0)
+      ksceIoLseek(out_fd, data_offset + offsets[0], SEEK_SET);
+  }
+  else
+  {
+    out_fd = open_dump_output(out_path, dev_fd, data_offset, card_id, nSectors, &g_fake_dump_journal);
+
+    //header of unfinished dump already has layout of the image
+    if(out_fd >= 0 && g_fake_dump_journal.done_sectors == 0)
+    {
+      write_fake_dump_header(out_fd, 0, 0, 0, &th, &g_fake_dump_error_map, th.uncompressed_size, data_offset);
+      ksceIoLseek(out_fd, data_offset, SEEK_SET);
+    }
+  }
+
+  if(out_fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open\n", out_path);
+    ksceIoClose(dev_fd);
+    free(offsets);
+    free(nodes);
+    return -1;
+  }
+
+  g_fake_dump_start_sectors = g_fake_dump_journal.done_sectors;
+  if(g_fake_dump_start_sectors > 0)
+    printf("continuing at sector 0x%x\n", g_fake_dump_start_sectors);
+
+  //leaves of interrupted dump are read back from the output
+  uint32_t done_leaves = g_fake_dump_start_sectors / (tree_chunk_size / SD_DEFAULT_SECTOR_SIZE);
+  if(done_leaves > 0)
+    pread_full(out_fd, nodes, done_leaves * HASH_TREE_NODE_SIZE, th.tree_offset);
+
+  if(load_dump_errors(out_fd, &g_fake_dump_journal, &g_fake_dump_error_map) < 0)
+  {
+    fprintf(stderr, "%s: error map of interrupted dump is invalid\n", out_path);
+    ksceIoClose(out_fd);
+    ksceIoClose(dev_fd);
+    free(offsets);
+    free(nodes);
+    return -1;
+  }
+
+  if(block_size == 0)
+  {
+    g_fake_dump_journal_fd = open_dump_journal(journal_path);
+    if(g_fake_dump_journal_fd >= 0)
+      save_dump_journal(g_fake_dump_journal_fd, &g_fake_dump_journal);
+  }
+
+  dump_pipeline_params params;
+  params.dev_fd = dev_fd;
+  params.out_fd = out_fd;
+  params.nSectors = nSectors - g_fake_dump_start_sectors;
+  params.chunk_sectors = chunk_sectors;
+  params.n_buffers = DUMP_PIPELINE_DEFAULT_BUFFERS;
+  params.progress = fake_dump_progress;
+  params.sha256_ctx = &g_fake_dump_journal.sha256_ctx;
+  params.checkpoint_sectors = journal_sectors;
+  params.checkpoint = g_fake_dump_journal_fd >= 0 ? fake_dump_checkpoint : 0;
+  params.block_size = block_size;
+  params.offsets = offsets;
+  params.trim = block_size == 0;
+  params.zero_sectors = block_size == 0 ? g_fake_dump_journal.zero_sectors : 0;
+  params.start_sector = g_fake_dump_start_sectors;
+  params.leaf_sectors = tree_chunk_size / SD_DEFAULT_SECTOR_SIZE;
+  params.leaves = nodes;
+  params.leaves_offset = th.tree_offset;
+  params.leaf_ctx = &g_fake_dump_journal.leaf_ctx;
+  params.errors = &g_fake_dump_error_map;
+
+  char digest[0x20];
+  uint32_t zero_sectors = 0;
+  int res = dump_pipeline_run(&params, digest, &zero_sectors);
+
+  if(res == DUMP_PIPELINE_DONE)
+  {
+    hash_tree_build(&layout, nodes);
+    memcpy(th.root, hash_tree_get_root(&layout, nodes), 0x20);
+
+    uint32_t flags = 0;
+    uint64_t image_size = (uint64_t)(nSectors - zero_sectors) * SD_DEFAULT_SECTOR_SIZE;
+
+    if(block_size > 0)
+    {
+      flags = FLAG_COMPRESSED;
+      image_size = offsets[ch.n_blocks];
+    }
+    else if(zero_sectors > 0)
+    {
+      flags = FLAG_TRIMMED;
+    }
+
+    if((block_size > 0 && pwrite_full(out_fd, offsets, (ch.n_blocks + 1) * sizeof(uint64_t), data_offset) < 0) ||
+       pwrite_full(out_fd, nodes, tree_size, th.tree_offset) < 0 ||
+       write_fake_dump_header(out_fd, flags, digest, block_size > 0 ? &ch : 0, &th, &g_fake_dump_error_map, image_size, data_offset) < 0)
+      res = DUMP_PIPELINE_ERROR;
+  }
+
+  if(res == DUMP_PIPELINE_DONE && block_size > 0)
+    printf("compressed to %.1f%%\n", 100.0 * (data_offset + offsets[ch.n_blocks]) / size);
+
+  if(res == DUMP_PIPELINE_DONE && zero_sectors > 0)
+    printf("trimmed 0x%x zero sectors, image size 0x%llx\n", zero_sectors, (unsigned long long)(nSectors - zero_sectors) * SD_DEFAULT_SECTOR_SIZE);
+
+  if(res == DUMP_PIPELINE_DONE && g_fake_dump_error_map.bad_sectors > 0)
+  {
+    printf("0x%x sectors can not be read%s\n", g_fake_dump_error_map.bad_sectors, (g_fake_dump_error_map.flags & ERROR_MAP_FLAG_INCOMPLETE) > 0 ? ", error map is incomplete" : "");
+
+    for(uint32_t i = 0; i < g_fake_dump_error_map.n_ranges; i++)
+      printf("  0x%x - 0x%x\n", g_fake_dump_error_map.ranges[i].sector, g_fake_dump_error_map.ranges[i].sector + g_fake_dump_error_map.ranges[i].n_sectors - 1);
+  }
+
+  if(g_fake_dump_journal_fd >= 0)
+    ksceIoClose(g_fake_dump_journal_fd);
+
+  ksceIoClose(out_fd);
+  ksceIoClose(dev_fd);
+  free(offsets);
+  free(nodes);
+
+  if(res != DUMP_PIPELINE_DONE)
+  {
+    fprintf(stderr, "dump failed\n");
+    return -1;
+  }
+
+  ksceIoRemove(journal_path);
+
+  for(int i = 0; i < 0x20; i++)
+    printf("%02x", (uint8_t)digest[i]);
+  printf("  %s\n", out_path);
+
+  return 0;
+}
+
+typedef struct read_request
+{
+  uint64_t sector;
+  uint32_t n_sectors;
+} read_request;
+
+//loads trace of "sector n_sectors" lines as recorded from emulate_read
+int load_trace(const char* path, read_request** trace, int* n_requests)
+{
+  FILE* fp = fopen(path, "r");
+  if(fp == 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  int capacity = 1024;
+  int n = 0;
+  read_request* reqs = (read_request*)malloc(capacity * sizeof(read_request));
+
+  unsigned long long sector = 0;
+  unsigned int n_sectors = 0;
+
+  while(reqs != 0 && fscanf(fp, "%lli %i", &sector, &n_sectors) == 2)
+  {
+    if(n == capacity)
+    {
+      capacity *= 2;
+      reqs = (read_request*)realloc(reqs, capacity * sizeof(read_request));
+      if(reqs == 0)
+        break;
+    }
+
+    reqs[n].sector = sector;
+    reqs[n].n_sectors = n_sectors;
+    n++;
+  }
+
+  fclose(fp);
+
+  if(reqs == 0)
+    return -1;
+
+  *trace = reqs;
+  *n_requests = n;
+  return 0;
+}
+
+int generate_trace(const psv_image* img, int random, uint32_t n_sectors, read_request* trace, int n_requests)
+{
+  uint64_t total_sectors = img->full_size / SD_DEFAULT_SECTOR_SIZE;
+  if(total_sectors < n_sectors)
+    return -1;
+
+  uint64_t max_start = total_sectors - n_sectors;
+  uint64_t sector = 0;
+
+  srand(0);
+
+  for(int i = 0; i < n_requests; i++)
+  {
+    if(random > 0)
+    {
+      sector = (((uint64_t)rand() << 31) | (uint64_t)rand()) % (max_start + 1);
+    }
+    else if(sector > max_start)
+    {
+      sector = 0;
+    }
+
+    trace[i].sector = sector;
+    trace[i].n_sectors = n_sectors;
+
+    sector += n_sectors;
+  }
+
+  return 0;
+}
+
+int replay_trace(psv_image* img, const char* name, const read_request* trace, int n_requests, uint64_t budget)
+{
+  if(psv_image_set_cache_budget(img, budget) < 0)
+  {
+    fprintf(stderr, "failed to allocate cache\n");
+    return -1;
+  }
+
+  uint32_t max_sectors = 0;
+  for(int i = 0; i < n_requests; i++)
+  {
+    if(trace[i].n_sectors > max_sectors)
+      max_sectors = trace[i].n_sectors;
+  }
+
+  char* buffer = (char*)malloc((uint64_t)max_sectors * SD_DEFAULT_SECTOR_SIZE);
+  if(buffer == 0)
+    return -1;
+
+  uint64_t bytes = 0;
+  double start = get_time_seconds();
+
+  for(int i = 0; i < n_requests; i++)
+  {
+    uint64_t size = (uint64_t)trace[i].n_sectors * SD_DEFAULT_SECTOR_SIZE;
+
+    if(psv_image_read(img, trace[i].sector * SD_DEFAULT_SECTOR_SIZE, buffer, size) < 0)
+    {
+      free(buffer);
+      return -1;
+    }
+
+    bytes += size;
+  }
+
+  double seconds = get_time_seconds() - start;
+
+  free(buffer);
+
+  uint64_t lookups = img->cache.hits + img->cache.misses;
+
+  printf("%-12s %10.1f %12.0f %10.1f %9.1f%%\n", name, budget / (1024.0 * 1024.0),
+    n_requests / seconds, bytes / seconds / 1e6,
+    lookups > 0 ? 100.0 * img->cache.hits / lookups : 0.0);
+
+  return 0;
+}
+
+//replays sector read traces with and without decompressed block cache
+int cmd_bench_read(int argc, char* argv[])
+{
+  uint64_t budget = PSV_DEFAULT_CACHE_BUDGET;
+  uint32_t n_sectors = 0x10;
+  int n_requests = 100000;
+  const char* trace_path = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "c:s:n:f:")) != -1)
+  {
+    switch(c)
+    {
+      case 'c':
+        budget = strtoull(optarg, 0, 0) * 1024 * 1024;
+        break;
+      case 's':
+        n_sectors = strtoul(optarg, 0, 0);
+        break;
+      case 'n':
+        n_requests = atoi(optarg);
+        break;
+      case 'f':
+        trace_path = optarg;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 1 || n_sectors == 0 || n_requests <= 0)
+  {
+    fprintf(stderr, "usage: psvtool bench-read [-c cache_mb] [-s sectors_per_read] [-n requests] [-f trace.txt] <input.psv>\n");
+    return -1;
+  }
+
+  psv_image img;
+  if(psv_image_open(&img, argv[optind]) < 0)
+    return -1;
+
+  read_request* seq_trace = 0;
+  read_request* rnd_trace = 0;
+  read_request* file_trace = 0;
+  int n_file_requests = 0;
+
+  int res = 0;
+
+  if(trace_path != 0)
+  {
+    res = load_trace(trace_path, &file_trace, &n_file_requests);
+  }
+  else
+  {
+    seq_trace = (read_request*)malloc(n_requests * sizeof(read_request));
+    rnd_trace = (read_request*)malloc(n_requests * sizeof(read_request));
+
+    if(seq_trace == 0 || rnd_trace == 0)
+      res = -1;
+    else if(generate_trace(&img, 0, n_sectors, seq_trace, n_requests) < 0 || generate_trace(&img, 1, n_sectors, rnd_trace, n_requests) < 0)
+      res = -1;
+  }
+
+  if(res == 0)
+  {
+    printf("%-12s %10s %12s %10s %10s\n", "trace", "cache MB", "requests/s", "MB/s", "hit rate");
+
+    uint64_t budgets[2] = { 0, budget };
+
+    for(int i = 0; i < 2 && res == 0; i++)
+    {
+      if(file_trace != 0)
+      {
+        res = replay_trace(&img, "file", file_trace, n_file_requests, budgets[i]);
+      }
+      else
+      {
+        res = replay_trace(&img, "sequential", seq_trace, n_requests, budgets[i]);
+        if(res == 0)
+          res = replay_trace(&img, "random", rnd_trace, n_requests, budgets[i]);
+      }
+    }
+  }
+
+  free(seq_trace);
+  free(rnd_trace);
+  free(file_trace);
+
+  psv_image_close(&img);
+
+  return res;
+}
+
+//media id lookup as it was done before partition map: block device name is matched and MBR is scanned on every request
+char g_gc_block_dev[] = "gcd-lp-act-mediaid";
+char g_mc_block_dev[] = "mcd-lp-act-mediaid";
+
+int legacy_media_id_sector(const MBR* mbr, const char* block_dev_name, int sector)
+{
+  enum PartitionCodes pc = empty_c;
+  if(memcmp(block_dev_name, g_gc_block_dev, 0x12) == 0)
+    pc = cardsExt;
+  else if(memcmp(block_dev_name, g_mc_block_dev, 0x12) == 0)
+    pc = cardsExt;
+
+  for(int i = 0; i < MAX_MBR_PARTITIONS; i++)
+  {
+    const PartitionEntry* pe = &mbr->partitions[i];
+    if(pe->partitionCode == pc)
+      return pe->partitionOffset == sector ? 1 : 0;
+  }
+
+  return -1;
+}
+
+const PartitionEntry* legacy_find_partition(const MBR* mbr, uint32_t sector)
+{
+  for(int i = 0; i < MAX_MBR_PARTITIONS; i++)
+  {
+    const PartitionEntry* pe = &mbr->partitions[i];
+    if(pe->partitionCode != empty_c && sector >= pe->partitionOffset && sector - pe->partitionOffset < pe->partitionSize)
+      return pe;
+  }
+
+  return 0;
+}
+
+//compares per request cost of media id check and sector classification with and without partition map
+int cmd_bench_partitions(int argc, char* argv[])
+{
+  int n_requests = 10000000;
+
+  int c;
+  while((c = getopt(argc, argv, "n:")) != -1)
+  {
+    switch(c)
+    {
+      case 'n':
+        n_requests = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 1 || n_requests <= 0)
+  {
+    fprintf(stderr, "usage: psvtool bench-partitions [-n requests] <input.psv>\n");
+    return -1;
+  }
+
+  psv_image img;
+  if(psv_image_open(&img, argv[optind]) < 0)
+    return -1;
+
+  MBR mbr;
+  int res = psv_image_read(&img, 0, (char*)&mbr, SD_DEFAULT_SECTOR_SIZE);
+
+  psv_image_close(&img);
+
+  if(res < 0)
+    return -1;
+
+  partition_map map;
+  partition_map_build(&map, &mbr);
+
+  printf("partitions: %u media id sector: %x\n", map.n_extents, map.media_id_sector);
+
+  uint32_t* sectors = (uint32_t*)malloc(n_requests * sizeof(uint32_t));
+  if(sectors == 0)
+    return -1;
+
+  //mostly data reads, every 64th request is media id so both outcomes are exercised
+  srand(0);
+  for(int i = 0; i < n_requests; i++)
+  {
+    if((i & 0x3F) == 0 && map.media_id_sector >= 0)
+      sectors[i] = map.media_id_sector;
+    else
+      sectors[i] = (((uint32_t)rand() << 16) ^ (uint32_t)rand()) % (mbr.sizeInBlocks > 0 ? mbr.sizeInBlocks : 1);
+  }
+
+  volatile uint64_t sink = 0;
+  uint64_t hits_old = 0;
+  uint64_t hits_new = 0;
+  uint64_t found_old = 0;
+  uint64_t found_new = 0;
+
+  printf("%-16s %12s %12s\n", "lookup", "mbr scan ns", "map ns");
+
+  double start = get_time_seconds();
+  for(int i = 0; i < n_requests; i++)
+    hits_old += legacy_media_id_sector(&mbr, g_gc_block_dev, sectors[i]) > 0;
+  double old_seconds = get_time_seconds() - start;
+
+  start = get_time_seconds();
+  for(int i = 0; i < n_requests; i++)
+    hits_new += (int32_t)sectors[i] == map.media_id_sector;
+  double new_seconds = get_time_seconds() - start;
+
+  printf("%-16s %12.2f %12.2f\n", "media id", old_seconds * 1e9 / n_requests, new_seconds * 1e9 / n_requests);
+
+  start = get_time_seconds();
+  for(int i = 0; i < n_requests; i++)
+  {
+    const PartitionEntry* pe = legacy_find_partition(&mbr, sectors[i]);
+    if(pe != 0)
+    {
+      found_old++;
+      sink += pe->partitionCode;
+    }
+  }
+  old_seconds = get_time_seconds() - start;
+
+  start = get_time_seconds();
+  for(int i = 0; i < n_requests; i++)
+  {
+    const partition_extent* e = partition_map_find(&map, sectors[i]);
+    if(e != 0)
+    {
+      found_new++;
+      sink += e->code;
+    }
+  }
+  new_seconds = get_time_seconds() - start;
+
+  printf("%-16s %12.2f %12.2f\n", "classification", old_seconds * 1e9 / n_requests, new_seconds * 1e9 / n_requests);
+
+  free(sectors);
+
+  if(hits_old != hits_new || found_old != found_new)
+  {
+    fprintf(stderr, "lookups do not match\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void print_sfo_entry(const sfo_entry* entry)
+{
+  if(entry->data_fmt == SFO_TE_DF_INT32 && entry->data_len == sizeof(int32_t))
+  {
+    int32_t value;
+    memcpy(&value, entry->data, sizeof(int32_t));
+    printf("%-24s 0x%x\n", entry->key, value);
+  }
+  else if(entry->data_fmt == SFO_TE_DF_UTF8)
+  {
+    printf("%-24s %.*s\n", entry->key, (int)strnlen((const char*)entry->data, entry->data_len), (const char*)entry->data);
+  }
+  else
+  {
+    printf("%-24s <%u bytes of format 0x%x>\n", entry->key, entry->data_len, entry->data_fmt);
+  }
+}
+
+//prints keys of PARAM.SFO with the same parser as the app. -n measures load, parse and lookup of all keys
+int cmd_sfo(int argc, char* argv[])
+{
+  int n_iterations = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "n:")) != -1)
+  {
+    switch(c)
+    {
+      case 'n':
+        n_iterations = atoi(optarg);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind < 1)
+  {
+    fprintf(stderr, "usage: psvtool sfo [-n iterations] <param.sfo> [key]...\n");
+    return -1;
+  }
+
+  const char* path = argv[optind];
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size > 0x10000)
+  {
+    fprintf(stderr, "%s: is not PARAM.SFO\n", path);
+    close(fd);
+    return -1;
+  }
+
+  uint32_t size = st.st_size;
+  char* data = (char*)malloc(size > 0 ? size : 1);
+
+  int res = data != 0 && pread_full(fd, data, size, 0) == size ? 0 : -1;
+
+  close(fd);
+
+  uint32_t memory_size = res == 0 ? sfo_get_memory_size(data, size) : 0;
+  void* memory = memory_size > 0 ? malloc(memory_size) : 0;
+
+  sfo_file sfo;
+  if(memory == 0 || sfo_parse(&sfo, data, size, memory, memory_size) < 0)
+  {
+    fprintf(stderr, "%s: is not valid PARAM.SFO\n", path);
+    free(memory);
+    free(data);
+    return -1;
+  }
+
+  if(argc - optind == 1)
+  {
+    for(uint32_t i = 0; i < sfo.n_entries; i++)
+      print_sfo_entry(&sfo.entries[i]);
+  }
+
+  for(int i = optind + 1; i < argc; i++)
+  {
+    const sfo_entry* entry = sfo_find(&sfo, argv[i]);
+    if(entry != 0)
+    {
+      print_sfo_entry(entry);
+    }
+    else
+    {
+      fprintf(stderr, "%s: key is not found\n", argv[i]);
+      res = -1;
+    }
+  }
+
+  if(n_iterations > 0)
+  {
+    double start = get_time_seconds();
+    for(int i = 0; i < n_iterations; i++)
+    {
+      sfo_file temp;
+      if(sfo_parse(&temp, data, size, memory, memory_size) < 0)
+        res = -1;
+    }
+    double parse_seconds = get_time_seconds() - start;
+
+    uint64_t found = 0;
+    start = get_time_seconds();
+    for(int i = 0; i < n_iterations; i++)
+    {
+      for(uint32_t j = 0; j < sfo.n_entries; j++)
+        found += sfo_find(&sfo, sfo.entries[j].key) != 0;
+    }
+    double find_seconds = get_time_seconds() - start;
+
+    printf("%u entries. parse %.0f ns, lookup %.1f ns (%llu found)\n", sfo.n_entries,
+      parse_seconds * 1e9 / n_iterations,
+      sfo.n_entries > 0 ? find_seconds * 1e9 / ((double)n_iterations * sfo.n_entries) : 0.0,
+      (unsigned long long)found);
+  }
+
+  free(memory);
+  free(data);
+
+  return res;
+}
+
+typedef struct command
+{
+  const char* name;
+  int (*func)(int argc, char* argv[]);
+  const char* description;
+} command;
+
+command g_commands[] =
+{
+  { "compress", cmd_compress, "compress raw or trimmed image into LZ4 block-compressed image" },
+  { "verify", cmd_verify, "check sha256 in the header of images or of all images in directories" },
+  { "verify-range", cmd_verify_range, "check range of image against per-chunk hash tree of the image" },
+  { "sparsify", cmd_sparsify, "convert cart image into sparse image that does not store zero blocks" },
+  { "convert", cmd_convert, "convert images of any cart layout into raw, trimmed, sparse or compressed layout" },
+  { "dedup", cmd_dedup, "store images as manifests over shared pool of chunks that are stored once" },
+  { "extract", cmd_extract, "write partition (gro0, grw0, cardsExt) of image of any layout to file" },
+  { "sfo", cmd_sfo, "print keys of PARAM.SFO using parser of the app" },
+  { "train-dict", cmd_train_dict, "train LZ4 dictionary on blocks sampled from set of images" },
+  { "bench-compress", cmd_bench_compress, "measure compression throughput per number of threads" },
+  { "bench-dump", cmd_bench_dump, "run card dump pipeline on file that stands in for the card" },
+  { "fake-dump", cmd_fake_dump, "dump file that stands in for the card with journal. can be interrupted and continued" },
+  { "bench-read", cmd_bench_read, "replay sector read traces with and without decompressed block cache" },
+  { "bench-partitions", cmd_bench_partitions, "measure media id and partition lookup per sector request" },
+};
+
+int print_usage()
+{
+  fprintf(stderr, "usage: psvtool <command> [options]\n\ncommands:\n");
+
+  for(int i = 0; i < sizeof(g_commands) / sizeof(command); i++)
+    fprintf(stderr, "  %-16s %s\n", g_commands[i].name, g_commands[i].description);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    print_usage();
+    return 1;
+  }
+
+  for(int i = 0; i < sizeof(g_commands) / sizeof(command); i++)
+  {
+    if(strcmp(argv[1], g_commands[i].name) == 0)
+      return g_commands[i].func(argc - 1, argv + 1) < 0 ? 1 : 0;
+  }
+
+  print_usage();
+  return 1;
+}
@@ -0,0 +1,875 @@
+/* psv_image.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "psv_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <lz4.h>
+
+#include "dictionary.h"
+#include "hash_tree.h"
+#include "dedup.h"
+
+int pread_full(int fd, void* buffer, uint64_t size, uint64_t offset)
+{
+  char* dst = (char*)buffer;
+
+  while(size > 0)
+  {
+    ssize_t n = pread(fd, dst, size, offset);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    //end of file
+    if(n == 0)
+      break;
+
+    dst += n;
+    offset += n;
+    size -= n;
+  }
+
+  return dst - (char*)buffer;
+}
+
+int pwrite_full(int fd, const void* buffer, uint64_t size, uint64_t offset)
+{
+  const char* src = (const char*)buffer;
+
+  while(size > 0)
+  {
+    ssize_t n = pwrite(fd, src, size, offset);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    src += n;
+    offset += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+static int load_offset_table(psv_image* img)
+{
+  uint32_t n_entries = img->compression.n_blocks + 1;
+  if(n_entries == 0)
+    return -1;
+
+  img->offsets_memory = malloc(offset_table_get_memory_size(n_entries));
+  if(img->offsets_memory == 0 || offset_table_init(&img->offsets, img->offsets_memory, n_entries) < 0)
+    return -1;
+
+  //raw table is read in chunks through compression buffer
+  uint64_t* chunk = (uint64_t*)img->comp_buffer;
+  uint32_t chunk_capacity = img->compression.block_size / sizeof(uint64_t);
+
+  for(uint32_t i = 0; i < n_entries; i += chunk_capacity)
+  {
+    uint32_t n = n_entries - i;
+    if(n > chunk_capacity)
+      n = chunk_capacity;
+
+    if(pread_full(img->fd, chunk, n * sizeof(uint64_t), img->data_offset + (uint64_t)i * sizeof(uint64_t)) != n * sizeof(uint64_t))
+      return -1;
+
+    for(uint32_t j = 0; j < n; j++)
+    {
+      if(offset_table_append(&img->offsets, chunk[j]) < 0)
+        return -1;
+    }
+  }
+
+  //last offset is the end of compressed data
+  if(img->data_offset + offset_table_get(&img->offsets, n_entries - 1) > img->file_size)
+    return -1;
+
+  return 0;
+}
+
+static int load_image_dictionary(psv_image* img, const char* path)
+{
+  uint32_t size = img->compression.dictionary_size;
+  if(size == 0)
+    return 0;
+
+  img->dictionary = (char*)malloc(COMPRESSION_MAX_DICTIONARY_SIZE);
+  if(img->dictionary == 0)
+    return -1;
+
+  if(img->compression.dictionary_offset > 0)
+  {
+    if(pread_full(img->fd, img->dictionary, size, img->data_offset + img->compression.dictionary_offset) != size)
+    {
+      fprintf(stderr, "%s: failed to read dictionary\n", path);
+      return -1;
+    }
+  }
+  else
+  {
+    char dict_path[PATH_MAX];
+    if(get_dictionary_path(path, img->compression.dictionary_hash, dict_path, PATH_MAX) < 0)
+      return -1;
+
+    uint32_t dict_size = 0;
+    if(load_dictionary(dict_path, img->dictionary, &dict_size) < 0)
+      return -1;
+
+    if(dict_size != size)
+    {
+      fprintf(stderr, "%s: dictionary size does not match\n", dict_path);
+      return -1;
+    }
+  }
+
+  //wrong dictionary would silently produce garbage instead of decompression error
+  uint8_t hash[0x20];
+  get_dictionary_hash(img->dictionary, size, hash);
+
+  if(memcmp(hash, img->compression.dictionary_hash, 0x20) != 0)
+  {
+    fprintf(stderr, "%s: dictionary hash does not match\n", path);
+    return -1;
+  }
+
+  img->dictionary_size = size;
+
+  return 0;
+}
+
+static int load_sparse_map(psv_image* img)
+{
+  uint32_t n_blocks = img->sparse.n_blocks;
+
+  img->sparse_memory = malloc(sparse_map_get_memory_size(n_blocks));
+  if(img->sparse_memory == 0 || sparse_map_init(&img->sparse_blocks, img->sparse_memory, n_blocks) < 0)
+    return -1;
+
+  uint32_t bitmap_size = sparse_map_get_bitmap_size(n_blocks);
+
+  if(pread_full(img->fd, img->sparse_blocks.bits, bitmap_size, img->data_offset) != bitmap_size)
+    return -1;
+
+  if(sparse_map_build(&img->sparse_blocks) < 0 || img->sparse_blocks.n_present != img->sparse.n_present)
+    return -1;
+
+  img->sparse_blocks_offset = img->data_offset + (bitmap_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+
+  return 0;
+}
+
+static int load_chunk_table(psv_image* img, const char* path)
+{
+  uint32_t n_chunks = img->chunked.n_chunks;
+  uint64_t table_size = (uint64_t)n_chunks * sizeof(chunk_location_t);
+
+  if(img->chunked.hashes_offset < table_size || img->data_offset + img->chunked.hashes_offset + (uint64_t)n_chunks * 0x20 > img->file_size)
+    return -1;
+
+  img->chunks = (chunk_location_t*)malloc(table_size);
+  img->packs = (psv_pack_cache*)calloc(1, sizeof(psv_pack_cache));
+  if(img->chunks == 0 || img->packs == 0)
+    return -1;
+
+  if(pread_full(img->fd, img->chunks, table_size, img->data_offset) != table_size)
+    return -1;
+
+  uint32_t n_stored = 0;
+  for(uint32_t i = 0; i < n_chunks; i++)
+  {
+    if(img->chunks[i].pack != CHUNK_PACK_ZERO)
+      n_stored++;
+  }
+
+  if(n_stored != img->chunked.n_stored)
+    return -1;
+
+  strncpy(img->packs->image_path, path, PATH_MAX - 1);
+
+  for(int i = 0; i < PSV_PACK_CACHE_SIZE; i++)
+    img->packs->fds[i] = -1;
+
+  return 0;
+}
+
+//hash tree header follows header of the layout
+static int load_hash_tree_header(psv_image* img, const char* header_area, uint32_t offset)
+{
+  memcpy(&img->tree, header_area + offset, sizeof(hash_tree_header_t));
+
+  hash_tree_layout layout;
+
+  if(img->tree.type != OPT_HEADER_TYPE_HASH_TREE ||
+     img->tree.chunk_size < HASH_TREE_MIN_CHUNK_SIZE || img->tree.chunk_size > HASH_TREE_MAX_CHUNK_SIZE || (img->tree.chunk_size % SD_DEFAULT_SECTOR_SIZE) != 0 ||
+     img->tree.n_chunks != (img->tree.uncompressed_size + img->tree.chunk_size - 1) / img->tree.chunk_size ||
+     hash_tree_get_layout(img->tree.n_chunks, &layout) < 0 || layout.n_nodes != img->tree.n_nodes ||
+     img->tree.tree_offset < PSV_HEADER_AREA_SIZE || img->tree.tree_offset + (uint64_t)img->tree.n_nodes * HASH_TREE_NODE_SIZE > img->file_size)
+    return -1;
+
+  return 0;
+}
+
+//error map header follows all other optional headers
+static int load_error_map_header(psv_image* img, const char* header_area, uint32_t offset)
+{
+  memcpy(&img->errors, header_area + offset, sizeof(error_map_header_t));
+
+  if(img->errors.type != OPT_HEADER_TYPE_ERROR_MAP || img->errors.n_ranges == 0 || img->errors.bad_sectors == 0 ||
+     img->errors.map_offset < PSV_HEADER_AREA_SIZE || img->errors.map_offset + (uint64_t)img->errors.n_ranges * sizeof(error_range_t) > img->file_size)
+    return -1;
+
+  return 0;
+}
+
+int psv_image_open(psv_image* img, const char* path)
+{
+  memset(img, 0, sizeof(psv_image));
+  img->cache.mru = -1;
+  img->cache.lru = -1;
+
+  img->fd = open(path, O_RDONLY);
+  if(img->fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(img->fd, &st) < 0)
+  {
+    fprintf(stderr, "%s: failed to stat: %s\n", path, strerror(errno));
+    psv_image_close(img);
+    return -1;
+  }
+
+  img->file_size = st.st_size;
+
+  char header_area[PSV_HEADER_AREA_SIZE];
+  memset(header_area, 0, PSV_HEADER_AREA_SIZE);
+
+  if(pread_full(img->fd, header_area, PSV_HEADER_AREA_SIZE, 0) < (int)sizeof(psv_file_header_v1))
+  {
+    fprintf(stderr, "%s: file is too small\n", path);
+    psv_image_close(img);
+    return -1;
+  }
+
+  memcpy(&img->header, header_area, sizeof(psv_file_header_v1));
+
+  if(img->header.magic != PSV_MAGIC || img->header.version != PSV_VERSION_V1)
+  {
+    fprintf(stderr, "%s: magic or version is invalid\n", path);
+    psv_image_close(img);
+    return -1;
+  }
+
+  if(img->header.image_offset_sector == 0)
+  {
+    fprintf(stderr, "%s: image does not contain data\n", path);
+    psv_image_close(img);
+    return -1;
+  }
+
+  img->data_offset = img->header.image_offset_sector * SD_DEFAULT_SECTOR_SIZE;
+
+  uint32_t opt_offset = sizeof(psv_file_header_v1);
+  if((img->header.flags & FLAG_COMPRESSED) > 0)
+    opt_offset += sizeof(compression_header_t);
+  else if((img->header.flags & FLAG_SPARSE) > 0)
+    opt_offset += sizeof(sparse_header_t);
+  else if((img->header.flags & FLAG_CHUNKED) > 0)
+    opt_offset += sizeof(chunked_header_t);
+
+  if((img->header.flags & FLAG_HASH_TREE) > 0)
+  {
+    if(load_hash_tree_header(img, header_area, opt_offset) < 0)
+    {
+      fprintf(stderr, "%s: hash tree header is invalid\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    opt_offset += sizeof(hash_tree_header_t);
+  }
+
+  if((img->header.flags & FLAG_ERROR_MAP) > 0 && load_error_map_header(img, header_area, opt_offset) < 0)
+  {
+    fprintf(stderr, "%s: error map header is invalid\n", path);
+    psv_image_close(img);
+    return -1;
+  }
+
+  if((img->header.flags & FLAG_COMPRESSED) > 0)
+  {
+    memcpy(&img->compression, header_area + sizeof(psv_file_header_v1), sizeof(compression_header_t));
+
+    if(img->compression.type != OPT_HEADER_TYPE_COMPRESSION)
+    {
+      fprintf(stderr, "%s: compression header is missing\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    if(img->compression.compression_algorithm != COMPRESSION_ALGORITHM_LZ4 ||
+       img->compression.block_size < COMPRESSION_MIN_BLOCK_SIZE || img->compression.block_size > COMPRESSION_MAX_BLOCK_SIZE ||
+       img->compression.uncompressed_size > PSV_MAX_UNCOMPRESSED_SIZE ||
+       img->compression.n_blocks != (img->compression.uncompressed_size + img->compression.block_size - 1) / img->compression.block_size ||
+       img->compression.dictionary_size > COMPRESSION_MAX_DICTIONARY_SIZE)
+    {
+      fprintf(stderr, "%s: compression header is not supported\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    img->full_size = img->compression.uncompressed_size;
+
+    img->comp_buffer = (char*)malloc(img->compression.block_size);
+    img->block_buffer = (char*)malloc(img->compression.block_size);
+
+    if(img->comp_buffer == 0 || img->block_buffer == 0 || psv_image_set_cache_budget(img, PSV_DEFAULT_CACHE_BUDGET) < 0)
+    {
+      fprintf(stderr, "%s: failed to allocate memory\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    if(load_offset_table(img) < 0)
+    {
+      fprintf(stderr, "%s: offset table is invalid\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    if(load_image_dictionary(img, path) < 0)
+    {
+      psv_image_close(img);
+      return -1;
+    }
+  }
+  else if((img->header.flags & FLAG_SPARSE) > 0)
+  {
+    memcpy(&img->sparse, header_area + sizeof(psv_file_header_v1), sizeof(sparse_header_t));
+
+    if(img->sparse.type != OPT_HEADER_TYPE_SPARSE ||
+       img->sparse.block_size < SPARSE_MIN_BLOCK_SIZE || img->sparse.block_size > SPARSE_MAX_BLOCK_SIZE || (img->sparse.block_size % SD_DEFAULT_SECTOR_SIZE) != 0 ||
+       img->sparse.n_blocks == 0 || (uint64_t)img->sparse.n_blocks * img->sparse.block_size < img->sparse.uncompressed_size ||
+       (uint64_t)(img->sparse.n_blocks - 1) * img->sparse.block_size >= img->sparse.uncompressed_size)
+    {
+      fprintf(stderr, "%s: sparse header is not supported\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    img->full_size = img->sparse.uncompressed_size;
+
+    if(load_sparse_map(img) < 0)
+    {
+      fprintf(stderr, "%s: sparse bitmap is invalid\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+  }
+  else if((img->header.flags & FLAG_CHUNKED) > 0)
+  {
+    memcpy(&img->chunked, header_area + sizeof(psv_file_header_v1), sizeof(chunked_header_t));
+
+    if(img->chunked.type != OPT_HEADER_TYPE_CHUNKED ||
+       img->chunked.chunk_size < CHUNKED_MIN_CHUNK_SIZE || img->chunked.chunk_size > CHUNKED_MAX_CHUNK_SIZE || (img->chunked.chunk_size % SD_DEFAULT_SECTOR_SIZE) != 0 ||
+       img->chunked.uncompressed_size > PSV_MAX_UNCOMPRESSED_SIZE ||
+       img->chunked.n_chunks == 0 || img->chunked.n_chunks != (img->chunked.uncompressed_size + img->chunked.chunk_size - 1) / img->chunked.chunk_size)
+    {
+      fprintf(stderr, "%s: chunked header is not supported\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    img->full_size = img->chunked.uncompressed_size;
+
+    if(load_chunk_table(img, path) < 0)
+    {
+      fprintf(stderr, "%s: chunk table is invalid\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+  }
+  else
+  {
+    //size of the cart is taken from MBR because trimmed image does not store the tail
+    MBR mbr;
+    if(pread_full(img->fd, &mbr, sizeof(MBR), img->data_offset) != sizeof(MBR) || memcmp(mbr.header, SCEHeader, 0x20) != 0)
+    {
+      fprintf(stderr, "%s: SCE header is invalid\n", path);
+      psv_image_close(img);
+      return -1;
+    }
+
+    img->full_size = (uint64_t)mbr.sizeInBlocks * SD_DEFAULT_SECTOR_SIZE;
+
+    img->stored_size = img->file_size - img->data_offset;
+    if(img->stored_size > img->full_size)
+      img->stored_size = img->full_size;
+
+    //resumed dump can leave stale bytes after image_size. they are not part of trimmed image
+    if((img->header.flags & FLAG_TRIMMED) > 0 && img->header.image_size < img->stored_size)
+      img->stored_size = img->header.image_size;
+  }
+
+  return 0;
+}
+
+int psv_image_close(psv_image* img)
+{
+  if(img->fd >= 0)
+    close(img->fd);
+
+  img->fd = -1;
+
+  block_cache_free(&img->cache);
+
+  free(img->comp_buffer);
+  img->comp_buffer = 0;
+
+  free(img->block_buffer);
+  img->block_buffer = 0;
+
+  free(img->offsets_memory);
+  img->offsets_memory = 0;
+
+  free(img->sparse_memory);
+  img->sparse_memory = 0;
+
+  free(img->chunks);
+  img->chunks = 0;
+
+  for(int i = 0; img->packs != 0 && i < PSV_PACK_CACHE_SIZE; i++)
+  {
+    if(img->packs->fds[i] >= 0)
+      close(img->packs->fds[i]);
+  }
+
+  free(img->packs);
+  img->packs = 0;
+
+  free(img->dictionary);
+  img->dictionary = 0;
+  img->dictionary_size = 0;
+
+  return 0;
+}
+
+int psv_image_set_cache_budget(psv_image* img, uint64_t budget_bytes)
+{
+  if((img->header.flags & FLAG_COMPRESSED) == 0)
+    return 0;
+
+  block_cache_free(&img->cache);
+
+  return block_cache_init(&img->cache, img->compression.block_size, img->compression.n_blocks, budget_bytes);
+}
+
+static uint32_t get_uncompressed_block_size(const psv_image* img, uint64_t block)
+{
+  uint64_t remaining = img->compression.uncompressed_size - block * img->compression.block_size;
+  return remaining < img->compression.block_size ? remaining : img->compression.block_size;
+}
+
+static int load_compressed_block(psv_image* img, uint64_t block, char* dst)
+{
+  //offsets of this block and the next one give size of the block
+  uint64_t offsets[2];
+  offsets[0] = offset_table_get(&img->offsets, block);
+  offsets[1] = offset_table_get(&img->offsets, block + 1);
+
+  uint32_t uncompressed_size = get_uncompressed_block_size(img, block);
+
+  if(offsets[1] <= offsets[0] || offsets[1] - offsets[0] > uncompressed_size)
+    return -1;
+
+  uint32_t compressed_size = offsets[1] - offsets[0];
+
+  //block that could not be compressed is stored raw
+  char* src = (compressed_size == uncompressed_size) ? dst : img->comp_buffer;
+
+  if(pread_full(img->fd, src, compressed_size, img->data_offset + offsets[0]) != compressed_size)
+    return -1;
+
+  if(compressed_size != uncompressed_size)
+  {
+    int dec_size = (img->dictionary_size > 0)
+      ? LZ4_decompress_safe_usingDict(src, dst, compressed_size, uncompressed_size, img->dictionary, img->dictionary_size)
+      : LZ4_decompress_safe(src, dst, compressed_size, uncompressed_size);
+
+    if(dec_size != uncompressed_size)
+      return -1;
+  }
+
+  return 0;
+}
+
+//returns uncompressed block data from cache or decompresses it
+static const char* get_block(psv_image* img, uint64_t block)
+{
+  char* data = block_cache_get(&img->cache, block);
+  if(data != 0)
+    return data;
+
+  data = block_cache_insert(&img->cache, block);
+  char* dst = data != 0 ? data : img->block_buffer;
+
+  if(load_compressed_block(img, block, dst) < 0)
+  {
+    if(data != 0)
+      block_cache_drop(&img->cache, block);
+    return 0;
+  }
+
+  return dst;
+}
+
+int psv_image_read(psv_image* img, uint64_t offset, char* buffer, uint64_t size)
+{
+  if(offset + size > img->full_size)
+    return -1;
+
+  if((img->header.flags & FLAG_COMPRESSED) == 0)
+    return psv_image_read_raw(img, offset, buffer, size);
+
+  uint32_t block_size = img->compression.block_size;
+
+  while(size > 0)
+  {
+    uint64_t block = offset / block_size;
+
+    const char* data = get_block(img, block);
+    if(data == 0)
+    {
+      fprintf(stderr, "failed to decompress block %llu\n", (unsigned long long)block);
+      return -1;
+    }
+
+    uint32_t offset_in_block = offset % block_size;
+    uint64_t n = get_uncompressed_block_size(img, block) - offset_in_block;
+    if(n > size)
+      n = size;
+
+    memcpy(buffer, data + offset_in_block, n);
+
+    buffer += n;
+    offset += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+//zero blocks are memset. consecutive stored blocks are consecutive in the file so every run takes single read
+static int read_sparse(const psv_image* img, uint64_t offset, char* buffer, uint64_t size)
+{
+  const sparse_map* map = &img->sparse_blocks;
+  uint32_t block_size = img->sparse.block_size;
+
+  uint64_t end = offset + size;
+
+  while(offset < end)
+  {
+    uint32_t block = offset / block_size;
+    uint32_t last_block = (end - 1) / block_size;
+
+    int present = sparse_map_is_present(map, block);
+
+    uint32_t n = 1;
+    while(block + n <= last_block && sparse_map_is_present(map, block + n) == present)
+      n++;
+
+    uint64_t run_end = (uint64_t)(block + n) * block_size;
+    if(run_end > end)
+      run_end = end;
+
+    uint64_t run_size = run_end - offset;
+
+    if(present > 0)
+    {
+      uint64_t file_offset = img->sparse_blocks_offset + (uint64_t)sparse_map_get_rank(map, block) * block_size + (offset - (uint64_t)block * block_size);
+
+      if(pread_full(img->fd, buffer, run_size, file_offset) != run_size)
+        return -1;
+    }
+    else
+    {
+      memset(buffer, 0, run_size);
+    }
+
+    buffer += run_size;
+    offset += run_size;
+  }
+
+  return 0;
+}
+
+static int get_pack_fd(psv_pack_cache* cache, uint32_t pack)
+{
+  int victim = 0;
+
+  for(int i = 0; i < PSV_PACK_CACHE_SIZE; i++)
+  {
+    if(cache->fds[i] >= 0 && cache->packs[i] == pack)
+    {
+      cache->last_use[i] = ++cache->clock;
+      return cache->fds[i];
+    }
+
+    if(cache->fds[victim] >= 0 && (cache->fds[i] < 0 || cache->last_use[i] < cache->last_use[victim]))
+      victim = i;
+  }
+
+  char pack_path[PATH_MAX];
+  if(get_pack_path(cache->image_path, pack, pack_path, PATH_MAX) < 0)
+    return -1;
+
+  int fd = open(pack_path, O_RDONLY);
+  if(fd < 0)
+  {
+    fprintf(stderr, "%s: failed to open: %s\n", pack_path, strerror(errno));
+    return -1;
+  }
+
+  if(cache->fds[victim] >= 0)
+    close(cache->fds[victim]);
+
+  cache->packs[victim] = pack;
+  cache->fds[victim] = fd;
+  cache->last_use[victim] = ++cache->clock;
+
+  return fd;
+}
+
+//zero chunks are memset. chunks that follow each other in the same pack are read at once
+static int read_chunked(const psv_image* img, uint64_t offset, char* buffer, uint64_t size)
+{
+  uint32_t chunk_size = img->chunked.chunk_size;
+  uint32_t chunk_sectors = chunk_size / SD_DEFAULT_SECTOR_SIZE;
+
+  uint64_t end = offset + size;
+
+  while(offset < end)
+  {
+    uint32_t chunk = offset / chunk_size;
+    uint32_t last_chunk = (end - 1) / chunk_size;
+
+    const chunk_location_t* first = &img->chunks[chunk];
+
+    uint32_t n = 1;
+    while(chunk + n <= last_chunk && img->chunks[chunk + n].pack == first->pack &&
+          (first->pack == CHUNK_PACK_ZERO || img->chunks[chunk + n].sector == first->sector + n * chunk_sectors))
+      n++;
+
+    uint64_t run_end = (uint64_t)(chunk + n) * chunk_size;
+    if(run_end > end)
+      run_end = end;
+
+    uint64_t run_size = run_end - offset;
+
+    if(first->pack != CHUNK_PACK_ZERO)
+    {
+      int fd = get_pack_fd(img->packs, first->pack);
+      if(fd < 0)
+        return -1;
+
+      uint64_t file_offset = (uint64_t)first->sector * SD_DEFAULT_SECTOR_SIZE + (offset - (uint64_t)chunk * chunk_size);
+
+      if(pread_full(fd, buffer, run_size, file_offset) != run_size)
+        return -1;
+    }
+    else
+    {
+      memset(buffer, 0, run_size);
+    }
+
+    buffer += run_size;
+    offset += run_size;
+  }
+
+  return 0;
+}
+
+int psv_image_read_raw(const psv_image* img, uint64_t offset, char* buffer, uint64_t size)
+{
+  if((img->header.flags & FLAG_SPARSE) > 0)
+  {
+    if(offset + size > img->full_size)
+      return -1;
+
+    return read_sparse(img, offset, buffer, size);
+  }
+
+  if((img->header.flags & FLAG_CHUNKED) > 0)
+  {
+    if(offset + size > img->full_size)
+      return -1;
+
+    return read_chunked(img, offset, buffer, size);
+  }
+
+  uint64_t stored = offset < img->stored_size ? img->stored_size - offset : 0;
+  if(stored > size)
+    stored = size;
+
+  if(stored > 0 && pread_full(img->fd, buffer, stored, img->data_offset + offset) != stored)
+    return -1;
+
+  //only trimmed images are allowed to end before the end of the cart
+  if(stored < size)
+  {
+    if((img->header.flags & FLAG_TRIMMED) == 0 || offset + size > img->full_size)
+      return -1;
+
+    memset(buffer + stored, 0, size - stored);
+  }
+
+  return 0;
+}
+
+int psv_write_header_area(int fd, const psv_file_header_v1* header, const void* opt_headers, uint32_t opt_headers_size)
+{
+  if(sizeof(psv_file_header_v1) + opt_headers_size > PSV_HEADER_AREA_SIZE)
+    return -1;
+
+  char header_area[PSV_HEADER_AREA_SIZE];
+  memset(header_area, 0, PSV_HEADER_AREA_SIZE);
+
+  memcpy(header_area, header, sizeof(psv_file_header_v1));
+  if(opt_headers_size > 0)
+    memcpy(header_area + sizeof(psv_file_header_v1), opt_headers, opt_headers_size);
+
+  return pwrite_full(fd, header_area, PSV_HEADER_AREA_SIZE, 0);
+}
+
+int psv_load_carried_tables(const psv_image* img, psv_carried_tables* carried)
+{
+  memset(carried, 0, sizeof(psv_carried_tables));
+
+  if((img->header.flags & FLAG_HASH_TREE) > 0)
+  {
+    uint64_t tree_size = (uint64_t)img->tree.n_nodes * HASH_TREE_NODE_SIZE;
+
+    carried->tree_nodes = (char*)malloc(tree_size);
+    if(carried->tree_nodes == 0 || pread_full(img->fd, carried->tree_nodes, tree_size, img->tree.tree_offset) != tree_size)
+    {
+      psv_free_carried_tables(carried);
+      return -1;
+    }
+
+    memcpy(&carried->tree, &img->tree, sizeof(hash_tree_header_t));
+    carried->flags |= FLAG_HASH_TREE;
+  }
+
+  if((img->header.flags & FLAG_ERROR_MAP) > 0)
+  {
+    uint64_t map_size = (uint64_t)img->errors.n_ranges * sizeof(error_range_t);
+
+    carried->ranges = (error_range_t*)malloc(map_size);
+    if(carried->ranges == 0 || pread_full(img->fd, carried->ranges, map_size, img->errors.map_offset) != map_size)
+    {
+      psv_free_carried_tables(carried);
+      return -1;
+    }
+
+    memcpy(&carried->errors, &img->errors, sizeof(error_map_header_t));
+    carried->flags |= FLAG_ERROR_MAP;
+  }
+
+  return 0;
+}
+
+void psv_free_carried_tables(psv_carried_tables* carried)
+{
+  free(carried->tree_nodes);
+  free(carried->ranges);
+  memset(carried, 0, sizeof(psv_carried_tables));
+}
+
+int psv_write_carried_tables(int fd, psv_carried_tables* carried, uint64_t offset, uint64_t* end)
+{
+  uint64_t pos = (offset + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+
+  if((carried->flags & FLAG_HASH_TREE) > 0)
+  {
+    uint64_t tree_size = (uint64_t)carried->tree.n_nodes * HASH_TREE_NODE_SIZE;
+
+    if(pwrite_full(fd, carried->tree_nodes, tree_size, pos) < 0)
+      return -1;
+
+    carried->tree.tree_offset = pos;
+    pos += tree_size;
+  }
+
+  if((carried->flags & FLAG_ERROR_MAP) > 0)
+  {
+    uint64_t map_size = (uint64_t)carried->errors.n_ranges * sizeof(error_range_t);
+
+    if(pwrite_full(fd, carried->ranges, map_size, pos) < 0)
+      return -1;
+
+    carried->errors.map_offset = pos;
+    pos += map_size;
+  }
+
+  *end = (carried->flags > 0) ? pos : offset;
+
+  return 0;
+}
+
+int psv_write_header_area_carried(int fd, const psv_file_header_v1* header, const void* layout_header, uint32_t layout_header_size, const psv_carried_tables* carried)
+{
+  char opt_headers[PSV_HEADER_AREA_SIZE];
+  uint32_t opt_headers_size = 0;
+
+  if(layout_header_size + sizeof(hash_tree_header_t) + sizeof(error_map_header_t) > sizeof(opt_headers))
+    return -1;
+
+  psv_file_header_v1 h;
+  memcpy(&h, header, sizeof(psv_file_header_v1));
+  h.flags |= carried->flags;
+
+  //header of the layout goes first, error map header goes last
+  if(layout_header_size > 0)
+  {
+    memcpy(opt_headers, layout_header, layout_header_size);
+    opt_headers_size += layout_header_size;
+  }
+
+  if((carried->flags & FLAG_HASH_TREE) > 0)
+  {
+    memcpy(opt_headers + opt_headers_size, &carried->tree, sizeof(hash_tree_header_t));
+    opt_headers_size += sizeof(hash_tree_header_t);
+  }
+
+  if((carried->flags & FLAG_ERROR_MAP) > 0)
+  {
+    memcpy(opt_headers + opt_headers_size, &carried->errors, sizeof(error_map_header_t));
+    opt_headers_size += sizeof(error_map_header_t);
+  }
+
+  return psv_write_header_area(fd, &h, opt_headers, opt_headers_size);
+}
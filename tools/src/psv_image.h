@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+#include <limits.h>
+
+#include "psv_types.h"
+#include "mbr_types.h"
+
+#include "block_cache.h"
+#include "offset_table.h"
+#include "sparse_map.h"
+
+//header, optional headers and padding always fit into first sector of the file
+#define PSV_HEADER_AREA_SIZE SD_DEFAULT_SECTOR_SIZE
+
+//default memory budget for decompressed blocks of compressed image
+#define PSV_DEFAULT_CACHE_BUDGET (16 * 1024 * 1024)
+
+//number of pack files of chunked image that are kept open
+#define PSV_PACK_CACHE_SIZE 8
+
+//pack files are opened on first read and least recently used one is closed when cache is full
+typedef struct psv_pack_cache
+{
+  char image_path[PATH_MAX];
+  uint32_t packs[PSV_PACK_CACHE_SIZE];
+  int fds[PSV_PACK_CACHE_SIZE];
+  uint64_t last_use[PSV_PACK_CACHE_SIZE];
+  uint64_t clock;
+} psv_pack_cache;
+
+typedef struct psv_image
+{
+  int fd;
+  uint64_t file_size;
+
+  psv_file_header_v1 header;
+  compression_header_t compression; //valid if FLAG_COMPRESSED is set
+  sparse_header_t sparse; //valid if FLAG_SPARSE is set
+  hash_tree_header_t tree; //valid if FLAG_HASH_TREE is set
+  error_map_header_t errors; //valid if FLAG_ERROR_MAP is set
+  chunked_header_t chunked; //valid if FLAG_CHUNKED is set
+
+  uint64_t data_offset; //offset of the image data in the file
+  uint64_t full_size;   //size of the uncompressed image including any trimmed bytes
+  uint64_t stored_size; //raw and trimmed: image bytes that are read from the file. the rest reads as zeros
+
+  //offset table of compressed image is loaded once on open
+  offset_table offsets;
+  void* offsets_memory;
+
+  //bitmap of stored blocks of sparse image is loaded once on open
+  sparse_map sparse_blocks;
+  void* sparse_memory;
+  uint64_t sparse_blocks_offset; //file offset of the first stored block
+
+  //chunk table of chunked image is loaded once on open. packs are shared with other images so they are opened on demand
+  chunk_location_t* chunks;
+  psv_pack_cache* packs;
+
+  //embedded or shared dictionary is loaded once on open
+  char* dictionary;
+  uint32_t dictionary_size;
+
+  //decompression state. psv_image_read is not thread safe - use one psv_image per thread
+  block_cache cache;
+  char* comp_buffer;
+  char* block_buffer; //used when cache is disabled
+} psv_image;
+
+int psv_image_open(psv_image* img, const char* path);
+
+int psv_image_close(psv_image* img);
+
+//sets memory budget for decompressed blocks. zero disables the cache
+int psv_image_set_cache_budget(psv_image* img, uint64_t budget_bytes);
+
+//reads uncompressed image data from image of any layout
+int psv_image_read(psv_image* img, uint64_t offset, char* buffer, uint64_t size);
+
+//reads not compressed (raw, trimmed, sparse or chunked) image data. bytes that are trimmed or elided from the file are returned as zeros
+int psv_image_read_raw(const psv_image* img, uint64_t offset, char* buffer, uint64_t size);
+
+//writes header area (header, optional headers and padding) to the beginning of the file
+int psv_write_header_area(int fd, const psv_file_header_v1* header, const void* opt_headers, uint32_t opt_headers_size);
+
+//hash tree and error map of the image. they describe uncompressed data so they are kept as is
+//when image is stored in another layout
+typedef struct psv_carried_tables
+{
+  uint32_t flags; //FLAG_HASH_TREE and FLAG_ERROR_MAP of the image
+  hash_tree_header_t tree;
+  error_map_header_t errors;
+  char* tree_nodes;
+  error_range_t* ranges;
+} psv_carried_tables;
+
+//loads hash tree and error map of the image if it has them
+int psv_load_carried_tables(const psv_image* img, psv_carried_tables* carried);
+
+void psv_free_carried_tables(psv_carried_tables* carried);
+
+//writes tables after data of the new image, starting at offset rounded up to sector, and points headers at them.
+//end is set to the end of the written tables
+int psv_write_carried_tables(int fd, psv_carried_tables* carried, uint64_t offset, uint64_t* end);
+
+//writes header area with header of the layout followed by carried headers. flags of carried tables are added to the header
+int psv_write_header_area_carried(int fd, const psv_file_header_v1* header, const void* layout_header, uint32_t layout_header_size, const psv_carried_tables* carried);
+
+int pread_full(int fd, void* buffer, uint64_t size, uint64_t offset);
+
+int pwrite_full(int fd, const void* buffer, uint64_t size, uint64_t offset);
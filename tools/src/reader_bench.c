@@ -0,0 +1,638 @@
+/* reader_bench.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+//benchmarks of the driver read path. reader.c is built as is over kernel shim
+//so it can not be linked into psvtool that has its own globals with the same names
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "kernel_shim.h"
+#include "sector_api.h"
+#include "reader.h"
+
+typedef struct trace_entry
+{
+  int sector;
+  int n_sectors;
+} trace_entry;
+
+double get_time_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int generate_trace(uint32_t total_sectors, int random, int n_sectors, trace_entry* trace, int n_requests)
+{
+  if(total_sectors < n_sectors)
+    return -1;
+
+  uint32_t max_start = total_sectors - n_sectors;
+  uint32_t sector = 0;
+
+  srand(0);
+
+  for(int i = 0; i < n_requests; i++)
+  {
+    if(random > 0)
+    {
+      sector = (((uint32_t)rand() << 16) ^ (uint32_t)rand()) % (max_start + 1);
+    }
+    else if(sector > max_start)
+    {
+      sector = 0;
+    }
+
+    trace[i].sector = sector;
+    trace[i].n_sectors = n_sectors;
+
+    sector += n_sectors;
+  }
+
+  return 0;
+}
+
+//loads trace of "sector n_sectors" lines as recorded from emulate_read
+int load_trace(const char* path, trace_entry** trace, int* n_requests)
+{
+  FILE* fp = fopen(path, "r");
+  if(fp == 0)
+  {
+    fprintf(stderr, "%s: failed to open\n", path);
+    return -1;
+  }
+
+  int capacity = 1024;
+  int n = 0;
+  trace_entry* entries = (trace_entry*)malloc(capacity * sizeof(trace_entry));
+
+  int sector = 0;
+  int n_sectors = 0;
+
+  while(entries != 0 && fscanf(fp, "%i %i", &sector, &n_sectors) == 2)
+  {
+    if(sector < 0 || n_sectors <= 0)
+      continue;
+
+    if(n == capacity)
+    {
+      trace_entry* grown = (trace_entry*)realloc(entries, capacity * 2 * sizeof(trace_entry));
+      if(grown == 0)
+      {
+        free(entries);
+        entries = 0;
+        break;
+      }
+
+      entries = grown;
+      capacity *= 2;
+    }
+
+    entries[n].sector = sector;
+    entries[n].n_sectors = n_sectors;
+    n++;
+  }
+
+  fclose(fp);
+
+  if(entries == 0 || n == 0)
+  {
+    free(entries);
+    fprintf(stderr, "%s: failed to load trace\n", path);
+    return -1;
+  }
+
+  *trace = entries;
+  *n_requests = n;
+  return 0;
+}
+
+//mounts image the same way the driver does. read threads are started once and live till exit
+int mount_image(const char* path)
+{
+  static int initialized = 0;
+
+  if(initialized == 0)
+  {
+    initialize_read_threading();
+    initialized = 1;
+  }
+
+  set_reader_iso_path(path);
+
+  if(get_mbr_ptr()->sizeInBlocks == 0)
+  {
+    fprintf(stderr, "%s: failed to mount\n", path);
+    clear_reader_iso_path();
+    return -1;
+  }
+
+  return 0;
+}
+
+//read path as it was before the image was kept open: open, seek, read and close for every request
+int legacy_read_sectors(const char* path, SceOff data_offset, int sector, char* buffer, int nSectors)
+{
+  //DO NOT REMOVE THE CASTS!
+  SceOff offset = data_offset + (SceOff)sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+  SceSize size = nSectors * SD_DEFAULT_SECTOR_SIZE;
+
+  int res = 0;
+
+  SceUID iso_fd = ksceIoOpen(path, SCE_O_RDONLY, 0777);
+  if(iso_fd < 0)
+    return SD_UNKNOWN_READ_WRITE_ERROR;
+
+  if(ksceIoLseek(iso_fd, offset, SEEK_SET) != offset || ksceIoRead(iso_fd, buffer, size) != size)
+    res = SD_UNKNOWN_READ_WRITE_ERROR;
+
+  ksceIoClose(iso_fd);
+
+  return res;
+}
+
+//compares open/seek/read/close per request with positioned reads on the handle that is opened on mount
+int cmd_fd(int argc, char* argv[])
+{
+  int n_sectors = 0x10;
+  int n_requests = 100000;
+  double open_latency = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "s:n:o:")) != -1)
+  {
+    switch(c)
+    {
+      case 's':
+        n_sectors = strtoul(optarg, 0, 0);
+        break;
+      case 'n':
+        n_requests = atoi(optarg);
+        break;
+      case 'o':
+        open_latency = atof(optarg) / 1e6;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 1 || n_sectors <= 0 || n_requests <= 0)
+  {
+    fprintf(stderr, "usage: reader-bench fd [-s sectors_per_read] [-n requests] [-o open_latency_us] <input.psv>\n");
+    return -1;
+  }
+
+  const char* path = argv[optind];
+
+  //legacy path only knows raw layout
+  psv_file_header_v1 header;
+  memset(&header, 0, sizeof(psv_file_header_v1));
+
+  SceUID fd = ksceIoOpen(path, SCE_O_RDONLY, 0777);
+  if(fd >= 0)
+  {
+    ksceIoPread(fd, &header, sizeof(psv_file_header_v1), 0);
+    ksceIoClose(fd);
+  }
+
+  if(header.magic != PSV_MAGIC || (header.flags & (FLAG_COMPRESSED | FLAG_SPARSE | FLAG_CHUNKED)) > 0)
+  {
+    fprintf(stderr, "%s: raw or trimmed image is required\n", path);
+    return -1;
+  }
+
+  if(mount_image(path) < 0)
+    return -1;
+
+  //trimmed image is only read up to its stored size so that both paths read the same data
+  uint32_t total_sectors = header.image_size / SD_DEFAULT_SECTOR_SIZE;
+  if(total_sectors > get_mbr_ptr()->sizeInBlocks)
+    total_sectors = get_mbr_ptr()->sizeInBlocks;
+
+  trace_entry* trace = (trace_entry*)malloc(n_requests * sizeof(trace_entry));
+  char* buffer = (char*)malloc(n_sectors * SD_DEFAULT_SECTOR_SIZE);
+
+  int res = (trace == 0 || buffer == 0) ? -1 : 0;
+
+  kernel_shim_set_open_latency(open_latency);
+
+  //DO NOT REMOVE THE CASTS!
+  SceOff data_offset = (SceOff)header.image_offset_sector * (SceOff)SD_DEFAULT_SECTOR_SIZE;
+
+  const char* names[2] = { "sequential", "random" };
+
+  if(res == 0)
+    printf("%-12s %16s %16s %8s\n", "trace", "open/close req/s", "persistent req/s", "speedup");
+
+  for(int t = 0; t < 2 && res == 0; t++)
+  {
+    if(generate_trace(total_sectors, t, n_sectors, trace, n_requests) < 0)
+    {
+      res = -1;
+      break;
+    }
+
+    double start = get_time_seconds();
+    for(int i = 0; i < n_requests && res == 0; i++)
+      res = legacy_read_sectors(path, data_offset, trace[i].sector, buffer, trace[i].n_sectors);
+    double legacy_seconds = get_time_seconds() - start;
+
+    start = get_time_seconds();
+    for(int i = 0; i < n_requests && res == 0; i++)
+      res = read_image_sectors(trace[i].sector, buffer, trace[i].n_sectors);
+    double persistent_seconds = get_time_seconds() - start;
+
+    if(res < 0)
+    {
+      fprintf(stderr, "%s: read failed : %x\n", path, res);
+      break;
+    }
+
+    printf("%-12s %16.0f %16.0f %7.2fx\n", names[t], n_requests / legacy_seconds, n_requests / persistent_seconds, legacy_seconds / persistent_seconds);
+  }
+
+  kernel_shim_set_open_latency(0);
+
+  free(trace);
+  free(buffer);
+
+  clear_reader_iso_path();
+
+  return res < 0 ? -1 : 0;
+}
+
+//replays trace through emulate_read on freshly mounted image so that cache starts empty.
+//with verify every request is also read bypassing the cache and compared
+int replay_trace(const char* path, const char* name, const trace_entry* trace, int n_requests, int verify)
+{
+  if(mount_image(path) < 0)
+    return -1;
+
+  int max_sectors = 0;
+  for(int i = 0; i < n_requests; i++)
+  {
+    if(trace[i].n_sectors > max_sectors)
+      max_sectors = trace[i].n_sectors;
+  }
+
+  char* buffer = (char*)malloc(max_sectors * SD_DEFAULT_SECTOR_SIZE);
+  char* direct = (char*)malloc(max_sectors * SD_DEFAULT_SECTOR_SIZE);
+  if(buffer == 0 || direct == 0)
+  {
+    free(buffer);
+    free(direct);
+    clear_reader_iso_path();
+    return -1;
+  }
+
+  uint64_t bytes = 0;
+  int n_errors = 0;
+  int n_mismatches = 0;
+
+  double start = get_time_seconds();
+
+  for(int i = 0; i < n_requests; i++)
+  {
+    if(emulate_read(trace[i].sector, buffer, trace[i].n_sectors) < 0)
+      n_errors++;
+
+    bytes += trace[i].n_sectors * SD_DEFAULT_SECTOR_SIZE;
+
+    if(verify > 0)
+    {
+      read_image_sectors(trace[i].sector, direct, trace[i].n_sectors);
+      if(memcmp(buffer, direct, trace[i].n_sectors * SD_DEFAULT_SECTOR_SIZE) != 0)
+        n_mismatches++;
+    }
+  }
+
+  double seconds = get_time_seconds() - start;
+
+  psvgamesd_read_cache_stats stats;
+  get_read_cache_stats_internal(&stats);
+
+  free(buffer);
+  free(direct);
+
+  clear_reader_iso_path();
+
+  uint64_t lookups = stats.hits + stats.misses;
+
+  printf("%-12s %12.0f %10.1f %9.1f%% %10u %10u %8u %8d", name, n_requests / seconds, bytes / seconds / 1e6,
+    lookups > 0 ? 100.0 * stats.hits / lookups : 0.0, stats.readahead_blocks, stats.readahead_hits, stats.bypass_reads, n_errors);
+
+  if(verify > 0)
+    printf(" %10d", n_mismatches);
+
+  printf("\n");
+
+  return n_mismatches > 0 ? -1 : 0;
+}
+
+//feeds recorded or generated (sector, nSectors) streams into emulate_read and reports read cache statistics
+int cmd_replay(int argc, char* argv[])
+{
+  int n_sectors = 0x10;
+  int n_requests = 100000;
+  const char* trace_path = 0;
+  int verify = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "s:n:f:v")) != -1)
+  {
+    switch(c)
+    {
+      case 's':
+        n_sectors = strtoul(optarg, 0, 0);
+        break;
+      case 'n':
+        n_requests = atoi(optarg);
+        break;
+      case 'f':
+        trace_path = optarg;
+        break;
+      case 'v':
+        verify = 1;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 1 || n_sectors <= 0 || n_requests <= 0)
+  {
+    fprintf(stderr, "usage: reader-bench replay [-s sectors_per_read] [-n requests] [-f trace.txt] [-v] <input.psv>\n");
+    return -1;
+  }
+
+  const char* path = argv[optind];
+
+  trace_entry* trace = 0;
+  int res = 0;
+
+  if(trace_path != 0)
+  {
+    res = load_trace(trace_path, &trace, &n_requests);
+  }
+  else
+  {
+    //size of the image is known only after mount
+    if(mount_image(path) < 0)
+      return -1;
+
+    uint32_t total_sectors = get_mbr_ptr()->sizeInBlocks;
+
+    clear_reader_iso_path();
+
+    trace = (trace_entry*)malloc(n_requests * 2 * sizeof(trace_entry));
+    if(trace == 0 || generate_trace(total_sectors, 0, n_sectors, trace, n_requests) < 0 || generate_trace(total_sectors, 1, n_sectors, trace + n_requests, n_requests) < 0)
+      res = -1;
+  }
+
+  if(res == 0)
+  {
+    printf("%-12s %12s %10s %10s %10s %10s %8s %8s%s\n", "trace", "requests/s", "MB/s", "hit rate", "ra blocks", "ra hits", "bypass", "errors", verify > 0 ? " mismatches" : "");
+
+    if(trace_path != 0)
+    {
+      res = replay_trace(path, "file", trace, n_requests, verify);
+    }
+    else
+    {
+      res = replay_trace(path, "sequential", trace, n_requests, verify);
+      if(res == 0)
+        res = replay_trace(path, "random", trace + n_requests, n_requests, verify);
+    }
+  }
+
+  free(trace);
+
+  return res;
+}
+
+typedef struct submitter_ctx
+{
+  pthread_t thread;
+  const trace_entry* trace;
+  int n_requests;
+  double* latencies; //seconds per request
+  int n_errors;
+} submitter_ctx;
+
+void* submitter_thread(void* arg)
+{
+  submitter_ctx* ctx = (submitter_ctx*)arg;
+
+  int max_sectors = 0;
+  for(int i = 0; i < ctx->n_requests; i++)
+  {
+    if(ctx->trace[i].n_sectors > max_sectors)
+      max_sectors = ctx->trace[i].n_sectors;
+  }
+
+  char* buffer = (char*)malloc(max_sectors * SD_DEFAULT_SECTOR_SIZE);
+  if(buffer == 0)
+  {
+    ctx->n_errors = ctx->n_requests;
+    return 0;
+  }
+
+  for(int i = 0; i < ctx->n_requests; i++)
+  {
+    double start = get_time_seconds();
+
+    if(submit_read_request(0, ctx->trace[i].sector, buffer, ctx->trace[i].n_sectors) < 0)
+      ctx->n_errors++;
+
+    ctx->latencies[i] = get_time_seconds() - start;
+  }
+
+  free(buffer);
+
+  return 0;
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+  double da = *(const double*)a;
+  double db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+//runs n_submitters threads that submit their part of the trace to read request queue at the same time
+int run_submitters(int n_submitters, const trace_entry* trace, int n_per_submitter)
+{
+  submitter_ctx ctxs[n_submitters];
+  int n_total = n_submitters * n_per_submitter;
+
+  double* latencies = (double*)malloc(n_total * sizeof(double));
+  if(latencies == 0)
+    return -1;
+
+  int n_started = 0;
+
+  double start = get_time_seconds();
+
+  for(int i = 0; i < n_submitters; i++)
+  {
+    ctxs[i].trace = trace + i * n_per_submitter;
+    ctxs[i].n_requests = n_per_submitter;
+    ctxs[i].latencies = latencies + i * n_per_submitter;
+    ctxs[i].n_errors = 0;
+
+    if(pthread_create(&ctxs[i].thread, 0, submitter_thread, &ctxs[i]) != 0)
+      break;
+
+    n_started++;
+  }
+
+  int n_errors = 0;
+
+  for(int i = 0; i < n_started; i++)
+  {
+    pthread_join(ctxs[i].thread, 0);
+    n_errors += ctxs[i].n_errors;
+  }
+
+  double seconds = get_time_seconds() - start;
+
+  if(n_started < n_submitters)
+  {
+    fprintf(stderr, "failed to start submitter threads\n");
+    free(latencies);
+    return -1;
+  }
+
+  qsort(latencies, n_total, sizeof(double), compare_doubles);
+
+  printf("%-10d %12.0f %10.1f %10.1f %10.1f %8d\n", n_submitters, n_total / seconds,
+    latencies[n_total / 2] * 1e6, latencies[(int)((n_total - 1) * 0.99)] * 1e6, latencies[n_total - 1] * 1e6, n_errors);
+
+  free(latencies);
+
+  return 0;
+}
+
+//measures throughput and latency of read request queue at 1, 2 and 4 concurrent submitters
+int cmd_queue(int argc, char* argv[])
+{
+  int n_sectors = 0x10;
+  int n_requests = 20000;
+  int sequential = 0;
+  double latency = 0;
+
+  int c;
+  while((c = getopt(argc, argv, "s:n:l:S")) != -1)
+  {
+    switch(c)
+    {
+      case 's':
+        n_sectors = strtoul(optarg, 0, 0);
+        break;
+      case 'n':
+        n_requests = atoi(optarg);
+        break;
+      case 'l':
+        latency = atof(optarg) / 1e6;
+        break;
+      case 'S':
+        sequential = 1;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if(argc - optind != 1 || n_sectors <= 0 || n_requests <= 0)
+  {
+    fprintf(stderr, "usage: reader-bench queue [-s sectors_per_read] [-n requests_per_submitter] [-l read_latency_us] [-S] <input.psv>\n");
+    return -1;
+  }
+
+  const char* path = argv[optind];
+
+  int submitters[3] = { 1, 2, 4 };
+  int max_submitters = submitters[2];
+
+  //latency applies to image file that is opened on mount
+  kernel_shim_set_default_io_latency(latency);
+
+  int res = mount_image(path);
+
+  kernel_shim_set_default_io_latency(0);
+
+  if(res < 0)
+    return -1;
+
+  //every submitter reads its own part of the stream
+  trace_entry* trace = (trace_entry*)malloc(n_requests * max_submitters * sizeof(trace_entry));
+  if(trace == 0 || generate_trace(get_mbr_ptr()->sizeInBlocks, sequential > 0 ? 0 : 1, n_sectors, trace, n_requests * max_submitters) < 0)
+    res = -1;
+
+  if(res == 0)
+    printf("%-10s %12s %10s %10s %10s %8s\n", "submitters", "requests/s", "p50 us", "p99 us", "max us", "errors");
+
+  for(int i = 0; i < 3 && res == 0; i++)
+    res = run_submitters(submitters[i], trace, n_requests);
+
+  free(trace);
+
+  clear_reader_iso_path();
+
+  return res;
+}
+
+typedef struct command
+{
+  const char* name;
+  int (*func)(int argc, char* argv[]);
+  const char* description;
+} command;
+
+command g_commands[] =
+{
+  { "fd", cmd_fd, "compare open/close per request with image handle that is kept open" },
+  { "replay", cmd_replay, "replay sector read traces through emulate_read and report read cache statistics" },
+  { "queue", cmd_queue, "measure requests/s and latency of read request queue at 1, 2 and 4 submitters" },
+};
+
+int print_usage()
+{
+  fprintf(stderr, "usage: reader-bench <command> [options]\n\ncommands:\n");
+
+  for(int i = 0; i < sizeof(g_commands) / sizeof(command); i++)
+    fprintf(stderr, "  %-16s %s\n", g_commands[i].name, g_commands[i].description);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc < 2)
+  {
+    print_usage();
+    return 1;
+  }
+
+  for(int i = 0; i < sizeof(g_commands) / sizeof(command); i++)
+  {
+    if(strcmp(argv[1], g_commands[i].name) == 0)
+      return g_commands[i].func(argc - 1, argv + 1) < 0 ? 1 : 0;
+  }
+
+  print_usage();
+  return 1;
+}
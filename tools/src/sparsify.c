@@ -0,0 +1,168 @@
+/* sparsify.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "sparsify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "compress.h"
+
+static int is_zero_block(const char* data, uint32_t size)
+{
+  //block size is multiple of sector size so it can be checked word by word
+  const uint64_t* words = (const uint64_t*)data;
+  uint32_t n_words = size / sizeof(uint64_t);
+
+  for(uint32_t i = 0; i < n_words; i++)
+  {
+    if(words[i] != 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+static int write_sparse_header(const psv_image* in, int out_fd, const sparse_header_t* sh, uint64_t image_size, const psv_carried_tables* carried)
+{
+  psv_file_header_v1 header;
+  memcpy(&header, &in->header, sizeof(psv_file_header_v1));
+
+  //hash is kept as is because it covers complete data
+  header.flags = FLAG_SPARSE;
+  header.image_size = image_size;
+  header.image_offset_sector = 1;
+
+  return psv_write_header_area_carried(out_fd, &header, sh, sizeof(sparse_header_t), carried);
+}
+
+int sparsify_image(psv_image* in, int out_fd, uint32_t block_size, sparsify_stats* stats)
+{
+  if((in->header.flags & FLAG_DIGITAL) > 0)
+  {
+    fprintf(stderr, "only cart images can be converted to sparse images\n");
+    return -1;
+  }
+
+  if(block_size < SPARSE_MIN_BLOCK_SIZE || block_size > SPARSE_MAX_BLOCK_SIZE || (block_size % SD_DEFAULT_SECTOR_SIZE) != 0)
+  {
+    fprintf(stderr, "block size must be multiple of 0x%x in range 0x%x - 0x%x\n", SD_DEFAULT_SECTOR_SIZE, SPARSE_MIN_BLOCK_SIZE, SPARSE_MAX_BLOCK_SIZE);
+    return -1;
+  }
+
+  double start = get_time_seconds();
+
+  sparse_header_t sh;
+  memset(&sh, 0, sizeof(sparse_header_t));
+  sh.type = OPT_HEADER_TYPE_SPARSE;
+  sh.block_size = block_size;
+  sh.uncompressed_size = in->full_size;
+  sh.n_blocks = (in->full_size + block_size - 1) / block_size;
+
+  uint32_t bitmap_size = sparse_map_get_bitmap_size(sh.n_blocks);
+
+  //stored blocks follow the bitmap at sector boundary
+  uint64_t data_offset = SD_DEFAULT_SECTOR_SIZE;
+  uint64_t blocks_offset = (bitmap_size + SD_DEFAULT_SECTOR_SIZE - 1) / SD_DEFAULT_SECTOR_SIZE * SD_DEFAULT_SECTOR_SIZE;
+
+  uint64_t* bitmap = (uint64_t*)calloc(1, bitmap_size);
+  char* block_data = (char*)malloc(block_size);
+
+  if(bitmap == 0 || block_data == 0)
+  {
+    fprintf(stderr, "failed to allocate memory\n");
+    free(bitmap);
+    free(block_data);
+    return -1;
+  }
+
+  posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  int res = 0;
+  uint64_t pos = blocks_offset;
+
+  for(uint32_t block = 0; block < sh.n_blocks; block++)
+  {
+    uint64_t offset = (uint64_t)block * block_size;
+    uint32_t size = (in->full_size - offset < block_size) ? in->full_size - offset : block_size;
+
+    if(psv_image_read(in, offset, block_data, size) < 0)
+    {
+      fprintf(stderr, "failed to read block %u\n", block);
+      res = -1;
+      break;
+    }
+
+    if(is_zero_block(block_data, size) > 0)
+      continue;
+
+    if(pwrite_full(out_fd, block_data, size, data_offset + pos) < 0)
+    {
+      fprintf(stderr, "failed to write block %u\n", block);
+      res = -1;
+      break;
+    }
+
+    bitmap[block / 64] |= ((uint64_t)1) << (block % 64);
+    sh.n_present++;
+    pos += size;
+  }
+
+  //hash tree and error map are kept. they go after stored blocks
+  psv_carried_tables carried;
+  uint64_t file_end = 0;
+
+  if(res == 0 && psv_load_carried_tables(in, &carried) < 0)
+  {
+    fprintf(stderr, "failed to read hash tree or error map\n");
+    res = -1;
+  }
+
+  if(res == 0)
+  {
+    //padding between bitmap and first block is written as zeros
+    char* bitmap_area = (char*)calloc(1, blocks_offset);
+
+    if(bitmap_area == 0)
+    {
+      res = -1;
+    }
+    else
+    {
+      memcpy(bitmap_area, bitmap, bitmap_size);
+
+      if(pwrite_full(out_fd, bitmap_area, blocks_offset, data_offset) < 0 ||
+         psv_write_carried_tables(out_fd, &carried, data_offset + pos, &file_end) < 0 ||
+         write_sparse_header(in, out_fd, &sh, pos, &carried) < 0)
+        res = -1;
+
+      free(bitmap_area);
+    }
+
+    if(res < 0)
+      fprintf(stderr, "failed to write header\n");
+
+    psv_free_carried_tables(&carried);
+  }
+
+  if(res == 0 && stats != 0)
+  {
+    stats->in_bytes = in->full_size;
+    stats->out_bytes = file_end;
+    stats->n_blocks = sh.n_blocks;
+    stats->n_zero_blocks = sh.n_blocks - sh.n_present;
+    stats->seconds = get_time_seconds() - start;
+  }
+
+  free(bitmap);
+  free(block_data);
+
+  return res;
+}
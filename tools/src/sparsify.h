@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "psv_image.h"
+
+#define SPARSIFY_DEFAULT_BLOCK_SIZE 0x10000
+
+typedef struct sparsify_stats
+{
+  uint64_t in_bytes;
+  uint64_t out_bytes;
+  uint32_t n_blocks;
+  uint32_t n_zero_blocks;
+  double seconds;
+} sparsify_stats;
+
+//converts cart image of any layout into sparse image where all zero blocks are not stored
+int sparsify_image(psv_image* in, int out_fd, uint32_t block_size, sparsify_stats* stats);
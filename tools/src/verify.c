@@ -0,0 +1,515 @@
+/* verify.c
+ *
+ * Copyright (C) 2017 Motoharu Gosuto
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include "verify.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include <openssl/evp.h>
+
+#include "psv_image.h"
+#include "compress.h"
+#include "hash_tree.h"
+
+//image is streamed through ring of large aligned buffers. reader thread fills them
+//while calling thread hashes, so hashing overlaps disk reads
+
+#define VERIFY_N_BUFFERS 4
+#define VERIFY_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct verify_ctx
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  psv_image* img;
+
+  char* buffers[VERIFY_N_BUFFERS];
+  uint32_t sizes[VERIFY_N_BUFFERS];
+  int filled[VERIFY_N_BUFFERS];
+
+  int error;
+} verify_ctx;
+
+static uint32_t get_chunk_size(const psv_image* img, uint64_t chunk)
+{
+  uint64_t remaining = img->full_size - chunk * VERIFY_BUFFER_SIZE;
+  return remaining < VERIFY_BUFFER_SIZE ? remaining : VERIFY_BUFFER_SIZE;
+}
+
+static uint64_t get_chunk_count(const psv_image* img)
+{
+  return (img->full_size + VERIFY_BUFFER_SIZE - 1) / VERIFY_BUFFER_SIZE;
+}
+
+static void* reader_thread(void* arg)
+{
+  verify_ctx* ctx = (verify_ctx*)arg;
+
+  uint64_t n_chunks = get_chunk_count(ctx->img);
+
+  for(uint64_t chunk = 0; chunk < n_chunks; chunk++)
+  {
+    int idx = chunk % VERIFY_N_BUFFERS;
+
+    pthread_mutex_lock(&ctx->lock);
+    while(ctx->filled[idx] > 0 && ctx->error == 0)
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+    int error = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(error > 0)
+      break;
+
+    uint32_t size = get_chunk_size(ctx->img, chunk);
+
+    //trimmed tail and elided blocks are returned as zeros
+    int res = psv_image_read(ctx->img, chunk * VERIFY_BUFFER_SIZE, ctx->buffers[idx], size);
+
+    pthread_mutex_lock(&ctx->lock);
+    if(res < 0)
+      ctx->error = 1;
+    ctx->sizes[idx] = size;
+    ctx->filled[idx] = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(res < 0)
+      break;
+  }
+
+  return 0;
+}
+
+static int hash_image(psv_image* img, uint8_t* hash)
+{
+  verify_ctx ctx;
+  memset(&ctx, 0, sizeof(verify_ctx));
+  pthread_mutex_init(&ctx.lock, 0);
+  pthread_cond_init(&ctx.cond, 0);
+
+  ctx.img = img;
+
+  int res = 0;
+
+  for(int i = 0; i < VERIFY_N_BUFFERS; i++)
+  {
+    //aligned buffers let the kernel copy pages without bouncing
+    if(posix_memalign((void**)&ctx.buffers[i], 0x1000, VERIFY_BUFFER_SIZE) != 0)
+    {
+      ctx.buffers[i] = 0;
+      res = -1;
+    }
+  }
+
+  EVP_MD_CTX* md = EVP_MD_CTX_new();
+
+  //openssl picks SHA extensions (x86 SHA-NI, ARMv8 crypto) when cpu has them
+  if(md == 0 || EVP_DigestInit_ex(md, EVP_sha256(), 0) != 1)
+    res = -1;
+
+  if(res == 0)
+  {
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_t reader;
+    pthread_create(&reader, 0, reader_thread, &ctx);
+
+    uint64_t n_chunks = get_chunk_count(img);
+
+    for(uint64_t chunk = 0; chunk < n_chunks && res == 0; chunk++)
+    {
+      int idx = chunk % VERIFY_N_BUFFERS;
+
+      pthread_mutex_lock(&ctx.lock);
+      while(ctx.filled[idx] == 0 && ctx.error == 0)
+        pthread_cond_wait(&ctx.cond, &ctx.lock);
+
+      if(ctx.error > 0)
+        res = -1;
+      pthread_mutex_unlock(&ctx.lock);
+
+      if(res < 0)
+        break;
+
+      if(EVP_DigestUpdate(md, ctx.buffers[idx], ctx.sizes[idx]) != 1)
+        res = -1;
+
+      pthread_mutex_lock(&ctx.lock);
+      ctx.filled[idx] = 0;
+      if(res < 0)
+        ctx.error = 1;
+      pthread_cond_broadcast(&ctx.cond);
+      pthread_mutex_unlock(&ctx.lock);
+    }
+
+    pthread_join(reader, 0);
+
+    if(res == 0 && EVP_DigestFinal_ex(md, hash, 0) != 1)
+      res = -1;
+  }
+
+  EVP_MD_CTX_free(md);
+
+  for(int i = 0; i < VERIFY_N_BUFFERS; i++)
+    free(ctx.buffers[i]);
+
+  pthread_cond_destroy(&ctx.cond);
+  pthread_mutex_destroy(&ctx.lock);
+
+  return res;
+}
+
+int verify_image(const char* path, verify_result* result)
+{
+  memset(result, 0, sizeof(verify_result));
+  result->status = VERIFY_ERROR;
+
+  double start = get_time_seconds();
+
+  psv_image img;
+  if(psv_image_open(&img, path) < 0)
+    return -1;
+
+  //decompressed blocks are only read once
+  psv_image_set_cache_budget(&img, 0);
+
+  uint8_t zero_hash[0x20];
+  memset(zero_hash, 0, 0x20);
+
+  if(memcmp(img.header.hash, zero_hash, 0x20) == 0)
+  {
+    result->status = VERIFY_NO_HASH;
+  }
+  else if(hash_image(&img, result->hash) == 0)
+  {
+    result->status = memcmp(img.header.hash, result->hash, 0x20) == 0 ? VERIFY_OK : VERIFY_MISMATCH;
+    result->bytes = img.full_size;
+  }
+
+  if((img.header.flags & FLAG_ERROR_MAP) > 0)
+    result->bad_sectors = img.errors.bad_sectors;
+
+  psv_image_close(&img);
+
+  result->seconds = get_time_seconds() - start;
+
+  return result->status == VERIFY_ERROR ? -1 : 0;
+}
+
+typedef struct verify_batch
+{
+  pthread_mutex_t lock;
+
+  const char* const* paths;
+  int n_paths;
+  int next;
+  int n_failed;
+} verify_batch;
+
+static void print_result(const char* path, const verify_result* result)
+{
+  switch(result->status)
+  {
+    case VERIFY_OK:
+      printf("%s: OK (%.1f MB/s)\n", path, result->seconds > 0 ? result->bytes / result->seconds / 1e6 : 0.0);
+      break;
+    case VERIFY_MISMATCH:
+      printf("%s: HASH MISMATCH\n", path);
+      break;
+    case VERIFY_NO_HASH:
+      printf("%s: header does not contain hash\n", path);
+      break;
+    default:
+      printf("%s: FAILED\n", path);
+      break;
+  }
+
+  //hash matches zeros that are stored in place of unreadable sectors, so image is only as good as the dump
+  if(result->bad_sectors > 0)
+    printf("%s: 0x%x sectors could not be read when dumped\n", path, result->bad_sectors);
+}
+
+static void* batch_thread(void* arg)
+{
+  verify_batch* batch = (verify_batch*)arg;
+
+  while(1)
+  {
+    pthread_mutex_lock(&batch->lock);
+    int idx = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+
+    if(idx >= batch->n_paths)
+      break;
+
+    verify_result result;
+    verify_image(batch->paths[idx], &result);
+
+    //results of images are printed whole even if they finish at the same time
+    pthread_mutex_lock(&batch->lock);
+    print_result(batch->paths[idx], &result);
+    if(result.status == VERIFY_MISMATCH || result.status == VERIFY_ERROR)
+      batch->n_failed++;
+    pthread_mutex_unlock(&batch->lock);
+  }
+
+  return 0;
+}
+
+int verify_images(const char* const* paths, int n_paths, int n_threads)
+{
+  verify_batch batch;
+  memset(&batch, 0, sizeof(verify_batch));
+  pthread_mutex_init(&batch.lock, 0);
+
+  batch.paths = paths;
+  batch.n_paths = n_paths;
+
+  if(n_threads > n_paths)
+    n_threads = n_paths;
+  if(n_threads < 1)
+    n_threads = 1;
+
+  pthread_t* threads = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+  if(threads == 0)
+  {
+    pthread_mutex_destroy(&batch.lock);
+    return n_paths;
+  }
+
+  for(int i = 0; i < n_threads; i++)
+    pthread_create(&threads[i], 0, batch_thread, &batch);
+
+  for(int i = 0; i < n_threads; i++)
+    pthread_join(threads[i], 0);
+
+  free(threads);
+  pthread_mutex_destroy(&batch.lock);
+
+  return batch.n_failed;
+}
+
+typedef struct verify_range_ctx
+{
+  pthread_mutex_t lock;
+
+  const char* path;
+  const hash_tree_header_t* tree;
+
+  uint32_t next_chunk;
+  uint32_t last_chunk;
+
+  uint8_t* leaves; //computed leaves of chunks in the range
+  uint32_t first_chunk;
+
+  int error;
+} verify_range_ctx;
+
+static void* range_thread(void* arg)
+{
+  verify_range_ctx* ctx = (verify_range_ctx*)arg;
+
+  //psv_image_read is not thread safe so each thread has its own image
+  psv_image img;
+  if(psv_image_open(&img, ctx->path) < 0)
+  {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->error = 1;
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+  }
+
+  char* buffer = 0;
+  int res = posix_memalign((void**)&buffer, 0x1000, ctx->tree->chunk_size) == 0 ? 0 : -1;
+
+  while(res == 0)
+  {
+    pthread_mutex_lock(&ctx->lock);
+    uint32_t chunk = ctx->next_chunk++;
+    int error = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(chunk > ctx->last_chunk || error > 0)
+      break;
+
+    uint64_t chunk_offset = (uint64_t)chunk * ctx->tree->chunk_size;
+    uint64_t remaining = ctx->tree->uncompressed_size - chunk_offset;
+    uint32_t chunk_size = remaining < ctx->tree->chunk_size ? remaining : ctx->tree->chunk_size;
+
+    uint8_t* leaf = ctx->leaves + (uint64_t)(chunk - ctx->first_chunk) * HASH_TREE_NODE_SIZE;
+
+    if(psv_image_read(&img, chunk_offset, buffer, chunk_size) < 0 || EVP_Digest(buffer, chunk_size, leaf, 0, EVP_sha256(), 0) != 1)
+      res = -1;
+  }
+
+  if(res < 0)
+  {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->error = 1;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  free(buffer);
+  psv_image_close(&img);
+
+  return 0;
+}
+
+//recomputes nodes above the range level by level. nodes outside of the range are taken from the stored tree
+static void climb_hash_tree(const hash_tree_layout* layout, uint8_t* nodes, uint32_t first_leaf, uint32_t last_leaf)
+{
+  uint32_t lo = first_leaf;
+  uint32_t hi = last_leaf;
+
+  for(uint32_t level = 0; level + 1 < layout->n_levels; level++)
+  {
+    uint8_t* children = nodes + (uint64_t)layout->level_offsets[level] * HASH_TREE_NODE_SIZE;
+    uint8_t* parents = nodes + (uint64_t)layout->level_offsets[level + 1] * HASH_TREE_NODE_SIZE;
+
+    for(uint32_t i = lo / 2; i <= hi / 2; i++)
+    {
+      uint8_t* left = children + (uint64_t)(i * 2) * HASH_TREE_NODE_SIZE;
+
+      if(i * 2 + 1 < layout->level_sizes[level])
+        hash_tree_hash_pair(left, left + HASH_TREE_NODE_SIZE, parents + (uint64_t)i * HASH_TREE_NODE_SIZE);
+      else
+        memcpy(parents + (uint64_t)i * HASH_TREE_NODE_SIZE, left, HASH_TREE_NODE_SIZE);
+    }
+
+    lo /= 2;
+    hi /= 2;
+  }
+}
+
+int verify_image_range(const char* path, uint64_t offset, uint64_t size, int n_threads, verify_range_result* result)
+{
+  memset(result, 0, sizeof(verify_range_result));
+  result->status = VERIFY_ERROR;
+
+  double start = get_time_seconds();
+
+  psv_image img;
+  if(psv_image_open(&img, path) < 0)
+    return -1;
+
+  if((img.header.flags & FLAG_HASH_TREE) == 0)
+  {
+    psv_image_close(&img);
+    result->status = VERIFY_NO_TREE;
+    return 0;
+  }
+
+  hash_tree_header_t tree = img.tree;
+
+  if(size == 0 || offset >= tree.uncompressed_size || size > tree.uncompressed_size - offset)
+  {
+    fprintf(stderr, "%s: range is outside of the image\n", path);
+    psv_image_close(&img);
+    return -1;
+  }
+
+  hash_tree_layout layout;
+  hash_tree_get_layout(tree.n_chunks, &layout);
+
+  //stored tree is small compared to the data. 4 GB card with 1 MB chunks has 256 KB tree
+  uint64_t tree_size = (uint64_t)tree.n_nodes * HASH_TREE_NODE_SIZE;
+  uint8_t* nodes = (uint8_t*)malloc(tree_size);
+
+  int res = nodes != 0 && pread_full(img.fd, nodes, tree_size, tree.tree_offset) == tree_size ? 0 : -1;
+
+  psv_image_close(&img);
+
+  if(res < 0)
+  {
+    fprintf(stderr, "%s: failed to read hash tree\n", path);
+    free(nodes);
+    return -1;
+  }
+
+  verify_range_ctx ctx;
+  memset(&ctx, 0, sizeof(verify_range_ctx));
+  pthread_mutex_init(&ctx.lock, 0);
+
+  ctx.path = path;
+  ctx.tree = &tree;
+  ctx.first_chunk = offset / tree.chunk_size;
+  ctx.last_chunk = (offset + size - 1) / tree.chunk_size;
+  ctx.next_chunk = ctx.first_chunk;
+
+  uint32_t n_chunks = ctx.last_chunk - ctx.first_chunk + 1;
+  ctx.leaves = (uint8_t*)malloc((uint64_t)n_chunks * HASH_TREE_NODE_SIZE);
+  result->bad_chunks = (uint32_t*)malloc(n_chunks * sizeof(uint32_t));
+
+  if(n_threads > n_chunks)
+    n_threads = n_chunks;
+  if(n_threads < 1)
+    n_threads = 1;
+
+  pthread_t* threads = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+
+  if(ctx.leaves == 0 || result->bad_chunks == 0 || threads == 0)
+  {
+    res = -1;
+  }
+  else
+  {
+    for(int i = 0; i < n_threads; i++)
+      pthread_create(&threads[i], 0, range_thread, &ctx);
+
+    for(int i = 0; i < n_threads; i++)
+      pthread_join(threads[i], 0);
+
+    res = ctx.error > 0 ? -1 : 0;
+  }
+
+  if(res == 0)
+  {
+    result->first_chunk = ctx.first_chunk;
+    result->n_chunks = n_chunks;
+
+    for(uint32_t i = 0; i < n_chunks; i++)
+    {
+      uint8_t* leaf = nodes + (uint64_t)(ctx.first_chunk + i) * HASH_TREE_NODE_SIZE;
+
+      if(memcmp(leaf, ctx.leaves + (uint64_t)i * HASH_TREE_NODE_SIZE, HASH_TREE_NODE_SIZE) != 0)
+      {
+        result->bad_chunks[result->n_bad_chunks++] = ctx.first_chunk + i;
+        memcpy(leaf, ctx.leaves + (uint64_t)i * HASH_TREE_NODE_SIZE, HASH_TREE_NODE_SIZE);
+      }
+    }
+
+    //root is recomputed from data of the range, so damaged siblings in the stored tree are caught as well
+    climb_hash_tree(&layout, nodes, ctx.first_chunk, ctx.last_chunk);
+
+    if(result->n_bad_chunks == 0 && memcmp(hash_tree_get_root(&layout, nodes), tree.root, 0x20) == 0)
+      result->status = VERIFY_OK;
+    else
+      result->status = VERIFY_MISMATCH;
+  }
+
+  free(threads);
+  free(ctx.leaves);
+  free(nodes);
+  pthread_mutex_destroy(&ctx.lock);
+
+  if(res < 0)
+  {
+    free(result->bad_chunks);
+    result->bad_chunks = 0;
+  }
+
+  result->seconds = get_time_seconds() - start;
+
+  return res;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#define VERIFY_OK 0
+#define VERIFY_MISMATCH 1
+#define VERIFY_NO_HASH 2 //header does not contain hash
+#define VERIFY_NO_TREE 3 //image does not have hash tree
+#define VERIFY_ERROR -1
+
+typedef struct verify_result
+{
+  int status;
+  uint64_t bytes;
+  double seconds;
+  uint8_t hash[0x20];
+  uint32_t bad_sectors; //sectors that could not be read when image was dumped. they are stored as zeros
+} verify_result;
+
+//computes sha256 over complete cart data (including trimmed or elided zeros) and checks it against the header
+int verify_image(const char* path, verify_result* result);
+
+//verifies images on n_threads threads and prints result of each image. returns number of images that failed
+int verify_images(const char* const* paths, int n_paths, int n_threads);
+
+typedef struct verify_range_result
+{
+  int status;
+  uint32_t first_chunk;
+  uint32_t n_chunks;
+  uint32_t n_bad_chunks;
+  uint32_t* bad_chunks; //indexes of chunks whose data does not match the leaf. must be freed
+  double seconds;
+} verify_range_result;
+
+//checks image data in range [offset, offset + size) against hash tree. only chunks that overlap the range are read,
+//on n_threads threads. their hashes are then combined with stored siblings up to the root in the header
+int verify_image_range(const char* path, uint64_t offset, uint64_t size, int n_threads, verify_range_result* result);